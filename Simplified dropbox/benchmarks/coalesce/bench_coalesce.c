@@ -0,0 +1,149 @@
+/**
+ * @file bench_coalesce.c
+ * @brief Counts the requests the client sends for bursts of inotify(7)
+ *        events, when every event is sent right away and when the events
+ *        of a file are merged in the pending journal until the quiet
+ *        period, and measures how fast the events are merged.
+ *
+ * Usage: bench_coalesce [files]
+ */
+#include "client/journal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/inotify.h>
+#include <syslog.h>
+#include <time.h>
+
+#define DEFAULT_FILES 4000
+#define REWRITES 50
+
+/** MSG_CHANGE_FILE requests of the changed attributes */
+#define ATTRIBUTE_REQUESTS 3
+
+/**
+ * Burst of events of every file.
+ */
+struct scenario {
+        const char *name;
+        const uint32_t *events; /**< events of one file, terminated by 0 */
+        bool exists;            /**< the file exists after the burst */
+        size_t repeat;          /**< the events are repeated this many times */
+};
+
+static double now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Requests of the event sent right away.
+ */
+static size_t event_requests(uint32_t mask)
+{
+        if (mask & IN_ATTRIB)
+                return ATTRIBUTE_REQUESTS;
+        return 1;
+}
+
+static size_t action_requests(enum client_journal_action action)
+{
+        switch (action) {
+        case CLIENT_JOURNAL_NONE:
+                return 0;
+        case CLIENT_JOURNAL_ATTRIBUTES:
+                return ATTRIBUTE_REQUESTS;
+        default:
+                return 1;
+        }
+}
+
+struct count_data {
+        bool exists;
+        size_t requests;
+};
+
+static bool count_entry(void *elem, void *data)
+{
+        struct count_data *count = data;
+        const enum client_journal_action action
+                = client_journal_action(elem, count->exists);
+        count->requests += action_requests(action);
+        return true;
+}
+
+static bool run(const struct scenario *scenario, size_t files)
+{
+        struct client_journal pending;
+        if (!client_journal_create(&pending))
+                return false;
+
+        char name[32];
+        size_t events = 0;
+        size_t immediate = 0;
+        const double start = now();
+        for (size_t i = 0; i < files; i++) {
+                snprintf(name, sizeof(name), "dir/file%zu", i);
+                for (size_t r = 0; r < scenario->repeat; r++) {
+                        for (const uint32_t *e = scenario->events; *e != 0;
+                             e++) {
+                                const unsigned changes
+                                        = client_journal_event_changes(*e);
+                                if (!client_journal_record(&pending, name,
+                                                           changes))
+                                        goto fail;
+                                immediate += event_requests(*e);
+                                events++;
+                        }
+                }
+        }
+        struct count_data count = { .exists = scenario->exists };
+        client_journal_foreach(&pending, count_entry, &count);
+        const double elapsed = now() - start;
+
+        printf("%-14s %8zu events %8zu -> %6zu requests %8.1f ns/event\n",
+               scenario->name, events, immediate, count.requests,
+               elapsed * 1e9 / events);
+        client_journal_destroy(&pending);
+        return !pending.overflowed;
+fail:
+        client_journal_destroy(&pending);
+        return false;
+}
+
+int main(int argc, char **argv)
+{
+        const size_t files = argc > 1 ? strtoul(argv[1], NULL, 10)
+                                      : DEFAULT_FILES;
+        if (files == 0 || files > CLIENT_JOURNAL_MAX_ENTRIES) {
+                fprintf(stderr, "usage: %s [files up to %d]\n", argv[0],
+                        CLIENT_JOURNAL_MAX_ENTRIES);
+                return EXIT_FAILURE;
+        }
+
+        static const uint32_t rewrite[] = { IN_CLOSE_WRITE, 0 };
+        static const uint32_t temporary[]
+                = { IN_CREATE, IN_CLOSE_WRITE, IN_DELETE, 0 };
+        static const uint32_t extract[]
+                = { IN_CREATE, IN_CLOSE_WRITE, IN_ATTRIB, 0 };
+        static const uint32_t chmod[] = { IN_ATTRIB, 0 };
+        static const uint32_t replace[]
+                = { IN_DELETE, IN_CREATE, IN_CLOSE_WRITE, 0 };
+        const struct scenario scenarios[] = {
+                { "rewrite x50", rewrite, true, REWRITES },
+                { "temporary", temporary, false, 1 },
+                { "extract", extract, true, 1 },
+                { "chmod x3", chmod, true, 3 },
+                { "replace", replace, true, 1 },
+        };
+
+        // the debug messages are logged only with -d
+        setlogmask(LOG_UPTO(LOG_INFO));
+        printf("%zu files, events sent right away -> merged\n", files);
+        bool success = true;
+        for (size_t i = 0; i < sizeof(scenarios) / sizeof(*scenarios); i++)
+                success = run(&scenarios[i], files) && success;
+        return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
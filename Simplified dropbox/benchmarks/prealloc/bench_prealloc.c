@@ -0,0 +1,169 @@
+/**
+ * @file bench_prealloc.c
+ * @brief Compares the files grown by the written blocks with the files
+ *        preallocated to their final size, as the server creates them.
+ *        It reports the write throughput and the number of the extents
+ *        of the files told by FIEMAP.
+ *
+ * Every file is written by its own thread at once, as by the sessions of
+ * the server, and its written part is handed to the writeback regularly,
+ * as under the memory pressure.
+ *
+ * Usage: bench_prealloc [files] [MiB per file] [directory]
+ */
+#include "server/storage.h"
+#include "utils.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_FILES 8
+#define DEFAULT_FILE_MIB 64
+#define DEFAULT_DIRECTORY "."
+
+/** the blocks the server writes without PACKET_FEATURE_CHUNKS */
+#define WRITE_SIZE 4096
+/** the written part of the file is handed to the writeback after this */
+#define WRITEBACK_SIZE (4 * 1024 * 1024)
+
+struct writer {
+        pthread_t thread;
+        char path[PATH_MAX];
+        off_t size;
+        bool preallocate;
+        bool success;
+};
+
+static double now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *write_file(void *arg)
+{
+        struct writer *writer = arg;
+        unsigned char block[WRITE_SIZE];
+        memset(block, 42, sizeof(block));
+        const int fd = open(writer->path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        if (fd == -1)
+                return NULL;
+
+        if (writer->preallocate
+            && !server_storage_preallocate(fd, writer->size, false))
+                goto clean;
+        for (off_t offset = 0; offset < writer->size; offset += WRITE_SIZE) {
+                if (utils_write(fd, WRITE_SIZE, block) == -1)
+                        goto clean;
+                if ((offset + WRITE_SIZE) % WRITEBACK_SIZE == 0)
+                        sync_file_range(fd, offset + WRITE_SIZE
+                                                    - WRITEBACK_SIZE,
+                                        WRITEBACK_SIZE,
+                                        SYNC_FILE_RANGE_WRITE);
+        }
+        writer->success = fsync(fd) == 0;
+clean:
+        close(fd);
+        return NULL;
+}
+
+/**
+ * @return the number of the extents of the file;
+ *         -1 if the filesystem does not tell them
+ */
+static ssize_t count_extents(const char *path)
+{
+        const int fd = open(path, O_RDONLY);
+        if (fd == -1)
+                return -1;
+        // without the room for the extents only their number is returned
+        struct fiemap fiemap = {
+                .fm_length = FIEMAP_MAX_OFFSET,
+                .fm_flags = FIEMAP_FLAG_SYNC,
+        };
+        const int rc = ioctl(fd, FS_IOC_FIEMAP, &fiemap);
+        close(fd);
+        return rc == -1 ? -1 : (ssize_t)fiemap.fm_mapped_extents;
+}
+
+static bool run(const char *name, bool preallocate, const char *directory,
+                size_t files, off_t file_size)
+{
+        struct writer *writers = calloc(files, sizeof(*writers));
+        if (writers == NULL)
+                return false;
+
+        size_t started = 0;
+        const double start = now();
+        for (; started < files; started++) {
+                struct writer *writer = &writers[started];
+                snprintf(writer->path, sizeof(writer->path),
+                         "%s/bench_prealloc.%zu", directory, started);
+                writer->size = file_size;
+                writer->preallocate = preallocate;
+                if (pthread_create(&writer->thread, NULL, write_file, writer)
+                    != 0)
+                        break;
+        }
+        bool success = started == files;
+        for (size_t i = 0; i < started; i++) {
+                pthread_join(writers[i].thread, NULL);
+                success = success && writers[i].success;
+        }
+        const double elapsed = now() - start;
+
+        ssize_t extents = 0;
+        ssize_t most = 0;
+        for (size_t i = 0; i < started; i++) {
+                const ssize_t count = count_extents(writers[i].path);
+                extents = count == -1 || extents == -1 ? -1 : extents + count;
+                most = count > most ? count : most;
+                unlink(writers[i].path);
+        }
+        free(writers);
+        if (!success) {
+                fprintf(stderr, "%s failed\n", name);
+                return false;
+        }
+        printf("%-14s %9.1f MiB/s", name,
+               files * (file_size / 1048576.0) / elapsed);
+        if (extents == -1)
+                printf("   extents unknown, no FIEMAP\n");
+        else
+                printf(" %9.1f extents per file, at most %zd\n",
+                       (double)extents / files, most);
+        return true;
+}
+
+int main(int argc, char **argv)
+{
+        const size_t files = argc > 1 ? strtoul(argv[1], NULL, 10)
+                                      : DEFAULT_FILES;
+        const size_t file_mib = argc > 2 ? strtoul(argv[2], NULL, 10)
+                                         : DEFAULT_FILE_MIB;
+        const char *directory = argc > 3 ? argv[3] : DEFAULT_DIRECTORY;
+        if (files == 0 || file_mib == 0) {
+                fprintf(stderr,
+                        "usage: %s [files] [MiB per file] [directory]\n",
+                        argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        const off_t file_size = (off_t)file_mib * 1024 * 1024;
+        printf("%zu files of %zu MiB written at once by blocks of %d B\n",
+               files, file_mib, WRITE_SIZE);
+        bool success = run("grown", false, directory, files, file_size);
+        success = run("preallocated", true, directory, files, file_size)
+                  && success;
+        return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,121 @@
+/**
+ * @file bench_scan.c
+ * @brief Measures the throughput of every scan kernel the CPU supports,
+ *        and of the former byte loop, on blocks which are scanned to the
+ *        end: a zero block and two same blocks.
+ *
+ * Usage: bench_scan [block size in KiB] [total size in MiB]
+ */
+#include "scan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_BLOCK_KIB 64
+#define DEFAULT_TOTAL_MIB 4096
+
+static double now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Checks the bytes one by one like check_null_bytes() of the client used to.
+ */
+static bool byte_loop_zero(size_t size, const unsigned char *buff)
+{
+        for (size_t i = 0; i < size; i++) {
+                if (buff[i] != 0)
+                        return false;
+        }
+        return true;
+}
+
+static size_t byte_loop_mismatch(size_t size, const unsigned char *a,
+                                 const unsigned char *b)
+{
+        size_t i = 0;
+        while (i < size && a[i] == b[i])
+                i++;
+        return i;
+}
+
+/**
+ * The results are summed, so the scans are not left out by the compiler.
+ */
+static volatile size_t sink;
+
+static void report(const char *kernel, const char *scan, size_t bytes,
+                   double elapsed)
+{
+        printf("%-10s %-10s %8.2f GB/s\n", kernel, scan, bytes / elapsed / 1e9);
+}
+
+static void run(const char *name, const struct scan_kernel *kernel,
+                size_t block_size, size_t blocks, const unsigned char *zeros,
+                const unsigned char *copy)
+{
+        size_t found = 0;
+        double start = now();
+        for (size_t i = 0; i < blocks; i++)
+                found += kernel->zero(block_size, zeros);
+        report(name, "zero", block_size * blocks, now() - start);
+
+        start = now();
+        for (size_t i = 0; i < blocks; i++)
+                found += kernel->mismatch(block_size, zeros, copy);
+        report(name, "mismatch", block_size * blocks, now() - start);
+        sink += found;
+}
+
+int main(int argc, char **argv)
+{
+        const size_t block_kib = argc > 1 ? strtoul(argv[1], NULL, 10)
+                                          : DEFAULT_BLOCK_KIB;
+        const size_t total_mib = argc > 2 ? strtoul(argv[2], NULL, 10)
+                                          : DEFAULT_TOTAL_MIB;
+        if (block_kib == 0 || total_mib == 0 || block_kib > 1024 * total_mib) {
+                fprintf(stderr, "usage: %s [block KiB] [total MiB]\n",
+                        argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        const size_t block_size = block_kib * 1024;
+        const size_t blocks = total_mib * 1024 / block_kib;
+        unsigned char *zeros = calloc(1, block_size);
+        unsigned char *copy = calloc(1, block_size);
+        if (zeros == NULL || copy == NULL) {
+                free(zeros);
+                free(copy);
+                return EXIT_FAILURE;
+        }
+        printf("%zu KiB blocks, %zu MiB scanned per kernel\n", block_kib,
+               total_mib);
+
+        const struct scan_kernel byte_loop = {
+                "byte loop", NULL, byte_loop_zero, byte_loop_mismatch,
+        };
+        run(byte_loop.name, &byte_loop, block_size, blocks, zeros, copy);
+
+        size_t count;
+        const struct scan_kernel *kernels = scan_kernels(&count);
+        for (size_t k = 0; k < count; k++) {
+                if (kernels[k].supported())
+                        run(kernels[k].name, &kernels[k], block_size, blocks,
+                            zeros, copy);
+                else
+                        printf("%-10s not supported\n", kernels[k].name);
+        }
+
+        const struct scan_kernel dispatched = {
+                "dispatched", NULL, scan_zero, scan_mismatch,
+        };
+        run(dispatched.name, &dispatched, block_size, blocks, zeros, copy);
+        free(zeros);
+        free(copy);
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,193 @@
+/**
+ * @file bench_storage.c
+ * @brief Compares the synchronous writes of the received blocks with
+ *        the writes through io_uring and the writer threads.
+ *
+ * A producer thread sends the blocks over a socket pair, as a client
+ * would, and the consumer reads every block and writes it to the file.
+ *
+ * Usage: bench_storage [total MiB] [block KiB] [file]
+ */
+#include "server/storage.h"
+#include "utils.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_TOTAL_MIB 256
+#define DEFAULT_BLOCK_KIB 1024
+#define DEFAULT_PATH "bench_storage.dat"
+
+struct producer {
+        int fd;
+        size_t block_size;
+        size_t blocks;
+};
+
+static void *produce(void *arg)
+{
+        const struct producer *producer = arg;
+        unsigned char *block = malloc(producer->block_size);
+        if (block == NULL)
+                return NULL;
+
+        for (size_t i = 0; i < producer->blocks; i++) {
+                memset(block, (int) i, producer->block_size);
+                if (utils_write(producer->fd, producer->block_size, block)
+                    == -1)
+                        break;
+        }
+        free(block);
+        return NULL;
+}
+
+static double now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool consume_sync(int sock, int fd, size_t block_size, size_t blocks)
+{
+        bool success = false;
+        unsigned char *block = malloc(block_size);
+        if (block == NULL)
+                return false;
+
+        for (size_t i = 0; i < blocks; i++) {
+                if (utils_read(sock, block_size, block)
+                            != (ssize_t) block_size
+                    || utils_write(fd, block_size, block) == -1)
+                        goto clean;
+        }
+        success = true;
+clean:
+        free(block);
+        return success;
+}
+
+static bool consume_async(struct server_storage *storage, int sock, int fd,
+                          size_t block_size, size_t blocks)
+{
+        if (storage == NULL) {
+                fprintf(stderr, "storage is not available\n");
+                return false;
+        }
+
+        bool success = false;
+        for (size_t i = 0; i < blocks; i++) {
+                unsigned char *buffer = server_storage_buffer(storage);
+                if (buffer == NULL
+                    || utils_read(sock, block_size, buffer)
+                               != (ssize_t) block_size
+                    || !server_storage_write(storage, fd, buffer, block_size,
+                                             (off_t) (i * block_size)))
+                        goto clean;
+        }
+        success = server_storage_drain(storage);
+clean:
+        server_storage_close(storage);
+        return success;
+}
+
+/**
+ * Sends the blocks to the consumer and writes them synchronously if
+ * @c writers is 0, through the writer threads if it is positive, or
+ * through io_uring if it is -1.
+ */
+static bool run(const char *name, int writers, const char *path,
+                size_t block_size, size_t blocks)
+{
+        int socks[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, socks) == -1) {
+                perror("socketpair");
+                return false;
+        }
+        const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd == -1) {
+                perror("open");
+                close(socks[0]);
+                close(socks[1]);
+                return false;
+        }
+
+        struct producer producer = {
+                .fd = socks[1],
+                .block_size = block_size,
+                .blocks = blocks,
+        };
+        pthread_t thread;
+        bool success = false;
+        const double start = now();
+        if (pthread_create(&thread, NULL, produce, &producer) != 0) {
+                fprintf(stderr, "pthread_create failed\n");
+                goto clean;
+        }
+
+        struct server_writer *writer = NULL;
+        if (writers == 0) {
+                success = consume_sync(socks[0], fd, block_size, blocks);
+        } else if (writers < 0) {
+                success = consume_async(server_storage_open(block_size),
+                                        socks[0], fd, block_size, blocks);
+        } else {
+                writer = server_writer_start(writers);
+                success = writer != NULL
+                          && consume_async(server_storage_open_writer(
+                                                   writer, block_size),
+                                           socks[0], fd, block_size, blocks);
+        }
+        // unblocks the producer if the consumer failed
+        shutdown(socks[0], SHUT_RDWR);
+        pthread_join(thread, NULL);
+        server_writer_stop(writer);
+        if (success && fdatasync(fd) == -1) {
+                perror("fdatasync");
+                success = false;
+        }
+
+        const double elapsed = now() - start;
+        const double mib = (double) (block_size * blocks) / (1024 * 1024);
+        if (success)
+                printf("%-10s %8.1f MiB in %6.3f s  %8.1f MiB/s\n", name, mib,
+                       elapsed, mib / elapsed);
+        else
+                fprintf(stderr, "%s failed\n", name);
+clean:
+        close(fd);
+        close(socks[0]);
+        close(socks[1]);
+        return success;
+}
+
+int main(int argc, char **argv)
+{
+        const size_t total_mib = argc > 1 ? strtoul(argv[1], NULL, 10)
+                                          : DEFAULT_TOTAL_MIB;
+        const size_t block_kib = argc > 2 ? strtoul(argv[2], NULL, 10)
+                                          : DEFAULT_BLOCK_KIB;
+        const char *path = argc > 3 ? argv[3] : DEFAULT_PATH;
+        if (total_mib == 0 || block_kib == 0) {
+                fprintf(stderr, "usage: %s [total MiB] [block KiB] [file]\n",
+                        argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        const size_t block_size = block_kib * 1024;
+        const size_t blocks = total_mib * 1024 / block_kib;
+        printf("%zu blocks of %zu KiB\n", blocks, block_kib);
+
+        bool success = run("write(2)", 0, path, block_size, blocks);
+        success = run("io_uring", -1, path, block_size, blocks) && success;
+        success = run("1 writer", 1, path, block_size, blocks) && success;
+        success = run("4 writers", 4, path, block_size, blocks) && success;
+        unlink(path);
+        return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,183 @@
+/**
+ * @file bench_watchers.c
+ * @brief Measures how fast the watchers are found by the watch descriptor
+ *        and by the path, removed and added again in the registry, and
+ *        compares it with the former reverse scan of the list of watchers.
+ *
+ * Usage: bench_watchers [files]
+ */
+#include "client/watcher_list.h"
+
+#include "generic_list.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_FILES 500000
+
+/** lookups of the reverse scan, which takes the time of the whole list */
+#define SCAN_LOOKUPS 200
+
+static double now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *file_name(size_t i)
+{
+        char *name;
+        if (asprintf(&name, "dir%zu/file%zu", i % 1000, i) == -1)
+                return NULL;
+        return name;
+}
+
+/**
+ * Index of the file looked up in the @c i-th step, so the files are not
+ * visited in the order they were added.
+ */
+static size_t shuffle(size_t i, size_t files)
+{
+        return (i * 2654435761u) % files;
+}
+
+static void report(const char *operation, size_t count, double elapsed)
+{
+        printf("%-16s %8zu ops %10.1f ns/op\n", operation, count,
+               elapsed * 1e9 / count);
+}
+
+static bool add_all(client_watcher_list *registry, size_t files)
+{
+        const double start = now();
+        for (size_t i = 0; i < files; i++) {
+                const struct client_watcher w = {
+                        .wd = i + 1,
+                        .name = file_name(i),
+                };
+                if (w.name == NULL || !client_watcher_list_add(registry, &w))
+                        return false;
+        }
+        report("add", files, now() - start);
+        return true;
+}
+
+/**
+ * The files are watched with the descriptors from @c first_wd on.
+ */
+static bool find_all(const client_watcher_list *registry, size_t files,
+                     size_t first_wd)
+{
+        size_t found = 0;
+        double start = now();
+        for (size_t i = 0; i < files; i++) {
+                const int wd = first_wd + shuffle(i, files);
+                found += client_watcher_list_find_wd(registry, wd) != NULL;
+        }
+        report("find wd", files, now() - start);
+
+        char **names = malloc(files * sizeof(*names));
+        if (names == NULL)
+                return false;
+        for (size_t i = 0; i < files; i++)
+                names[i] = file_name(shuffle(i, files));
+        start = now();
+        for (size_t i = 0; i < files; i++)
+                found += names[i] != NULL
+                         && client_watcher_list_find_name(registry, names[i])
+                                    != NULL;
+        report("find path", files, now() - start);
+        for (size_t i = 0; i < files; i++)
+                free(names[i]);
+        free(names);
+        return found == 2 * files;
+}
+
+/**
+ * Every file is replaced, so its watcher is removed and the new i-node is
+ * watched with the next descriptor.
+ */
+static bool replace_all(client_watcher_list *registry, size_t files)
+{
+        const double start = now();
+        for (size_t i = 0; i < files; i++) {
+                const size_t file = shuffle(i, files);
+                if (!client_watcher_list_remove(registry, file + 1))
+                        return false;
+                const struct client_watcher w = {
+                        .wd = files + i + 1,
+                        .name = file_name(file),
+                };
+                if (w.name == NULL || !client_watcher_list_add(registry, &w))
+                        return false;
+        }
+        report("remove + add", files, now() - start);
+        return client_watcher_list_find_wd(registry, 1) == NULL;
+}
+
+/**
+ * Looks the paths up like client_watcher_list_find_last() used to, from
+ * the last watcher to the first one.
+ */
+static bool scan(const client_watcher_list *registry, size_t files)
+{
+        generic_list list;
+        if (!generic_list_create(&list, sizeof(struct client_watcher)))
+                return false;
+        bool success = false;
+        for (size_t i = 0; i < files; i++) {
+                char *name = file_name(i);
+                const struct client_watcher *w
+                        = client_watcher_list_find_name(registry, name);
+                free(name);
+                if (w == NULL || !generic_list_push_back(&list, w))
+                        goto clean;
+        }
+
+        const size_t lookups = files < SCAN_LOOKUPS ? files : SCAN_LOOKUPS;
+        size_t found = 0;
+        const double start = now();
+        for (size_t i = 0; i < lookups; i++) {
+                char *name = file_name(shuffle(i, files));
+                for (size_t j = files; name != NULL && j > 0; j--) {
+                        const struct client_watcher *w
+                                = generic_list_at(&list, j - 1);
+                        if (strcmp(w->name, name) == 0) {
+                                found++;
+                                break;
+                        }
+                }
+                free(name);
+        }
+        report("scan path", lookups, now() - start);
+        success = found == lookups;
+clean:
+        generic_list_destroy(&list);
+        return success;
+}
+
+int main(int argc, char **argv)
+{
+        const size_t files = argc > 1 ? strtoul(argv[1], NULL, 10)
+                                      : DEFAULT_FILES;
+        if (files == 0 || files > (size_t)INT_MAX / 2) {
+                fprintf(stderr, "usage: %s [files]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        client_watcher_list registry;
+        if (!client_watcher_list_create(&registry))
+                return EXIT_FAILURE;
+        printf("%zu watched files\n", files);
+        const bool success = add_all(&registry, files)
+                             && find_all(&registry, files, 1)
+                             && replace_all(&registry, files)
+                             && find_all(&registry, files, files + 1)
+                             && scan(&registry, files);
+        client_watcher_list_destroy(&registry);
+        return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
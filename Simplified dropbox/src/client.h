@@ -9,6 +9,21 @@
 
 #include "settings.h"
 
+/**
+ * Maximum number of the blocks the client reads ahead.
+ */
+#define CLIENT_MAX_READ_AHEAD 64
+
+/**
+ * Maximum number of the threads scanning the SOURCE folder.
+ */
+#define CLIENT_MAX_SCANNERS 64
+
+/**
+ * Maximum quiet period in milliseconds the changes of a file wait for.
+ */
+#define CLIENT_MAX_QUIET_PERIOD (60 * 1000)
+
 /**
  * @brief Entry point of the client.
  *
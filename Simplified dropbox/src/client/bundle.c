@@ -0,0 +1,158 @@
+/**
+ * @file bundle.c
+ * @brief Sending of the small files in bundles.
+ */
+#include "bundle.h"
+
+#include "helper.h"
+#include "log.h"
+#include "utils.h"
+
+#include <endian.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+void client_bundle_init(struct client_bundle *bundle)
+{
+        bundle->payload = NULL;
+        bundle->size = sizeof(uint64_t);
+        bundle->count = 0;
+}
+
+void client_bundle_destroy(struct client_bundle *bundle)
+{
+        free(bundle->payload);
+        client_bundle_init(bundle);
+}
+
+bool client_bundle_accepts(const struct client_traverse_data *data)
+{
+        return (data->settings->features & PACKET_FEATURE_BUNDLE)
+               && S_ISREG(data->sb->st_mode)
+               && data->sb->st_size <= CLIENT_BUNDLE_MAX_FILE_SIZE;
+}
+
+/**
+ * Checks whether the record of the file fits the rest of the bundle.
+ */
+static bool fits(const struct client_bundle *bundle, size_t name_size,
+                 size_t size)
+{
+        return bundle->count < PACKET_BUNDLE_MAX_FILES
+               && bundle->size + sizeof(struct packet_bundle_record)
+                                  + name_size + size
+                          <= PACKET_BUNDLE_MAX_SIZE;
+}
+
+/**
+ * Reads at most @c size bytes of the file into @c buff.
+ *
+ * @return the number of the bytes read on success;
+ *         -1 on failure
+ */
+static ssize_t read_content(const struct client_traverse_data *data,
+                            size_t size, unsigned char *buff)
+{
+        const int fd = openat(data->settings->dirfd, data->fpath,
+                              O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+                return -1;
+        const ssize_t done = utils_read(fd, size, buff);
+        if (close(fd) == -1)
+                log_warning("close");
+        return done;
+}
+
+int client_bundle_add(struct client_bundle *bundle,
+                      const struct client_traverse_data *data)
+{
+        const size_t name_size = strlen(data->fpath);
+        const size_t size = data->sb->st_size;
+        if (!fits(bundle, name_size, size)
+            && client_bundle_flush(bundle, data) == FTW_STOP)
+                return FTW_STOP;
+        if (bundle->payload == NULL
+            && (bundle->payload = malloc(PACKET_BUNDLE_MAX_SIZE)) == NULL) {
+                log_error("malloc");
+                return FTW_STOP;
+        }
+
+        unsigned char *record = &bundle->payload[bundle->size];
+        unsigned char *name = record + sizeof(struct packet_bundle_record);
+        unsigned char *content = name + name_size;
+        // the file may have been truncated since the scan
+        const ssize_t done = read_content(data, size, content);
+        if (done == -1) {
+                syslog(LOG_WARNING, "cannot read %s: %s", data->fpath,
+                       strerror(errno));
+                return FTW_CONTINUE;
+        }
+
+        const struct stat *sb = data->sb;
+        const struct packet_bundle_record header = {
+                .size = htobe64(done),
+                .mode = htobe64(sb->st_mode),
+                .uid = htobe64(sb->st_uid),
+                .gid = htobe64(sb->st_gid),
+                .atime_sec = htobe64(sb->st_atim.tv_sec),
+                .atime_nsec = htobe64(sb->st_atim.tv_nsec),
+                .mtime_sec = htobe64(sb->st_mtim.tv_sec),
+                .mtime_nsec = htobe64(sb->st_mtim.tv_nsec),
+                .name_size = htobe64(name_size),
+        };
+        memcpy(record, &header, sizeof(header));
+        memcpy(name, data->fpath, name_size);
+        bundle->names[bundle->count].offset = name - bundle->payload;
+        bundle->names[bundle->count].size = name_size;
+        bundle->count++;
+        bundle->size = content + done - bundle->payload;
+        syslog(LOG_DEBUG, "%s added to bundle", data->fpath);
+        return FTW_CONTINUE;
+}
+
+/**
+ * Logs the files of the bundle the server did not create.
+ */
+static void log_refused(const struct client_bundle *bundle,
+                        const unsigned char *status)
+{
+        for (size_t i = 0; i < bundle->count; i++) {
+                if (status[i / 8] & 1u << (i % 8))
+                        continue;
+                syslog(LOG_WARNING, "server did not create %.*s",
+                       (int)bundle->names[i].size,
+                       (const char *)&bundle->payload[bundle->names[i].offset]);
+        }
+}
+
+int client_bundle_flush(struct client_bundle *bundle,
+                        const struct client_traverse_data *data)
+{
+        if (bundle->count == 0)
+                return FTW_CONTINUE;
+
+        const uint64_t count = htobe64(bundle->count);
+        memcpy(bundle->payload, &count, sizeof(count));
+        syslog(LOG_INFO, "sending bundle of %zu files", bundle->count);
+        int result = FTW_STOP;
+        if (!log_packet_send(data->settings->stream, MSG_FILE_BUNDLE,
+                             bundle->size, bundle->payload)
+            || !client_helper_check_expected_code(
+                    client_helper_get_answer(data), MSG_BUNDLE_STATUS))
+                goto end;
+
+        const struct packet *status = *data->packet_buffptr;
+        if (status->payload_size != (bundle->count + 7) / 8) {
+                syslog(LOG_ERR, "invalid status of bundle");
+                goto end;
+        }
+        log_refused(bundle, status->payload);
+        if (client_helper_check_expected_code(client_helper_get_answer(data),
+                                              MSG_OK))
+                result = FTW_CONTINUE;
+end:
+        bundle->size = sizeof(uint64_t);
+        bundle->count = 0;
+        return result;
+}
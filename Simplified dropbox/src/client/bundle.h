@@ -0,0 +1,82 @@
+/**
+ * @file bundle.h
+ * @brief Module for sending the small files in bundles, so a file does not
+ *        need several requests of its own.
+ */
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include "traverse_data.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Largest file the client sends in a bundle.
+ */
+#define CLIENT_BUNDLE_MAX_FILE_SIZE (64 * 1024)
+
+/**
+ * Files collected for MSG_FILE_BUNDLE.
+ */
+struct client_bundle {
+        unsigned char *payload; /**< PACKET_BUNDLE_MAX_SIZE bytes or NULL */
+        size_t size;            /**< bytes of the payload used */
+        size_t count;           /**< number of the files */
+        struct {
+                size_t offset; /**< offset of the path in the payload */
+                size_t size;   /**< length of the path */
+        } names[PACKET_BUNDLE_MAX_FILES];
+};
+
+/**
+ * Initializes the empty bundle. The payload is allocated with the first
+ * file.
+ *
+ * @param bundle  the bundle
+ */
+void client_bundle_init(struct client_bundle *bundle);
+
+/**
+ * Frees the bundle, the files which were not sent are dropped.
+ *
+ * @param bundle  the bundle
+ */
+void client_bundle_destroy(struct client_bundle *bundle);
+
+/**
+ * Checks whether the file can be sent in a bundle, i.e. the server supports
+ * bundles and the file is a small regular file.
+ *
+ * @param data  struct holding data, which are used when traversing a folder
+ * @return      true if the file can be bundled;
+ *              false otherwise
+ */
+bool client_bundle_accepts(const struct client_traverse_data *data);
+
+/**
+ * Reads the file into the bundle. The full bundle is sent first.
+ *
+ * @param bundle  the bundle
+ * @param data    struct holding data, which are used when traversing a
+ *                folder, the path is relative to the SOURCE folder
+ * @return        FTW_CONTINUE on success;
+ *                FTW_STOP on failure
+ */
+int client_bundle_add(struct client_bundle *bundle,
+                      const struct client_traverse_data *data);
+
+/**
+ * Sends the files of the bundle and empties it. The files the server did
+ * not create are logged.
+ *
+ * @param bundle  the bundle
+ * @param data    struct holding data, which are used when traversing a
+ *                folder
+ * @return        FTW_CONTINUE on success;
+ *                FTW_STOP on failure
+ */
+int client_bundle_flush(struct client_bundle *bundle,
+                        const struct client_traverse_data *data);
+
+#endif //BUNDLE_H
@@ -1,5 +1,7 @@
+#include "connection.h"
 #include "copy.h"
 #include "event.h"
+#include "fanotify.h"
 #include "helper.h"
 #include "send.h"
 #include "watcher_list.h"
@@ -8,55 +10,6 @@
 
 #include <sys/inotify.h>
 
-/**
- * Gets the block_size from server and stores it into settings
- *
- * @param packet_buff   an address of the pointer of type struct packet *
- * @param settings      struct holding information about behaviour of the program.
- */
-static void set_block_size(struct packet *packet_buff,
-                           struct settings *settings)
-{
-        struct packet_payload_settings *size
-                = (struct packet_payload_settings *)packet_buff->payload;
-        settings->fs_block_size = size->fs_block_size;
-
-        syslog(LOG_DEBUG, "set block size: %lu", settings->fs_block_size);
-}
-
-/**
- * Gets settings from server
- *
- * @param settings  struct holding information about behaviour of the program.
- * @return          true on success;
- *                  false on failure
- */
-static bool get_settings_from_server(struct settings *settings)
-{
-        struct packet *packet_buff = NULL;
-        size_t n = 0;
-
-        bool is_success = false;
-        if (!log_packet_read(settings->read_fd, &packet_buff, &n))
-                goto clean;
-
-        if (packet_buff->code == MSG_REJECTED) {
-                syslog(LOG_ERR, "rejected by server");
-                goto clean;
-        }
-
-        if (!client_helper_check_expected_code(packet_buff->code, MSG_SETTINGS))
-                goto clean;
-        syslog(LOG_DEBUG, "received settings from server");
-
-        set_block_size(packet_buff, settings);
-
-        is_success = true;
-clean:
-        free(packet_buff);
-        return is_success;
-}
-
 /**
  * Main function of clients which calls other functions.
  *
@@ -68,7 +21,12 @@ int client_main(struct settings *settings)
 {
         syslog(LOG_DEBUG, "call main");
 
-        const int inot_fd = inotify_init1(IN_NONBLOCK);
+        // one mark of the filesystem replaces the watches of the directories
+        if (!settings->one_shot)
+                settings->fanotify = client_fanotify_create(settings->dirfd);
+        const int inot_fd = settings->fanotify != NULL
+                                    ? client_fanotify_fd(settings->fanotify)
+                                    : inotify_init1(IN_NONBLOCK);
         if (inot_fd == -1) {
                 log_error("inotify_init1");
                 syslog(LOG_DEBUG, "Client main EXIT_FAILURE.");
@@ -83,7 +41,7 @@ int client_main(struct settings *settings)
                 goto clean_inot;
         }
 
-        if (!get_settings_from_server(settings)
+        if (!client_connection_open(settings)
             || !client_copy_files(inot_fd, &watchers, settings))
                 goto clean_inot;
 
@@ -91,15 +49,20 @@ int client_main(struct settings *settings)
             && !client_event_loop(&watchers, inot_fd, settings))
                 goto clean_inot;
 
-        if (!log_packet_send(settings->write_fd, MSG_END_CONNECTION, 0, NULL))
+        if (!log_packet_send(settings->stream, MSG_END_CONNECTION, 0, NULL)
+            || !log_packet_flush(settings->stream))
                 goto clean_inot;
 
         syslog(LOG_DEBUG, "Server end connection successfully");
 
         exit_status = EXIT_SUCCESS;
 clean_inot:
+        client_connection_close(settings);
         client_watcher_list_destroy(&watchers);
-        if (close(inot_fd) == -1) {
+        if (settings->fanotify != NULL) {
+                client_fanotify_destroy(settings->fanotify);
+                settings->fanotify = NULL;
+        } else if (close(inot_fd) == -1) {
                 log_error("inotify_close");
                 exit_status = EXIT_FAILURE;
         }
@@ -0,0 +1,183 @@
+/**
+ * @file connection.c
+ * @brief Opening of the connection to the server and agreeing on the
+ *        settings of the protocol.
+ */
+#include "connection.h"
+
+#include "helper.h"
+
+#include "log.h"
+#include "packet.h"
+
+/**
+ * Gets the block_size from server and stores it into settings
+ *
+ * @param packet_buff   an address of the pointer of type struct packet *
+ * @param settings      struct holding information about behaviour of the program.
+ */
+static void set_block_size(struct packet *packet_buff,
+                           struct settings *settings)
+{
+        struct packet_payload_settings *size
+                = (struct packet_payload_settings *)packet_buff->payload;
+        settings->fs_block_size = size->fs_block_size;
+
+        syslog(LOG_DEBUG, "set block size: %lu", settings->fs_block_size);
+}
+
+/**
+ * Chooses the size of the data chunks. It is the smaller of the maximums
+ * of both peers rounded down to whole filesystem blocks, so the server
+ * can still skip the null blocks of sparse files. The server which does
+ * not support the chunks gets blocks of the filesystem size.
+ *
+ * @param server_settings settings advertised by the server
+ * @param settings        struct holding information about behaviour of the program.
+ * @return                size of the data chunks
+ */
+static unsigned long
+choose_chunk_size(const struct packet_payload_settings *server_settings,
+                  const struct settings *settings)
+{
+        const unsigned long block_size = settings->fs_block_size;
+        if (!(settings->features & PACKET_FEATURE_CHUNKS))
+                return block_size;
+
+        unsigned long chunk_size = settings->chunk_size;
+        if (chunk_size > server_settings->chunk_size)
+                chunk_size = server_settings->chunk_size;
+        chunk_size -= chunk_size % block_size;
+        return chunk_size < block_size ? block_size : chunk_size;
+}
+
+/**
+ * Agrees with the server on the features of the protocol, the size of the
+ * data chunks and the number of blocks sent without waiting for the
+ * acknowledgement. The server which does not support the window
+ * advertises window of size 0 and the client waits for every block then.
+ * The server older than @c PACKET_PROTOCOL_VERSION 1 advertises neither
+ * features nor chunk size and gets blocks of the filesystem size.
+ *
+ * @param packet_buffptr  an address of the pointer of type struct packet *
+ * @param nptr            a pointer to a value representing size of packet_buffptr
+ * @param settings        struct holding information about behaviour of the program.
+ * @return                true on success;
+ *                        false on failure
+ */
+static bool negotiate_settings(struct packet **packet_buffptr, size_t *nptr,
+                               struct settings *settings)
+{
+        const struct packet_payload_settings *server_settings
+                = (struct packet_payload_settings *)(*packet_buffptr)->payload;
+        const uint64_t server_version = server_settings->protocol_version;
+
+        settings->features = server_version >= 1
+                                     ? server_settings->features & PACKET_FEATURES
+                                     : 0;
+        settings->chunk_size = choose_chunk_size(server_settings, settings);
+        syslog(LOG_DEBUG, "server protocol version: %lu, features: %#lx",
+               (unsigned long)server_version, settings->features);
+        syslog(LOG_DEBUG, "set chunk size: %lu", settings->chunk_size);
+
+        if (server_settings->window_size == 0 || settings->window_size == 0) {
+                settings->window_size = 0;
+                syslog(LOG_DEBUG, "window disabled");
+        } else if (settings->window_size > server_settings->window_size) {
+                settings->window_size = server_settings->window_size;
+        }
+
+        // nothing to agree on with the oldest servers
+        if (server_version == 0 && settings->window_size == 0)
+                return true;
+
+        const struct packet_payload_settings payload = {
+                .fs_block_size = settings->fs_block_size,
+                .window_size = settings->window_size,
+                .protocol_version = PACKET_PROTOCOL_VERSION,
+                .features = settings->features,
+                .chunk_size = settings->chunk_size,
+        };
+        if (!log_packet_send(settings->stream, MSG_SETTINGS, sizeof(payload),
+                             (const unsigned char *)&payload)
+            || !log_packet_read(settings->stream, packet_buffptr, nptr)
+            || !client_helper_check_expected_code((*packet_buffptr)->code,
+                                                  MSG_OK))
+                return false;
+
+        syslog(LOG_DEBUG, "set window size: %lu", settings->window_size);
+        return true;
+}
+
+/**
+ * Gets settings from server
+ *
+ * @param settings  struct holding information about behaviour of the program.
+ * @return          true on success;
+ *                  false on failure
+ */
+static bool get_settings_from_server(struct settings *settings)
+{
+        struct packet *packet_buff = NULL;
+        size_t n = 0;
+
+        bool is_success = false;
+        if (!log_packet_read(settings->stream, &packet_buff, &n))
+                goto clean;
+
+        if (packet_buff->code == MSG_REJECTED) {
+                syslog(LOG_ERR, "rejected by server");
+                goto clean;
+        }
+
+        if (!client_helper_check_expected_code(packet_buff->code, MSG_SETTINGS))
+                goto clean;
+        syslog(LOG_DEBUG, "received settings from server");
+
+        set_block_size(packet_buff, settings);
+        if (!negotiate_settings(&packet_buff, &n, settings))
+                goto clean;
+
+        is_success = true;
+clean:
+        free(packet_buff);
+        return is_success;
+}
+
+bool client_connection_open(struct settings *settings)
+{
+        settings->stream
+                = packet_stream_create(settings->read_fd, settings->write_fd);
+        if (settings->stream == NULL) {
+                log_error("packet_stream_create");
+                return false;
+        }
+        return get_settings_from_server(settings);
+}
+
+bool client_connection_reopen(struct settings *settings)
+{
+        client_connection_close(settings);
+        if (settings->reconnect == NULL || !settings->reconnect(settings))
+                return false;
+
+        if (client_connection_open(settings))
+                return true;
+        client_connection_close(settings);
+        return false;
+}
+
+void client_connection_close(struct settings *settings)
+{
+        packet_stream_destroy(settings->stream);
+        settings->stream = NULL;
+}
+
+unsigned long client_connection_next_delay(unsigned long delay)
+{
+        if (delay < CLIENT_RECONNECT_MIN_DELAY)
+                return CLIENT_RECONNECT_MIN_DELAY;
+        if (delay > CLIENT_RECONNECT_MAX_DELAY / 2)
+                return CLIENT_RECONNECT_MAX_DELAY;
+        return 2 * delay;
+}
@@ -0,0 +1,55 @@
+/**
+ * @file connection.h
+ * @brief Module for opening the connection to the server and agreeing on
+ *        the settings of the protocol.
+ */
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include "settings.h"
+
+#include <stdbool.h>
+
+/** delay before the first attempt to reconnect in milliseconds */
+#define CLIENT_RECONNECT_MIN_DELAY 100
+/** the delay is doubled after every failed attempt up to this maximum */
+#define CLIENT_RECONNECT_MAX_DELAY (30 * 1000)
+
+/**
+ * Creates the packet stream over the connected file descriptors and agrees
+ * with the server on the settings of the protocol.
+ *
+ * @param settings  struct holding information about behaviour of the program.
+ * @return          true on success;
+ *                  false on failure
+ */
+bool client_connection_open(struct settings *settings);
+
+/**
+ * Connects to the server again after the connection was lost and agrees
+ * on the settings of the protocol with it.
+ *
+ * @param settings  struct holding information about behaviour of the program.
+ * @return          true on success;
+ *                  false on failure, the client stays disconnected
+ */
+bool client_connection_reopen(struct settings *settings);
+
+/**
+ * Drops the packet stream of the lost connection. Packets not sent yet are
+ * discarded.
+ *
+ * @param settings  struct holding information about behaviour of the program.
+ */
+void client_connection_close(struct settings *settings);
+
+/**
+ * Computes the delay before the next attempt to reconnect after the attempt
+ * made after @c delay failed.
+ *
+ * @param delay  the last delay in milliseconds
+ * @return       the doubled delay, at most @c CLIENT_RECONNECT_MAX_DELAY
+ */
+unsigned long client_connection_next_delay(unsigned long delay);
+
+#endif /* CONNECTION_H */
@@ -1,12 +1,23 @@
 #include "copy.h"
 
+#include "bundle.h"
+#include "delta.h"
+#include "hash.h"
 #include "helper.h"
 #include "log.h"
+#include "manifest.h"
+#include "readahead.h"
+#include "resume.h"
 #include "traverse_data.h"
 #include "send.h"
+#include "walker.h"
 #include "watcher.h"
 #include "watcher_list.h"
 
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
 /**
  * Converts absolute path to a relative path.
  *
@@ -54,7 +65,19 @@ static int get_op_response(const char *op,
         return NEXT_STEP;
 }
 
-int client_copy_regular_file(struct client_traverse_data data)
+/**
+ * Sends the file to the server. If the signatures of the copy on the server
+ * are given, only the delta against the copy is sent. If the server
+ * continues the partial file, only the blocks after @c data.offset are sent.
+ *
+ * @param data   struct holding data, which are used when traversing a folder
+ * @param delta  signatures of the copy on the server received after
+ *               MSG_DELTA_FILE; NULL to create the file
+ * @return       FTW_CONTINUE on success
+ *               FTW_STOP on failure
+ */
+static int send_file(struct client_traverse_data data,
+                     const struct client_delta *delta)
 {
         const char *path_for_server
                 = get_relative_path(data.fpath, data.ftwbuf);
@@ -73,12 +96,25 @@ int client_copy_regular_file(struct client_traverse_data data)
                         goto end;                                              \
         } while (0)
 
+        // the disk reads the beginning while the metadata are sent
+        if (delta == NULL)
+                client_readahead_prefetch(data.settings->dirfd, data.fpath,
+                                          data.offset,
+                                          data.settings->read_ahead
+                                                  * data.settings->chunk_size);
+
         int result;
-        DO_STEP(client_send_create_file(&data, path_for_server));
+        if (delta == NULL && data.offset == 0) {
+                DO_STEP(client_send_create_file(&data, path_for_server));
+                DO_STEP(client_send_file_size(&data));
+        }
         DO_STEP(client_send_timestamps(&data));
         DO_STEP(client_send_permission_modes(&data));
         DO_STEP(client_send_owner(&data));
-        DO_STEP(client_send_blocks(&data));
+        if (delta == NULL)
+                DO_STEP(client_send_blocks(&data));
+        else
+                DO_STEP(client_delta_send_blocks(&data, delta));
         DO_STEP(client_send_done(&data));
 
         const char *operations[]
@@ -93,62 +129,327 @@ end:
         return result;
 }
 
+int client_copy_regular_file(struct client_traverse_data data)
+{
+        return send_file(data, NULL);
+}
+
+int client_copy_changed_file(struct client_traverse_data data)
+{
+        if (data.settings->features & PACKET_FEATURE_DELTA) {
+                struct client_delta delta;
+                const int result = client_delta_request(&data, &delta);
+                if (result != NEXT_STEP && result != FTW_CONTINUE)
+                        return result;
+                if (result == NEXT_STEP) {
+                        const int copy_result = send_file(data, &delta);
+                        client_delta_destroy(&delta);
+                        return copy_result;
+                }
+        }
+
+        // the server replaces the file once the new version is complete
+        if (!(data.settings->features & PACKET_FEATURE_REPLACE)
+            && client_send_delete_file(&data) == FTW_STOP)
+                return FTW_STOP;
+        return send_file(data, NULL);
+}
+
+/**
+ * Continues the file the server has only the beginning of at the checkpoint
+ * of the server. The file is sent as the changed file if it cannot be
+ * continued.
+ *
+ * @param data  struct holding data, which are used when traversing a folder
+ * @return      FTW_CONTINUE on success
+ *              FTW_STOP on failure
+ */
+static int copy_partial_file(struct client_traverse_data data)
+{
+        const int result = client_resume_request(&data, &data.offset);
+        if (result == NEXT_STEP)
+                return send_file(data, NULL);
+        if (result != FTW_CONTINUE)
+                return result;
+        return client_copy_changed_file(data);
+}
+
+/**
+ * Checks whether the server may have a checkpoint of the file, because its
+ * copy is shorter by at least one segment of the checkpoints.
+ */
+static bool may_be_partial(const struct client_traverse_data *data,
+                           const struct client_manifest_entry *entry)
+{
+        return (data->settings->features & PACKET_FEATURE_RESUME)
+               && entry->size >= HASH_PREFIX_SEGMENT_SIZE
+               && entry->size < (uint64_t)data->sb->st_size;
+}
+
+/**
+ * Checks whether the file is in a directory of the server, which is not in
+ * the SOURCE folder, so it is deleted with the directory.
+ */
+static bool in_extra_dir(const struct client_manifest *manifest,
+                         const char *name)
+{
+        char path[PATH_MAX];
+        if (strlen(name) >= sizeof(path))
+                return false;
+        strcpy(path, name);
+
+        char *slash;
+        while ((slash = strrchr(path, '/')) != NULL) {
+                *slash = '\0';
+                const struct client_manifest_entry *entry
+                        = client_manifest_find(manifest, path);
+                if (entry != NULL && !entry->seen && S_ISDIR(entry->mode))
+                        return true;
+        }
+        return false;
+}
+
+/**
+ * Deletes the files and directories of the server, which are not in the
+ * SOURCE folder.
+ *
+ * @param data      struct holding data, which are used when traversing a folder
+ * @param manifest  the files of the server
+ * @return          true on success;
+ *                  false on failure
+ */
+static bool delete_extra_files(struct client_traverse_data data,
+                               const struct client_manifest *manifest)
+{
+        for (size_t i = 0; i < manifest->slot_count; i++) {
+                const struct client_manifest_entry *entry
+                        = &manifest->slots[i];
+                if (entry->name == NULL || entry->seen
+                    || in_extra_dir(manifest, entry->name))
+                        continue;
+
+                syslog(LOG_INFO, "deleting extra file: %s", entry->name);
+                data.fpath = entry->name;
+                const int result = S_ISDIR(entry->mode)
+                                           ? client_send_delete_dir(&data)
+                                           : client_send_delete_file(&data);
+                if (result == FTW_STOP)
+                        return false;
+        }
+        return true;
+}
+
 static bool
 create_and_add_watcher(const struct client_watcher_data *watcher_data,
                        client_watcher_list *watchers)
 {
         struct client_watcher watcher;
+        if (!watcher_create(&watcher, watcher_data))
+                return false;
+        if (client_watcher_list_add(watchers, &watcher))
+                return true;
+        free((void *)watcher.name);
+        return false;
+}
 
-        return watcher_create(&watcher, watcher_data)
-               && client_watcher_list_push_back(watchers, &watcher);
+/**
+ * Watches the file or directory of the SOURCE folder for changes.
+ */
+static bool watch_entry(const struct settings *settings, const char *path,
+                        int inot_fd, client_watcher_list *watchers)
+{
+        char *full_path = NULL;
+        if (asprintf(&full_path, "%s/%s", settings->cwd, path) == -1) {
+                log_error("asprintf");
+                return false;
+        }
+
+        const struct client_watcher_data watcher_data = {
+                .inot_fd = inot_fd,
+                .fanotify = settings->fanotify,
+                .fpath = full_path,
+                .relative_path = path,
+        };
+        const bool success = create_and_add_watcher(&watcher_data, watchers);
+        if (!success)
+                syslog(LOG_DEBUG, "create_watcher failed in traversal");
+        free(full_path);
+        return success;
 }
 
-static int _traversal(const char *fpath, const struct stat *sb, int tflag,
-                      const struct FTW *ftwbuf, const struct settings *settings,
-                      struct packet **packet_buffptr, size_t *nptr, int inot_fd,
-                      client_watcher_list *watchers)
+/**
+ * Creates the directory on the server unless it has it already.
+ *
+ * @return FTW_CONTINUE on success;
+ *         FTW_STOP on failure
+ */
+static int copy_dir(const struct client_traverse_data *data,
+                    struct client_manifest *manifest)
 {
-        syslog(LOG_DEBUG, "traversal: fpath: %s, type: %d", fpath, tflag);
+        if (manifest != NULL) {
+                struct client_manifest_entry *entry
+                        = client_manifest_find(manifest, data->fpath);
+                if (entry != NULL) {
+                        entry->seen = true;
+                        if (S_ISDIR(entry->mode))
+                                return FTW_CONTINUE;
+                }
+        }
+        return client_send_create_dir(data) == FTW_STOP ? FTW_STOP
+                                                        : FTW_CONTINUE;
+}
 
-        if (ftwbuf->level == 0)
-                return FTW_CONTINUE;
+/**
+ * State of the copying of the tree.
+ */
+struct copy_tree_data {
+        struct client_traverse_data data;
+        struct client_manifest *manifest; /**< files of the server or NULL */
+        client_watcher_list *watchers;    /**< NULL if nothing is watched */
+        int inot_fd;
+};
 
-        if (ftwbuf->level > 1)
+/**
+ * Sends the file unless the server has it already. The small files are
+ * added to the bundle instead.
+ *
+ * @param data      struct holding data, which are used when traversing a
+ *                  folder
+ * @param manifest  the files of the server or NULL
+ * @param bundle    the bundle or NULL to send the file on its own
+ * @return          FTW_CONTINUE on success;
+ *                  FTW_STOP on failure
+ */
+static int copy_file(struct client_traverse_data data,
+                     struct client_manifest *manifest,
+                     struct client_bundle *bundle);
+
+static int copy_entry(const struct copy_tree_data *tree,
+                      struct client_bundle *bundle,
+                      struct client_walker_entry *entry)
+{
+        const struct settings *settings = tree->data.settings;
+        syslog(LOG_DEBUG, "traversal: path: %s", entry->path);
+        // the files are watched through their directory
+        if (tree->watchers != NULL && !settings->one_shot
+            && S_ISDIR(entry->sb.st_mode)
+            && !watch_entry(settings, entry->path, tree->inot_fd,
+                            tree->watchers))
                 return FTW_STOP;
 
-        const struct client_traverse_data data = {
-                .settings = settings,
-                .packet_buffptr = packet_buffptr,
-                .nptr = nptr,
-                .fpath = fpath,
-                .sb = (struct stat *)sb,
-                .ftwbuf = ftwbuf,
-        };
+        struct client_traverse_data data = tree->data;
+        data.fpath = entry->path;
+        data.sb = &entry->sb;
+        if (S_ISDIR(entry->sb.st_mode))
+                return copy_dir(&data, tree->manifest);
+        return copy_file(data, tree->manifest, bundle);
+}
 
-        switch (tflag) {
-        case FTW_F:
-                if (!settings->one_shot) {
-                        struct client_watcher_data watcher_data = {
-                                .inot_fd = inot_fd,
-                                .fpath = fpath,
-                                .relative_path
-                                = get_relative_path(data.fpath, data.ftwbuf),
-                        };
-                        if (!create_and_add_watcher(&watcher_data, watchers)) {
-                                syslog(LOG_DEBUG,
-                                       "create_watcher failed in traversal");
-                                return FTW_STOP;
-                        }
-                }
-                return client_copy_regular_file(data);
-        case FTW_D:
+/**
+ * Sends the files of the directory to the server as the walker finds them.
+ * The subdirectories are sent only if the server supports them.
+ */
+static bool copy_tree(const struct copy_tree_data *tree, const char *dir)
+{
+        const struct settings *settings = tree->data.settings;
+        const bool recursive = settings->features & PACKET_FEATURE_DIRS;
+        struct client_walker *walker = client_walker_start(
+                settings->dirfd, dir, settings->scanners, recursive);
+        if (walker == NULL)
+                return false;
+
+        // the small files are sent together once the bundle is full
+        struct client_bundle bundle;
+        client_bundle_init(&bundle);
+        int found = 0;
+        int result = FTW_CONTINUE;
+        struct client_walker_entry entry;
+        while (result != FTW_STOP
+               && (found = client_walker_next(walker, &entry)) == 1) {
+                result = copy_entry(tree, &bundle, &entry);
+                free(entry.path);
+        }
+        client_walker_stop(walker);
+        if (result != FTW_STOP)
+                result = client_bundle_flush(&bundle, &tree->data);
+        client_bundle_destroy(&bundle);
+        if (found == -1)
+                syslog(LOG_ERR, "scanning of %s failed", settings->cwd);
+        return result != FTW_STOP && found == 0;
+}
+
+/**
+ * Sends the whole file, in the bundle if it is small enough.
+ *
+ * @param changed  the server has an older version of the file
+ */
+static int copy_whole_file(struct client_traverse_data data,
+                           struct client_bundle *bundle, bool changed)
+{
+        if (bundle != NULL && client_bundle_accepts(&data)) {
+                data.fpath = get_relative_path(data.fpath, data.ftwbuf);
+                return client_bundle_add(bundle, &data);
+        }
+        return changed ? client_copy_changed_file(data)
+                       : client_copy_regular_file(data);
+}
+
+static int copy_file(struct client_traverse_data data,
+                     struct client_manifest *manifest,
+                     struct client_bundle *bundle)
+{
+        if (manifest == NULL)
+                return copy_whole_file(data, bundle, false);
+
+        const char *path = get_relative_path(data.fpath, data.ftwbuf);
+        struct client_manifest_entry *entry
+                = client_manifest_find(manifest, path);
+        if (entry == NULL)
+                return copy_whole_file(data, bundle, false);
+
+        entry->seen = true;
+        if (client_manifest_is_current(entry, data.sb)) {
+                syslog(LOG_DEBUG, "%s is up to date", path);
                 return FTW_CONTINUE;
-        case FTW_DNR:
-                syslog(LOG_WARNING, "Could read folder: %s", fpath);
-        default:
-                break;
         }
-        return FTW_CONTINUE;
+
+        data.fpath = path;
+        data.ftwbuf = NULL;
+        if (S_ISDIR(entry->mode)) {
+                // the directory was replaced by the file in the SOURCE
+                if (client_send_delete_dir(&data) == FTW_STOP)
+                        return FTW_STOP;
+                return client_copy_regular_file(data);
+        }
+        if (may_be_partial(&data, entry))
+                return copy_partial_file(data);
+        return copy_whole_file(data, bundle, true);
+}
+
+int client_copy_new_or_changed_file(struct client_traverse_data data,
+                                    struct client_manifest *manifest)
+{
+        return copy_file(data, manifest, NULL);
+}
+
+bool client_copy_dir(const char *dir, int inot_fd,
+                     client_watcher_list *watchers,
+                     const struct settings *settings)
+{
+        struct packet *packet_buff = NULL;
+        size_t n = 0;
+        const struct copy_tree_data tree = {
+                .data = {
+                        .settings = settings,
+                        .packet_buffptr = &packet_buff,
+                        .nptr = &n,
+                },
+                .watchers = watchers,
+                .inot_fd = inot_fd,
+        };
+        const bool success = copy_tree(&tree, dir);
+        free(packet_buff);
+        return success;
 }
 
 bool client_copy_files(int inot_fd, client_watcher_list *watchers,
@@ -156,10 +457,11 @@ bool client_copy_files(int inot_fd, client_watcher_list *watchers,
 {
         syslog(LOG_DEBUG, "starting to copy files");
 
-        if (!settings->one_shot) {
+        if (watchers != NULL && !settings->one_shot) {
                 struct client_watcher_data watcher_data = {
                         .fpath = settings->cwd,
                         .inot_fd = inot_fd,
+                        .fanotify = settings->fanotify,
                         .relative_path = settings->cwd,
                 };
                 if (!create_and_add_watcher(&watcher_data, watchers)) {
@@ -168,28 +470,42 @@ bool client_copy_files(int inot_fd, client_watcher_list *watchers,
                 }
         }
 
+        bool is_success = false;
         struct packet *packet_buff = NULL;
         size_t n = 0;
+        struct copy_tree_data tree = {
+                .data = {
+                        .settings = settings,
+                        .packet_buffptr = &packet_buff,
+                        .nptr = &n,
+                },
+                .watchers = watchers,
+                .inot_fd = inot_fd,
+        };
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wpedantic"
-        /* Nested function. GNU extension */
-        int traversal(const char *fpath, const struct stat *sb, int tflag,
-                      struct FTW *ftwbuf)
-        {
-                return _traversal(fpath, sb, tflag, ftwbuf, settings,
-                                  &packet_buff, &n, inot_fd, watchers);
+        // the files the server already has are skipped
+        struct client_manifest manifest_buff;
+        if (settings->features & PACKET_FEATURE_MANIFEST) {
+                if (client_manifest_request(&tree.data, &manifest_buff)
+                    != NEXT_STEP)
+                        goto clean;
+                tree.manifest = &manifest_buff;
+        } else if (settings->delete) {
+                syslog(LOG_WARNING, "server cannot list its files to delete");
         }
-#pragma GCC diagnostic pop
 
-        bool is_success = false;
-        if (nftw(settings->cwd, traversal, 64, FTW_ACTIONRETVAL | FTW_PHYS)
-            == -1)
+        if (!copy_tree(&tree, ""))
+                goto clean;
+
+        if (tree.manifest != NULL && settings->delete
+            && !delete_extra_files(tree.data, tree.manifest))
                 goto clean;
 
         syslog(LOG_DEBUG, "copying finished");
         is_success = true;
 clean:
+        if (tree.manifest != NULL)
+                client_manifest_destroy(tree.manifest);
         free(packet_buff);
         return is_success;
 }
@@ -7,6 +7,7 @@
 #ifndef COPY_H
 #define COPY_H
 
+#include "manifest.h"
 #include "traverse_data.h"
 #include "watcher_list.h"
 
@@ -20,10 +21,37 @@
 int client_copy_regular_file(const struct client_traverse_data data);
 
 /**
- * Traversal through all files and copying them into the server.
+ * Sends the changed regular file to the server. If the server supports it,
+ * only the delta against its copy of the file is sent, otherwise the copy
+ * is deleted and the file is copied again.
+ *
+ * @param data  struct holding data, which are used when traversing a folder
+ * @return      FTW_CONTINUE on success
+ *              FTW_STOP on failure
+ */
+int client_copy_changed_file(const struct client_traverse_data data);
+
+/**
+ * Sends the file unless the server already has the same file. The changed
+ * file is sent by client_copy_changed_file() or continued at the
+ * checkpoint of the server.
+ *
+ * @param data      struct holding data, which are used when traversing a folder
+ * @param manifest  the files of the server; NULL if the server did not
+ *                  send them
+ * @return          FTW_CONTINUE on success
+ *                  FTW_STOP on failure
+ */
+int client_copy_new_or_changed_file(struct client_traverse_data data,
+                                    struct client_manifest *manifest);
+
+/**
+ * Traversal through all files and copying them into the server. The
+ * subdirectories are created and copied too if the server supports them.
  *
  * @param inot_fd   inotify file descriptor
- * @param watchers  pointer to the list of watchers
+ * @param watchers  pointer to the list of watchers; NULL if the files are
+ *                  already watched
  * @param settings  pointer to the configuration struct
  * @return          true on success;
  *                  false on failure
@@ -31,4 +59,20 @@ int client_copy_regular_file(const struct client_traverse_data data);
 bool client_copy_files(int inot_fd, client_watcher_list *watchers,
                        const struct settings *settings);
 
+/**
+ * Copies the content of the directory, which the server does not have yet,
+ * e.g. the directory just created in the SOURCE folder.
+ *
+ * @param dir       path of the directory relative to the SOURCE folder
+ * @param inot_fd   inotify file descriptor
+ * @param watchers  pointer to the list of watchers; NULL if the files are
+ *                  not watched
+ * @param settings  pointer to the configuration struct
+ * @return          true on success;
+ *                  false on failure
+ */
+bool client_copy_dir(const char *dir, int inot_fd,
+                     client_watcher_list *watchers,
+                     const struct settings *settings);
+
 #endif //COPY_H
@@ -0,0 +1,201 @@
+/**
+ * @file dedup.c
+ * @brief Sending of the chunks of the files the server does not have yet.
+ */
+#include "dedup.h"
+
+#include "helper.h"
+#include "readahead.h"
+#include "send.h"
+
+#include "hash.h"
+#include "log.h"
+#include "utils.h"
+
+#include <assert.h>
+#include <endian.h>
+#include <stdlib.h>
+
+/**
+ * Size of the part of the file chunked and offered at once.
+ */
+#define DEDUP_BUFFER_SIZE (4 * 1024 * 1024)
+
+/**
+ * Maximal number of the chunks of one offer.
+ */
+#define DEDUP_MAX_CHUNKS (DEDUP_BUFFER_SIZE / HASH_CDC_MIN_SIZE + 1)
+
+static_assert(sizeof(((struct packet_chunk_offer *)NULL)->hash)
+                       == HASH_SHA256_SIZE,
+               "chunks are offered by their SHA-256");
+static_assert(DEDUP_BUFFER_SIZE >= HASH_CDC_MAX_SIZE,
+               "the whole largest chunk has to fit into the buffer");
+
+/**
+ * Part of the file split into the chunks.
+ */
+struct batch {
+        unsigned char *buff; /**< bytes of the file not sent yet */
+        size_t len;          /**< number of the bytes in @c buff */
+        bool eof;            /**< the rest of the file is in @c buff */
+        size_t count;        /**< number of the chunks */
+        size_t offsets[DEDUP_MAX_CHUNKS + 1]; /**< offsets of the chunks in
+                                                   @c buff and their end */
+        struct packet_chunk_offer offers[DEDUP_MAX_CHUNKS];
+        uint64_t missing[DEDUP_MAX_CHUNKS]; /**< chunks the server misses */
+        size_t missing_count;               /**< number of @c missing */
+};
+
+bool client_dedup_usable(const struct client_traverse_data *data,
+                         off_t file_size)
+{
+        return (data->settings->features & PACKET_FEATURE_DEDUP)
+               && data->settings->chunk_size >= HASH_CDC_MAX_SIZE
+               && file_size > HASH_CDC_MIN_SIZE;
+}
+
+static bool fill(struct batch *b, int fd)
+{
+        while (!b->eof && b->len < DEDUP_BUFFER_SIZE) {
+                const ssize_t ret = utils_read(fd, DEDUP_BUFFER_SIZE - b->len,
+                                               &b->buff[b->len]);
+                if (ret == -1) {
+                        log_error("utils_read");
+                        return false;
+                }
+                if (ret == 0)
+                        b->eof = true;
+                b->len += ret;
+        }
+        return true;
+}
+
+/**
+ * Splits the buffer into the chunks. The chunk is cut only if all bytes,
+ * which could decide its end, are buffered.
+ */
+static void cut(struct batch *b)
+{
+        size_t offset = 0;
+        b->count = 0;
+        while (offset < b->len && b->count < DEDUP_MAX_CHUNKS) {
+                const size_t rest = b->len - offset;
+                if (rest < HASH_CDC_MAX_SIZE && !b->eof)
+                        break;
+
+                const size_t size = hash_cdc_chunk_size(rest, &b->buff[offset]);
+                struct packet_chunk_offer *offer = &b->offers[b->count];
+                hash_sha256(size, &b->buff[offset], offer->hash);
+                offer->size = htobe64(size);
+                b->offsets[b->count++] = offset;
+                offset += size;
+        }
+        b->offsets[b->count] = offset;
+}
+
+/**
+ * Decodes the payload of MSG_MISSING_CHUNKS.
+ */
+static bool parse_missing(const struct packet *packet, struct batch *b)
+{
+        const size_t index_size = sizeof(*b->missing);
+        if (packet->payload_size % index_size != 0
+            || packet->payload_size / index_size > b->count)
+                goto invalid;
+
+        b->missing_count = packet->payload_size / index_size;
+        memcpy(b->missing, packet->payload, packet->payload_size);
+        for (size_t i = 0; i < b->missing_count; i++) {
+                b->missing[i] = be64toh(b->missing[i]);
+                if (b->missing[i] >= b->count
+                    || (i > 0 && b->missing[i] <= b->missing[i - 1]))
+                        goto invalid;
+        }
+        return true;
+invalid:
+        syslog(LOG_ERR, "invalid missing chunks");
+        return false;
+}
+
+/**
+ * Offers the chunks of the batch to the server and sends it the missing
+ * ones.
+ */
+static bool offer(const struct client_traverse_data *data, struct batch *b,
+                  struct client_block_window *window)
+{
+        // the reply must not be preceded by acknowledgements
+        if (!client_send_wait_for_all_acks(data, window))
+                return false;
+
+        syslog(LOG_DEBUG, "MSG_OFFER_CHUNKS: %zu", b->count);
+        if (!log_packet_send(data->settings->stream, MSG_OFFER_CHUNKS,
+                             b->count * sizeof(*b->offers),
+                             (const unsigned char *)b->offers))
+                return false;
+
+        if (!client_helper_check_expected_code(client_helper_get_answer(data),
+                                               MSG_MISSING_CHUNKS)
+            || !parse_missing(*data->packet_buffptr, b)
+            || !client_helper_check_expected_code(
+                    client_helper_get_answer(data), MSG_OK))
+                return false;
+
+        syslog(LOG_DEBUG, "server misses %zu of %zu chunks", b->missing_count,
+               b->count);
+        for (size_t i = 0; i < b->missing_count; i++) {
+                const size_t index = b->missing[i];
+                const size_t size = b->offsets[index + 1] - b->offsets[index];
+                syslog(LOG_DEBUG, "MSG_WRITE_BLOCK: %zu", size);
+                if (!client_send_data_block(data, MSG_WRITE_BLOCK, size,
+                                            &b->buff[b->offsets[index]],
+                                            window))
+                        return false;
+        }
+        return true;
+}
+
+bool client_dedup_send_blocks(const struct client_traverse_data *data, int fd)
+{
+        struct batch *b = calloc(1, sizeof(*b));
+        if (b == NULL || (b->buff = malloc(DEDUP_BUFFER_SIZE)) == NULL) {
+                log_error("malloc");
+                free(b);
+                return false;
+        }
+
+        bool success = false;
+        struct client_block_window window = { 0 };
+        syslog(LOG_DEBUG, "start offering chunks of %s", data->fpath);
+        while (true) {
+                if (!fill(b, fd))
+                        goto clean;
+                if (b->len == 0)
+                        break;
+                // the next batch is read while this one is offered
+                const off_t position = lseek(fd, 0, SEEK_CUR);
+                if (!b->eof && data->settings->read_ahead > 0
+                    && position != -1)
+                        client_readahead_advise(fd, position,
+                                                DEDUP_BUFFER_SIZE);
+
+                cut(b);
+                if (!offer(data, b, &window))
+                        goto clean;
+
+                const size_t sent = b->offsets[b->count];
+                memmove(b->buff, &b->buff[sent], b->len - sent);
+                b->len -= sent;
+        }
+
+        if (!client_send_wait_for_all_acks(data, &window))
+                goto clean;
+
+        syslog(LOG_DEBUG, "send chunks success");
+        success = true;
+clean:
+        free(b->buff);
+        free(b);
+        return success;
+}
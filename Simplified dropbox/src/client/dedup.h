@@ -0,0 +1,36 @@
+/**
+ * @file dedup.h
+ * @brief Module for sending only the chunks of the files, which the server
+ *        does not have yet.
+ */
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "traverse_data.h"
+
+#include <sys/types.h>
+
+/**
+ * Checks whether the file is sent by its chunks. The server has to support
+ * the deduplication and accept the largest chunks in one block, and the
+ * file has to be larger than one chunk.
+ *
+ * @param data       struct holding data, which are used when traversing a folder
+ * @param file_size  size of the file
+ * @return           true if client_dedup_send_blocks() should be used
+ */
+bool client_dedup_usable(const struct client_traverse_data *data,
+                         off_t file_size);
+
+/**
+ * Splits the file into content-defined chunks, offers their hashes to the
+ * server and sends only the chunks the server is missing.
+ *
+ * @param data  struct holding data, which are used when traversing a folder
+ * @param fd    file descriptor of the file open for reading
+ * @return      true on success;
+ *              false on failure
+ */
+bool client_dedup_send_blocks(const struct client_traverse_data *data, int fd);
+
+#endif /* DEDUP_H */
@@ -0,0 +1,418 @@
+/**
+ * @file delta.c
+ * @brief Sending of the changed files as deltas against the copies on
+ *        the server.
+ */
+#include "delta.h"
+
+#include "helper.h"
+#include "send.h"
+
+#include "hash.h"
+#include "log.h"
+#include "utils.h"
+
+#include <endian.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#define NO_SLOT SIZE_MAX
+#define NO_BLOCK UINT64_MAX
+
+static int compare_blocks(const void *lhs, const void *rhs)
+{
+        const struct client_delta_block *a = lhs;
+        const struct client_delta_block *b = rhs;
+        if (a->weak != b->weak)
+                return a->weak < b->weak ? -1 : 1;
+        return (a->index > b->index) - (a->index < b->index);
+}
+
+static size_t slot_of(const struct client_delta *delta, uint32_t weak)
+{
+        return (size_t)((weak * 0x9E3779B97F4A7C15ULL)
+                        >> (64 - delta->slot_bits));
+}
+
+static size_t next_slot(const struct client_delta *delta, size_t slot)
+{
+        return (slot + 1) & (((size_t)1 << delta->slot_bits) - 1);
+}
+
+/**
+ * Indexes the first block of every run of blocks with the same weak
+ * checksum by an open addressing hash table.
+ */
+static bool build_index(struct client_delta *delta)
+{
+        qsort(delta->blocks, delta->block_count, sizeof(*delta->blocks),
+              compare_blocks);
+
+        delta->slot_bits = 4;
+        while (((size_t)1 << delta->slot_bits) < 2 * delta->block_count)
+                delta->slot_bits++;
+
+        const size_t slot_count = (size_t)1 << delta->slot_bits;
+        delta->slots = malloc(slot_count * sizeof(*delta->slots));
+        if (delta->slots == NULL)
+                return false;
+        for (size_t i = 0; i < slot_count; i++)
+                delta->slots[i] = NO_SLOT;
+
+        for (size_t i = 0; i < delta->block_count; i++) {
+                const uint32_t weak = delta->blocks[i].weak;
+                if (i > 0 && delta->blocks[i - 1].weak == weak)
+                        continue;
+
+                size_t slot = slot_of(delta, weak);
+                while (delta->slots[slot] != NO_SLOT)
+                        slot = next_slot(delta, slot);
+                delta->slots[slot] = i;
+        }
+        return true;
+}
+
+/**
+ * Decodes the payload of MSG_SIGNATURES.
+ */
+static bool parse_signatures(const struct packet *packet,
+                             struct client_delta *delta)
+{
+        uint64_t header[2];
+        const size_t signature_size = sizeof(struct packet_block_signature);
+        if (packet->payload_size < sizeof(header)
+            || (packet->payload_size - sizeof(header)) % signature_size != 0)
+                goto invalid;
+
+        memcpy(header, packet->payload, sizeof(header));
+        const uint64_t block_size = be64toh(header[0]);
+        const uint64_t file_size = be64toh(header[1]);
+        const size_t block_count
+                = (packet->payload_size - sizeof(header)) / signature_size;
+        if (block_size == 0
+            || block_count != (file_size + block_size - 1) / block_size)
+                goto invalid;
+
+        delta->block_size = block_size;
+        delta->last_block_size
+                = block_count > 0 ? file_size - (block_count - 1) * block_size
+                                  : 0;
+        delta->block_count = block_count;
+        delta->slots = NULL;
+        delta->blocks = malloc(block_count * sizeof(*delta->blocks) + 1);
+        if (delta->blocks == NULL) {
+                log_error("malloc");
+                return false;
+        }
+
+        const unsigned char *signatures = &packet->payload[sizeof(header)];
+        for (size_t i = 0; i < block_count; i++) {
+                struct packet_block_signature signature;
+                memcpy(&signature, &signatures[i * signature_size],
+                       signature_size);
+                delta->blocks[i] = (struct client_delta_block){
+                        .weak = (uint32_t)be64toh(signature.weak),
+                        .strong = be64toh(signature.strong),
+                        .index = i,
+                };
+        }
+
+        if (!build_index(delta)) {
+                log_error("malloc");
+                client_delta_destroy(delta);
+                return false;
+        }
+        return true;
+invalid:
+        syslog(LOG_ERR, "invalid signatures");
+        return false;
+}
+
+int client_delta_request(const struct client_traverse_data *data,
+                         struct client_delta *delta)
+{
+        syslog(LOG_DEBUG, "MSG_DELTA_FILE: %s", data->fpath);
+        if (!log_packet_send(data->settings->stream, MSG_DELTA_FILE,
+                             strlen(data->fpath) + 1,
+                             (const unsigned char *)data->fpath))
+                return FTW_STOP;
+
+        const enum packet_msg_code answer = client_helper_get_answer(data);
+        if (answer == MSG_NOK) {
+                syslog(LOG_DEBUG, "no copy of %s on the server", data->fpath);
+                return FTW_CONTINUE;
+        }
+        if (!client_helper_check_expected_code(answer, MSG_SIGNATURES)
+            || !parse_signatures(*data->packet_buffptr, delta))
+                return FTW_STOP;
+
+        if (!client_helper_check_expected_code(client_helper_get_answer(data),
+                                               MSG_OK)) {
+                client_delta_destroy(delta);
+                return FTW_STOP;
+        }
+
+        syslog(LOG_DEBUG, "received %zu signatures of blocks of %lu bytes",
+               delta->block_count, (unsigned long)delta->block_size);
+        return NEXT_STEP;
+}
+
+void client_delta_destroy(struct client_delta *delta)
+{
+        free(delta->blocks);
+        free(delta->slots);
+        delta->blocks = NULL;
+        delta->slots = NULL;
+}
+
+/**
+ * Finds a block of the copy on the server equal to the @c size bytes at
+ * @c window. The block following the previous match is preferred, so the
+ * copied blocks form longer runs.
+ *
+ * @return index of the block or NO_BLOCK
+ */
+static uint64_t find_block(const struct client_delta *delta, uint32_t weak,
+                           size_t size, const unsigned char *window,
+                           uint64_t preferred)
+{
+        size_t slot = slot_of(delta, weak);
+        while (delta->slots[slot] != NO_SLOT
+               && delta->blocks[delta->slots[slot]].weak != weak)
+                slot = next_slot(delta, slot);
+        if (delta->slots[slot] == NO_SLOT)
+                return NO_BLOCK;
+
+        bool hashed = false;
+        uint64_t strong = 0;
+        uint64_t found = NO_BLOCK;
+        for (size_t i = delta->slots[slot];
+             i < delta->block_count && delta->blocks[i].weak == weak; i++) {
+                const struct client_delta_block *block = &delta->blocks[i];
+                const uint64_t block_size
+                        = block->index == delta->block_count - 1
+                                  ? delta->last_block_size
+                                  : delta->block_size;
+                if (block_size != size)
+                        continue;
+
+                if (!hashed) {
+                        strong = hash_xxh64(size, window, 0);
+                        hashed = true;
+                }
+                if (block->strong != strong)
+                        continue;
+                if (block->index == preferred)
+                        return preferred;
+                if (found == NO_BLOCK)
+                        found = block->index;
+        }
+        return found;
+}
+
+/**
+ * State of the comparison of the file with the copy on the server.
+ */
+struct matcher {
+        const struct client_traverse_data *data;
+        const struct client_delta *delta;
+        struct client_block_window window;
+        int fd;
+        off_t file_size;       /**< size of the file */
+        unsigned char *buff;   /**< bytes of the file from @c buff_offset */
+        size_t capacity;       /**< size of @c buff */
+        off_t buff_offset;     /**< offset of the first byte in @c buff */
+        size_t buff_len;       /**< number of the bytes in @c buff */
+        off_t literal;         /**< offset of the literal data not sent yet */
+        uint64_t copy_index;   /**< first block of the copy not sent yet */
+        uint64_t copy_count;   /**< number of the blocks of the copy */
+};
+
+static const unsigned char *at(const struct matcher *m, off_t offset)
+{
+        return &m->buff[offset - m->buff_offset];
+}
+
+/**
+ * Reads the file until the bytes before @c end are buffered. Only the
+ * bytes from the literal data on are kept in the buffer.
+ */
+static bool ensure_buffered(struct matcher *m, off_t end)
+{
+        if (end > m->file_size)
+                end = m->file_size;
+        if (end <= m->buff_offset + (off_t)m->buff_len)
+                return true;
+
+        if (end - m->buff_offset > (off_t)m->capacity) {
+                const size_t keep
+                        = m->buff_offset + m->buff_len - m->literal;
+                memmove(m->buff, at(m, m->literal), keep);
+                m->buff_offset = m->literal;
+                m->buff_len = keep;
+        }
+
+        while (m->buff_offset + (off_t)m->buff_len < end) {
+                const ssize_t ret = utils_read(m->fd, m->capacity - m->buff_len,
+                                               &m->buff[m->buff_len]);
+                if (ret == -1) {
+                        log_error("utils_read");
+                        return false;
+                }
+                // the file was truncated meanwhile
+                if (ret == 0) {
+                        m->file_size = m->buff_offset + m->buff_len;
+                        break;
+                }
+                m->buff_len += ret;
+        }
+        return true;
+}
+
+static bool flush_copy(struct matcher *m)
+{
+        if (m->copy_count == 0)
+                return true;
+
+        const struct packet_payload_copy_blocks payload = {
+                .index = m->copy_index,
+                .count = m->copy_count,
+        };
+        syslog(LOG_DEBUG, "MSG_COPY_BLOCKS: %lu, %lu",
+               (unsigned long)payload.index, (unsigned long)payload.count);
+        m->copy_count = 0;
+        return client_send_data_block(m->data, MSG_COPY_BLOCKS,
+                                      sizeof(payload),
+                                      (const unsigned char *)&payload,
+                                      &m->window);
+}
+
+static bool flush_literal(struct matcher *m, off_t end)
+{
+        if (end == m->literal)
+                return true;
+
+        const size_t size = end - m->literal;
+        syslog(LOG_DEBUG, "MSG_WRITE_BLOCK: %zu", size);
+        const bool success = client_send_data_block(m->data, MSG_WRITE_BLOCK,
+                                                    size, at(m, m->literal),
+                                                    &m->window);
+        m->literal = end;
+        return success;
+}
+
+static bool add_copy(struct matcher *m, uint64_t index)
+{
+        if (m->copy_count > 0 && m->copy_index + m->copy_count == index) {
+                m->copy_count++;
+                return true;
+        }
+        if (!flush_copy(m))
+                return false;
+        m->copy_index = index;
+        m->copy_count = 1;
+        return true;
+}
+
+static bool match_file(struct matcher *m)
+{
+        const struct client_delta *delta = m->delta;
+        const off_t block_size = delta->block_size;
+        struct hash_rolling rolling;
+        bool rolling_valid = false;
+
+        off_t pos = 0;
+        while (pos < m->file_size) {
+                if (!ensure_buffered(m, pos + block_size + 1))
+                        return false;
+                if (pos >= m->file_size)
+                        break;
+
+                const size_t size = m->file_size - pos < block_size
+                                            ? m->file_size - pos
+                                            : block_size;
+                uint64_t index = NO_BLOCK;
+                if ((off_t)size == block_size) {
+                        if (!rolling_valid)
+                                hash_rolling_init(&rolling, size, at(m, pos));
+                        rolling_valid = true;
+                        index = find_block(delta, hash_rolling_digest(&rolling),
+                                           size, at(m, pos),
+                                           m->copy_index + m->copy_count);
+                } else if (size == delta->last_block_size) {
+                        struct hash_rolling tail;
+                        hash_rolling_init(&tail, size, at(m, pos));
+                        index = find_block(delta, hash_rolling_digest(&tail),
+                                           size, at(m, pos), NO_BLOCK);
+                }
+
+                if (index != NO_BLOCK) {
+                        if (!flush_literal(m, pos) || !add_copy(m, index))
+                                return false;
+                        pos += size;
+                        m->literal = pos;
+                        rolling_valid = false;
+                        continue;
+                }
+
+                // the copied blocks precede the literal data
+                if (!flush_copy(m))
+                        return false;
+                if (rolling_valid && pos + block_size < m->file_size)
+                        hash_rolling_roll(&rolling, *at(m, pos),
+                                          *at(m, pos + block_size));
+                else
+                        rolling_valid = false;
+                pos++;
+
+                if (pos - m->literal == (off_t)m->data->settings->chunk_size
+                    && !flush_literal(m, pos))
+                        return false;
+        }
+
+        return flush_copy(m) && flush_literal(m, m->file_size);
+}
+
+int client_delta_send_blocks(const struct client_traverse_data *data,
+                             const struct client_delta *delta)
+{
+        syslog(LOG_DEBUG, "opening %s for reading", data->fpath);
+        struct matcher m = {
+                .data = data,
+                .delta = delta,
+                .fd = openat(data->settings->dirfd, data->fpath, O_RDONLY),
+                .capacity = data->settings->chunk_size + delta->block_size + 1,
+        };
+        if (m.fd == -1) {
+                log_error("openat");
+                return NEXT_STEP;
+        }
+
+        int result = FTW_STOP;
+        struct stat sb;
+        if (fstat(m.fd, &sb) == -1) {
+                log_error("fstat");
+                goto clean_fd;
+        }
+        m.file_size = sb.st_size;
+
+        m.buff = malloc(m.capacity);
+        if (m.buff == NULL) {
+                log_error("malloc");
+                goto clean_fd;
+        }
+
+        syslog(LOG_DEBUG, "start matching blocks of %s", data->fpath);
+        if (!match_file(&m) || !client_send_wait_for_all_acks(data, &m.window))
+                goto clean;
+
+        syslog(LOG_DEBUG, "send delta success");
+        result = NEXT_STEP;
+clean:
+        free(m.buff);
+clean_fd:
+        if (close(m.fd) == -1)
+                syslog(LOG_ERR, "close: %s", data->fpath);
+        return result;
+}
@@ -0,0 +1,65 @@
+/**
+ * @file delta.h
+ * @brief Module for sending the changed files as deltas against the copies
+ *        on the server.
+ */
+#ifndef DELTA_H
+#define DELTA_H
+
+#include "traverse_data.h"
+
+#include <stdint.h>
+
+/**
+ * Signature of a block of the copy on the server.
+ */
+struct client_delta_block {
+        uint32_t weak;   /**< rolling checksum of the block */
+        uint64_t strong; /**< XXH64 of the block */
+        uint64_t index;  /**< index of the block in the file */
+};
+
+/**
+ * Signatures of the copy on the server indexed by their weak checksum.
+ */
+struct client_delta {
+        uint64_t block_size;              /**< size of the blocks */
+        uint64_t last_block_size;         /**< size of the last block */
+        size_t block_count;               /**< number of the blocks */
+        struct client_delta_block *blocks; /**< blocks sorted by weak checksum */
+        size_t *slots;                    /**< hash table of the first blocks
+                                               with the same weak checksum */
+        unsigned slot_bits;               /**< log2 of the number of slots */
+};
+
+/**
+ * Asks the server for the signatures of its copy of the file.
+ *
+ * @param data       struct holding data, which are used when traversing a folder
+ * @param[out] delta signatures of the copy, which must be freed by
+ *                   client_delta_destroy() on success
+ * @return           NEXT_STEP if the signatures were received;
+ *                   FTW_CONTINUE if the server has no copy of the file;
+ *                   FTW_STOP on failure
+ */
+int client_delta_request(const struct client_traverse_data *data,
+                         struct client_delta *delta);
+
+/**
+ * Sends the file as the blocks the server copies from its copy of the file
+ * and the literal data between them.
+ *
+ * @param data   struct holding data, which are used when traversing a folder
+ * @param delta  signatures of the copy
+ * @return       NEXT_STEP on success;
+ *               FTW_STOP on failure
+ */
+int client_delta_send_blocks(const struct client_traverse_data *data,
+                             const struct client_delta *delta);
+
+/**
+ * Frees the signatures.
+ */
+void client_delta_destroy(struct client_delta *delta);
+
+#endif /* DELTA_H */
@@ -1,6 +1,10 @@
 #include "event.h"
 
+#include "connection.h"
 #include "copy.h"
+#include "fanotify.h"
+#include "helper.h"
+#include "journal.h"
 #include "traverse_data.h"
 #include "send.h"
 
@@ -8,14 +12,63 @@
 #include "log.h"
 #include "utils.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
-#include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <sys/inotify.h>
 #include <sys/ioctl.h>
 #include <sys/signalfd.h>
+#include <time.h>
+
+/** the changes of a file changed all the time are sent at the latest after
+ *  this number of quiet periods */
+#define FLUSH_MAX_PERIODS 10
+/** the event of the moved file waits for the event of its new name at most
+ *  this number of milliseconds */
+#define MOVE_TIMEOUT 10
+
+/**
+ * The file or directory moved from its name. The move within the SOURCE
+ * folder is followed by the event of the new name with the same cookie,
+ * usually right away, so the server renames the file instead of deleting
+ * it and getting its content again.
+ */
+struct event_move {
+        struct inotify_event *event; /**< copy of IN_MOVED_FROM, or NULL */
+        int timer;                   /**< expires if no new name came    */
+};
+
+/**
+ * State of the connection to the server. The changes are recorded in the
+ * journal until the server confirms them, so the changes made while the
+ * client is disconnected are sent after it reconnects. While connected,
+ * the changes wait in the pending journal until the files stop changing,
+ * so e.g. a file created and deleted right away is not sent at all.
+ */
+struct event_connection {
+        struct client_journal journal; /**< changes not confirmed yet      */
+        struct client_journal pending; /**< changes not sent yet           */
+        struct event_reader *reader;   /**< monitors the connection        */
+        int timer;                     /**< expires at the next reconnect  */
+        int flush_timer;               /**< expires when pending are sent  */
+        unsigned long pending_since;   /**< time of the oldest pending, ms */
+        unsigned long delay;           /**< milliseconds to the reconnect  */
+        struct event_move move;        /**< file waiting for its new name  */
+        bool connected;                /**< the stream of settings is open */
+};
+
+/**
+ * Data of the callbacks of the event loop.
+ */
+struct event_loop {
+        client_watcher_list *watchers;
+        struct settings *settings;
+        struct event_connection connection;
+        int inot_fd;
+};
 
 /**
  * Finds a name of the file among all of the file watchers.
@@ -25,13 +78,13 @@
  */
 static const char *find_name(client_watcher_list *watchers, int needle_wd)
 {
-        const struct client_watcher *w = client_watcher_list_find_last(
-                watchers,
-                (struct client_watcher){ .name = NULL, .wd = needle_wd });
+        const struct client_watcher *w
+                = client_watcher_list_find_wd(watchers, needle_wd);
 
-        if (w == NULL)
+        if (w == NULL) {
                 syslog(LOG_DEBUG, "Find name returning NULL.");
-
+                return NULL;
+        }
         return w->name;
 }
 
@@ -47,98 +100,50 @@ static const char *find_name(client_watcher_list *watchers, int needle_wd)
 static bool send_change_file(const char *name, enum packet_msg_code code,
                              const struct settings *settings)
 {
-        return log_packet_send(settings->write_fd, code, strlen(name) + 1,
+        return log_packet_send(settings->stream, code, strlen(name) + 1,
                                (const unsigned char *)name);
 }
 
 /**
- * This function changes meta data of a file.
+ * Changes one attribute of the file on the server.
  *
- * @param name      name of the file
- * @param data      struct holding data, which are used when traversing a folder
- * @return          true on success;
- *                  false on failure
+ * @param data  struct holding data, which are used when traversing a folder
+ * @param send  function sending the attribute and reading the answer
+ * @return      true on success, or if the server does not have the file;
+ *              false on failure
  */
-static bool change_metadata(const char *name,
-                            const struct client_traverse_data *data)
+static bool change_attribute(const struct client_traverse_data *data,
+                             int (*send)(const struct client_traverse_data *))
 {
-        if (fstatat(data->settings->dirfd, name, data->sb, 0) == -1) {
-                log_warning("fstatat");
-                return true;
-        }
-
-        if (!send_change_file(name, MSG_CHANGE_FILE, data->settings))
-                return false;
-        if (client_send_timestamps(data) == FTW_STOP
-            || client_send_done(data) == FTW_STOP)
-                return false;
-
-        if (!send_change_file(name, MSG_CHANGE_FILE, data->settings))
-                return false;
-        if (client_send_owner(data) == FTW_STOP
-            || client_send_done(data) == FTW_STOP)
-                return false;
-
-        if (!send_change_file(name, MSG_CHANGE_FILE, data->settings))
+        if (!send_change_file(data->fpath, MSG_CHANGE_FILE, data->settings))
                 return false;
-        if (client_send_permission_modes(data) == FTW_STOP
-            || client_send_done(data) == FTW_STOP)
-                return false;
-
-        return true;
-}
-
-/**
- * IN_CLOSE_WRITE event
- *
- * @param name name of processed file
- * @param data traverse structure
- * @return true if deleting and copying succeeded
- * @return false otherwise;
- */
-static bool close_write(const char *name,
-                        const struct client_traverse_data *data)
-{
-        if (fstatat(data->settings->dirfd, name, data->sb, 0) == -1) {
-                log_warning("fstatat");
+        const enum packet_msg_code answer = client_helper_get_answer(data);
+        if (answer == MSG_NOK)
                 return true;
-        }
-
-        if (client_send_delete_file(data) == FTW_STOP)
-                return false;
-
-        const int copy_file = client_copy_regular_file(*data);
-        if (copy_file != FTW_CONTINUE) {
-                syslog(LOG_DEBUG, "copying of file failed");
-                return false;
-        }
-        return true;
+        return client_helper_check_expected_code(answer, MSG_OK)
+               && send(data) != FTW_STOP;
 }
 
 /**
- * IN_MOVED_IN or IN_CREATE event
+ * This function changes meta data of a file. Every attribute is changed
+ * by its own MSG_CHANGE_FILE request.
  *
- * @param name name of processed file
- * @param data traverse structure
- * @return true if copying succeeded;
- * @return false otherwise;
+ * @param name      name of the file
+ * @param data      struct holding data, which are used when traversing a folder
+ * @return          true on success;
+ *                  false on failure
  */
-static bool moved_to_create(const char *name,
+static bool change_metadata(const char *name,
                             const struct client_traverse_data *data)
 {
-        syslog(LOG_DEBUG, "IN_CREATE || IN_MOVED_TO");
         if (fstatat(data->settings->dirfd, name, data->sb, 0) == -1) {
                 log_warning("fstatat");
                 return true;
         }
 
-        syslog(LOG_DEBUG, "STAT SUCCESS");
-        int copy_file = client_copy_regular_file(*data);
-        if (copy_file != FTW_CONTINUE) {
-                syslog(LOG_DEBUG, "copying of file failed");
-                return false;
-        }
-        return true;
+        return change_attribute(data, client_send_timestamps)
+               && change_attribute(data, client_send_owner)
+               && change_attribute(data, client_send_permission_modes);
 }
 
 static bool add_watcher(const struct settings *settings,
@@ -154,16 +159,24 @@ static bool add_watcher(const struct settings *settings,
         const struct client_watcher_data watcher_data = {
                 .fpath = full_path,
                 .inot_fd = inot_fd,
+                .fanotify = settings->fanotify,
                 .relative_path = relative_path,
         };
 
         bool success = false;
         struct client_watcher watcher;
-        if (!watcher_create(&watcher, &watcher_data))
+        if (!watcher_create(&watcher, &watcher_data)) {
+                // the directory deleted right away is not watched
+                success = faccessat(settings->dirfd, relative_path, F_OK,
+                                    AT_SYMLINK_NOFOLLOW)
+                                  == -1
+                          && errno == ENOENT;
                 goto clean;
+        }
 
-        if (!client_watcher_list_push_back(watchers, &watcher)) {
-                log_error("client_watcher_list_push_back");
+        if (!client_watcher_list_add(watchers, &watcher)) {
+                log_error("client_watcher_list_add");
+                free((void *)watcher.name);
                 goto clean;
         }
         success = true;
@@ -173,114 +186,504 @@ clean:
 }
 
 static void remove_watcher(const char *name, int inot_fd,
-                           client_watcher_list *watchers)
+                           client_watcher_list *watchers,
+                           const struct settings *settings)
 {
         syslog(LOG_DEBUG, "removing '%s' from watch list", name);
-        const struct client_watcher needle = { .wd = -1, .name = name };
         const struct client_watcher *w
-                = client_watcher_list_find_last(watchers, needle);
+                = client_watcher_list_find_name(watchers, name);
         if (w == NULL)
                 return;
 
-        syslog(LOG_DEBUG, "found watcher: wd: '%d' | name : '%s'", w->wd,
+        const int wd = w->wd;
+        syslog(LOG_DEBUG, "found watcher: wd: '%d' | name : '%s'", wd,
                w->name);
-        // can succeed if there exists hardlink to that file.
-        // The i-node itself wasn't deleted.
-        if (inotify_rm_watch(inot_fd, w->wd) == -1)
+        client_watcher_list_remove(watchers, wd);
+        if (settings->fanotify != NULL)
+                client_fanotify_forget(settings->fanotify, wd);
+        // the watch of the deleted directory is already gone
+        else if (inotify_rm_watch(inot_fd, wd) == -1 && errno != EINVAL)
                 log_warning("inotify_rm_watch");
 }
 
 /**
- * This function process one particular event, which can happen.
+ * @brief Get the name of the file or directory in the watched directory.
+ *        The name in a subdirectory is prefixed by the path of the
+ *        subdirectory in @c path.
  *
- * @param event     system structure inotify_event
- * @param name      name of the file
- * @param data      struct holding data, which are used when traversing a folder
- * @param inot_fd   inotify file descriptor
- * @param watchers  pointer to the list of watchers
- * @return          true on success;
- *                  false on failure
+ * @return the name;
+ *         NULL if the event is of the watched directory itself or of the
+ *         directory no longer watched
  */
-
-static bool process_event(const struct inotify_event *event, const char *name,
-                          const struct client_traverse_data *data, int inot_fd,
-                          client_watcher_list *watchers)
+static const char *get_name(client_watcher_list *watchers,
+                            const struct inotify_event *event,
+                            const struct settings *settings,
+                            char path[PATH_MAX])
 {
-        syslog(LOG_DEBUG, "process_event started");
-        if (event->mask & IN_CLOSE_WRITE) {
-                if (!close_write(name, data))
-                        return false;
-        }
-        if (event->mask & IN_ATTRIB) {
-                if (!change_metadata(name, data))
-                        return false;
+        if (event->len == 0)
+                return NULL;
+
+        const char *dir = find_name(watchers, event->wd);
+        if (dir == NULL)
+                return NULL;
+        // the files of the SOURCE folder itself have no prefix
+        if (strcmp(dir, settings->cwd) == 0)
+                return event->name;
+        if (snprintf(path, PATH_MAX, "%s/%s", dir, event->name) >= PATH_MAX) {
+                syslog(LOG_WARNING, "path in %s is too long", dir);
+                return NULL;
         }
-        if (event->mask & IN_MOVED_FROM || event->mask & IN_DELETE) {
-                syslog(LOG_DEBUG, "IN_DELETE || IN_MOVED_FROM");
-                remove_watcher(name, inot_fd, watchers);
-                if (client_send_delete_file(data) == FTW_STOP)
-                        return false;
+        return path;
+}
+
+/**
+ * Updates the watchers after the directory was created or deleted.
+ */
+static bool update_watchers(const struct inotify_event *event, const char *name,
+                            int inot_fd, client_watcher_list *watchers,
+                            const struct settings *settings)
+{
+        if (event->mask & IN_MOVED_FROM || event->mask & IN_DELETE)
+                remove_watcher(name, inot_fd, watchers, settings);
+        if (event->mask & IN_MOVED_TO || event->mask & IN_CREATE)
+                return add_watcher(settings, name, inot_fd, watchers);
+        return true;
+}
+
+/**
+ * Records the changes of the file in the journal.
+ */
+static bool record_event(const struct inotify_event *event, const char *name,
+                         struct client_journal *journal)
+{
+        const unsigned changes = client_journal_event_changes(event->mask);
+        return changes == 0 || client_journal_record(journal, name, changes);
+}
+
+/**
+ * Arms the timer of the next attempt to reconnect.
+ */
+static bool schedule_reconnect(struct event_connection *connection)
+{
+        if (!event_reader_arm_timer(connection->reader, connection->timer,
+                                    connection->delay, 0))
+                return false;
+        syslog(LOG_INFO, "reconnecting in %lu ms", connection->delay);
+        return true;
+}
+
+/**
+ * Drops the lost connection. The changes are recorded in the journal
+ * until the client reconnects.
+ */
+static bool disconnect(struct event_connection *connection,
+                       struct settings *settings)
+{
+        syslog(LOG_WARNING, "connection to the server lost");
+        if (!event_reader_remove(connection->reader, settings->read_fd))
+                log_warning("event_reader_remove");
+        // the pending changes are in the journal too
+        if (!client_journal_clear(&connection->pending)
+            || !event_reader_arm_timer(connection->reader,
+                                       connection->flush_timer, 0, 0))
+                return false;
+        client_connection_close(settings);
+        connection->connected = false;
+        connection->delay = CLIENT_RECONNECT_MIN_DELAY;
+        return schedule_reconnect(connection);
+}
+
+/**
+ * Checks whether the failure of the connection can be recovered from.
+ */
+static bool can_reconnect(const struct event_connection *connection)
+{
+        return connection->timer != -1;
+}
+
+static unsigned long now_ms(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Sends the changes of the file to the server after all of them happened,
+ * e.g. the file created and written is sent only once.
+ */
+static bool send_change(const struct client_journal_entry *entry,
+                        const struct client_traverse_data *send_data)
+{
+        struct stat sb;
+        struct client_traverse_data data = *send_data;
+        data.fpath = entry->name;
+        data.sb = &sb;
+        syslog(LOG_DEBUG, "sending changes of %s (%#x)", entry->name,
+               entry->changes);
+
+        const bool exists = fstatat(data.settings->dirfd, entry->name, &sb,
+                                    AT_SYMLINK_NOFOLLOW)
+                            != -1;
+        if (!exists && errno != ENOENT) {
+                log_warning("fstatat");
+                return true;
         }
-        if (event->mask & IN_MOVED_TO || event->mask & IN_CREATE) {
-                if (!add_watcher(data->settings, name, inot_fd, watchers)
-                    || !moved_to_create(name, data))
-                        return false;
+        if (exists && !S_ISREG(sb.st_mode))
+                return true;
+
+        switch (client_journal_action(entry, exists)) {
+        case CLIENT_JOURNAL_CREATE:
+                return client_copy_regular_file(data) == FTW_CONTINUE;
+        case CLIENT_JOURNAL_UPDATE:
+                return client_copy_changed_file(data) == FTW_CONTINUE;
+        case CLIENT_JOURNAL_ATTRIBUTES:
+                return change_metadata(entry->name, &data);
+        case CLIENT_JOURNAL_DELETE:
+                return client_send_delete_file(&data) != FTW_STOP;
+        case CLIENT_JOURNAL_NONE:
+                break;
         }
-        syslog(LOG_DEBUG, "mask processed successfully");
         return true;
 }
 
+struct iter_send_data {
+        const struct client_traverse_data *data;
+        bool success;
+};
+
+static bool iter_send_change(void *elem, void *data)
+{
+        struct iter_send_data *send = data;
+        send->success = send_change(elem, send->data);
+        return send->success;
+}
+
 /**
- * @brief Get the name of the file or proccessed directory
+ * Sends the pending changes. The journal is cleared once the server has
+ * received all the changes. The connection is dropped if sending fails.
  */
-static const char *get_name(client_watcher_list *watchers,
-                            const struct inotify_event *event)
-{
-        const char *name;
-        if (event->mask & IN_CLOSE_WRITE || event->mask & IN_ATTRIB) {
-                name = find_name(watchers, event->wd);
-                syslog(LOG_DEBUG, "Event happened on file");
-        } else {
-                name = event->name;
-                syslog(LOG_DEBUG, "Event happened in directory.");
-        }
-        return name;
+static bool flush_pending(struct event_connection *connection,
+                          struct settings *settings)
+{
+        if (connection->pending.count == 0)
+                return true;
+        if (!event_reader_arm_timer(connection->reader,
+                                    connection->flush_timer, 0, 0))
+                return false;
+
+        struct packet *packet_buff = NULL;
+        size_t n = 0;
+        const struct client_traverse_data data = {
+                .settings = settings,
+                .packet_buffptr = &packet_buff,
+                .nptr = &n,
+        };
+        struct iter_send_data send = {
+                .data = &data,
+                .success = true,
+        };
+        syslog(LOG_DEBUG, "sending %zu changed files",
+               connection->pending.count);
+        client_journal_foreach(&connection->pending, iter_send_change, &send);
+        free(packet_buff);
+        if (!client_journal_clear(&connection->pending))
+                return false;
+
+        if (send.success && log_packet_flush(settings->stream))
+                return client_journal_clear(&connection->journal);
+        return can_reconnect(connection) && disconnect(connection, settings);
 }
 
-static enum utils_loop_status
-prepare_process_event(const struct inotify_event *event, size_t *nptr,
-                      struct packet **packet_buffptr, int inot_fd,
-                      client_watcher_list *watchers,
-                      const struct settings *settings)
+/**
+ * Arms the timer of the pending changes to expire after the quiet period.
+ * The period is shortened, so the oldest change does not wait longer than
+ * @c FLUSH_MAX_PERIODS quiet periods.
+ */
+static bool schedule_flush(struct event_connection *connection,
+                           struct settings *settings)
 {
-        if (event->mask & IN_ISDIR)
-                return UTILS_LOOP_CONTINUE;
-        const char *name = get_name(watchers, event);
+        const unsigned long waited = now_ms() - connection->pending_since;
+        const unsigned long max_wait
+                = FLUSH_MAX_PERIODS * settings->quiet_period;
+        if (waited >= max_wait)
+                return flush_pending(connection, settings);
 
-        syslog(LOG_DEBUG, "event file name: %s", name);
-        struct stat sb;
+        unsigned long delay = settings->quiet_period;
+        if (max_wait - waited < delay)
+                delay = max_wait - waited;
+        return event_reader_arm_timer(connection->reader,
+                                      connection->flush_timer, delay, 0);
+}
+
+/**
+ * Adds the changes of the file to the pending changes. The pending changes
+ * are sent first if there are too many of them.
+ */
+static bool queue_event(const struct inotify_event *event, const char *name,
+                        struct event_connection *connection,
+                        struct settings *settings)
+{
+        const unsigned changes = client_journal_event_changes(event->mask);
+        if (changes == 0)
+                return true;
+
+        struct client_journal *pending = &connection->pending;
+        if (pending->count == CLIENT_JOURNAL_MAX_ENTRIES
+            && !flush_pending(connection, settings))
+                return false;
+        // the change is only in the journal if the connection was lost
+        if (!connection->connected)
+                return true;
+        if (pending->count == 0)
+                connection->pending_since = now_ms();
+        return client_journal_record(pending, name, changes);
+}
+
+/**
+ * Creates or deletes the directory on the server. The content of the new
+ * directory is copied and watched.
+ */
+static bool send_dir_change(const struct inotify_event *event,
+                            const char *name, size_t *nptr,
+                            struct packet **packet_buffptr, int inot_fd,
+                            client_watcher_list *watchers,
+                            const struct settings *settings)
+{
         const struct client_traverse_data data = {
                 .settings = settings,
                 .packet_buffptr = packet_buffptr,
                 .nptr = nptr,
                 .fpath = name,
-                .ftwbuf = NULL,
-                .sb = &sb,
         };
-        const bool success
-                = process_event(event, name, &data, inot_fd, watchers);
-        if (!success)
-                syslog(LOG_DEBUG, "process_event failure");
+        if (event->mask & IN_MOVED_FROM || event->mask & IN_DELETE)
+                return client_send_delete_dir(&data) != FTW_STOP;
+        return client_send_create_dir(&data) != FTW_STOP
+               && client_copy_dir(name, inot_fd, watchers, settings);
+}
+
+/**
+ * Watches the created directory and sends the change to the server if the
+ * client is connected and the server supports the directories. The whole
+ * folder is synchronized if the change is not sent before the client
+ * reconnects.
+ */
+static bool process_dir_event(const struct inotify_event *event,
+                              const char *name, size_t *nptr,
+                              struct packet **packet_buffptr, int inot_fd,
+                              client_watcher_list *watchers,
+                              struct event_connection *connection,
+                              struct settings *settings)
+{
+        if (!(settings->features & PACKET_FEATURE_DIRS)
+            || !(event->mask & (IN_CREATE | IN_DELETE | IN_MOVE)))
+                return true;
+
+        syslog(LOG_DEBUG, "event directory name: %s", name);
+        if (!update_watchers(event, name, inot_fd, watchers, settings))
+                return false;
+        // the changes of the files in the directory are sent before it
+        if (!flush_pending(connection, settings))
+                return false;
+        if (!connection->connected) {
+                client_journal_overflow(&connection->journal);
+                return true;
+        }
 
+        if (send_dir_change(event, name, nptr, packet_buffptr, inot_fd,
+                            watchers, settings))
+                return true;
+        client_journal_overflow(&connection->journal);
+        return can_reconnect(connection) && disconnect(connection, settings);
+}
+
+/**
+ * Records the event in the journal. The change of the file waits for the
+ * quiet period if the client is connected, the change of the directory is
+ * sent right away. The connection is dropped if sending fails.
+ */
+static bool prepare_process_event(const struct inotify_event *event,
+                                  size_t *nptr, struct packet **packet_buffptr,
+                                  int inot_fd, client_watcher_list *watchers,
+                                  struct event_connection *connection,
+                                  struct settings *settings)
+{
+        if (event->mask & IN_Q_OVERFLOW) {
+                syslog(LOG_WARNING, "inotify events lost");
+                client_journal_overflow(&connection->journal);
+                return true;
+        }
+        // the watch was removed or the file deleted
+        if (event->mask & IN_IGNORED) {
+                client_watcher_list_remove(watchers, event->wd);
+                return true;
+        }
+        char path[PATH_MAX];
+        const char *name = get_name(watchers, event, settings, path);
+        if (name == NULL)
+                return true;
+        if (event->mask & IN_ISDIR)
+                return process_dir_event(event, name, nptr, packet_buffptr,
+                                         inot_fd, watchers, connection,
+                                         settings);
+
+        syslog(LOG_DEBUG, "event file name: %s", name);
+        if (!record_event(event, name, &connection->journal))
+                return false;
+        return !connection->connected
+               || queue_event(event, name, connection, settings);
+}
+
+/**
+ * Checks whether the moved file can be renamed on the server, so its event
+ * waits for the event of the new name. The moves told by fanotify(7)
+ * without FAN_RENAME have no cookie to pair them.
+ */
+static bool can_rename(const struct inotify_event *event,
+                       const struct event_connection *connection,
+                       const struct settings *settings)
+{
+        if (!(event->mask & IN_MOVED_FROM) || event->cookie == 0
+            || connection->move.timer == -1 || !connection->connected)
+                return false;
+        const uint64_t needed = event->mask & IN_ISDIR
+                                        ? PACKET_FEATURE_RENAME
+                                                  | PACKET_FEATURE_DIRS
+                                        : PACKET_FEATURE_RENAME;
+        return (settings->features & needed) == needed;
+}
+
+static bool hold_move(const struct inotify_event *event,
+                      struct event_move *move)
+{
+        const size_t size = sizeof(*event) + event->len;
+        move->event = malloc(size);
+        if (move->event == NULL) {
+                log_error("malloc");
+                return false;
+        }
+        memcpy(move->event, event, size);
+        return true;
+}
+
+/**
+ * Processes the waiting event of the moved file, which got no new name in
+ * the SOURCE folder, like the deletion.
+ */
+static bool release_move(size_t *nptr, struct packet **packet_buffptr,
+                         int inot_fd, client_watcher_list *watchers,
+                         struct event_connection *connection,
+                         struct settings *settings)
+{
+        struct inotify_event *event = connection->move.event;
+        if (event == NULL)
+                return true;
+        connection->move.event = NULL;
+        const bool success = prepare_process_event(event, nptr, packet_buffptr,
+                                                   inot_fd, watchers,
+                                                   connection, settings);
+        free(event);
         return success;
 }
 
+/**
+ * Renames the moved file or directory on the server. The changes of the
+ * files not sent yet follow them to the new names, the watchers of the
+ * directories are renamed. The events are processed like the deletion and
+ * the creation if the server refuses it.
+ */
+static bool process_move(const struct inotify_event *from,
+                         const struct inotify_event *to, size_t *nptr,
+                         struct packet **packet_buffptr, int inot_fd,
+                         client_watcher_list *watchers,
+                         struct event_connection *connection,
+                         struct settings *settings)
+{
+        char old_path[PATH_MAX];
+        char new_path[PATH_MAX];
+        const char *old_name = get_name(watchers, from, settings, old_path);
+        const char *new_name = get_name(watchers, to, settings, new_path);
+        // e.g. the temporary file of an editor is not on the server yet
+        const struct client_journal_entry *pending
+                = old_name == NULL ? NULL
+                                   : client_journal_find(&connection->pending,
+                                                         old_name);
+        const bool created = pending != NULL
+                             && pending->changes & CLIENT_JOURNAL_CREATED;
+
+        int sent = FTW_CONTINUE;
+        if (old_name != NULL && new_name != NULL && !created
+            && connection->connected) {
+                const struct client_traverse_data data = {
+                        .settings = settings,
+                        .packet_buffptr = packet_buffptr,
+                        .nptr = nptr,
+                        .fpath = old_name,
+                };
+                sent = client_send_rename(&data, new_name);
+        }
+        if (sent == FTW_CONTINUE)
+                return prepare_process_event(from, nptr, packet_buffptr,
+                                             inot_fd, watchers, connection,
+                                             settings)
+                       && prepare_process_event(to, nptr, packet_buffptr,
+                                                inot_fd, watchers, connection,
+                                                settings);
+        if (sent == FTW_STOP) {
+                client_journal_overflow(&connection->journal);
+                return can_reconnect(connection)
+                       && disconnect(connection, settings);
+        }
+
+        syslog(LOG_DEBUG, "%s renamed to %s", old_name, new_name);
+        if (from->mask & IN_ISDIR
+            && !client_watcher_list_rename(watchers, old_name, new_name)) {
+                log_error("client_watcher_list_rename");
+                return false;
+        }
+        return client_journal_rename(&connection->journal, old_name, new_name)
+               && client_journal_rename(&connection->pending, old_name,
+                                        new_name);
+}
+
+/**
+ * Processes the event. The event of the moved file waits for the event of
+ * its new name, any other event lets it be processed first.
+ */
+static bool process_event(const struct inotify_event *event, size_t *nptr,
+                          struct packet **packet_buffptr, int inot_fd,
+                          client_watcher_list *watchers,
+                          struct event_connection *connection,
+                          struct settings *settings)
+{
+        struct inotify_event *from = connection->move.event;
+        if (from != NULL && event->mask & IN_MOVED_TO
+            && event->cookie == from->cookie) {
+                connection->move.event = NULL;
+                const bool success = process_move(from, event, nptr,
+                                                  packet_buffptr, inot_fd,
+                                                  watchers, connection,
+                                                  settings);
+                free(from);
+                return success;
+        }
+
+        if (!release_move(nptr, packet_buffptr, inot_fd, watchers, connection,
+                          settings))
+                return false;
+        if (can_rename(event, connection, settings))
+                return hold_move(event, &connection->move);
+        return prepare_process_event(event, nptr, packet_buffptr, inot_fd,
+                                     watchers, connection, settings);
+}
+
 /**
  * @brief This function goes through all events and process them.
  */
 static bool processing(size_t size, const unsigned char events_raw[size],
                        int inot_fd, client_watcher_list *watchers,
-                       const struct settings *settings)
+                       struct event_connection *connection,
+                       struct settings *settings)
 {
         const unsigned char *buff_ptr = events_raw;
         size_t n = 0;
@@ -292,8 +695,8 @@ static bool processing(size_t size, const unsigned char events_raw[size],
                 buff_ptr += event_len;
                 size -= event_len;
 
-                if (!prepare_process_event(event, &n, &packet_buff, inot_fd,
-                                           watchers, settings)) {
+                if (!process_event(event, &n, &packet_buff, inot_fd, watchers,
+                                   connection, settings)) {
                         success = false;
                         break;
                 }
@@ -338,64 +741,334 @@ static bool read_events(int inot_fd, size_t *buff_size,
 }
 
 /**
- * This function goes through all events and process them.
+ * Sends the pending changes after the quiet period, or right away if it is
+ * 0. The journal is cleared once the server has received all the changes.
+ */
+static bool finish_events(struct event_connection *connection,
+                          struct settings *settings)
+{
+        if (!connection->connected)
+                return true;
+        if (connection->pending.count > 0)
+                return settings->quiet_period == 0
+                               ? flush_pending(connection, settings)
+                               : schedule_flush(connection, settings);
+
+        if (log_packet_flush(settings->stream))
+                return client_journal_clear(&connection->journal);
+        return can_reconnect(connection) && disconnect(connection, settings);
+}
+
+/**
+ * This function goes through all events and process them. The event of the
+ * moved file waits for the event of its new name in the next events up to
+ * @c MOVE_TIMEOUT.
  */
 static bool process_all_events(client_watcher_list *watchers, int inot_fd,
-                               const struct settings *settings)
+                               struct event_connection *connection,
+                               struct settings *settings)
 {
         size_t size = 0;
         unsigned char *events_raw = NULL;
 
-        if (!read_events(inot_fd, &size, &events_raw))
+        const bool read
+                = settings->fanotify != NULL
+                          ? client_fanotify_read(settings->fanotify, &size,
+                                                 &events_raw)
+                          : read_events(inot_fd, &size, &events_raw);
+        if (!read)
                 return false;
 
-        const bool success
-                = processing(size, events_raw, inot_fd, watchers, settings);
-
+        const bool success = processing(size, events_raw, inot_fd, watchers,
+                                        connection, settings);
         free(events_raw);
-        return success;
+        if (!success)
+                return false;
+        if (connection->move.event != NULL
+            && !event_reader_arm_timer(connection->reader,
+                                       connection->move.timer, MOVE_TIMEOUT,
+                                       0))
+                return false;
+        return finish_events(connection, settings);
 }
 
-bool client_event_loop(client_watcher_list *watchers, int inot_fd,
-                       const struct settings *settings)
+/**
+ * Sends the change of the file recorded in the journal unless the server
+ * already has it. The file deleted since is deleted on the server if the
+ * server has it.
+ */
+static bool replay_entry(const struct client_journal_entry *entry,
+                         const struct client_traverse_data *replay_data,
+                         struct client_manifest *manifest)
 {
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wpedantic"
-        EVENT_READER_CALLBACK(callback)
-        {
-                log_assert(n == 2);
+        struct stat sb;
+        struct client_traverse_data data = *replay_data;
+        data.fpath = entry->name;
+        data.sb = &sb;
+        syslog(LOG_DEBUG, "replaying: %s", entry->name);
 
-                struct pollfd *inotify_pollfd = &pollfds[0];
-                struct pollfd *connection_pollfd = &pollfds[1];
+        if (fstatat(data.settings->dirfd, entry->name, &sb,
+                    AT_SYMLINK_NOFOLLOW)
+            == -1) {
+                if (errno != ENOENT) {
+                        log_warning("fstatat");
+                        return true;
+                }
+                if (client_manifest_find(manifest, entry->name) == NULL)
+                        return true;
+                return client_send_delete_file(&data) != FTW_STOP;
+        }
+        if (!S_ISREG(sb.st_mode))
+                return true;
 
-                syslog(LOG_DEBUG, "inot_fd: %d | sock_fd: %d | signal_fd : %d",
-                       inotify_pollfd->revents, connection_pollfd->revents,
-                       signal_pollfd->revents);
+        if (entry->changes & CLIENT_JOURNAL_CONTENT
+            && client_copy_new_or_changed_file(data, manifest) != FTW_CONTINUE)
+                return false;
+        return !(entry->changes & CLIENT_JOURNAL_METADATA)
+               || change_metadata(entry->name, &data);
+}
 
-                if (connection_pollfd->revents & POLLRDHUP
-                    || connection_pollfd->revents & POLLERR) {
-                        syslog(LOG_ERR, "connection to the server closed");
-                        return UTILS_LOOP_ERROR;
-                }
+struct iter_replay_data {
+        const struct client_traverse_data *data;
+        struct client_manifest *manifest;
+        bool success;
+};
 
-                if (inotify_pollfd->revents & POLLIN
-                    && !process_all_events(watchers, inot_fd, settings)) {
-                        syslog(LOG_DEBUG, "process_all_event failed");
-                        return UTILS_LOOP_ERROR;
-                }
+static bool iter_replay_entry(void *elem, void *data)
+{
+        struct iter_replay_data *replay = data;
+        replay->success = replay_entry(elem, replay->data, replay->manifest);
+        return replay->success;
+}
 
-                if (signal_pollfd->revents & POLLIN) {
-                        syslog(LOG_DEBUG, "termination signal caught");
-                        return UTILS_LOOP_BREAK;
-                }
+/**
+ * Sends the changes recorded in the journal, which the server does not
+ * have according to its manifest. The whole folder is synchronized again
+ * if the journal overflowed or the server cannot list its files.
+ */
+static bool replay_journal(struct client_journal *journal,
+                           const struct settings *settings)
+{
+        if (journal->overflowed
+            || !(settings->features & PACKET_FEATURE_MANIFEST))
+                return client_copy_files(-1, NULL, settings);
+
+        struct packet *packet_buff = NULL;
+        size_t n = 0;
+        const struct client_traverse_data data = {
+                .settings = settings,
+                .packet_buffptr = &packet_buff,
+                .nptr = &n,
+        };
+        struct iter_replay_data replay = {
+                .data = &data,
+                .success = false,
+        };
+
+        struct client_manifest manifest;
+        if (client_manifest_request(&data, &manifest) != NEXT_STEP)
+                goto clean;
+        replay.manifest = &manifest;
+
+        syslog(LOG_INFO, "sending %zu changed files", journal->count);
+        replay.success = true;
+        client_journal_foreach(journal, iter_replay_entry, &replay);
+        client_manifest_destroy(&manifest);
+clean:
+        free(packet_buff);
+        return replay.success;
+}
+
+/**
+ * Starts to monitor the connection to the server.
+ */
+static bool watch_connection(struct event_loop *loop);
+
+/**
+ * Tries to connect to the server again and send it the changes made while
+ * the client was disconnected. The next attempt is scheduled after the
+ * doubled delay on failure.
+ */
+static bool reconnect(struct event_loop *loop)
+{
+        struct event_connection *connection = &loop->connection;
+        struct settings *settings = loop->settings;
+
+        if (client_connection_reopen(settings)
+            && replay_journal(&connection->journal, settings)
+            && log_packet_flush(settings->stream) && watch_connection(loop)) {
+                syslog(LOG_INFO, "reconnected to the server");
+                connection->connected = true;
+                return client_journal_clear(&connection->journal);
+        }
+
+        client_connection_close(settings);
+        connection->delay = client_connection_next_delay(connection->delay);
+        return schedule_reconnect(connection);
+}
+
+static enum utils_loop_status _connection_callback(int fd, uint32_t events,
+                                                   void *data)
+{
+        UNUSED(fd);
+        struct event_loop *loop = data;
+        if (!(events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
                 return UTILS_LOOP_CONTINUE;
+
+        syslog(LOG_ERR, "connection to the server closed");
+        if (!can_reconnect(&loop->connection)
+            || !disconnect(&loop->connection, loop->settings))
+                return UTILS_LOOP_ERROR;
+        return UTILS_LOOP_CONTINUE;
+}
+
+static bool watch_connection(struct event_loop *loop)
+{
+        return event_reader_add(loop->connection.reader,
+                                loop->settings->read_fd, EPOLLRDHUP,
+                                _connection_callback, loop);
+}
+
+static enum utils_loop_status _inotify_callback(int fd, uint32_t events,
+                                                void *data)
+{
+        UNUSED(events);
+        struct event_loop *loop = data;
+        if (!process_all_events(loop->watchers, fd, &loop->connection,
+                                loop->settings)) {
+                syslog(LOG_DEBUG, "process_all_event failed");
+                return UTILS_LOOP_ERROR;
         }
-#pragma GCC diagnostic pop
+        return UTILS_LOOP_CONTINUE;
+}
+
+static enum utils_loop_status _reconnect_callback(int timer, uint32_t events,
+                                                  void *data)
+{
+        UNUSED(timer);
+        UNUSED(events);
+        return reconnect(data) ? UTILS_LOOP_CONTINUE : UTILS_LOOP_ERROR;
+}
 
-        const struct pollfd fds[] = {
-                { .fd = inot_fd, .events = POLLIN },
-                { .fd = settings->read_fd, .events = POLLRDHUP },
+static enum utils_loop_status _flush_callback(int timer, uint32_t events,
+                                              void *data)
+{
+        UNUSED(timer);
+        UNUSED(events);
+        struct event_loop *loop = data;
+        return flush_pending(&loop->connection, loop->settings)
+                       ? UTILS_LOOP_CONTINUE
+                       : UTILS_LOOP_ERROR;
+}
+
+/**
+ * Processes the event of the moved file, which waits for its new name.
+ */
+static bool release_loop_move(struct event_loop *loop)
+{
+        struct packet *packet_buff = NULL;
+        size_t n = 0;
+        const bool success
+                = release_move(&n, &packet_buff, loop->inot_fd, loop->watchers,
+                               &loop->connection, loop->settings);
+        free(packet_buff);
+        return success;
+}
+
+static enum utils_loop_status _move_callback(int timer, uint32_t events,
+                                             void *data)
+{
+        UNUSED(timer);
+        UNUSED(events);
+        struct event_loop *loop = data;
+        return release_loop_move(loop)
+                               && finish_events(&loop->connection,
+                                                loop->settings)
+                       ? UTILS_LOOP_CONTINUE
+                       : UTILS_LOOP_ERROR;
+}
+
+static enum utils_loop_status
+_signal_callback(const struct signalfd_siginfo *info, void *data)
+{
+        UNUSED(info);
+        struct event_loop *loop = data;
+        syslog(LOG_DEBUG, "termination signal caught");
+        if (!release_loop_move(loop))
+                log_warning("release_loop_move");
+        // the changes waiting for the quiet period are not lost
+        if (loop->connection.connected)
+                flush_pending(&loop->connection, loop->settings);
+        return loop->connection.connected ? UTILS_LOOP_BREAK
+                                          : UTILS_LOOP_ERROR;
+}
+
+bool client_event_loop(client_watcher_list *watchers, int inot_fd,
+                       struct settings *settings)
+{
+        struct event_loop loop = {
+                .watchers = watchers,
+                .settings = settings,
+                .connection = {
+                        .timer = -1,
+                        .flush_timer = -1,
+                        .delay = CLIENT_RECONNECT_MIN_DELAY,
+                        .move = { .timer = -1 },
+                        .connected = true,
+                },
+                .inot_fd = inot_fd,
         };
-        return event_reader(&settings->mask, sizeof(fds) / sizeof(*fds), fds,
-                            callback);
+        struct event_connection *connection = &loop.connection;
+        bool success = false;
+
+        if (!client_journal_create(&connection->journal)) {
+                log_error("client_journal_create");
+                return false;
+        }
+        if (!client_journal_create(&connection->pending)) {
+                log_error("client_journal_create");
+                client_journal_destroy(&connection->journal);
+                return false;
+        }
+
+        connection->reader
+                = event_reader_create(&settings->mask, _signal_callback, &loop);
+        if (connection->reader == NULL)
+                goto clean_journal;
+
+        // all the queued events are read on every wake up
+        if (!event_reader_add(connection->reader, inot_fd, EPOLLIN | EPOLLET,
+                              _inotify_callback, &loop)
+            || !watch_connection(&loop))
+                goto clean_reader;
+
+        connection->flush_timer = event_reader_add_timer(
+                connection->reader, 0, 0, _flush_callback, &loop);
+        if (connection->flush_timer == -1) {
+                log_error("event_reader_add_timer");
+                goto clean_reader;
+        }
+
+        if (settings->reconnect != NULL) {
+                connection->timer = event_reader_add_timer(
+                        connection->reader, 0, 0, _reconnect_callback, &loop);
+                if (connection->timer == -1)
+                        log_warning("event_reader_add_timer");
+        }
+
+        // the moved files are deleted and sent again without the timer
+        connection->move.timer = event_reader_add_timer(
+                connection->reader, 0, 0, _move_callback, &loop);
+        if (connection->move.timer == -1)
+                log_warning("event_reader_add_timer");
+
+        success = event_reader_run(connection->reader);
+
+clean_reader:
+        free(connection->move.event);
+        event_reader_destroy(connection->reader);
+clean_journal:
+        client_journal_destroy(&connection->pending);
+        client_journal_destroy(&connection->journal);
+        return success;
 }
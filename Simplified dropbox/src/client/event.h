@@ -11,7 +11,10 @@
 #include "traverse_data.h"
 
 /**
- * Prepares then runs event loop.
+ * Prepares then runs event loop. When the connection to the server is lost
+ * and the client can reconnect, the changes are recorded in a journal
+ * while the client tries to reconnect with exponential backoff, and only
+ * the changed files are sent after it reconnects.
  *
  * @param watchers  pointer to the list of watchers
  * @param inot_fd   inotify file descriptor
@@ -20,6 +23,6 @@
  *                  false on failure
  */
 bool client_event_loop(client_watcher_list *watchers, int inot_fd,
-                       const struct settings *settings);
+                       struct settings *settings);
 
 #endif //EVENT_H
@@ -0,0 +1,431 @@
+/**
+ * @file fanotify.c
+ * @brief Watching of the SOURCE folder through one fanotify(7) mark of
+ *        the whole filesystem.
+ */
+#include "fanotify.h"
+
+#include "watcher_list.h"
+
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/statfs.h>
+#include <unistd.h>
+
+#define EVENTS_SIZE (64 * 1024)
+
+#define MASK                                                                   \
+        (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO               \
+         | FAN_CLOSE_WRITE | FAN_ATTRIB | FAN_ONDIR)
+
+/** the moves reported with both names since Linux 5.17, so the renamed
+ *  files are paired like by the cookies of inotify(7) */
+#define RENAME_MASK ((MASK & ~(FAN_MOVED_FROM | FAN_MOVED_TO)) | FAN_RENAME)
+
+/** hexadecimal id of the filesystem, type of the handle and the handle */
+#define KEY_SIZE (2 * (sizeof(fsid_t) + sizeof(int) + MAX_HANDLE_SZ) + 1)
+
+struct client_fanotify {
+        int fd;
+        int mount_fd; /**< the SOURCE folder, for open_by_handle_at(2) */
+        fsid_t fsid;  /**< filesystem of the SOURCE folder               */
+        client_watcher_list dirs; /**< directories keyed by their handle  */
+        uint64_t mask;            /**< events of the marks                */
+        int last_wd;
+        uint32_t last_cookie;     /**< cookie of the last converted rename */
+};
+
+static char *append_hex(char *key, const void *data, size_t size)
+{
+        static const char digits[] = "0123456789abcdef";
+        const unsigned char *bytes = data;
+        for (size_t i = 0; i < size; i++) {
+                *key++ = digits[bytes[i] >> 4];
+                *key++ = digits[bytes[i] & 0xf];
+        }
+        *key = '\0';
+        return key;
+}
+
+/**
+ * Writes the key of the directory in the table of the watched directories.
+ */
+static void format_key(const void *fsid, const struct file_handle *handle,
+                       char key[KEY_SIZE])
+{
+        key = append_hex(key, fsid, sizeof(fsid_t));
+        key = append_hex(key, &handle->handle_type,
+                         sizeof(handle->handle_type));
+        append_hex(key, handle->f_handle, handle->handle_bytes);
+}
+
+static bool mark(const struct client_fanotify *fanotify, int dirfd,
+                 const char *path)
+{
+        return fanotify_mark(fanotify->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                             fanotify->mask, dirfd, path)
+               == 0;
+}
+
+struct client_fanotify *client_fanotify_create(int dirfd)
+{
+        struct client_fanotify *fanotify = calloc(1, sizeof(*fanotify));
+        if (fanotify == NULL) {
+                log_error("calloc");
+                return NULL;
+        }
+        if (!client_watcher_list_create(&fanotify->dirs)) {
+                log_error("client_watcher_list_create");
+                free(fanotify);
+                return NULL;
+        }
+        fanotify->fd = -1;
+
+        struct statfs sb;
+        if (fstatfs(dirfd, &sb) == -1) {
+                log_warning("fstatfs");
+                goto clean;
+        }
+        fanotify->fsid = sb.f_fsid;
+        fanotify->mount_fd = dirfd;
+        // the events of the other processes are queued while they are sent
+        fanotify->fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC
+                                             | FAN_NONBLOCK
+                                             | FAN_REPORT_DFID_NAME
+                                             | FAN_UNLIMITED_QUEUE,
+                                     O_RDONLY);
+        if (fanotify->fd == -1) {
+                syslog(LOG_INFO, "fanotify_init: %s, inotify is used",
+                       strerror(errno));
+                goto clean;
+        }
+        fanotify->mask = RENAME_MASK;
+        if (!mark(fanotify, dirfd, NULL) && errno == EINVAL) {
+                fanotify->mask = MASK;
+                syslog(LOG_INFO, "no FAN_RENAME, moves are not paired");
+        }
+        if (fanotify->mask == MASK && !mark(fanotify, dirfd, NULL)) {
+                syslog(LOG_INFO, "fanotify_mark: %s, inotify is used",
+                       strerror(errno));
+                goto clean;
+        }
+        return fanotify;
+clean:
+        if (fanotify->fd != -1 && close(fanotify->fd) == -1)
+                log_warning("close");
+        client_watcher_list_destroy(&fanotify->dirs);
+        free(fanotify);
+        return NULL;
+}
+
+int client_fanotify_fd(const struct client_fanotify *fanotify)
+{
+        return fanotify->fd;
+}
+
+bool client_fanotify_watch(struct client_fanotify *fanotify, const char *path,
+                           int *wd)
+{
+        struct file_handle *handle = malloc(sizeof(*handle) + MAX_HANDLE_SZ);
+        if (handle == NULL) {
+                log_error("malloc");
+                return false;
+        }
+        bool success = false;
+        handle->handle_bytes = MAX_HANDLE_SZ;
+        int mount_id;
+        if (name_to_handle_at(AT_FDCWD, path, handle, &mount_id, 0) == -1) {
+                log_error("name_to_handle_at");
+                goto clean;
+        }
+        struct statfs sb;
+        if (statfs(path, &sb) == -1) {
+                log_error("statfs");
+                goto clean;
+        }
+        // e.g. a filesystem mounted in the SOURCE folder
+        if (memcmp(&sb.f_fsid, &fanotify->fsid, sizeof(fsid_t)) != 0
+            && !mark(fanotify, AT_FDCWD, path)) {
+                log_error("fanotify_mark");
+                goto clean;
+        }
+
+        char key[KEY_SIZE];
+        format_key(&sb.f_fsid, handle, key);
+        const struct client_watcher dir = {
+                .wd = ++fanotify->last_wd,
+                .name = strdup(key),
+        };
+        if (dir.name == NULL
+            || !client_watcher_list_add(&fanotify->dirs, &dir)) {
+                log_error("malloc");
+                free((void *)dir.name);
+                goto clean;
+        }
+        *wd = dir.wd;
+        success = true;
+clean:
+        free(handle);
+        return success;
+}
+
+void client_fanotify_forget(struct client_fanotify *fanotify, int wd)
+{
+        client_watcher_list_remove(&fanotify->dirs, wd);
+}
+
+static uint32_t inotify_mask(uint64_t mask)
+{
+        uint32_t result = 0;
+        if (mask & FAN_CREATE)
+                result |= IN_CREATE;
+        if (mask & FAN_DELETE)
+                result |= IN_DELETE;
+        if (mask & FAN_MOVED_FROM)
+                result |= IN_MOVED_FROM;
+        if (mask & FAN_MOVED_TO)
+                result |= IN_MOVED_TO;
+        if (mask & FAN_CLOSE_WRITE)
+                result |= IN_CLOSE_WRITE;
+        if (mask & FAN_ATTRIB)
+                result |= IN_ATTRIB;
+        if (mask & FAN_ONDIR)
+                result |= IN_ISDIR;
+        return result;
+}
+
+/**
+ * Writes the event padded like inotify(7) does.
+ *
+ * @return size of the event
+ */
+static size_t put_event(unsigned char *out, int wd, uint32_t mask,
+                        const char *name, uint32_t cookie)
+{
+        const size_t name_size = name == NULL ? 0 : strlen(name) + 1;
+        const struct inotify_event event = {
+                .wd = wd,
+                .mask = mask,
+                .cookie = cookie,
+                .len = (name_size + sizeof(event) - 1) / sizeof(event)
+                       * sizeof(event),
+        };
+        memcpy(out, &event, sizeof(event));
+        memset(out + sizeof(event), 0, event.len);
+        if (name != NULL)
+                memcpy(out + sizeof(event), name, name_size);
+        return sizeof(event) + event.len;
+}
+
+/**
+ * Checks whether the directory of the handle has the file now.
+ */
+static bool exists(const struct client_fanotify *fanotify,
+                   struct file_handle *handle, const char *name)
+{
+        const int dirfd = open_by_handle_at(fanotify->mount_fd, handle,
+                                            O_PATH | O_DIRECTORY);
+        if (dirfd == -1)
+                return false;
+        const bool found = faccessat(dirfd, name, F_OK, AT_SYMLINK_NOFOLLOW)
+                           == 0;
+        if (close(dirfd) == -1)
+                log_warning("close");
+        return found;
+}
+
+/**
+ * Converts the event, fanotify(7) merges the events of the same name. The
+ * removal goes first if the name exists again, otherwise the creation.
+ *
+ * @return size of the converted events
+ */
+static size_t put_events(const struct client_fanotify *fanotify,
+                         unsigned char *out, int wd, uint32_t mask,
+                         struct file_handle *handle, const char *name)
+{
+        uint32_t removal = mask & (IN_DELETE | IN_MOVED_FROM);
+        const uint32_t creation = mask & (IN_CREATE | IN_MOVED_TO);
+        if (removal == 0 || creation == 0)
+                return put_event(out, wd, mask, name, 0);
+
+        const uint32_t rest = mask & ~removal;
+        removal |= mask & IN_ISDIR;
+        if (exists(fanotify, handle, name)) {
+                const size_t size = put_event(out, wd, removal, name, 0);
+                return size + put_event(out + size, wd, rest, name, 0);
+        }
+        const size_t size = put_event(out, wd, rest, name, 0);
+        return size + put_event(out + size, wd, removal, name, 0);
+}
+
+/**
+ * Finds the directory and the name of the event, the old or the new ones
+ * of the rename by @c info_type.
+ */
+static struct fanotify_event_info_fid *
+find_name(struct fanotify_event_metadata *meta, uint8_t info_type)
+{
+        unsigned char *info = (unsigned char *)meta + meta->metadata_len;
+        unsigned char *end = (unsigned char *)meta + meta->event_len;
+        const ptrdiff_t min_size = sizeof(struct fanotify_event_info_fid);
+        while (end - info >= min_size) {
+                struct fanotify_event_info_fid *fid = (void *)info;
+                if (fid->hdr.len == 0 || fid->hdr.len > end - info)
+                        return NULL;
+                struct file_handle *handle = (void *)fid->handle;
+                if (fid->hdr.info_type == info_type
+                    && handle->handle_bytes <= MAX_HANDLE_SZ)
+                        return fid;
+                info += fid->hdr.len;
+        }
+        return NULL;
+}
+
+/**
+ * Finds the watched directory of the name of the event.
+ *
+ * @param[out] name  the name in the directory
+ * @return           the watcher of the directory;
+ *                   NULL if the directory is not watched
+ */
+static const struct client_watcher *
+find_dir(const struct client_fanotify *fanotify,
+         struct fanotify_event_info_fid *fid, const char **name)
+{
+        if (fid == NULL)
+                return NULL;
+        struct file_handle *handle = (void *)fid->handle;
+        char key[KEY_SIZE];
+        format_key(&fid->fsid, handle, key);
+        *name = (const char *)handle->f_handle + handle->handle_bytes;
+        if ((*name)[0] == '\0')
+                return NULL;
+        return client_watcher_list_find_name(&fanotify->dirs, key);
+}
+
+/**
+ * Converts the rename to the events of the old and the new name with the
+ * same cookie, like inotify(7) reports them. Only the name in a watched
+ * directory gets its event.
+ *
+ * @return size of the converted events
+ */
+static size_t put_rename(struct client_fanotify *fanotify, unsigned char *out,
+                         struct fanotify_event_metadata *meta)
+{
+        const char *old_name;
+        const char *new_name;
+        const struct client_watcher *old_dir = find_dir(
+                fanotify, find_name(meta, FAN_EVENT_INFO_TYPE_OLD_DFID_NAME),
+                &old_name);
+        const struct client_watcher *new_dir = find_dir(
+                fanotify, find_name(meta, FAN_EVENT_INFO_TYPE_NEW_DFID_NAME),
+                &new_name);
+        const uint32_t dir = meta->mask & FAN_ONDIR ? IN_ISDIR : 0;
+        // 0 is no cookie
+        if (++fanotify->last_cookie == 0)
+                fanotify->last_cookie = 1;
+
+        size_t size = 0;
+        if (old_dir != NULL)
+                size += put_event(out, old_dir->wd, IN_MOVED_FROM | dir,
+                                  old_name, fanotify->last_cookie);
+        if (new_dir != NULL)
+                size += put_event(out + size, new_dir->wd, IN_MOVED_TO | dir,
+                                  new_name, fanotify->last_cookie);
+        return size;
+}
+
+/**
+ * Converts the events of the watched directories.
+ *
+ * @return size of the converted events, at most 4 times @c size
+ */
+static size_t convert(struct client_fanotify *fanotify, unsigned char *events,
+                      size_t size, unsigned char *out)
+{
+        size_t out_size = 0;
+        struct fanotify_event_metadata *meta = (void *)events;
+        for (; FAN_EVENT_OK(meta, size); meta = FAN_EVENT_NEXT(meta, size)) {
+                if (meta->mask & FAN_Q_OVERFLOW) {
+                        out_size += put_event(out + out_size, -1,
+                                              IN_Q_OVERFLOW, NULL, 0);
+                        continue;
+                }
+                if (meta->fd >= 0 && close(meta->fd) == -1)
+                        log_warning("close");
+                if (meta->mask & FAN_RENAME) {
+                        out_size += put_rename(fanotify, out + out_size, meta);
+                        continue;
+                }
+
+                struct fanotify_event_info_fid *fid
+                        = find_name(meta, FAN_EVENT_INFO_TYPE_DFID_NAME);
+                const char *name;
+                const struct client_watcher *dir
+                        = find_dir(fanotify, fid, &name);
+                if (dir == NULL)
+                        continue;
+                out_size += put_events(fanotify, out + out_size, dir->wd,
+                                       inotify_mask(meta->mask),
+                                       (void *)fid->handle, name);
+        }
+        return out_size;
+}
+
+bool client_fanotify_read(struct client_fanotify *fanotify, size_t *buff_size,
+                          unsigned char **buff_ptr)
+{
+        unsigned char *events = malloc(EVENTS_SIZE);
+        if (events == NULL) {
+                log_error("malloc");
+                return false;
+        }
+        unsigned char *converted = NULL;
+        size_t size = 0;
+        for (;;) {
+                const ssize_t rc = read(fanotify->fd, events, EVENTS_SIZE);
+                if (rc == -1 && errno == EINTR)
+                        continue;
+                if (rc == -1 && errno == EAGAIN)
+                        break;
+                if (rc <= 0) {
+                        log_error("read");
+                        goto fail;
+                }
+                // the name and the header of inotify(7) are padded
+                unsigned char *grown = realloc(converted, size + 4 * rc);
+                if (grown == NULL) {
+                        log_error("realloc");
+                        goto fail;
+                }
+                converted = grown;
+                size += convert(fanotify, events, rc, converted + size);
+        }
+        free(events);
+        *buff_size = size;
+        *buff_ptr = converted;
+        return true;
+fail:
+        free(converted);
+        free(events);
+        return false;
+}
+
+void client_fanotify_destroy(struct client_fanotify *fanotify)
+{
+        if (fanotify == NULL)
+                return;
+        if (close(fanotify->fd) == -1)
+                log_warning("close");
+        client_watcher_list_destroy(&fanotify->dirs);
+        free(fanotify);
+}
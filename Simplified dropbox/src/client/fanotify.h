@@ -0,0 +1,79 @@
+/**
+ * @file fanotify.h
+ * @brief Module for watching the directories of the SOURCE folder through
+ *        one fanotify(7) mark of the whole filesystem instead of an
+ *        inotify(7) watch of every directory.
+ */
+#ifndef FANOTIFY_H
+#define FANOTIFY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * The fanotify group and the watched directories told by their file
+ * handles. The events of the other directories of the filesystem are left
+ * out.
+ */
+struct client_fanotify;
+
+/**
+ * Marks the filesystem of the SOURCE folder. It needs CAP_SYS_ADMIN and a
+ * filesystem reporting the file handles, otherwise inotify(7) is used.
+ *
+ * @param dirfd  the SOURCE folder
+ * @return       the group on success;
+ *               NULL if fanotify(7) is not permitted or fails
+ */
+struct client_fanotify *client_fanotify_create(int dirfd);
+
+/**
+ * @param fanotify  the group
+ * @return          descriptor of the group to be polled for the events
+ */
+int client_fanotify_fd(const struct client_fanotify *fanotify);
+
+/**
+ * Reports the changes in the directory from now on. The directory on
+ * another filesystem gets the mark of its filesystem too.
+ *
+ * @param fanotify  the group
+ * @param path      path of the directory
+ * @param[out] wd   descriptor of the watched directory
+ * @return          true on success;
+ *                  false on failure
+ */
+bool client_fanotify_watch(struct client_fanotify *fanotify, const char *path,
+                           int *wd);
+
+/**
+ * Stops reporting the changes in the directory, e.g. after it is deleted.
+ *
+ * @param fanotify  the group
+ * @param wd        descriptor of the watched directory
+ */
+void client_fanotify_forget(struct client_fanotify *fanotify, int wd);
+
+/**
+ * Reads all the queued events and converts those of the watched
+ * directories to struct inotify_event with the descriptor of the
+ * directory. The event of the name created and deleted in between is split
+ * into the removal and the creation in the order they happened.
+ *
+ * @param fanotify        the group
+ * @param[out] buff_size  size of the converted events
+ * @param[out] buff_ptr   the converted events, to be freed
+ * @return                true on success;
+ *                        false on failure
+ */
+bool client_fanotify_read(struct client_fanotify *fanotify, size_t *buff_size,
+                          unsigned char **buff_ptr);
+
+/**
+ * Closes the group and frees it.
+ *
+ * @param fanotify  the group; may be NULL
+ */
+void client_fanotify_destroy(struct client_fanotify *fanotify);
+
+#endif //FANOTIFY_H
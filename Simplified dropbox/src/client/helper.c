@@ -24,7 +24,7 @@ static enum packet_msg_code answer_from_server(const struct settings *settings,
                                                struct packet **packet_buffptr,
                                                size_t *nptr)
 {
-        if (!log_packet_read(settings->read_fd, packet_buffptr, nptr))
+        if (!log_packet_read(settings->stream, packet_buffptr, nptr))
                 return MSG_ABORT;
 
         enum packet_msg_code code = (*packet_buffptr)->code;
@@ -44,3 +44,16 @@ client_helper_get_answer(const struct client_traverse_data *data)
         return answer_from_server(data->settings, data->packet_buffptr,
                                   data->nptr);
 }
+
+bool client_helper_get_ack(const struct client_traverse_data *data,
+                           uint64_t *block_count)
+{
+        const enum packet_msg_code answer = client_helper_get_answer(data);
+        if (!client_helper_check_expected_code(answer, MSG_ACK))
+                return false;
+
+        const struct packet_payload_ack *ack
+                = (struct packet_payload_ack *)(*data->packet_buffptr)->payload;
+        *block_count = ack->block_count;
+        return true;
+}
@@ -29,4 +29,15 @@ bool client_helper_check_expected_code(enum packet_msg_code got_code,
 enum packet_msg_code
 client_helper_get_answer(const struct client_traverse_data *data);
 
+/**
+ * Waits for the acknowledgement of the written blocks
+ *
+ * @param data              struct holding data, which are used when traversing a folder
+ * @param[out] block_count  number of the blocks acknowledged by the server
+ * @return                  true on success;
+ *                          false on failure
+ */
+bool client_helper_get_ack(const struct client_traverse_data *data,
+                           uint64_t *block_count);
+
 #endif //HELPER_H
@@ -0,0 +1,248 @@
+/**
+ * @file journal.c
+ * @brief Journal of the changed files, indexed by their paths.
+ */
+#include "journal.h"
+
+#include "hash.h"
+#include "log.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+
+#define MIN_SLOT_COUNT 64
+
+bool client_journal_create(struct client_journal *journal)
+{
+        journal->count = 0;
+        journal->slots = NULL;
+        journal->slot_count = 0;
+        journal->overflowed = false;
+        return generic_list_create(&journal->entries,
+                                   sizeof(struct client_journal_entry));
+}
+
+static struct client_journal_entry *entry_at(struct client_journal *journal,
+                                             size_t slot)
+{
+        return generic_list_at(&journal->entries, journal->slots[slot] - 1);
+}
+
+/**
+ * Finds the slot of the file or the empty slot where it belongs.
+ */
+static size_t find_slot(struct client_journal *journal, const char *name)
+{
+        const size_t mask = journal->slot_count - 1;
+        size_t slot = hash_xxh64(strlen(name), name, 0) & mask;
+        while (journal->slots[slot] != 0
+               && strcmp(entry_at(journal, slot)->name, name) != 0)
+                slot = (slot + 1) & mask;
+        return slot;
+}
+
+static bool grow(struct client_journal *journal)
+{
+        const size_t slot_count = journal->slot_count == 0
+                                          ? MIN_SLOT_COUNT
+                                          : 2 * journal->slot_count;
+        size_t *slots = calloc(slot_count, sizeof(*slots));
+        if (slots == NULL) {
+                log_error("calloc");
+                return false;
+        }
+
+        free(journal->slots);
+        journal->slots = slots;
+        journal->slot_count = slot_count;
+        for (size_t i = 0; i < journal->count; i++) {
+                const struct client_journal_entry *entry
+                        = generic_list_at(&journal->entries, i);
+                journal->slots[find_slot(journal, entry->name)] = i + 1;
+        }
+        return true;
+}
+
+bool client_journal_record(struct client_journal *journal, const char *name,
+                           unsigned changes)
+{
+        if (journal->overflowed)
+                return true;
+
+        if (2 * (journal->count + 1) > journal->slot_count && !grow(journal))
+                return false;
+        const size_t slot = find_slot(journal, name);
+        if (journal->slots[slot] != 0) {
+                entry_at(journal, slot)->changes
+                        |= changes & ~CLIENT_JOURNAL_CREATED;
+                return true;
+        }
+
+        if (journal->count == CLIENT_JOURNAL_MAX_ENTRIES) {
+                client_journal_overflow(journal);
+                return true;
+        }
+
+        const struct client_journal_entry entry = {
+                .name = strdup(name),
+                .changes = changes,
+        };
+        if (entry.name == NULL) {
+                log_error("strdup");
+                return false;
+        }
+        if (!generic_list_push_back(&journal->entries, &entry)) {
+                log_error("generic_list_push_back");
+                free(entry.name);
+                return false;
+        }
+        journal->slots[slot] = ++journal->count;
+        syslog(LOG_DEBUG, "journal: %s (%#x)", name, changes);
+        return true;
+}
+
+const struct client_journal_entry *
+client_journal_find(struct client_journal *journal, const char *name)
+{
+        if (journal->count == 0)
+                return NULL;
+        const size_t slot = find_slot(journal, name);
+        return journal->slots[slot] == 0 ? NULL : entry_at(journal, slot);
+}
+
+unsigned client_journal_event_changes(uint32_t mask)
+{
+        unsigned changes = 0;
+        if (mask
+            & (IN_CLOSE_WRITE | IN_MOVED_FROM | IN_DELETE | IN_MOVED_TO
+               | IN_CREATE))
+                changes |= CLIENT_JOURNAL_CONTENT;
+        if (mask & IN_ATTRIB)
+                changes |= CLIENT_JOURNAL_METADATA;
+        // the file moved in may replace a file the server has, which has to
+        // be deleted if the new one goes away again
+        if (mask & IN_CREATE)
+                changes |= CLIENT_JOURNAL_CREATED;
+        return changes;
+}
+
+enum client_journal_action
+client_journal_action(const struct client_journal_entry *entry, bool exists)
+{
+        const bool created = entry->changes & CLIENT_JOURNAL_CREATED;
+        if (!exists)
+                return created ? CLIENT_JOURNAL_NONE : CLIENT_JOURNAL_DELETE;
+        if (created)
+                return CLIENT_JOURNAL_CREATE;
+        if (entry->changes & CLIENT_JOURNAL_CONTENT)
+                return CLIENT_JOURNAL_UPDATE;
+        return CLIENT_JOURNAL_ATTRIBUTES;
+}
+
+struct iter_rename_data {
+        struct client_journal *renamed;
+        const char *old_name;
+        const char *new_name;
+        bool found;
+        bool success;
+};
+
+static bool iter_find_renamed(void *elem, void *data)
+{
+        const struct client_journal_entry *entry = elem;
+        struct iter_rename_data *rename = data;
+        rename->found = utils_path_is_within(entry->name, rename->old_name);
+        return !rename->found;
+}
+
+static bool iter_rename_entry(void *elem, void *data)
+{
+        const struct client_journal_entry *entry = elem;
+        struct iter_rename_data *rename = data;
+        if (!utils_path_is_within(entry->name, rename->old_name)) {
+                rename->success = client_journal_record(
+                        rename->renamed, entry->name, entry->changes);
+                return rename->success;
+        }
+
+        char *name;
+        if (asprintf(&name, "%s%s", rename->new_name,
+                     &entry->name[strlen(rename->old_name)])
+            == -1) {
+                log_error("asprintf");
+                rename->success = false;
+                return false;
+        }
+        rename->success = client_journal_record(rename->renamed, name,
+                                                entry->changes);
+        free(name);
+        return rename->success;
+}
+
+bool client_journal_rename(struct client_journal *journal,
+                           const char *old_name, const char *new_name)
+{
+        struct iter_rename_data rename = {
+                .old_name = old_name,
+                .new_name = new_name,
+                .success = true,
+        };
+        // the journal is rebuilt only if it has some of the renamed files
+        generic_list_foreach(&journal->entries, iter_find_renamed, &rename);
+        if (!rename.found)
+                return true;
+
+        struct client_journal renamed;
+        if (!client_journal_create(&renamed))
+                return false;
+        rename.renamed = &renamed;
+        generic_list_foreach(&journal->entries, iter_rename_entry, &rename);
+        if (!rename.success) {
+                client_journal_destroy(&renamed);
+                return false;
+        }
+        renamed.overflowed = journal->overflowed;
+        client_journal_destroy(journal);
+        *journal = renamed;
+        return true;
+}
+
+void client_journal_overflow(struct client_journal *journal)
+{
+        if (!journal->overflowed)
+                syslog(LOG_WARNING, "journal overflowed, the whole folder "
+                                    "will be synchronized");
+        journal->overflowed = true;
+}
+
+void client_journal_foreach(struct client_journal *journal, iter_func func,
+                            void *data)
+{
+        generic_list_foreach(&journal->entries, func, data);
+}
+
+bool client_journal_clear(struct client_journal *journal)
+{
+        client_journal_destroy(journal);
+        return client_journal_create(journal);
+}
+
+static bool iter_free_entry_name(void *elem, void *data)
+{
+        UNUSED(data);
+        const struct client_journal_entry *entry = elem;
+        free(entry->name);
+        return true;
+}
+
+void client_journal_destroy(struct client_journal *journal)
+{
+        generic_list_foreach(&journal->entries, iter_free_entry_name, NULL);
+        generic_list_destroy(&journal->entries);
+        free(journal->slots);
+        journal->slots = NULL;
+        journal->slot_count = 0;
+        journal->count = 0;
+}
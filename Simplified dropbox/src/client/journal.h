@@ -0,0 +1,165 @@
+/**
+ * @file journal.h
+ * @brief Journal of the changed files, e.g. the files changed while the
+ *        client is not connected to the server, so only they are sent
+ *        after the client reconnects.
+ */
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "generic_list.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Maximum number of the files in the journal. When more files change,
+ * the journal overflows and the whole folder is synchronized again.
+ */
+#define CLIENT_JOURNAL_MAX_ENTRIES 4096
+
+/**
+ * Kinds of the changes of a file.
+ */
+enum client_journal_change {
+        CLIENT_JOURNAL_CONTENT = 1 << 0,  /**< created, written or deleted */
+        CLIENT_JOURNAL_METADATA = 1 << 1, /**< only the attributes changed */
+        CLIENT_JOURNAL_CREATED = 1 << 2,  /**< the first change created it */
+};
+
+/**
+ * Request the server needs to get the changed file up to date.
+ */
+enum client_journal_action {
+        CLIENT_JOURNAL_NONE,       /**< nothing, e.g. a temporary file */
+        CLIENT_JOURNAL_CREATE,     /**< send the new file              */
+        CLIENT_JOURNAL_UPDATE,     /**< send the changed file          */
+        CLIENT_JOURNAL_ATTRIBUTES, /**< send only the attributes       */
+        CLIENT_JOURNAL_DELETE,     /**< delete the file                */
+};
+
+/**
+ * The file changed since the connection was lost.
+ */
+struct client_journal_entry {
+        char *name;       /**< name of the file relative to the folder */
+        unsigned changes; /**< enum client_journal_change flags       */
+};
+
+/**
+ * Set of the changed files. Every file is recorded only once with all
+ * of its changes.
+ */
+struct client_journal {
+        generic_list entries; /**< list of struct client_journal_entry   */
+        size_t count;         /**< number of the entries                 */
+        size_t *slots;        /**< open addressing hash table of the
+                                   indexes of the entries + 1, 0 if empty */
+        size_t slot_count;    /**< a power of 2                          */
+        bool overflowed;      /**< some changes were not recorded        */
+};
+
+/**
+ * @brief Creates the empty journal.
+ *
+ * @param[out] journal  pointer to the uninitialized journal
+ * @return              true on success;
+ *                      false otherwise
+ */
+bool client_journal_create(struct client_journal *journal);
+
+/**
+ * Records the change of the file. The changes of the file recorded before
+ * are merged, @c CLIENT_JOURNAL_CREATED is kept only if it is the first
+ * change. When the journal is full, it overflows instead and no more
+ * changes are recorded.
+ *
+ * @param journal  pointer to the journal
+ * @param name     name of the file relative to the folder
+ * @param changes  enum client_journal_change flags
+ * @return         true on success;
+ *                 false otherwise
+ */
+bool client_journal_record(struct client_journal *journal, const char *name,
+                           unsigned changes);
+
+/**
+ * Finds the changes of the file.
+ *
+ * @param journal  pointer to the journal
+ * @param name     name of the file relative to the folder
+ * @return         the entry valid until the journal is changed;
+ *                 NULL if the file did not change
+ */
+const struct client_journal_entry *
+client_journal_find(struct client_journal *journal, const char *name);
+
+/**
+ * Converts the inotify(7) events of the file to the changes. Only
+ * @c IN_CREATE marks the file created, the name was free before it.
+ *
+ * @param mask  mask of the events
+ * @return      enum client_journal_change flags, 0 if nothing changed
+ */
+unsigned client_journal_event_changes(uint32_t mask);
+
+/**
+ * Decides how the server gets the file up to date after all its changes,
+ * e.g. the file created and deleted since needs nothing.
+ *
+ * @param entry   the changed file
+ * @param exists  the file exists now
+ * @return        the request to send
+ */
+enum client_journal_action
+client_journal_action(const struct client_journal_entry *entry, bool exists);
+
+/**
+ * Moves the changes of the renamed file, or of the files in the renamed
+ * directory, to their new names. They are merged with the changes recorded
+ * under the new names before.
+ *
+ * @param journal   pointer to the journal
+ * @param old_name  the old name relative to the folder
+ * @param new_name  the new name relative to the folder
+ * @return          true on success;
+ *                  false otherwise
+ */
+bool client_journal_rename(struct client_journal *journal,
+                           const char *old_name, const char *new_name);
+
+/**
+ * Marks the journal as overflowed, e.g. because some events were lost.
+ *
+ * @param journal  pointer to the journal
+ */
+void client_journal_overflow(struct client_journal *journal);
+
+/**
+ * @brief Iterates through the entries in the order of their first change.
+ *
+ * @param journal  pointer to the journal
+ * @param func     function applied to each struct client_journal_entry
+ * @param data     pointer to a data passed to the @c func
+ */
+void client_journal_foreach(struct client_journal *journal, iter_func func,
+                            void *data);
+
+/**
+ * Forgets all the entries and the overflow.
+ *
+ * @param journal  pointer to the journal
+ * @return         true on success;
+ *                 false otherwise
+ */
+bool client_journal_clear(struct client_journal *journal);
+
+/**
+ * @brief Release all the resource of the @c journal.
+ *
+ * @param journal  pointer to the journal
+ */
+void client_journal_destroy(struct client_journal *journal);
+
+#endif /* JOURNAL_H */
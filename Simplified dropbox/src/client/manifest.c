@@ -0,0 +1,179 @@
+/**
+ * @file manifest.c
+ * @brief Comparison of the files of the SOURCE folder with the files the
+ *        server already has.
+ */
+#include "manifest.h"
+
+#include "helper.h"
+#include "send.h"
+
+#include "hash.h"
+#include "log.h"
+
+#include <endian.h>
+#include <stdlib.h>
+
+#define MIN_SLOT_COUNT 64
+
+static size_t slot_of(const struct client_manifest *manifest, const char *name)
+{
+        return hash_xxh64(strlen(name), name, 0) & (manifest->slot_count - 1);
+}
+
+static size_t next_slot(const struct client_manifest *manifest, size_t slot)
+{
+        return (slot + 1) & (manifest->slot_count - 1);
+}
+
+/**
+ * Finds the slot of the file or the empty slot where it belongs.
+ */
+static struct client_manifest_entry *
+find_slot(const struct client_manifest *manifest, const char *name)
+{
+        size_t slot = slot_of(manifest, name);
+        while (manifest->slots[slot].name != NULL
+               && strcmp(manifest->slots[slot].name, name) != 0)
+                slot = next_slot(manifest, slot);
+        return &manifest->slots[slot];
+}
+
+static bool grow(struct client_manifest *manifest)
+{
+        const size_t old_count = manifest->slot_count;
+        struct client_manifest_entry *old_slots = manifest->slots;
+
+        const size_t slot_count
+                = old_count == 0 ? MIN_SLOT_COUNT : 2 * old_count;
+        struct client_manifest_entry *slots
+                = calloc(slot_count, sizeof(*slots));
+        if (slots == NULL)
+                return false;
+
+        manifest->slots = slots;
+        manifest->slot_count = slot_count;
+        for (size_t i = 0; i < old_count; i++) {
+                if (old_slots[i].name != NULL)
+                        *find_slot(manifest, old_slots[i].name) = old_slots[i];
+        }
+        free(old_slots);
+        return true;
+}
+
+static bool insert(struct client_manifest *manifest,
+                   const struct packet_manifest_entry *entry,
+                   const char *name, size_t name_size)
+{
+        if (2 * (manifest->count + 1) > manifest->slot_count
+            && !grow(manifest))
+                return false;
+
+        char *copy = strndup(name, name_size);
+        if (copy == NULL)
+                return false;
+
+        struct client_manifest_entry *slot = find_slot(manifest, copy);
+        if (slot->name != NULL) {
+                free(slot->name);
+                manifest->count--;
+        }
+        *slot = (struct client_manifest_entry){
+                .name = copy,
+                .size = be64toh(entry->size),
+                .mtim = {
+                        .tv_sec = be64toh(entry->mtime_sec),
+                        .tv_nsec = be64toh(entry->mtime_nsec),
+                },
+                .mode = be64toh(entry->mode),
+        };
+        manifest->count++;
+        return true;
+}
+
+/**
+ * Decodes the payload of MSG_MANIFEST.
+ */
+static bool parse_entries(const struct packet *packet,
+                          struct client_manifest *manifest)
+{
+        size_t offset = 0;
+        while (offset < packet->payload_size) {
+                struct packet_manifest_entry entry;
+                if (packet->payload_size - offset < sizeof(entry))
+                        goto invalid;
+                memcpy(&entry, &packet->payload[offset], sizeof(entry));
+                offset += sizeof(entry);
+
+                const uint64_t name_size = be64toh(entry.name_size);
+                if (name_size == 0 || name_size > packet->payload_size - offset)
+                        goto invalid;
+
+                const char *name = (const char *)&packet->payload[offset];
+                if (memchr(name, '\0', name_size) != NULL)
+                        goto invalid;
+                if (!insert(manifest, &entry, name, name_size)) {
+                        log_error("malloc");
+                        return false;
+                }
+                offset += name_size;
+        }
+        return true;
+invalid:
+        syslog(LOG_ERR, "invalid manifest");
+        return false;
+}
+
+int client_manifest_request(const struct client_traverse_data *data,
+                            struct client_manifest *manifest)
+{
+        *manifest = (struct client_manifest){ 0 };
+        if (!grow(manifest)) {
+                log_error("malloc");
+                return FTW_STOP;
+        }
+
+        syslog(LOG_DEBUG, "MSG_GET_MANIFEST");
+        if (!log_packet_send(data->settings->stream, MSG_GET_MANIFEST, 0, NULL))
+                goto error;
+
+        enum packet_msg_code answer;
+        while ((answer = client_helper_get_answer(data)) == MSG_MANIFEST) {
+                if (!parse_entries(*data->packet_buffptr, manifest))
+                        goto error;
+        }
+        if (!client_helper_check_expected_code(answer, MSG_OK))
+                goto error;
+
+        syslog(LOG_DEBUG, "server has %zu files", manifest->count);
+        return NEXT_STEP;
+error:
+        client_manifest_destroy(manifest);
+        return FTW_STOP;
+}
+
+struct client_manifest_entry *
+client_manifest_find(const struct client_manifest *manifest, const char *name)
+{
+        struct client_manifest_entry *slot = find_slot(manifest, name);
+        return slot->name != NULL ? slot : NULL;
+}
+
+bool client_manifest_is_current(const struct client_manifest_entry *entry,
+                                const struct stat *sb)
+{
+        return entry->size == (uint64_t)sb->st_size
+               && entry->mtim.tv_sec == sb->st_mtim.tv_sec
+               && entry->mtim.tv_nsec == sb->st_mtim.tv_nsec
+               && entry->mode == sb->st_mode;
+}
+
+void client_manifest_destroy(struct client_manifest *manifest)
+{
+        for (size_t i = 0; i < manifest->slot_count; i++)
+                free(manifest->slots[i].name);
+        free(manifest->slots);
+        manifest->slots = NULL;
+        manifest->slot_count = 0;
+        manifest->count = 0;
+}
@@ -0,0 +1,72 @@
+/**
+ * @file manifest.h
+ * @brief Module for comparing the files of the SOURCE folder with the files
+ *        the server already has.
+ */
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include "traverse_data.h"
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+/**
+ * File of the server.
+ */
+struct client_manifest_entry {
+        char *name;            /**< name of the file, NULL for an empty slot */
+        uint64_t size;         /**< size of the file */
+        struct timespec mtim;  /**< time of last modification */
+        mode_t mode;           /**< type and permissions of the file */
+        bool seen;             /**< the file is in the SOURCE folder too */
+};
+
+/**
+ * Files of the server indexed by their names.
+ */
+struct client_manifest {
+        struct client_manifest_entry *slots; /**< open addressing hash table */
+        size_t slot_count;                   /**< a power of 2 */
+        size_t count;                        /**< number of the files */
+};
+
+/**
+ * Asks the server for the list of its files.
+ *
+ * @param data          struct holding data, which are used when traversing a folder
+ * @param[out] manifest the files of the server, which must be freed by
+ *                      client_manifest_destroy() on success
+ * @return              NEXT_STEP on success;
+ *                      FTW_STOP on failure
+ */
+int client_manifest_request(const struct client_traverse_data *data,
+                            struct client_manifest *manifest);
+
+/**
+ * Finds the file of the server.
+ *
+ * @param manifest  the files of the server
+ * @param name      name of the file relative to the SOURCE folder
+ * @return          the file or NULL if the server does not have it
+ */
+struct client_manifest_entry *
+client_manifest_find(const struct client_manifest *manifest, const char *name);
+
+/**
+ * Checks whether the copy of the server is up to date, which is when the
+ * size, the modification time and the mode of both are equal.
+ *
+ * @param entry  the file of the server
+ * @param sb     status of the file in the SOURCE folder
+ * @return       true if the file does not need to be sent
+ */
+bool client_manifest_is_current(const struct client_manifest_entry *entry,
+                                const struct stat *sb);
+
+/**
+ * Frees the files of the server.
+ */
+void client_manifest_destroy(struct client_manifest *manifest);
+
+#endif /* MANIFEST_H */
@@ -0,0 +1,197 @@
+/**
+ * @file readahead.c
+ * @brief Reading of the blocks of the file ahead of the sent one.
+ */
+#include "readahead.h"
+
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct slot {
+        ssize_t size; /**< size of the block, 0 at the end, -1 on failure */
+        int error;    /**< errno of the failed read                       */
+};
+
+struct client_readahead {
+        int fd;
+        off_t offset;          /**< offset of the next block to read       */
+        size_t block_size;
+        size_t depth;
+        unsigned char *buffers;
+        struct slot slots[CLIENT_MAX_READ_AHEAD];
+
+        pthread_t thread;
+        pthread_mutex_t lock;
+        pthread_cond_t filled; /**< the reader filled a slot               */
+        pthread_cond_t freed;  /**< the sender gave a slot back or stops   */
+        size_t head;           /**< blocks taken by the sender             */
+        size_t tail;           /**< blocks filled by the reader            */
+        bool taken;            /**< the sender holds the block of the head */
+        bool stopping;
+};
+
+/**
+ * Reads the whole block unless the file ends.
+ */
+static ssize_t read_block(int fd, off_t offset, size_t size,
+                          unsigned char *buff)
+{
+        size_t done = 0;
+        while (done < size) {
+                const ssize_t rc = pread(fd, buff + done, size - done,
+                                         offset + done);
+                if (rc == -1 && errno == EINTR)
+                        continue;
+                if (rc == -1)
+                        return -1;
+                if (rc == 0)
+                        break;
+                done += rc;
+        }
+        return done;
+}
+
+static void advise(int fd, off_t offset, off_t length, int advice)
+{
+        const int rc = posix_fadvise(fd, offset, length, advice);
+        if (rc != 0) {
+                errno = rc;
+                log_warning("posix_fadvise");
+        }
+}
+
+static void *read_blocks(void *arg)
+{
+        struct client_readahead *ra = arg;
+        bool end = false;
+        while (!end) {
+                pthread_mutex_lock(&ra->lock);
+                while (!ra->stopping && ra->tail - ra->head == ra->depth)
+                        pthread_cond_wait(&ra->freed, &ra->lock);
+                const bool stopping = ra->stopping;
+                pthread_mutex_unlock(&ra->lock);
+                if (stopping)
+                        break;
+
+                // the sender sees the slot only once the tail moves past it
+                const size_t index = ra->tail % ra->depth;
+                struct slot *slot = &ra->slots[index];
+                slot->size = read_block(ra->fd, ra->offset, ra->block_size,
+                                        ra->buffers + index * ra->block_size);
+                slot->error = slot->size == -1 ? errno : 0;
+                end = slot->size <= 0;
+                if (slot->size > 0)
+                        ra->offset += slot->size;
+
+                pthread_mutex_lock(&ra->lock);
+                ra->tail++;
+                pthread_cond_signal(&ra->filled);
+                pthread_mutex_unlock(&ra->lock);
+        }
+        return NULL;
+}
+
+struct client_readahead *client_readahead_start(int fd, off_t offset,
+                                                size_t block_size,
+                                                size_t depth)
+{
+        log_assert(depth > 0 && depth <= CLIENT_MAX_READ_AHEAD);
+        struct client_readahead *ra = calloc(1, sizeof(*ra));
+        if (ra == NULL) {
+                log_error("calloc");
+                return NULL;
+        }
+        ra->fd = fd;
+        ra->offset = offset;
+        ra->block_size = block_size;
+        ra->depth = depth;
+        ra->buffers = malloc(depth * block_size);
+        if (ra->buffers == NULL) {
+                log_error("malloc");
+                goto clean;
+        }
+
+        // doubles the readahead window of the kernel
+        advise(fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+        pthread_mutex_init(&ra->lock, NULL);
+        pthread_cond_init(&ra->filled, NULL);
+        pthread_cond_init(&ra->freed, NULL);
+        const int rc = pthread_create(&ra->thread, NULL, read_blocks, ra);
+        if (rc != 0) {
+                errno = rc;
+                log_error("pthread_create");
+                pthread_cond_destroy(&ra->freed);
+                pthread_cond_destroy(&ra->filled);
+                pthread_mutex_destroy(&ra->lock);
+                goto clean;
+        }
+        return ra;
+clean:
+        free(ra->buffers);
+        free(ra);
+        return NULL;
+}
+
+ssize_t client_readahead_next(struct client_readahead *ra,
+                              const unsigned char **block)
+{
+        pthread_mutex_lock(&ra->lock);
+        if (ra->taken) {
+                ra->head++;
+                ra->taken = false;
+                pthread_cond_signal(&ra->freed);
+        }
+        while (ra->head == ra->tail)
+                pthread_cond_wait(&ra->filled, &ra->lock);
+        ra->taken = true;
+        pthread_mutex_unlock(&ra->lock);
+
+        const size_t index = ra->head % ra->depth;
+        const struct slot *slot = &ra->slots[index];
+        if (slot->size == -1)
+                errno = slot->error;
+        *block = ra->buffers + index * ra->block_size;
+        return slot->size;
+}
+
+void client_readahead_stop(struct client_readahead *ra)
+{
+        if (ra == NULL)
+                return;
+
+        pthread_mutex_lock(&ra->lock);
+        ra->stopping = true;
+        pthread_cond_signal(&ra->freed);
+        pthread_mutex_unlock(&ra->lock);
+
+        pthread_join(ra->thread, NULL);
+        pthread_cond_destroy(&ra->freed);
+        pthread_cond_destroy(&ra->filled);
+        pthread_mutex_destroy(&ra->lock);
+        free(ra->buffers);
+        free(ra);
+}
+
+void client_readahead_advise(int fd, off_t offset, off_t length)
+{
+        if (length > 0)
+                advise(fd, offset, length, POSIX_FADV_WILLNEED);
+}
+
+void client_readahead_prefetch(int dirfd, const char *path, off_t offset,
+                               off_t length)
+{
+        if (length == 0)
+                return;
+        const int fd = openat(dirfd, path, O_RDONLY);
+        if (fd == -1)
+                return;
+        client_readahead_advise(fd, offset, length);
+        if (close(fd) == -1)
+                log_warning("close");
+}
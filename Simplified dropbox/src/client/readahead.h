@@ -0,0 +1,81 @@
+/**
+ * @file readahead.h
+ * @brief Module for reading the blocks of the file ahead in another
+ *        thread, so the disk reads the next blocks while the current one
+ *        is sent.
+ */
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include "client.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Ring of the buffers the reader thread fills with the blocks of the file
+ * in order.
+ */
+struct client_readahead;
+
+/**
+ * Starts the reader thread.
+ *
+ * @param fd          file open for reading; it must not be used until
+ *                    client_readahead_stop()
+ * @param offset      offset of the first block
+ * @param block_size  size of the blocks
+ * @param depth       number of the blocks read ahead, from 1 to
+ *                    CLIENT_MAX_READ_AHEAD
+ * @return            the ring on success;
+ *                    NULL on failure
+ */
+struct client_readahead *client_readahead_start(int fd, off_t offset,
+                                                size_t block_size,
+                                                size_t depth);
+
+/**
+ * Waits for the next block. The previous block is given back to the
+ * reader thread.
+ *
+ * @param readahead  the ring
+ * @param block      the block, valid until the next call
+ * @return           size of the block, smaller than the block size only
+ *                   at the end of the file;
+ *                   0 at the end of the file;
+ *                   -1 on failure and errno is set appropriately
+ */
+ssize_t client_readahead_next(struct client_readahead *readahead,
+                              const unsigned char **block);
+
+/**
+ * Stops the reader thread and frees the ring.
+ *
+ * @param readahead  the ring; may be NULL
+ */
+void client_readahead_stop(struct client_readahead *readahead);
+
+/**
+ * Asks the kernel to read the part of the file into the page cache in the
+ * background.
+ *
+ * @param fd      the file
+ * @param offset  start of the part
+ * @param length  length of the part
+ */
+void client_readahead_advise(int fd, off_t offset, off_t length);
+
+/**
+ * Asks the kernel to read the beginning of the file before it is sent,
+ * e.g. while its metadata are sent.
+ *
+ * @param dirfd   directory of the file
+ * @param path    path of the file relative to @c dirfd
+ * @param offset  offset the file is sent from
+ * @param length  length of the beginning; 0 does nothing
+ */
+void client_readahead_prefetch(int dirfd, const char *path, off_t offset,
+                               off_t length);
+
+#endif //READAHEAD_H
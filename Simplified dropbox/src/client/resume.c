@@ -0,0 +1,86 @@
+/**
+ * @file resume.c
+ * @brief Continuing of the files the server has only a part of.
+ */
+#include "resume.h"
+
+#include "helper.h"
+#include "send.h"
+
+#include "hash.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * Checks whether the first @c checkpoint->offset bytes of the file are the
+ * bytes the server has.
+ */
+static bool verify_prefix(const struct client_traverse_data *data,
+                          const struct packet_payload_resume *checkpoint)
+{
+        if ((uint64_t)data->sb->st_size < checkpoint->offset)
+                return false;
+
+        const int fd = openat(data->settings->dirfd, data->fpath, O_RDONLY);
+        if (fd == -1) {
+                log_warning("openat");
+                return false;
+        }
+        uint64_t hash = 0;
+        const bool hashed = hash_file_prefix(fd, 0, checkpoint->offset, &hash);
+        if (!hashed)
+                log_warning("hash_file_prefix");
+        if (close(fd) == -1)
+                log_warning("close");
+        return hashed && hash == checkpoint->hash;
+}
+
+int client_resume_request(const struct client_traverse_data *data,
+                          off_t *offset)
+{
+        syslog(LOG_DEBUG, "MSG_GET_RESUME: %s", data->fpath);
+        if (!log_packet_send(data->settings->stream, MSG_GET_RESUME,
+                             strlen(data->fpath) + 1,
+                             (const unsigned char *)data->fpath))
+                return FTW_STOP;
+
+        if (!client_helper_check_expected_code(client_helper_get_answer(data),
+                                               MSG_RESUME_OFFSET))
+                return FTW_STOP;
+        const struct packet_payload_resume checkpoint
+                = *(struct packet_payload_resume *)(*data->packet_buffptr)
+                           ->payload;
+        if (!client_helper_check_expected_code(client_helper_get_answer(data),
+                                               MSG_OK))
+                return FTW_STOP;
+
+        if (checkpoint.offset == 0) {
+                syslog(LOG_DEBUG, "no checkpoint of %s", data->fpath);
+                return FTW_CONTINUE;
+        }
+        if (!verify_prefix(data, &checkpoint)) {
+                syslog(LOG_INFO, "%s changed since it was interrupted",
+                       data->fpath);
+                return FTW_CONTINUE;
+        }
+
+        syslog(LOG_DEBUG, "MSG_RESUME_FILE: %lu",
+               (unsigned long)checkpoint.offset);
+        if (!log_packet_send(data->settings->stream, MSG_RESUME_FILE,
+                             sizeof(checkpoint),
+                             (const unsigned char *)&checkpoint))
+                return FTW_STOP;
+
+        const enum packet_msg_code answer = client_helper_get_answer(data);
+        if (answer == MSG_NOK)
+                return FTW_CONTINUE;
+        if (!client_helper_check_expected_code(answer, MSG_OK))
+                return FTW_STOP;
+
+        syslog(LOG_INFO, "resuming %s at %lu", data->fpath,
+               (unsigned long)checkpoint.offset);
+        *offset = checkpoint.offset;
+        return NEXT_STEP;
+}
@@ -0,0 +1,26 @@
+/**
+ * @file resume.h
+ * @brief Module for continuing the files the server has only a part of,
+ *        because the connection was lost while they were sent.
+ */
+#ifndef RESUME_H
+#define RESUME_H
+
+#include "traverse_data.h"
+
+#include <sys/types.h>
+
+/**
+ * Asks the server for the checkpoint of the partial file and continues the
+ * file at it, if the beginning of the file has the hash of the checkpoint.
+ *
+ * @param data         struct holding data, which are used when traversing a folder
+ * @param[out] offset  the offset the rest of the file is sent from
+ * @return             NEXT_STEP if the server continues the file;
+ *                     FTW_CONTINUE if the file cannot be continued;
+ *                     FTW_STOP on failure
+ */
+int client_resume_request(const struct client_traverse_data *data,
+                          off_t *offset);
+
+#endif /* RESUME_H */
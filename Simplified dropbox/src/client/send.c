@@ -1,31 +1,19 @@
 #include "send.h"
 
+#include "dedup.h"
 #include "helper.h"
+#include "readahead.h"
 
+#include "scan.h"
 #include "utils.h"
 #include "log.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdlib.h>
-
-/**
- * Checks if all bytes are null bytes.
- *
- * @param buff  pointer to a memory, which is checked
- * @param size  size of this memory
- * @return      true if all bytes are null bytes;
- *              false if there is one or more not null bytes
- */
-static bool check_null_bytes(const unsigned char *buff, ssize_t size)
-{
-        for (ssize_t i = 0; i < size; i++) {
-                if (buff[i] != 0)
-                        return false;
-        }
-        return true;
-}
+#include <unistd.h>
 
 int client_send_owner(const struct client_traverse_data *data)
 {
@@ -37,7 +25,7 @@ int client_send_owner(const struct client_traverse_data *data)
         syslog(LOG_DEBUG, "MSG_SET_OWNER: uid: %d, gid: %d", payload.uid,
                payload.gid);
 
-        if (!log_packet_send(data->settings->write_fd, MSG_SET_OWNER,
+        if (!log_packet_send(data->settings->stream, MSG_SET_OWNER,
                              sizeof(payload), (const unsigned char *)&payload))
                 return FTW_STOP;
 
@@ -58,7 +46,7 @@ int client_send_permission_modes(const struct client_traverse_data *data)
         };
         syslog(LOG_DEBUG, "MSG_SET_PERM_MODES: %o", payload.mode);
 
-        if (!log_packet_send(data->settings->write_fd, MSG_SET_PERM_MODES,
+        if (!log_packet_send(data->settings->stream, MSG_SET_PERM_MODES,
                              sizeof(payload), (const unsigned char *)&payload))
                 return FTW_STOP;
         int answer = client_helper_get_answer(data);
@@ -83,7 +71,7 @@ int client_send_timestamps(const struct client_traverse_data *data)
                payload.atim.tv_sec, payload.atim.tv_nsec, payload.mtim.tv_sec,
                payload.mtim.tv_nsec);
 
-        if (!log_packet_send(data->settings->write_fd, MSG_SET_TIMESTAMPS,
+        if (!log_packet_send(data->settings->stream, MSG_SET_TIMESTAMPS,
                              sizeof(payload), (const unsigned char *)&payload))
                 return FTW_STOP;
 
@@ -102,7 +90,7 @@ int client_send_delete_file(const struct client_traverse_data *data)
 {
         const char *payload = data->fpath;
         syslog(LOG_DEBUG, "client_send_delete payload: %s", payload);
-        if (!log_packet_send(data->settings->write_fd, MSG_DELETE_FILE,
+        if (!log_packet_send(data->settings->stream, MSG_DELETE_FILE,
                              strlen(payload) + 1,
                              (const unsigned char *)payload))
                 return FTW_STOP;
@@ -118,11 +106,77 @@ int client_send_delete_file(const struct client_traverse_data *data)
         return NEXT_STEP;
 }
 
+/**
+ * Sends the path of the directory and reads the answer.
+ *
+ * @return NEXT_STEP on success;
+ *         FTW_CONTINUE if the server refused it;
+ *         FTW_STOP on failure
+ */
+static int send_dir_request(const struct client_traverse_data *data,
+                            enum packet_msg_code code)
+{
+        const char *payload = data->fpath;
+        syslog(LOG_DEBUG, "%s directory: %s",
+               code == MSG_CREATE_DIR ? "create" : "delete", payload);
+        if (!log_packet_send(data->settings->stream, code,
+                             strlen(payload) + 1,
+                             (const unsigned char *)payload))
+                return FTW_STOP;
+        const int answer = client_helper_get_answer(data);
+        if (answer == MSG_NOK) {
+                syslog(LOG_WARNING, "server refused directory %s", payload);
+                return FTW_CONTINUE;
+        }
+        if (!client_helper_check_expected_code(answer, MSG_OK))
+                return FTW_STOP;
+        return NEXT_STEP;
+}
+
+int client_send_create_dir(const struct client_traverse_data *data)
+{
+        return send_dir_request(data, MSG_CREATE_DIR);
+}
+
+int client_send_delete_dir(const struct client_traverse_data *data)
+{
+        return send_dir_request(data, MSG_DELETE_DIR);
+}
+
+int client_send_rename(const struct client_traverse_data *data,
+                       const char *new_path)
+{
+        const size_t old_size = strlen(data->fpath) + 1;
+        const size_t new_size = strlen(new_path) + 1;
+        unsigned char *payload = malloc(old_size + new_size);
+        if (payload == NULL) {
+                log_error("malloc");
+                return FTW_STOP;
+        }
+        memcpy(payload, data->fpath, old_size);
+        memcpy(&payload[old_size], new_path, new_size);
+
+        syslog(LOG_DEBUG, "MSG_RENAME: %s to %s", data->fpath, new_path);
+        const bool sent = log_packet_send(data->settings->stream, MSG_RENAME,
+                                          old_size + new_size, payload);
+        free(payload);
+        if (!sent)
+                return FTW_STOP;
+        const int answer = client_helper_get_answer(data);
+        if (answer == MSG_NOK) {
+                syslog(LOG_DEBUG, "server refused to rename %s", data->fpath);
+                return FTW_CONTINUE;
+        }
+        if (!client_helper_check_expected_code(answer, MSG_OK))
+                return FTW_STOP;
+        return NEXT_STEP;
+}
+
 int client_send_create_file(const struct client_traverse_data *data,
                             const char *file_path)
 {
         syslog(LOG_DEBUG, "MSG_CREATE_FILE: %s", file_path);
-        if (!log_packet_send(data->settings->write_fd, MSG_CREATE_FILE,
+        if (!log_packet_send(data->settings->stream, MSG_CREATE_FILE,
                              strlen(file_path) + 1,
                              (const unsigned char *)file_path))
                 return FTW_STOP;
@@ -138,33 +192,332 @@ int client_send_create_file(const struct client_traverse_data *data,
         return NEXT_STEP;
 }
 
+int client_send_file_size(const struct client_traverse_data *data)
+{
+        const struct settings *settings = data->settings;
+        if (!(settings->features & PACKET_FEATURE_PREALLOC)
+            || (uint64_t)data->sb->st_size <= settings->chunk_size)
+                return NEXT_STEP;
+
+        const struct packet_payload_file_size payload = {
+                .size = data->sb->st_size,
+                .sparse = settings->sparse,
+        };
+        syslog(LOG_DEBUG, "MSG_FILE_SIZE: %ld", (long)data->sb->st_size);
+        if (!log_packet_send(settings->stream, MSG_FILE_SIZE, sizeof(payload),
+                             (const unsigned char *)&payload))
+                return FTW_STOP;
+        if (!client_helper_check_expected_code(client_helper_get_answer(data),
+                                               MSG_OK))
+                return FTW_STOP;
+        return NEXT_STEP;
+}
+
+/**
+ * Waits for acknowledgements until at most @c max_in_flight blocks
+ * remain unacknowledged.
+ *
+ * @param data           struct holding data, which are used when traversing a folder
+ * @param window         counters of the blocks sent and acknowledged
+ * @param max_in_flight  number of the blocks allowed to stay unacknowledged
+ * @return               true on success;
+ *                       false on failure
+ */
+static bool wait_for_acks(const struct client_traverse_data *data,
+                          struct client_block_window *window,
+                          uint64_t max_in_flight)
+{
+        while (window->sent - window->acked > max_in_flight) {
+                uint64_t block_count;
+                if (!client_helper_get_ack(data, &block_count))
+                        return false;
+
+                if (block_count < window->acked || block_count > window->sent) {
+                        syslog(LOG_ERR, "invalid acknowledgement: %lu",
+                               (unsigned long)block_count);
+                        return false;
+                }
+                window->acked = block_count;
+        }
+        return true;
+}
+
+/**
+ * Waits for the server to answer the block. Without window every block
+ * is answered, otherwise the blocks are acknowledged cumulatively when the
+ * window is full.
+ */
+static bool wait_for_answer(const struct client_traverse_data *data,
+                            struct client_block_window *window)
+{
+        const uint64_t window_size = data->settings->window_size;
+        if (window_size > 0)
+                return wait_for_acks(data, window, window_size - 1);
+
+        const int answer = client_helper_get_answer(data);
+        if (!client_helper_check_expected_code(answer, MSG_OK))
+                return false;
+        window->acked = window->sent;
+        return true;
+}
+
+bool client_send_data_block(const struct client_traverse_data *data,
+                            enum packet_msg_code code, size_t size,
+                            const unsigned char *payload,
+                            struct client_block_window *window)
+{
+        if (!log_packet_send(data->settings->stream, code, size, payload))
+                return false;
+        window->sent++;
+
+        return wait_for_answer(data, window);
+}
+
+bool client_send_wait_for_all_acks(const struct client_traverse_data *data,
+                                   struct client_block_window *window)
+{
+        return wait_for_acks(data, window, 0);
+}
+
+static bool send_block(const struct client_traverse_data *data, size_t size,
+                       const unsigned char *buff,
+                       struct client_block_window *window)
+{
+        syslog(LOG_DEBUG, "MSG_WRITE_BLOCK: %zu", size);
+        return client_send_data_block(data, MSG_WRITE_BLOCK, size, buff,
+                                      window);
+}
+
+/**
+ * Sends the chunk by the runs of non-null filesystem blocks. Each null
+ * block is sent as an empty block, which the server skips.
+ */
+static bool send_sparse_chunk(const struct client_traverse_data *data,
+                              size_t size, const unsigned char *chunk,
+                              struct client_block_window *window)
+{
+        const size_t block_size = data->settings->fs_block_size;
+        size_t run_begin = 0;
+        for (size_t offset = 0; offset < size; offset += block_size) {
+                const size_t len = size - offset < block_size ? size - offset
+                                                              : block_size;
+                if (!scan_zero(len, &chunk[offset]))
+                        continue;
+
+                if (offset > run_begin
+                    && !send_block(data, offset - run_begin, &chunk[run_begin],
+                                   window))
+                        return false;
+                if (!send_block(data, 0, NULL, window))
+                        return false;
+                run_begin = offset + len;
+        }
+
+        return run_begin == size
+               || send_block(data, size - run_begin, &chunk[run_begin],
+                             window);
+}
+
 static bool sending(const struct client_traverse_data *data, int fd,
                     unsigned char *read_buff)
 {
         ssize_t size;
+        struct client_block_window window = { 0 };
         syslog(LOG_DEBUG, "start reading blocks from %s", data->fpath);
-        while ((size = utils_read(fd, data->settings->fs_block_size, read_buff))
+        while ((size = utils_read(fd, data->settings->chunk_size, read_buff))
                > 0) {
-                syslog(LOG_DEBUG, "MSG_WRITE_BLOCK: %ld", size);
+                if (!send_sparse_chunk(data, size, read_buff, &window))
+                        return false;
+        }
+        if (size == -1)
+                log_error("utils_read");
 
-                if (data->settings->sparse && check_null_bytes(read_buff, size))
-                        size = 0;
+        if (!client_send_wait_for_all_acks(data, &window))
+                return false;
 
-                if (!log_packet_send(data->settings->write_fd, MSG_WRITE_BLOCK,
-                                     size, (const unsigned char *)read_buff))
-                        return false;
+        syslog(LOG_DEBUG, "send blocks success");
+        return true;
+}
 
-                const int answer = client_helper_get_answer(data);
-                if (!client_helper_check_expected_code(answer, MSG_OK))
+/**
+ * Sends the chunks read ahead by the reader thread, so the disk reads the
+ * next chunks while the current one is sent.
+ *
+ * @param data       struct holding data, which are used when traversing a folder
+ * @param readahead  the chunks of the file
+ * @return           true on success;
+ *                   false on failure
+ */
+static bool sending_read_ahead(const struct client_traverse_data *data,
+                               struct client_readahead *readahead)
+{
+        ssize_t size;
+        const unsigned char *chunk;
+        struct client_block_window window = { 0 };
+        syslog(LOG_DEBUG, "start reading blocks ahead from %s", data->fpath);
+        while ((size = client_readahead_next(readahead, &chunk)) > 0) {
+                if (!send_sparse_chunk(data, size, chunk, &window))
                         return false;
         }
         if (size == -1)
-                log_error("utils_read");
+                log_error("read ahead");
+
+        if (!client_send_wait_for_all_acks(data, &window))
+                return false;
 
         syslog(LOG_DEBUG, "send blocks success");
         return true;
 }
 
+/**
+ * Sends the blocks of the part of the file straight from the file to the
+ * server without copying them into the user space.
+ *
+ * @param data    struct holding data, which are used when traversing a folder
+ * @param fd      file descriptor of the file open for reading
+ * @param offset  start of the part
+ * @param end     end of the part
+ * @param window  counters of the blocks sent and acknowledged
+ * @return        true on success;
+ *                false on failure
+ */
+static bool send_range(const struct client_traverse_data *data, int fd,
+                       off_t offset, off_t end,
+                       struct client_block_window *window)
+{
+        const off_t block_size = data->settings->chunk_size;
+        // the kernel reads the blocks ahead while the current one is sent
+        const off_t ahead = data->settings->read_ahead * block_size;
+        for (; offset < end; offset += block_size) {
+                const off_t size = end - offset < block_size ? end - offset
+                                                             : block_size;
+                if (ahead > 0 && offset + ahead < end)
+                        client_readahead_advise(fd, offset + ahead,
+                                                block_size);
+                syslog(LOG_DEBUG, "MSG_WRITE_BLOCK: %ld", (long)size);
+
+                if (!log_packet_send_file(data->settings->stream,
+                                          MSG_WRITE_BLOCK, size, fd, offset))
+                        return false;
+                window->sent++;
+
+                if (!wait_for_answer(data, window))
+                        return false;
+        }
+        return true;
+}
+
+/**
+ * Sends the blocks straight from the file to the server, starting at the
+ * offset the file is sent from. The holes aren't detected, so it is used
+ * only when the sparse flag isn't set.
+ *
+ * @param data       struct holding data, which are used when traversing a folder
+ * @param fd         file descriptor of the file open for reading
+ * @param file_size  size of the file
+ * @return           true on success;
+ *                   false on failure
+ */
+static bool sending_zero_copy(const struct client_traverse_data *data, int fd,
+                              off_t file_size)
+{
+        struct client_block_window window = { 0 };
+        syslog(LOG_DEBUG, "start sending blocks from %s", data->fpath);
+        if (!send_range(data, fd, data->offset, file_size, &window)
+            || !client_send_wait_for_all_acks(data, &window))
+                return false;
+
+        syslog(LOG_DEBUG, "send blocks success");
+        return true;
+}
+
+static bool send_hole(const struct client_traverse_data *data, off_t size,
+                      struct client_block_window *window)
+{
+        const struct packet_payload_hole payload = { .size = size };
+        syslog(LOG_DEBUG, "MSG_WRITE_HOLE: %ld", (long)size);
+        return client_send_data_block(data, MSG_WRITE_HOLE, sizeof(payload),
+                                      (const unsigned char *)&payload, window);
+}
+
+/**
+ * Finds the next data of the file by lseek(2).
+ *
+ * @return the offset of the data;
+ *         @c file_size if only a hole follows
+ */
+static off_t seek_data(int fd, off_t offset, off_t file_size)
+{
+        const off_t data = lseek(fd, offset, SEEK_DATA);
+        if (data != -1)
+                return data < file_size ? data : file_size;
+        if (errno == ENXIO)
+                return file_size;
+        // the filesystem does not tell the holes, the rest is data
+        log_warning("lseek");
+        return offset;
+}
+
+/**
+ * Sends the extents of data straight from the file and every hole between
+ * them as its size, so the holes are neither read nor scanned. The file
+ * ending with a hole gets its whole size on the server.
+ *
+ * @param data  struct holding data, which are used when traversing a folder
+ * @param fd    file descriptor of the file open for reading
+ * @return      true on success;
+ *              false on failure
+ */
+static bool sending_extents(const struct client_traverse_data *data, int fd)
+{
+        struct stat sb;
+        if (fstat(fd, &sb) == -1) {
+                log_error("fstat");
+                return false;
+        }
+
+        struct client_block_window window = { 0 };
+        syslog(LOG_DEBUG, "start sending extents from %s", data->fpath);
+        off_t offset = data->offset;
+        while (offset < sb.st_size) {
+                const off_t data_start = seek_data(fd, offset, sb.st_size);
+                if (data_start > offset
+                    && !send_hole(data, data_start - offset, &window))
+                        return false;
+                if (data_start == sb.st_size)
+                        break;
+
+                off_t data_end = lseek(fd, data_start, SEEK_HOLE);
+                if (data_end == -1 || data_end > sb.st_size)
+                        data_end = sb.st_size;
+                if (!send_range(data, fd, data_start, data_end, &window))
+                        return false;
+                offset = data_end;
+        }
+        if (!client_send_wait_for_all_acks(data, &window))
+                return false;
+
+        syslog(LOG_DEBUG, "send extents success");
+        return true;
+}
+
+/**
+ * Sends the file without detecting the null blocks, only by the chunks the
+ * server misses if it supports it.
+ */
+static bool sending_whole_file(const struct client_traverse_data *data, int fd)
+{
+        struct stat sb;
+        if (fstat(fd, &sb) == -1) {
+                log_error("fstat");
+                return false;
+        }
+
+        if (client_dedup_usable(data, sb.st_size - data->offset))
+                return client_dedup_send_blocks(data, fd);
+        return sending_zero_copy(data, fd, sb.st_size);
+}
+
 int client_send_blocks(const struct client_traverse_data *data)
 {
         syslog(LOG_DEBUG, "opening %s for reading", data->fpath);
@@ -174,9 +527,37 @@ int client_send_blocks(const struct client_traverse_data *data)
                 return NEXT_STEP;
         }
         log_assert(data->settings->fs_block_size > 0);
+        log_assert(data->settings->chunk_size >= data->settings->fs_block_size);
 
         int result = FTW_STOP;
-        unsigned char *read_buff = malloc(data->settings->fs_block_size);
+        if (data->offset > 0 && lseek(fd, data->offset, SEEK_SET) == -1) {
+                log_error("lseek");
+                goto clean_fd;
+        }
+        if (!data->settings->sparse) {
+                if (sending_whole_file(data, fd))
+                        result = NEXT_STEP;
+                goto clean_fd;
+        }
+        if (data->settings->features & PACKET_FEATURE_HOLES) {
+                if (sending_extents(data, fd))
+                        result = NEXT_STEP;
+                goto clean_fd;
+        }
+
+        struct client_readahead *readahead = NULL;
+        if (data->settings->read_ahead > 0)
+                readahead = client_readahead_start(fd, data->offset,
+                                                   data->settings->chunk_size,
+                                                   data->settings->read_ahead);
+        if (readahead != NULL) {
+                if (sending_read_ahead(data, readahead))
+                        result = NEXT_STEP;
+                client_readahead_stop(readahead);
+                goto clean_fd;
+        }
+
+        unsigned char *read_buff = malloc(data->settings->chunk_size);
         if (read_buff == NULL) {
                 log_error("malloc");
                 goto clean_fd;
@@ -204,7 +585,7 @@ clean_fd:
 int client_send_done(const struct client_traverse_data *data)
 {
         syslog(LOG_DEBUG, "MSG_DONE");
-        if (!log_packet_send(data->settings->write_fd, MSG_DONE, 0, NULL))
+        if (!log_packet_send(data->settings->stream, MSG_DONE, 0, NULL))
                 return FTW_STOP;
 
         syslog(LOG_DEBUG, "send done success");
@@ -31,6 +31,23 @@ int client_send_timestamps(const struct client_traverse_data *data);
 /** Sends name of file to delete. */
 int client_send_delete_file(const struct client_traverse_data *data);
 
+/** Sends path of the directory @c data->fpath to create. */
+int client_send_create_dir(const struct client_traverse_data *data);
+
+/** Sends path of the directory @c data->fpath to delete with its content. */
+int client_send_delete_dir(const struct client_traverse_data *data);
+
+/**
+ * Sends the old path @c data->fpath and the new path of the renamed file
+ * or directory.
+ *
+ * @return NEXT_STEP if the server renamed it;
+ *         FTW_CONTINUE if the server refused it;
+ *         FTW_STOP on failure
+ */
+int client_send_rename(const struct client_traverse_data *data,
+                       const char *new_path);
+
 /**
  * Sends information about creating of the file.
  *
@@ -39,10 +56,53 @@ int client_send_delete_file(const struct client_traverse_data *data);
 int client_send_create_file(const struct client_traverse_data *data,
                             const char *file_path);
 
+/**
+ * Sends the size of the created file, so the server allocates it at once.
+ * The file of at most one chunk is written at once anyway and the server
+ * without @c PACKET_FEATURE_PREALLOC does not take the size, so nothing is
+ * sent for them.
+ */
+int client_send_file_size(const struct client_traverse_data *data);
+
 /** Sends blocks to server of predefined size */
 int client_send_blocks(const struct client_traverse_data *data);
 
 /** Sends done message to a server. */
 int client_send_done(const struct client_traverse_data *data);
 
+/**
+ * Counters of the data blocks of the current file.
+ */
+struct client_block_window {
+        uint64_t sent;  /**< number of the blocks sent */
+        uint64_t acked; /**< number of the blocks acknowledged */
+};
+
+/**
+ * Sends a packet with data of the file, i.e. MSG_WRITE_BLOCK or
+ * MSG_COPY_BLOCKS, and waits for the server as the negotiated window
+ * requires.
+ *
+ * @param code     a message code of the packet
+ * @param size     a size of the payload
+ * @param payload  a pointer to the payload
+ * @param window   counters of the blocks of the current file
+ * @return         true on success;
+ *                 false on failure
+ */
+bool client_send_data_block(const struct client_traverse_data *data,
+                            enum packet_msg_code code, size_t size,
+                            const unsigned char *payload,
+                            struct client_block_window *window);
+
+/**
+ * Waits until the server acknowledges all blocks of the current file.
+ *
+ * @param window   counters of the blocks of the current file
+ * @return         true on success;
+ *                 false on failure
+ */
+bool client_send_wait_for_all_acks(const struct client_traverse_data *data,
+                                   struct client_block_window *window);
+
 #endif //SEND_H
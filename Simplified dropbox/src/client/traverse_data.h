@@ -24,6 +24,7 @@ struct client_traverse_data {
         struct stat *sb;
         const struct FTW *ftwbuf;
         int fd;
+        off_t offset; /**< offset the blocks of the file are sent from */
 };
 
 #endif //TRAVERSE_DATA_H
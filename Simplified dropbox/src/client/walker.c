@@ -0,0 +1,481 @@
+/**
+ * @file walker.c
+ * @brief Scanning of the SOURCE folder in several threads.
+ */
+#include "walker.h"
+
+#include "log.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysmacros.h>
+#include <syslog.h>
+#include <unistd.h>
+
+/** entries found but not taken by the sender yet */
+#define WALKER_QUEUE_SIZE 1024
+/** buffer of getdents64(2) */
+#define WALKER_DENTS_SIZE (32 * 1024)
+/** initial capacity of the deque of a thread */
+#define WALKER_MIN_JOBS 16
+
+/**
+ * Directories found by one thread, which scans the newest one and the
+ * other threads steal the oldest one.
+ */
+struct deque {
+        pthread_mutex_t lock;
+        char **paths;
+        size_t capacity; /**< a power of 2 */
+        size_t head;     /**< oldest directory, taken by the thieves */
+        size_t tail;     /**< after the newest directory, taken by the owner */
+};
+
+struct worker {
+        struct client_walker *walker;
+        size_t index;
+        pthread_t thread;
+        struct deque deque;
+};
+
+struct client_walker {
+        int dirfd;
+        bool recursive;
+        size_t thread_count;   /**< threads whose deques are stolen from    */
+        size_t started;        /**< threads to join                         */
+        struct worker workers[CLIENT_MAX_SCANNERS];
+
+        pthread_mutex_t lock;
+        pthread_cond_t work;   /**< a directory was queued or the scan ends */
+        size_t queued;         /**< directories in the deques, atomic       */
+        size_t pending;        /**< directories not scanned yet, atomic     */
+        bool stopping;         /**< the sender stops the scan               */
+        bool failed;           /**< a thread failed, guarded by the lock    */
+
+        pthread_cond_t filled; /**< an entry was found or a thread ended    */
+        pthread_cond_t freed;  /**< the sender took an entry or stops       */
+        struct client_walker_entry entries[WALKER_QUEUE_SIZE];
+        size_t head;           /**< entries taken by the sender             */
+        size_t tail;           /**< entries found by the threads            */
+        size_t running;        /**< threads still scanning                  */
+};
+
+static bool deque_push(struct deque *deque, char *path)
+{
+        pthread_mutex_lock(&deque->lock);
+        if (deque->tail - deque->head == deque->capacity) {
+                const size_t capacity = deque->capacity == 0
+                                                ? WALKER_MIN_JOBS
+                                                : 2 * deque->capacity;
+                char **paths = malloc(capacity * sizeof(*paths));
+                if (paths == NULL) {
+                        pthread_mutex_unlock(&deque->lock);
+                        return false;
+                }
+                for (size_t i = deque->head; i != deque->tail; i++)
+                        paths[i & (capacity - 1)]
+                                = deque->paths[i & (deque->capacity - 1)];
+                free(deque->paths);
+                deque->paths = paths;
+                deque->capacity = capacity;
+        }
+        deque->paths[deque->tail++ & (deque->capacity - 1)] = path;
+        pthread_mutex_unlock(&deque->lock);
+        return true;
+}
+
+static char *deque_pop(struct deque *deque)
+{
+        char *path = NULL;
+        pthread_mutex_lock(&deque->lock);
+        if (deque->head != deque->tail)
+                path = deque->paths[--deque->tail & (deque->capacity - 1)];
+        pthread_mutex_unlock(&deque->lock);
+        return path;
+}
+
+static char *deque_steal(struct deque *deque)
+{
+        char *path = NULL;
+        pthread_mutex_lock(&deque->lock);
+        if (deque->head != deque->tail)
+                path = deque->paths[deque->head++ & (deque->capacity - 1)];
+        pthread_mutex_unlock(&deque->lock);
+        return path;
+}
+
+static void deque_destroy(struct deque *deque)
+{
+        for (size_t i = deque->head; i != deque->tail; i++)
+                free(deque->paths[i & (deque->capacity - 1)]);
+        free(deque->paths);
+        pthread_mutex_destroy(&deque->lock);
+}
+
+/**
+ * Stops the scan because the thread failed, unless the sender stopped it.
+ */
+static void fail(struct client_walker *walker)
+{
+        pthread_mutex_lock(&walker->lock);
+        if (!walker->stopping) {
+                walker->failed = true;
+                walker->stopping = true;
+                pthread_cond_broadcast(&walker->work);
+                pthread_cond_broadcast(&walker->freed);
+        }
+        pthread_mutex_unlock(&walker->lock);
+}
+
+/**
+ * Queues the directory to be scanned by the worker or a thief.
+ */
+static bool push_dir(struct worker *worker, char *path)
+{
+        struct client_walker *walker = worker->walker;
+        __atomic_add_fetch(&walker->pending, 1, __ATOMIC_SEQ_CST);
+        if (!deque_push(&worker->deque, path)) {
+                log_error("malloc");
+                __atomic_sub_fetch(&walker->pending, 1, __ATOMIC_SEQ_CST);
+                return false;
+        }
+        __atomic_add_fetch(&walker->queued, 1, __ATOMIC_SEQ_CST);
+
+        // the lock orders the wake up after the check of a sleeping thread
+        pthread_mutex_lock(&walker->lock);
+        pthread_cond_signal(&walker->work);
+        pthread_mutex_unlock(&walker->lock);
+        return true;
+}
+
+static char *take_dir(struct worker *worker)
+{
+        struct client_walker *walker = worker->walker;
+        char *path = deque_pop(&worker->deque);
+        const size_t count = walker->thread_count;
+        for (size_t i = 1; path == NULL && i < count; i++) {
+                const size_t victim = (worker->index + i) % count;
+                path = deque_steal(&walker->workers[victim].deque);
+        }
+        if (path != NULL)
+                __atomic_sub_fetch(&walker->queued, 1, __ATOMIC_SEQ_CST);
+        return path;
+}
+
+/**
+ * Waits for the next directory to scan.
+ *
+ * @return the path of the directory;
+ *         NULL when the whole tree is scanned or the scan stops
+ */
+static char *next_dir(struct worker *worker)
+{
+        struct client_walker *walker = worker->walker;
+        while (true) {
+                char *path = take_dir(worker);
+                if (path != NULL)
+                        return path;
+
+                pthread_mutex_lock(&walker->lock);
+                while (!walker->stopping
+                       && __atomic_load_n(&walker->queued, __ATOMIC_SEQ_CST)
+                                  == 0
+                       && __atomic_load_n(&walker->pending, __ATOMIC_SEQ_CST)
+                                  > 0)
+                        pthread_cond_wait(&walker->work, &walker->lock);
+                const bool end
+                        = walker->stopping
+                          || __atomic_load_n(&walker->pending, __ATOMIC_SEQ_CST)
+                                     == 0;
+                pthread_mutex_unlock(&walker->lock);
+                if (end)
+                        return NULL;
+        }
+}
+
+static void finish_dir(struct client_walker *walker)
+{
+        if (__atomic_sub_fetch(&walker->pending, 1, __ATOMIC_SEQ_CST) > 0)
+                return;
+        pthread_mutex_lock(&walker->lock);
+        pthread_cond_broadcast(&walker->work);
+        pthread_mutex_unlock(&walker->lock);
+}
+
+/**
+ * Hands the entry over to the sender, waits while the queue is full.
+ *
+ * @return false if the scan stops, the path is freed then
+ */
+static bool emit(struct client_walker *walker, char *path,
+                 const struct stat *sb)
+{
+        pthread_mutex_lock(&walker->lock);
+        while (!walker->stopping
+               && walker->tail - walker->head == WALKER_QUEUE_SIZE)
+                pthread_cond_wait(&walker->freed, &walker->lock);
+        const bool stopping = walker->stopping;
+        if (!stopping) {
+                walker->entries[walker->tail++ % WALKER_QUEUE_SIZE]
+                        = (struct client_walker_entry){
+                                .path = path,
+                                .sb = *sb,
+                        };
+                pthread_cond_signal(&walker->filled);
+        }
+        pthread_mutex_unlock(&walker->lock);
+        if (stopping)
+                free(path);
+        return !stopping;
+}
+
+static void statx_to_stat(const struct statx *stx, struct stat *sb)
+{
+        *sb = (struct stat){
+                .st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor),
+                .st_ino = stx->stx_ino,
+                .st_mode = stx->stx_mode,
+                .st_nlink = stx->stx_nlink,
+                .st_uid = stx->stx_uid,
+                .st_gid = stx->stx_gid,
+                .st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor),
+                .st_size = stx->stx_size,
+                .st_blksize = stx->stx_blksize,
+                .st_blocks = stx->stx_blocks,
+                .st_atim = { stx->stx_atime.tv_sec, stx->stx_atime.tv_nsec },
+                .st_mtim = { stx->stx_mtime.tv_sec, stx->stx_mtime.tv_nsec },
+                .st_ctim = { stx->stx_ctime.tv_sec, stx->stx_ctime.tv_nsec },
+        };
+}
+
+static bool stat_entry(int dirfd, const char *name, struct stat *sb)
+{
+        struct statx stx;
+        if (statx(dirfd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_SYNC_AS_STAT,
+                  STATX_BASIC_STATS, &stx)
+            == 0) {
+                statx_to_stat(&stx, sb);
+                return true;
+        }
+        return errno == ENOSYS
+               && fstatat(dirfd, name, sb, AT_SYMLINK_NOFOLLOW) == 0;
+}
+
+/**
+ * Emits the entry of the scanned directory and queues it if it is a
+ * directory.
+ *
+ * @return false if the scan stops
+ */
+static bool visit(struct worker *worker, int dirfd, const char *dir,
+                  const struct dirent64 *dirent)
+{
+        struct client_walker *walker = worker->walker;
+        const char *name = dirent->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+                return true;
+        if (dirent->d_type != DT_REG && dirent->d_type != DT_UNKNOWN
+            && !(walker->recursive && dirent->d_type == DT_DIR))
+                return true;
+
+        struct stat sb;
+        // the file was removed meanwhile
+        if (!stat_entry(dirfd, name, &sb))
+                return true;
+        if (!S_ISREG(sb.st_mode)
+            && !(walker->recursive && S_ISDIR(sb.st_mode)))
+                return true;
+
+        char *path = NULL;
+        if (asprintf(&path, *dir == '\0' ? "%s%s" : "%s/%s", dir, name)
+            == -1) {
+                log_error("asprintf");
+                return false;
+        }
+        if (!S_ISDIR(sb.st_mode))
+                return emit(walker, path, &sb);
+
+        // the directory is found before its content
+        char *job = strdup(path);
+        if (job == NULL) {
+                log_error("strdup");
+                free(path);
+                return false;
+        }
+        if (!emit(walker, path, &sb)) {
+                free(job);
+                return false;
+        }
+        if (!push_dir(worker, job)) {
+                free(job);
+                return false;
+        }
+        return true;
+}
+
+/**
+ * Reads the entries of the directory.
+ *
+ * @return false if the scan stops
+ */
+static bool scan_dir(struct worker *worker, const char *dir,
+                     unsigned char *buffer)
+{
+        const int fd = openat(worker->walker->dirfd, *dir == '\0' ? "." : dir,
+                              O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd == -1) {
+                syslog(LOG_WARNING, "cannot read folder %s: %s", dir,
+                       strerror(errno));
+                return true;
+        }
+
+        bool success = true;
+        ssize_t size;
+        while (success
+               && (size = getdents64(fd, buffer, WALKER_DENTS_SIZE)) > 0) {
+                for (ssize_t offset = 0; success && offset < size;) {
+                        const struct dirent64 *dirent
+                                = (const struct dirent64 *)&buffer[offset];
+                        success = visit(worker, fd, dir, dirent);
+                        offset += dirent->d_reclen;
+                }
+        }
+        if (success && size == -1)
+                syslog(LOG_WARNING, "cannot read folder %s: %s", dir,
+                       strerror(errno));
+        if (close(fd) == -1)
+                log_warning("close");
+        return success;
+}
+
+static void *walk(void *arg)
+{
+        struct worker *worker = arg;
+        struct client_walker *walker = worker->walker;
+        unsigned char *buffer = malloc(WALKER_DENTS_SIZE);
+        if (buffer == NULL) {
+                log_error("malloc");
+                fail(walker);
+        }
+
+        char *dir;
+        while (buffer != NULL && (dir = next_dir(worker)) != NULL) {
+                const bool success = scan_dir(worker, dir, buffer);
+                free(dir);
+                finish_dir(walker);
+                if (!success)
+                        fail(walker);
+        }
+        free(buffer);
+
+        pthread_mutex_lock(&walker->lock);
+        walker->running--;
+        pthread_cond_signal(&walker->filled);
+        pthread_mutex_unlock(&walker->lock);
+        return NULL;
+}
+
+struct client_walker *client_walker_start(int dirfd, const char *dir,
+                                          size_t threads, bool recursive)
+{
+        log_assert(threads > 0 && threads <= CLIENT_MAX_SCANNERS);
+        struct client_walker *walker = calloc(1, sizeof(*walker));
+        if (walker == NULL) {
+                log_error("calloc");
+                return NULL;
+        }
+        walker->dirfd = dirfd;
+        walker->recursive = recursive;
+        walker->thread_count = threads;
+        pthread_mutex_init(&walker->lock, NULL);
+        pthread_cond_init(&walker->work, NULL);
+        pthread_cond_init(&walker->filled, NULL);
+        pthread_cond_init(&walker->freed, NULL);
+        for (size_t i = 0; i < threads; i++) {
+                walker->workers[i].walker = walker;
+                walker->workers[i].index = i;
+                pthread_mutex_init(&walker->workers[i].deque.lock, NULL);
+        }
+
+        char *root = strdup(dir);
+        if (root == NULL) {
+                log_error("strdup");
+                goto error;
+        }
+        if (!push_dir(&walker->workers[0], root)) {
+                free(root);
+                goto error;
+        }
+
+        for (; walker->started < threads; walker->started++) {
+                struct worker *worker = &walker->workers[walker->started];
+                pthread_mutex_lock(&walker->lock);
+                walker->running++;
+                pthread_mutex_unlock(&walker->lock);
+                const int rc
+                        = pthread_create(&worker->thread, NULL, walk, worker);
+                if (rc != 0) {
+                        errno = rc;
+                        log_error("pthread_create");
+                        pthread_mutex_lock(&walker->lock);
+                        walker->running--;
+                        pthread_mutex_unlock(&walker->lock);
+                        break;
+                }
+        }
+        if (walker->started == 0)
+                goto error;
+        // the threads started so far scan the whole tree
+        syslog(LOG_DEBUG, "%zu threads scanning '%s'", walker->started, dir);
+        return walker;
+error:
+        client_walker_stop(walker);
+        return NULL;
+}
+
+int client_walker_next(struct client_walker *walker,
+                       struct client_walker_entry *entry)
+{
+        pthread_mutex_lock(&walker->lock);
+        while (walker->head == walker->tail && walker->running > 0)
+                pthread_cond_wait(&walker->filled, &walker->lock);
+
+        int result = walker->failed ? -1 : 0;
+        if (walker->head != walker->tail) {
+                *entry = walker->entries[walker->head++ % WALKER_QUEUE_SIZE];
+                pthread_cond_signal(&walker->freed);
+                result = 1;
+        }
+        pthread_mutex_unlock(&walker->lock);
+        return result;
+}
+
+void client_walker_stop(struct client_walker *walker)
+{
+        if (walker == NULL)
+                return;
+
+        pthread_mutex_lock(&walker->lock);
+        walker->stopping = true;
+        pthread_cond_broadcast(&walker->work);
+        pthread_cond_broadcast(&walker->freed);
+        pthread_mutex_unlock(&walker->lock);
+
+        for (size_t i = 0; i < walker->started; i++)
+                pthread_join(walker->workers[i].thread, NULL);
+        for (size_t i = 0; i < walker->thread_count; i++)
+                deque_destroy(&walker->workers[i].deque);
+        for (; walker->head != walker->tail; walker->head++)
+                free(walker->entries[walker->head % WALKER_QUEUE_SIZE].path);
+
+        pthread_cond_destroy(&walker->freed);
+        pthread_cond_destroy(&walker->filled);
+        pthread_cond_destroy(&walker->work);
+        pthread_mutex_destroy(&walker->lock);
+        free(walker);
+}
@@ -0,0 +1,68 @@
+/**
+ * @file walker.h
+ * @brief Module for scanning the SOURCE folder in several threads, so the
+ *        files are sent while the rest of the tree is still scanned.
+ */
+#ifndef WALKER_H
+#define WALKER_H
+
+#include "client.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+/**
+ * Regular file or directory found by the walker.
+ */
+struct client_walker_entry {
+        char *path;     /**< path relative to the root, freed by the caller */
+        struct stat sb; /**< status of the file */
+};
+
+/**
+ * Threads scanning the directories of the tree. Every thread has a deque
+ * of the directories it found and scans them depth first; an idle thread
+ * steals the oldest directory of another one.
+ */
+struct client_walker;
+
+/**
+ * Starts the threads scanning the directory @c dir. The directories are
+ * found before the files and directories in them, otherwise the entries
+ * come in no particular order. Symbolic links and special files are left
+ * out.
+ *
+ * @param dirfd      root of the tree
+ * @param dir        path of the scanned directory relative to @c dirfd,
+ *                   "" for the root itself
+ * @param threads    number of the threads, from 1 to CLIENT_MAX_SCANNERS
+ * @param recursive  the subdirectories are scanned too; otherwise only the
+ *                   regular files of @c dir are found
+ * @return           the walker on success;
+ *                   NULL on failure
+ */
+struct client_walker *client_walker_start(int dirfd, const char *dir,
+                                          size_t threads, bool recursive);
+
+/**
+ * Waits for the next entry of the tree.
+ *
+ * @param walker       the walker
+ * @param[out] entry   the entry, its path must be freed
+ * @return             1 if an entry was found;
+ *                     0 after the last entry;
+ *                     -1 if the scan failed
+ */
+int client_walker_next(struct client_walker *walker,
+                       struct client_walker_entry *entry);
+
+/**
+ * Stops the threads, even before the whole tree is scanned, and frees the
+ * walker.
+ *
+ * @param walker  the walker; may be NULL
+ */
+void client_walker_stop(struct client_walker *walker);
+
+#endif //WALKER_H
@@ -1,5 +1,6 @@
 #include "watcher.h"
 
+#include "fanotify.h"
 #include "traverse_data.h"
 
 #include "log.h"
@@ -49,21 +50,6 @@ static bool add_object_watch(int *wd, const char *obj_name, int inot_fd,
         return true;
 }
 
-/**
- * Adds watcher for given file to inotify
- *
- * @param fd File descriptor
- * @param file_name Name of the file
- * @param inot_fd Inotify object file descriptor
- * @return true if adding succeeded;
- * @return false otherwise;
- */
-static bool watch_file(int *wd, const char *file_name, int inot_fd)
-{
-        uint32_t mask = IN_CLOSE_WRITE | IN_ATTRIB;
-        return add_object_watch(wd, file_name, inot_fd, mask);
-}
-
 /**
  * Adds watcher for given directory to inotify
  *
@@ -75,39 +61,25 @@ static bool watch_file(int *wd, const char *file_name, int inot_fd)
  */
 static bool watch_dir(int *wd, const char *dir_name, int inot_fd)
 {
-        uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVE;
+        // the files of the directory report IN_CLOSE_WRITE and IN_ATTRIB too
+        uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVE | IN_CLOSE_WRITE
+                        | IN_ATTRIB | IN_ONLYDIR;
         return add_object_watch(wd, dir_name, inot_fd, mask);
 }
 
-/**
- * Identifies object type and calls appropriate watcher adder
- *
- * @param fd File descriptor
- * @param obj_name Name of the file/directory
- * @param inot_fd Inotify object file descriptor
- * @param st Stat struct
- * @return true
- * @return false
- */
-static bool watch_object(int *wd, const char *obj_name, int inot_fd)
-{
-        struct stat st;
-        if (stat(obj_name, &st) == -1) {
-                log_error("watch_object");
-                return false;
-        }
-        if (S_ISDIR(st.st_mode))
-                return watch_dir(wd, obj_name, inot_fd);
-        return watch_file(wd, obj_name, inot_fd);
-}
-
 bool watcher_create(struct client_watcher *watcher,
                     const struct client_watcher_data *watcher_data)
 {
         syslog(LOG_DEBUG, "create_watcher started");
         int wd;
-        if (!watch_object(&wd, watcher_data->fpath, watcher_data->inot_fd)) {
-                syslog(LOG_DEBUG, "watch_object failed.");
+        const bool watched
+                = watcher_data->fanotify != NULL
+                          ? client_fanotify_watch(watcher_data->fanotify,
+                                                  watcher_data->fpath, &wd)
+                          : watch_dir(&wd, watcher_data->fpath,
+                                      watcher_data->inot_fd);
+        if (!watched) {
+                syslog(LOG_DEBUG, "watch_dir failed.");
                 return false;
         }
 
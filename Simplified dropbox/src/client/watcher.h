@@ -15,6 +15,8 @@ struct client_watcher {
         const char *name; /**< relative path of the file/folder */
 };
 
+struct client_fanotify;
+
 /**
  * @brief Data for constructing creating inotify watch
  */
@@ -22,10 +24,13 @@ struct client_watcher_data {
         const char *fpath;
         const char *relative_path;
         int inot_fd;
+        struct client_fanotify *fanotify; /**< NULL if inotify is used */
 };
 
 /**
- * @brief Creates watcher from the watcher data
+ * @brief Creates watcher of the directory from the watcher data. The
+ *        directory reports the changes of the files in it too, so the
+ *        files are not watched one by one.
  *
  * @param watcher       pointer to an uninitialized watcher object
  * @param watcher_data  a pointer to data
@@ -1,83 +1,274 @@
 #include "watcher_list.h"
 
+#include "hash.h"
+#include "log.h"
 #include "utils.h"
 
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
-bool client_watcher_list_create(client_watcher_list *list)
+#define MIN_SLOT_COUNT 64
+
+#define EMPTY_WD -1
+#define REMOVED_WD -2
+
+#define EMPTY_PATH 0
+#define REMOVED_PATH SIZE_MAX
+
+#define NOT_FOUND SIZE_MAX
+
+static size_t next_slot(const client_watcher_list *list, size_t slot)
 {
-        return generic_list_create(list, sizeof(struct client_watcher));
+        return (slot + 1) & (list->_slot_count - 1);
 }
 
-bool client_watcher_list_push_back(client_watcher_list *list,
-                                   const struct client_watcher *elem)
+/**
+ * Finds the slot of the watcher with the watch descriptor. The first free
+ * slot where it belongs is stored in @c free_slot if it is not found.
+ *
+ * The descriptors are allocated one after another, so they index the table
+ * without hashing.
+ */
+static size_t probe_wd(const client_watcher_list *list, int wd,
+                       size_t *free_slot)
 {
-        return generic_list_push_back(list, elem);
+        size_t slot = (size_t)wd & (list->_slot_count - 1);
+        size_t removed = NOT_FOUND;
+        while (list->_watchers[slot].wd != EMPTY_WD) {
+                if (list->_watchers[slot].wd == wd)
+                        return slot;
+                if (list->_watchers[slot].wd == REMOVED_WD
+                    && removed == NOT_FOUND)
+                        removed = slot;
+                slot = next_slot(list, slot);
+        }
+        if (free_slot != NULL)
+                *free_slot = removed == NOT_FOUND ? slot : removed;
+        return NOT_FOUND;
 }
 
-void client_watcher_list_foreach(client_watcher_list *list, iter_func func,
-                                 void *data)
+/**
+ * Analogous to the probe_wd(), but the path table is searched.
+ */
+static size_t probe_path(const client_watcher_list *list, const char *name,
+                         size_t *free_slot)
 {
-        generic_list_foreach(list, func, data);
+        size_t slot = hash_xxh64(strlen(name), name, 0)
+                      & (list->_slot_count - 1);
+        size_t removed = NOT_FOUND;
+        while (list->_paths[slot] != EMPTY_PATH) {
+                const size_t index = list->_paths[slot];
+                if (index == REMOVED_PATH) {
+                        if (removed == NOT_FOUND)
+                                removed = slot;
+                } else if (strcmp(list->_watchers[index - 1].name, name) == 0) {
+                        return slot;
+                }
+                slot = next_slot(list, slot);
+        }
+        if (free_slot != NULL)
+                *free_slot = removed == NOT_FOUND ? slot : removed;
+        return NOT_FOUND;
 }
 
-void client_watcher_list_foreach_reverse(client_watcher_list *list,
-                                         iter_func func, void *data)
+/**
+ * Moves the watchers to the new tables without the tombstones. The path
+ * still leads to the same watcher.
+ */
+static bool rebuild(client_watcher_list *list, size_t slot_count)
 {
-        generic_list_foreach_reverse(list, func, data);
-}
+        struct client_watcher *watchers
+                = malloc(slot_count * sizeof(*watchers));
+        size_t *paths = calloc(slot_count, sizeof(*paths));
+        if (watchers == NULL || paths == NULL) {
+                free(watchers);
+                free(paths);
+                return false;
+        }
+        for (size_t i = 0; i < slot_count; i++)
+                watchers[i] = (struct client_watcher){ .wd = EMPTY_WD };
 
-struct iter_find_watcher_data {
-        const struct client_watcher needle;
-        struct client_watcher *found_watcher;
-};
+        const client_watcher_list old = *list;
+        list->_watchers = watchers;
+        list->_paths = paths;
+        list->_slot_count = slot_count;
+        list->_wd_used = list->_count;
+        list->_path_used = 0;
 
-static bool iter_find_watcher(void *elem, void *data)
+        size_t slot;
+        for (size_t i = 0; i < old._slot_count; i++) {
+                if (old._watchers[i].wd < 0)
+                        continue;
+                probe_wd(list, old._watchers[i].wd, &slot);
+                watchers[slot] = old._watchers[i];
+        }
+        for (size_t i = 0; i < old._slot_count; i++) {
+                const size_t index = old._paths[i];
+                if (index == EMPTY_PATH || index == REMOVED_PATH)
+                        continue;
+                const struct client_watcher *w = &old._watchers[index - 1];
+                probe_path(list, w->name, &slot);
+                paths[slot] = probe_wd(list, w->wd, NULL) + 1;
+                list->_path_used++;
+        }
+        free(old._watchers);
+        free(old._paths);
+        return true;
+}
+
+/**
+ * Makes room for one more watcher. The tables are rebuilt once one of them
+ * is half full of the watchers and tombstones; they grow only if the
+ * watchers alone would take more than a quarter of the slots.
+ */
+static bool reserve(client_watcher_list *list)
 {
-        struct client_watcher *w = elem;
-        struct iter_find_watcher_data *find_data = data;
+        const size_t used = list->_wd_used > list->_path_used
+                                    ? list->_wd_used
+                                    : list->_path_used;
+        if (2 * (used + 1) <= list->_slot_count)
+                return true;
 
-        bool wd_equal = true;
-        bool name_equal = true;
+        size_t slot_count = MIN_SLOT_COUNT;
+        while (4 * (list->_count + 1) > slot_count)
+                slot_count *= 2;
+        return rebuild(list, slot_count);
+}
 
-        if (find_data->needle.wd != -1 && find_data->needle.wd != w->wd)
-                wd_equal = false;
+/**
+ * Removes the path of the watcher unless it leads to a newer watcher.
+ */
+static void unlink_path(client_watcher_list *list, size_t slot)
+{
+        const size_t path = probe_path(list, list->_watchers[slot].name, NULL);
+        if (path != NOT_FOUND && list->_paths[path] == slot + 1)
+                list->_paths[path] = REMOVED_PATH;
+}
 
-        if (find_data->needle.name != NULL
-            && strcmp(find_data->needle.name, w->name) != 0)
-                name_equal = false;
+/**
+ * Makes the path of the watcher lead to it, instead of an older watcher of
+ * the same path.
+ */
+static void link_path(client_watcher_list *list, size_t slot)
+{
+        size_t path;
+        const size_t found_path
+                = probe_path(list, list->_watchers[slot].name, &path);
+        if (found_path != NOT_FOUND)
+                path = found_path;
+        else if (list->_paths[path] == EMPTY_PATH)
+                list->_path_used++;
+        list->_paths[path] = slot + 1;
+}
 
-        bool found = wd_equal && name_equal;
+bool client_watcher_list_create(client_watcher_list *list)
+{
+        *list = (client_watcher_list){ 0 };
+        return rebuild(list, MIN_SLOT_COUNT);
+}
 
-        if (found)
-                find_data->found_watcher = w;
+bool client_watcher_list_add(client_watcher_list *list,
+                             const struct client_watcher *elem)
+{
+        log_assert(elem->wd >= 0);
+        if (!reserve(list))
+                return false;
 
-        return !found;
+        size_t slot;
+        const size_t found = probe_wd(list, elem->wd, &slot);
+        if (found != NOT_FOUND) {
+                slot = found;
+                unlink_path(list, slot);
+                free((void *)list->_watchers[slot].name);
+        } else {
+                if (list->_watchers[slot].wd == EMPTY_WD)
+                        list->_wd_used++;
+                list->_count++;
+        }
+        list->_watchers[slot] = *elem;
+        link_path(list, slot);
+        return true;
 }
 
-struct client_watcher *
-client_watcher_list_find_last(client_watcher_list *list,
-                              struct client_watcher needle)
+const struct client_watcher *
+client_watcher_list_find_wd(const client_watcher_list *list, int wd)
 {
-        struct iter_find_watcher_data data = {
-                .needle = needle,
-                .found_watcher = NULL,
-        };
-        client_watcher_list_foreach_reverse(list, iter_find_watcher, &data);
+        if (wd < 0)
+                return NULL;
+        const size_t slot = probe_wd(list, wd, NULL);
+        return slot == NOT_FOUND ? NULL : &list->_watchers[slot];
+}
 
-        return data.found_watcher;
+const struct client_watcher *
+client_watcher_list_find_name(const client_watcher_list *list,
+                              const char *name)
+{
+        const size_t path = probe_path(list, name, NULL);
+        return path == NOT_FOUND ? NULL
+                                 : &list->_watchers[list->_paths[path] - 1];
 }
 
-static bool iter_free_watcher_name(void *elem, void *data)
+bool client_watcher_list_remove(client_watcher_list *list, int wd)
 {
-        UNUSED(data);
-        const struct client_watcher *w = elem;
-        free((void *)w->name);
+        if (wd < 0)
+                return false;
+        const size_t slot = probe_wd(list, wd, NULL);
+        if (slot == NOT_FOUND)
+                return false;
+
+        unlink_path(list, slot);
+        free((void *)list->_watchers[slot].name);
+        list->_watchers[slot] = (struct client_watcher){ .wd = REMOVED_WD };
+        list->_count--;
         return true;
 }
 
+bool client_watcher_list_rename(client_watcher_list *list,
+                                const char *old_name, const char *new_name)
+{
+        if (list->_count == 0)
+                return true;
+        // the watchers are collected first, the tables may be rebuilt
+        int *wds = malloc(list->_count * sizeof(*wds));
+        if (wds == NULL)
+                return false;
+        size_t count = 0;
+        for (size_t i = 0; i < list->_slot_count; i++) {
+                if (list->_watchers[i].wd >= 0
+                    && utils_path_is_within(list->_watchers[i].name, old_name))
+                        wds[count++] = list->_watchers[i].wd;
+        }
+
+        const size_t old_length = strlen(old_name);
+        size_t renamed = 0;
+        for (; renamed < count; renamed++) {
+                if (!reserve(list))
+                        break;
+                const size_t slot = probe_wd(list, wds[renamed], NULL);
+                struct client_watcher *watcher = &list->_watchers[slot];
+                char *name;
+                if (asprintf(&name, "%s%s", new_name,
+                             &watcher->name[old_length])
+                    == -1)
+                        break;
+                unlink_path(list, slot);
+                free((void *)watcher->name);
+                watcher->name = name;
+                link_path(list, slot);
+        }
+        free(wds);
+        return renamed == count;
+}
+
 void client_watcher_list_destroy(client_watcher_list *list)
 {
-        client_watcher_list_foreach(list, iter_free_watcher_name, NULL);
-        generic_list_destroy(list);
+        for (size_t i = 0; i < list->_slot_count; i++) {
+                if (list->_watchers[i].wd >= 0)
+                        free((void *)list->_watchers[i].name);
+        }
+        free(list->_watchers);
+        free(list->_paths);
+        *list = (client_watcher_list){ 0 };
 }
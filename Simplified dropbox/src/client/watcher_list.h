@@ -1,6 +1,7 @@
 /**
  * @file watcher_list.h
- * @brief Dynamic array of struct watcher
+ * @brief Registry of struct watcher indexed by the watch descriptor and by
+ *        the path
  * @author Dávid Šutor (xsutor@fi.muni.cz)
  * @date 2021-08-05
  */
@@ -9,14 +10,31 @@
 
 #include "watcher.h"
 
-#include "generic_list.h"
+#include <stdbool.h>
+#include <stddef.h>
 
-typedef generic_list client_watcher_list;
+/**
+ * @brief Two open addressing tables of the same size. The first one holds
+ *        the watchers keyed by the watch descriptor, the second one the
+ *        index of the watcher keyed by its path. The removed watchers leave
+ *        tombstones in both tables until they are rebuilt.
+ *
+ * @note Members of this struct should not be access directly.
+ *       Accessible for an ability to allocate on the stack.
+ */
+typedef struct client_watcher_list {
+        struct client_watcher *_watchers; /**< slots keyed by the wd      */
+        size_t *_paths;     /**< index of the watcher + 1, keyed by the path */
+        size_t _slot_count; /**< slots of each table, a power of two      */
+        size_t _count;      /**< number of the watchers                   */
+        size_t _wd_used;    /**< watchers and tombstones in the wd table  */
+        size_t _path_used;  /**< paths and tombstones in the path table   */
+} client_watcher_list;
 
 /**
- * @brief Creates list of watchers
+ * @brief Creates the empty registry of watchers
  *
- * @param[out] list pointer to a uninitialized list
+ * @param[out] list pointer to a uninitialized registry
  *
  * @return true on success;
  *         false otherwise
@@ -24,57 +42,76 @@ typedef generic_list client_watcher_list;
 bool client_watcher_list_create(client_watcher_list *list);
 
 /**
- * @brief Push @c elem at the end of the @c list
+ * @brief Adds the watcher to the @c list. The @c list takes over the name
+ *        of the watcher on success.
  *
- * @param list pointer to the list
+ * The watcher replaces the one with the same watch descriptor, which
+ * inotify returns again for the watched i-node, and it is found by its path
+ * instead of the older watcher with the same path.
+ *
+ * @param list pointer to the registry
  * @param elem pointer to the watcher to insert
  *
  * @return true on success; false otherwise
  */
-bool client_watcher_list_push_back(client_watcher_list *list,
-                                   const struct client_watcher *elem);
+bool client_watcher_list_add(client_watcher_list *list,
+                             const struct client_watcher *elem);
 
 /**
- * @brief Iterates through the @c list from the start to the end.
- *        Each element of the list and @c data is passed to the @c func.
+ * Finds the watcher with the watch descriptor @c wd.
  *
- * @note See typedef iter_func for detailed description.
+ * @param list  pointer to the registry
+ * @param wd    the watch descriptor
  *
- * @param list  pointer to the list
- * @param func  function applied to each element
- * @param data  pointer to a data passed to he @c func
+ * @return a pointer to the watcher valid until the registry is changed;
+ *         NULL if there is none
  */
-void client_watcher_list_foreach(client_watcher_list *list, iter_func func,
-                                 void *data);
+const struct client_watcher *
+client_watcher_list_find_wd(const client_watcher_list *list, int wd);
 
 /**
- * @brief Analogous to the @e client_watcher_list_foreach(), but the elements
- *        are iterated from end to start.
- * @see generic_list_foreach
+ * Finds the last added watcher of the file or folder @c name.
+ *
+ * @param list  pointer to the registry
+ * @param name  relative path of the file or folder
+ *
+ * @return a pointer to the watcher valid until the registry is changed;
+ *         NULL if there is none
  */
-void client_watcher_list_foreach_reverse(client_watcher_list *list,
-                                         iter_func func, void *data);
+const struct client_watcher *
+client_watcher_list_find_name(const client_watcher_list *list,
+                              const char *name);
 
 /**
- * Finds last watcher specified by @c needle.
+ * Removes the watcher with the watch descriptor @c wd and frees its name.
  *
- * If @c needle.wd is -1 then every value of this field is matched.
- * If @c needle.name is @c NULL every value of this field is matched.
+ * @param list  pointer to the registry
+ * @param wd    the watch descriptor
  *
- * @param list    pointer to the list
- * @param needle  structure containing searching parameters
+ * @return true if the watcher was removed;
+ *         false if there is none
+ */
+bool client_watcher_list_remove(client_watcher_list *list, int wd);
+
+/**
+ * Renames the watchers of the renamed folder and of the folders in it, their
+ * watch descriptors stay the same. The watchers renamed before a failure
+ * keep the new name.
  *
- * @return a pointer to matched element in the list;
- *         NULL otherwise
+ * @param list      pointer to the registry
+ * @param old_name  the old relative path of the folder
+ * @param new_name  the new relative path of the folder
+ *
+ * @return true on success;
+ *         false otherwise
  */
-struct client_watcher *
-client_watcher_list_find_last(client_watcher_list *list,
-                              struct client_watcher needle);
+bool client_watcher_list_rename(client_watcher_list *list,
+                                const char *old_name, const char *new_name);
 
 /**
  * @brief Release all the resource of the @c list.
  *
- * @param list  pointer to the list
+ * @param list  pointer to the registry
  */
 void client_watcher_list_destroy(client_watcher_list *list);
 
@@ -8,47 +8,157 @@
 #ifndef EVENT_READER_H
 #define EVENT_READER_H
 
-#include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 
 #include "utils.h"
 
 /**
- * @brier Function called when an event occurs on file descriptors
+ * Reactor dispatching the events of the registered file descriptors,
+ * timers and signals to their callbacks. Only the descriptors with an
+ * event are visited on every wake up.
+ */
+struct event_reader;
+
+/**
+ * @brief Function called when an event occurs on a registered file
+ *        descriptor or when a timer expires.
  *
- * @param pollfds[n]     an array of read file descriptors
- * @param singal_pollfd  file descriptor created by signalfd(2)
+ * @param fd      the file descriptor; the timer for timers
+ * @param events  epoll(7) events which occurred, e.g. EPOLLIN, EPOLLRDHUP,
+ *                EPOLLERR; EPOLLIN for timers
+ * @param data    pointer given at the registration
  *
  * @return   UTILS_LOOP_CONTINUE - indicating to go on
  *           UTILS_LOOP_BREAK    - to exit the event loop
  *           UTILS_LOOP_ERROR    - an error occurred and the event loop
  *                                 cannot continue
  */
-typedef enum utils_loop_status (*event_reader_callback_t)(
-        nfds_t n, struct pollfd pollfds[n], struct pollfd *singal_pollfd);
+typedef enum utils_loop_status (*event_reader_callback_t)(int fd,
+                                                          uint32_t events,
+                                                          void *data);
 
-#define EVENT_READER_CALLBACK(NAME)                                            \
-        enum utils_loop_status NAME(nfds_t n, struct pollfd pollfds[n],        \
-                                    struct pollfd *signal_pollfd)
+/**
+ * @brief Function called when a monitored signal is caught.
+ *
+ * @param info  information about the signal
+ * @param data  pointer given to event_reader_create()
+ *
+ * @return  as for event_reader_callback_t
+ */
+typedef enum utils_loop_status (*event_reader_signal_callback_t)(
+        const struct signalfd_siginfo *info, void *data);
 
 /**
- * Monitor read events on file descriptors @c read_fds and signals specified
- * in @c mask.
+ * Creates the reactor monitoring the signals in @c mask. The signals have
+ * to be blocked.
  *
  * @param mask      pointer to the mask of signals to monitored
- * @param n         number of read file descriptors
- * @param fds[n]    array of poll file descriptors to monitor
- *                  specified events
+ * @param callback  function processing the caught signals
+ * @param data      pointer passed to the @c callback
+ *
+ * @return  the reactor;
+ *          NULL on failure
+ */
+struct event_reader *event_reader_create(const sigset_t *mask,
+                                         event_reader_signal_callback_t callback,
+                                         void *data);
+
+/**
+ * Registers the file descriptor. The descriptor has to be unregistered
+ * before it is closed.
+ *
+ * @param reader    the reactor
+ * @param fd        file descriptor to monitor
+ * @param events    epoll(7) events to monitor, e.g. EPOLLIN | EPOLLRDHUP;
+ *                  with EPOLLET the @c callback is called only when the
+ *                  descriptor becomes ready again, so it has to read all
+ *                  the available data
+ * @param callback  function processing the events
+ * @param data      pointer passed to the @c callback
+ *
+ * @return  true on success;
+ *          false otherwise
+ */
+bool event_reader_add(struct event_reader *reader, int fd, uint32_t events,
+                      event_reader_callback_t callback, void *data);
+
+/**
+ * Unregisters the file descriptor. Its pending events are dropped, so it
+ * can be called from any callback.
+ *
+ * @param reader  the reactor
+ * @param fd      registered file descriptor
+ *
+ * @return  true on success;
+ *          false otherwise
+ */
+bool event_reader_remove(struct event_reader *reader, int fd);
+
+/**
+ * Creates the timer expiring after @c delay_ms milliseconds and then
+ * every @c interval_ms milliseconds. The timer is disarmed if @c delay_ms
+ * is 0.
+ *
+ * @param reader       the reactor
+ * @param delay_ms     milliseconds to the first expiration
+ * @param interval_ms  milliseconds between next expirations; 0 for
+ *                     a one-shot timer
+ * @param callback     function called when the timer expires
+ * @param data         pointer passed to the @c callback
+ *
+ * @return  the timer;
+ *          -1 on failure
+ */
+int event_reader_add_timer(struct event_reader *reader, unsigned long delay_ms,
+                           unsigned long interval_ms,
+                           event_reader_callback_t callback, void *data);
+
+/**
+ * Arms the timer again, as in event_reader_add_timer().
+ *
+ * @param reader       the reactor
+ * @param timer        the timer
+ * @param delay_ms     milliseconds to the first expiration; 0 disarms
+ *                     the timer
+ * @param interval_ms  milliseconds between next expirations
+ *
+ * @return  true on success;
+ *          false otherwise
+ */
+bool event_reader_arm_timer(struct event_reader *reader, int timer,
+                            unsigned long delay_ms, unsigned long interval_ms);
+
+/**
+ * Removes the timer.
+ *
+ * @param reader  the reactor
+ * @param timer   the timer
+ *
+ * @return  true on success;
+ *          false otherwise
+ */
+bool event_reader_remove_timer(struct event_reader *reader, int timer);
+
+/**
+ * Dispatches the events until a callback ends the loop.
  *
- * @param callback  function for processing poll file descriptors
- *                  corresponding to the @c read_fds and signals
- *                  specified in @c mask
+ * @param reader  the reactor
  *
- * @return true  if the &c callback wanted to end the event_loop
+ * @return true  if a callback wanted to end the event loop
  *         false if an error occurred
  */
-bool event_reader(const sigset_t *mask, size_t n, const struct pollfd fds[n],
-                  event_reader_callback_t callback);
+bool event_reader_run(struct event_reader *reader);
+
+/**
+ * Releases the reactor and its timers. The registered file descriptors
+ * are not closed.
+ *
+ * @param reader  the reactor
+ */
+void event_reader_destroy(struct event_reader *reader);
 
 #endif //EVENT_READER_H
@@ -2,79 +2,366 @@
 
 #include "log.h"
 
+#include <errno.h>
 #include <stdlib.h>
-#include <sys/signalfd.h>
+#include <string.h>
+#include <sys/timerfd.h>
 #include <syslog.h>
 #include <unistd.h>
 
-static void set_signal_fd(int fd, struct pollfd *pollfd)
+/**
+ * Maximum number of the events dispatched after one wake up.
+ */
+#define MAX_EVENTS 64
+
+enum handler_kind {
+        HANDLER_FD,
+        HANDLER_TIMER,
+        HANDLER_SIGNAL,
+};
+
+struct handler {
+        int fd;
+        enum handler_kind kind;
+        event_reader_callback_t callback;
+        void *data;
+        struct handler *next_removed;
+};
+
+struct event_reader {
+        int epoll_fd;
+        int signal_fd;
+        event_reader_signal_callback_t signal_callback;
+        void *signal_data;
+        struct handler signal_handler;
+
+        /* registered handlers indexed by their file descriptors */
+        struct handler **handlers;
+        size_t handlers_size;
+
+        /* handlers removed while their events may still be dispatched */
+        struct handler *removed;
+};
+
+static bool reserve_handlers(struct event_reader *reader, int fd)
 {
-        pollfd->fd = fd;
-        pollfd->events = POLLIN;
-        pollfd->revents = 0;
+        if ((size_t) fd < reader->handlers_size)
+                return true;
+
+        size_t size = reader->handlers_size == 0 ? 64 : reader->handlers_size;
+        while (size <= (size_t) fd)
+                size *= 2;
+
+        struct handler **handlers
+                = realloc(reader->handlers, size * sizeof(*handlers));
+        if (handlers == NULL) {
+                log_error("realloc");
+                return false;
+        }
+        memset(handlers + reader->handlers_size, 0,
+               (size - reader->handlers_size) * sizeof(*handlers));
+        reader->handlers = handlers;
+        reader->handlers_size = size;
+        return true;
 }
 
-static void insert_fds(size_t n, const struct pollfd fds[n],
-                       struct pollfd pollfds[])
+static bool add_handler(struct event_reader *reader, int fd, uint32_t events,
+                        enum handler_kind kind, event_reader_callback_t callback,
+                        void *data)
 {
-        for (size_t i = 0; i < n; i++) {
-                pollfds[i] = fds[i];
+        if (fd < 0 || !reserve_handlers(reader, fd))
+                return false;
+        log_assert(reader->handlers[fd] == NULL);
+
+        struct handler *handler = malloc(sizeof(*handler));
+        if (handler == NULL) {
+                log_error("malloc");
+                return false;
+        }
+        handler->fd = fd;
+        handler->kind = kind;
+        handler->callback = callback;
+        handler->data = data;
+        handler->next_removed = NULL;
+
+        struct epoll_event event = {
+                .events = events,
+                .data.ptr = handler,
+        };
+        if (epoll_ctl(reader->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+                log_error("epoll_ctl add");
+                free(handler);
+                return false;
         }
+        reader->handlers[fd] = handler;
+        return true;
 }
 
-static bool main_loop(nfds_t nfds, struct pollfd pollfds[nfds],
-                      event_reader_callback_t callback)
+static struct handler *find_handler(const struct event_reader *reader, int fd)
 {
-        while (true) {
-                if (poll(pollfds, nfds, -1) == -1) {
-                        log_error("poll");
-                        break;
-                }
-                syslog(LOG_DEBUG, "Event was caught.");
-
-                enum utils_loop_status status
-                        = callback(nfds - 1, pollfds, &pollfds[nfds - 1]);
-                syslog(LOG_DEBUG, "callback status: %d", status);
+        if (fd < 0 || (size_t) fd >= reader->handlers_size)
+                return NULL;
+        return reader->handlers[fd];
+}
 
-                if (status == UTILS_LOOP_ERROR)
-                        return false;
-                if (status == UTILS_LOOP_BREAK)
-                        return true;
+static bool remove_handler(struct event_reader *reader, int fd,
+                           enum handler_kind kind)
+{
+        struct handler *handler = find_handler(reader, fd);
+        if (handler == NULL || handler->kind != kind) {
+                syslog(LOG_WARNING, "fd %d is not registered", fd);
+                return false;
+        }
 
-                syslog(LOG_DEBUG, "all pollfd checked");
+        bool success = true;
+        if (epoll_ctl(reader->epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+                log_error("epoll_ctl del");
+                success = false;
         }
-        syslog(LOG_DEBUG, "main event loop failed");
-        return false;
+        reader->handlers[fd] = NULL;
+
+        // events of the handler may wait in the current batch
+        handler->callback = NULL;
+        handler->next_removed = reader->removed;
+        reader->removed = handler;
+        return success;
 }
 
-bool event_reader(const sigset_t *mask, size_t n, const struct pollfd fds[n],
-                  event_reader_callback_t callback)
+static void free_removed(struct event_reader *reader)
 {
-        syslog(LOG_DEBUG, "Event loop started.");
+        while (reader->removed != NULL) {
+                struct handler *handler = reader->removed;
+                reader->removed = handler->next_removed;
+                free(handler);
+        }
+}
 
-        const nfds_t nfds = n + 1;
-        struct pollfd *pollfds = malloc(nfds * sizeof(*pollfds));
-        if (pollfds == NULL) {
-                log_error("malloc");
-                return false;
+struct event_reader *event_reader_create(const sigset_t *mask,
+                                         event_reader_signal_callback_t callback,
+                                         void *data)
+{
+        struct event_reader *reader = calloc(1, sizeof(*reader));
+        if (reader == NULL) {
+                log_error("calloc");
+                return NULL;
         }
-        insert_fds(n, fds, pollfds);
+        reader->signal_callback = callback;
+        reader->signal_data = data;
 
-        bool success = false;
+        reader->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (reader->epoll_fd == -1) {
+                log_error("epoll_create1");
+                goto clean_reader;
+        }
 
-        const int signal_fd = signalfd(-1, mask, SFD_NONBLOCK);
-        if (signal_fd == -1) {
+        reader->signal_fd = signalfd(-1, mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (reader->signal_fd == -1) {
                 log_error("signalfd");
-                goto clean_pollfds;
+                goto clean_epoll;
+        }
+
+        reader->signal_handler.fd = reader->signal_fd;
+        reader->signal_handler.kind = HANDLER_SIGNAL;
+        struct epoll_event event = {
+                .events = EPOLLIN,
+                .data.ptr = &reader->signal_handler,
+        };
+        if (epoll_ctl(reader->epoll_fd, EPOLL_CTL_ADD, reader->signal_fd,
+                      &event)
+            == -1) {
+                log_error("epoll_ctl add signalfd");
+                goto clean_signal;
         }
-        set_signal_fd(signal_fd, &pollfds[n]);
 
-        success = main_loop(nfds, pollfds, callback);
+        syslog(LOG_DEBUG, "Event reader created.");
+        return reader;
 
-        if (close(signal_fd) == -1)
+clean_signal:
+        if (close(reader->signal_fd) == -1)
                 log_error("close signal_fd");
+clean_epoll:
+        if (close(reader->epoll_fd) == -1)
+                log_error("close epoll_fd");
+clean_reader:
+        free(reader);
+        return NULL;
+}
 
-clean_pollfds:
-        free(pollfds);
-        return success;
+bool event_reader_add(struct event_reader *reader, int fd, uint32_t events,
+                      event_reader_callback_t callback, void *data)
+{
+        return add_handler(reader, fd, events, HANDLER_FD, callback, data);
+}
+
+bool event_reader_remove(struct event_reader *reader, int fd)
+{
+        return remove_handler(reader, fd, HANDLER_FD);
+}
+
+static struct timespec to_timespec(unsigned long ms)
+{
+        return (struct timespec){
+                .tv_sec = ms / 1000,
+                .tv_nsec = (ms % 1000) * 1000000,
+        };
+}
+
+static bool set_timer(int timer, unsigned long delay_ms,
+                      unsigned long interval_ms)
+{
+        const struct itimerspec spec = {
+                .it_value = to_timespec(delay_ms),
+                .it_interval = to_timespec(interval_ms),
+        };
+        if (timerfd_settime(timer, 0, &spec, NULL) == -1) {
+                log_error("timerfd_settime");
+                return false;
+        }
+        return true;
+}
+
+int event_reader_add_timer(struct event_reader *reader, unsigned long delay_ms,
+                           unsigned long interval_ms,
+                           event_reader_callback_t callback, void *data)
+{
+        const int timer
+                = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (timer == -1) {
+                log_error("timerfd_create");
+                return -1;
+        }
+        if (!set_timer(timer, delay_ms, interval_ms)
+            || !add_handler(reader, timer, EPOLLIN, HANDLER_TIMER, callback,
+                            data)) {
+                if (close(timer) == -1)
+                        log_error("close timer");
+                return -1;
+        }
+        return timer;
+}
+
+bool event_reader_arm_timer(struct event_reader *reader, int timer,
+                            unsigned long delay_ms, unsigned long interval_ms)
+{
+        const struct handler *handler = find_handler(reader, timer);
+        if (handler == NULL || handler->kind != HANDLER_TIMER) {
+                syslog(LOG_WARNING, "%d is not a timer", timer);
+                return false;
+        }
+        return set_timer(timer, delay_ms, interval_ms);
+}
+
+bool event_reader_remove_timer(struct event_reader *reader, int timer)
+{
+        if (!remove_handler(reader, timer, HANDLER_TIMER))
+                return false;
+        if (close(timer) == -1) {
+                log_error("close timer");
+                return false;
+        }
+        return true;
+}
+
+static enum utils_loop_status dispatch_signals(struct event_reader *reader)
+{
+        struct signalfd_siginfo info;
+        ssize_t rc;
+        while ((rc = read(reader->signal_fd, &info, sizeof(info)))
+               == sizeof(info)) {
+                syslog(LOG_DEBUG, "Signal %u was caught.", info.ssi_signo);
+                const enum utils_loop_status status
+                        = reader->signal_callback(&info, reader->signal_data);
+                if (status != UTILS_LOOP_CONTINUE)
+                        return status;
+        }
+        if (rc == -1 && errno != EAGAIN) {
+                log_error("read signal_fd");
+                return UTILS_LOOP_ERROR;
+        }
+        return UTILS_LOOP_CONTINUE;
+}
+
+static enum utils_loop_status dispatch_timer(const struct handler *handler)
+{
+        uint64_t expirations;
+        if (read(handler->fd, &expirations, sizeof(expirations)) == -1) {
+                // the timer was armed again or disarmed meanwhile
+                if (errno == EAGAIN)
+                        return UTILS_LOOP_CONTINUE;
+                log_error("read timer");
+                return UTILS_LOOP_ERROR;
+        }
+        return handler->callback(handler->fd, EPOLLIN, handler->data);
+}
+
+static enum utils_loop_status dispatch(struct event_reader *reader,
+                                       const struct epoll_event *event)
+{
+        const struct handler *handler = event->data.ptr;
+        switch (handler->kind) {
+        case HANDLER_SIGNAL:
+                return dispatch_signals(reader);
+        case HANDLER_TIMER:
+                if (handler->callback == NULL)
+                        return UTILS_LOOP_CONTINUE;
+                return dispatch_timer(handler);
+        case HANDLER_FD:
+                if (handler->callback == NULL)
+                        return UTILS_LOOP_CONTINUE;
+                return handler->callback(handler->fd, event->events,
+                                         handler->data);
+        }
+        return UTILS_LOOP_ERROR;
+}
+
+bool event_reader_run(struct event_reader *reader)
+{
+        syslog(LOG_DEBUG, "Event loop started.");
+
+        struct epoll_event events[MAX_EVENTS];
+        while (true) {
+                const int n = epoll_wait(reader->epoll_fd, events, MAX_EVENTS,
+                                         -1);
+                if (n == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        log_error("epoll_wait");
+                        return false;
+                }
+
+                enum utils_loop_status status = UTILS_LOOP_CONTINUE;
+                for (int i = 0; i < n && status == UTILS_LOOP_CONTINUE; i++)
+                        status = dispatch(reader, &events[i]);
+                free_removed(reader);
+                syslog(LOG_DEBUG, "%d events dispatched, status: %d", n,
+                       status);
+
+                if (status == UTILS_LOOP_ERROR)
+                        return false;
+                if (status == UTILS_LOOP_BREAK)
+                        return true;
+        }
+}
+
+void event_reader_destroy(struct event_reader *reader)
+{
+        if (reader == NULL)
+                return;
+
+        for (size_t fd = 0; fd < reader->handlers_size; fd++) {
+                struct handler *handler = reader->handlers[fd];
+                if (handler == NULL)
+                        continue;
+                if (handler->kind == HANDLER_TIMER && close(handler->fd) == -1)
+                        log_error("close timer");
+                free(handler);
+        }
+        free(reader->handlers);
+        free_removed(reader);
+
+        if (close(reader->signal_fd) == -1)
+                log_error("close signal_fd");
+        if (close(reader->epoll_fd) == -1)
+                log_error("close epoll_fd");
+        free(reader);
 }
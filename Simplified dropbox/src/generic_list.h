@@ -61,6 +61,19 @@ bool generic_list_create(generic_list *list, size_t elem_size);
  */
 bool generic_list_push_back(generic_list *list, const void *elem);
 
+/**
+ * @brief Returns the element of the @c list at the @c index.
+ *
+ * @note The pointer is valid until the next element is pushed.
+ *
+ * @param list   pointer to the list
+ * @param index  index of the element from the start
+ *
+ * @return pointer to the element;
+ *         NULL if the list is shorter
+ */
+void *generic_list_at(generic_list *list, size_t index);
+
 /**
  * @brief Iterates through the @c list from the start to the end.
  *        Each element of the list and @c data is passed to the @c func.
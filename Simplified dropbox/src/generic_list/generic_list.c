@@ -83,6 +83,16 @@ bool generic_list_push_back(generic_list *list, const void *elem)
         return true;
 }
 
+void *generic_list_at(generic_list *list, size_t index)
+{
+        log_assert(list != NULL);
+        log_assert(is_correct(list));
+
+        if (index >= list->_used / list->_elem_size)
+                return NULL;
+        return &list->_array[index * list->_elem_size];
+}
+
 static void _generic_list_foreach(generic_list *list, iter_func func,
                                   void *data, bool reverse)
 {
@@ -0,0 +1,130 @@
+/**
+ * @file hash.h
+ * @brief Checksums of the blocks of data compared by the client and the server
+ */
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Weak checksum of a window of bytes which can be moved by one byte
+ * in constant time, as used by rsync.
+ */
+struct hash_rolling {
+        uint32_t a;    /**< sum of the bytes */
+        uint32_t b;    /**< sum of the prefix sums of the bytes */
+        size_t length; /**< number of bytes in the window */
+};
+
+/**
+ * Computes the checksum of the window of @c size bytes at @c buff.
+ *
+ * @param rolling  the checksum to initialize
+ * @param size     a number of bytes in the window
+ * @param buff     a pointer to the bytes of the window
+ */
+void hash_rolling_init(struct hash_rolling *rolling, size_t size,
+                       const unsigned char *buff);
+
+/**
+ * Moves the window by one byte.
+ *
+ * @param rolling  the checksum of the window
+ * @param out      the first byte of the window which leaves it
+ * @param in       the byte right after the window which enters it
+ */
+static inline void hash_rolling_roll(struct hash_rolling *rolling,
+                                     unsigned char out, unsigned char in)
+{
+        rolling->a += in - out;
+        rolling->b += rolling->a - (uint32_t)rolling->length * out;
+}
+
+/**
+ * @return the 32-bit checksum of the window
+ */
+static inline uint32_t hash_rolling_digest(const struct hash_rolling *rolling)
+{
+        return (rolling->a & 0xffff) | (rolling->b << 16);
+}
+
+/**
+ * Computes the 64-bit XXH64 hash of @c size bytes at @c buff.
+ *
+ * @param size  a number of bytes to hash
+ * @param buff  a pointer to the bytes
+ * @param seed  a seed of the hash
+ * @return      the hash
+ */
+uint64_t hash_xxh64(size_t size, const void *buff, uint64_t seed);
+
+/**
+ * Size of the SHA-256 digest in bytes.
+ */
+#define HASH_SHA256_SIZE 32
+
+/**
+ * Computes the SHA-256 digest of @c size bytes at @c buff.
+ *
+ * @param size        a number of bytes to hash
+ * @param buff        a pointer to the bytes
+ * @param[out] digest the digest
+ */
+void hash_sha256(size_t size, const void *buff,
+                 unsigned char digest[HASH_SHA256_SIZE]);
+
+/**
+ * Bounds and the expected size of the chunks of the content-defined
+ * chunking.
+ */
+#define HASH_CDC_MIN_SIZE (16 * 1024)
+#define HASH_CDC_AVG_SIZE (64 * 1024)
+#define HASH_CDC_MAX_SIZE (256 * 1024)
+
+/**
+ * Finds the end of the chunk at the beginning of @c buff by the Gear
+ * rolling hash with the normalized chunking of FastCDC. The boundaries
+ * depend only on the bytes around them, so they move together with the
+ * data when bytes are inserted or removed earlier in the file.
+ *
+ * The boundary is found only within the first @c HASH_CDC_MAX_SIZE bytes,
+ * so unless @c buff holds the rest of the file, at least that many bytes
+ * must be given to get the same chunks every time.
+ *
+ * @param size  a number of bytes at @c buff
+ * @param buff  a pointer to the bytes
+ * @return      the size of the chunk, at most @c size
+ */
+size_t hash_cdc_chunk_size(size_t size, const unsigned char *buff);
+
+/**
+ * Size of the segments the prefix of a file is hashed by.
+ */
+#define HASH_PREFIX_SEGMENT_SIZE (16 * 1024 * 1024)
+
+/**
+ * Extends the hash of the first @c offset bytes of the file to the first
+ * @c end bytes. The prefix is hashed by segments of
+ * @c HASH_PREFIX_SEGMENT_SIZE bytes, each by XXH64 seeded by the hash of
+ * the segments before it, and the hash of the empty prefix is 0. So only
+ * the bytes added to the prefix are read.
+ *
+ * Errors:
+ *      EIO - the file is shorter than @c end bytes.
+ *
+ * For other errors see pread(2) and malloc(3).
+ *
+ * @param fd          a file descriptor of a regular file open for reading
+ * @param offset      a multiple of @c HASH_PREFIX_SEGMENT_SIZE
+ * @param end         the end of the prefix, at least @c offset
+ * @param[in,out] hash  the hash of the first @c offset bytes, replaced by
+ *                      the hash of the first @c end bytes
+ * @return            true on success;
+ *                    false on failure and errno is set appropriately
+ */
+bool hash_file_prefix(int fd, uint64_t offset, uint64_t end, uint64_t *hash);
+
+#endif /* HASH_H */
@@ -0,0 +1,390 @@
+/**
+ * @file hash.c
+ * @brief Definitions of the checksums
+ */
+#include "hash.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void hash_rolling_init(struct hash_rolling *rolling, size_t size,
+                       const unsigned char *buff)
+{
+        uint32_t a = 0;
+        uint32_t b = 0;
+        for (size_t i = 0; i < size; i++) {
+                a += buff[i];
+                b += a;
+        }
+        rolling->a = a;
+        rolling->b = b;
+        rolling->length = size;
+}
+
+/* XXH64, see https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md */
+
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+        return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+        uint64_t x;
+        memcpy(&x, p, sizeof(x));
+        return le64toh(x);
+}
+
+static inline uint32_t read32(const unsigned char *p)
+{
+        uint32_t x;
+        memcpy(&x, p, sizeof(x));
+        return le32toh(x);
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+        acc += input * PRIME64_2;
+        acc = rotl64(acc, 31);
+        return acc * PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t val)
+{
+        acc ^= xxh64_round(0, val);
+        return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t hash_xxh64(size_t size, const void *buff, uint64_t seed)
+{
+        const unsigned char *p = buff;
+        const unsigned char *const end = p + size;
+        uint64_t h;
+
+        if (size >= 32) {
+                uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+                uint64_t v2 = seed + PRIME64_2;
+                uint64_t v3 = seed;
+                uint64_t v4 = seed - PRIME64_1;
+                for (; end - p >= 32; p += 32) {
+                        v1 = xxh64_round(v1, read64(p));
+                        v2 = xxh64_round(v2, read64(p + 8));
+                        v3 = xxh64_round(v3, read64(p + 16));
+                        v4 = xxh64_round(v4, read64(p + 24));
+                }
+                h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12)
+                    + rotl64(v4, 18);
+                h = xxh64_merge_round(h, v1);
+                h = xxh64_merge_round(h, v2);
+                h = xxh64_merge_round(h, v3);
+                h = xxh64_merge_round(h, v4);
+        } else {
+                h = seed + PRIME64_5;
+        }
+        h += size;
+
+        for (; end - p >= 8; p += 8) {
+                h ^= xxh64_round(0, read64(p));
+                h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+        }
+        if (end - p >= 4) {
+                h ^= read32(p) * PRIME64_1;
+                h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+                p += 4;
+        }
+        for (; p < end; p++) {
+                h ^= *p * PRIME64_5;
+                h = rotl64(h, 11) * PRIME64_1;
+        }
+
+        h ^= h >> 33;
+        h *= PRIME64_2;
+        h ^= h >> 29;
+        h *= PRIME64_3;
+        h ^= h >> 32;
+        return h;
+}
+
+/* SHA-256, see FIPS 180-4 */
+
+static const uint32_t SHA256_K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+        0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+        0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+        0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+        0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+        0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+        0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+        0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+        0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define SHA256_BLOCK_SIZE 64
+
+static inline uint32_t rotr32(uint32_t x, int r)
+{
+        return (x >> r) | (x << (32 - r));
+}
+
+static void sha256_compress(uint32_t state[8],
+                            const unsigned char block[SHA256_BLOCK_SIZE])
+{
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+                uint32_t x;
+                memcpy(&x, &block[i * 4], sizeof(x));
+                w[i] = be32toh(x);
+        }
+        for (int i = 16; i < 64; i++) {
+                const uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18)
+                                    ^ (w[i - 15] >> 3);
+                const uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19)
+                                    ^ (w[i - 2] >> 10);
+                w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+                const uint32_t s1 = rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25);
+                const uint32_t ch = (e & f) ^ (~e & g);
+                const uint32_t t1 = h + s1 + ch + SHA256_K[i] + w[i];
+                const uint32_t s0 = rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22);
+                const uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+                const uint32_t t2 = s0 + maj;
+                h = g;
+                g = f;
+                f = e;
+                e = d + t1;
+                d = c;
+                c = b;
+                b = a;
+                a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+}
+
+void hash_sha256(size_t size, const void *buff,
+                 unsigned char digest[HASH_SHA256_SIZE])
+{
+        uint32_t state[8] = {
+                0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+        };
+
+        const unsigned char *p = buff;
+        size_t rest = size;
+        for (; rest >= SHA256_BLOCK_SIZE; rest -= SHA256_BLOCK_SIZE) {
+                sha256_compress(state, p);
+                p += SHA256_BLOCK_SIZE;
+        }
+
+        // the padding and the length in bits take one or two blocks
+        unsigned char tail[2 * SHA256_BLOCK_SIZE] = { 0 };
+        memcpy(tail, p, rest);
+        tail[rest] = 0x80;
+        const size_t tail_size = rest + 1 + sizeof(uint64_t) <= SHA256_BLOCK_SIZE
+                                         ? SHA256_BLOCK_SIZE
+                                         : 2 * SHA256_BLOCK_SIZE;
+        const uint64_t bits = htobe64((uint64_t)size * 8);
+        memcpy(&tail[tail_size - sizeof(bits)], &bits, sizeof(bits));
+        for (size_t offset = 0; offset < tail_size; offset += SHA256_BLOCK_SIZE)
+                sha256_compress(state, &tail[offset]);
+
+        for (int i = 0; i < 8; i++) {
+                const uint32_t x = htobe32(state[i]);
+                memcpy(&digest[i * 4], &x, sizeof(x));
+        }
+}
+
+/* Gear content-defined chunking, see FastCDC (Xia et al., USENIX ATC '16) */
+
+/**
+ * Random values of the bytes, generated by splitmix64. They must never
+ * change, otherwise the chunks of the same data would differ.
+ */
+static const uint64_t GEAR[256] = {
+        0x9b8c86f03439cacaULL, 0x24a0e42aa1cc075bULL, 0x46106fda5935d6c3ULL,
+        0xdce1439d594511daULL, 0x34f6108e7314d30bULL, 0x3fbf6c433e4d3325ULL,
+        0x66b16cfb50125328ULL, 0x4307a142e963cac9ULL, 0xfab31de64b4f0d3bULL,
+        0x75d7fb9cb6af3de1ULL, 0x2816450c53ad321bULL, 0xf0c89a1cd76c81bcULL,
+        0x66a9f35084d0c71aULL, 0xf24c19a0f8eb73d7ULL, 0x8576efa26d020556ULL,
+        0x8d422841e866cae6ULL, 0x4bbc6273af6cd91dULL, 0x2fd6061c4ff197d4ULL,
+        0xfc5d49fc546ea401ULL, 0x4b575047865dcfa0ULL, 0x83c56ee3ac9722cdULL,
+        0xc2a25c6e2a60040fULL, 0xea0dccf6d7d1e659ULL, 0x1eadc784b1bae110ULL,
+        0x4fef3732d5640a4bULL, 0x2904e443b94ae292ULL, 0x6480e35ad6311d87ULL,
+        0xecaa6c3d47f771d9ULL, 0xea3f9f04f1f8a8d1ULL, 0xc2dc298ea0619c59ULL,
+        0x330ba7821772ad99ULL, 0xaa1f9c690973de16ULL, 0x8a56a671ca4d53acULL,
+        0xbd4ceb7b77ce9d5fULL, 0xd33757f3006a2ab8ULL, 0xafe84244b4fc3fe4ULL,
+        0x7ace5741b65f2be0ULL, 0x88b6743f82121d85ULL, 0x8d0c38abc091fe28ULL,
+        0x206f5c5aa143f43eULL, 0xfe2c810247f81af7ULL, 0xc4ea52ae374ef63bULL,
+        0xfbeb4a00cee4f3c6ULL, 0x7f4a8a19fe1dd1aaULL, 0x1ead107d5235ca32ULL,
+        0xc2f6d1cfe2735b93ULL, 0xd591447252cd724bULL, 0xf187db07f9bc76e1ULL,
+        0x070b744a524a0a7eULL, 0xf86daa28f994d88fULL, 0x9acdb2ad26a02c0aULL,
+        0x9c03dad6300559eeULL, 0xd304dc0220c3ffa9ULL, 0xfb3ccf001bbeb72eULL,
+        0x025bc347b02819efULL, 0x032bfcf5a48f7bb0ULL, 0xc689c52deb4fd587ULL,
+        0xb8f717d5aca54e67ULL, 0xf85af974774396eeULL, 0x07cdc53e7b7497cbULL,
+        0x3bd2e15f1b6617ebULL, 0xa87a2694a6165e9cULL, 0x9be971ed4ec5c4beULL,
+        0x32ec432624fc519aULL, 0x0716ae2b01a3e183ULL, 0xb06cf8c9a8f0c80aULL,
+        0x249a276b4f3ff3d5ULL, 0x9dd2828c883ca416ULL, 0xc96dde1bc12f14e9ULL,
+        0xe69aa45fb455b729ULL, 0x7285d3c56cd3bf9cULL, 0x3d8f191a2403f143ULL,
+        0xea1b9d5fd703c4edULL, 0x41638defe21b22e0ULL, 0xff4530ce557e9bb1ULL,
+        0xc6728b8cd60b67a4ULL, 0x2bfaec13f2e9dea0ULL, 0xc33684442c3ee560ULL,
+        0xc8b11a0d351fa290ULL, 0x0b5acb2d3319cb6bULL, 0x8bcd38cb48b0006dULL,
+        0x5b2bd022ffcad6faULL, 0xa4d7d40ecebe59f4ULL, 0x6e5dffe5dbd5a959ULL,
+        0xa0894812b5cc4901ULL, 0xa57f90f11874364aULL, 0x6f8b5c3641c81e5eULL,
+        0xda45bc0d19d324fcULL, 0x3f1f9a3cdb6bb07fULL, 0x6e627d518089136fULL,
+        0x11ec9691eb1fd1e7ULL, 0x2122a9c26b93e6b0ULL, 0xb590ba6a4cd3430fULL,
+        0x75153ecae96332d5ULL, 0x336338619562bca3ULL, 0xccc5ca717243a68bULL,
+        0x2fb52dfbb3df8e4fULL, 0xa7ea03bf14176b5eULL, 0xc3fbab248adb4548ULL,
+        0x2d1ca7ac285c583bULL, 0x65741ce08b9e23d8ULL, 0xb12427b740d8d8f2ULL,
+        0x332376f9bf775466ULL, 0xbfdda96f2ea1e6f5ULL, 0x84b080d0c95f963bULL,
+        0x9cab451a7453c9e2ULL, 0x3146dc0d0e753dfcULL, 0xc1ebd6ca8f50cf21ULL,
+        0x0d9d847924367392ULL, 0xd9901a0a265a1b4bULL, 0xa16d57ed2fbb55b6ULL,
+        0x183b2493fed9eaa5ULL, 0x6e75da81098b3234ULL, 0xba7b708a761fbde9ULL,
+        0x97fff65f9cb5621aULL, 0xdb662e25b0cde964ULL, 0x63fa0366679c9227ULL,
+        0xe7699f0c9efcdb12ULL, 0x42598bd2e247f626ULL, 0x9ba06fa450501850ULL,
+        0x4187da27870f544cULL, 0x9b4c459fd886cbcaULL, 0x7de51aba26d621f0ULL,
+        0xe1abb2d1d7ca28f8ULL, 0x342287a8dd2f482dULL, 0x81ebc869ca76ac58ULL,
+        0xc01258c74d696cecULL, 0x75bd837055d931e6ULL, 0x4ce09e80cca9e148ULL,
+        0x54b898e3338c982cULL, 0xa7f8945c77111f03ULL, 0x99790a2f127b0867ULL,
+        0x073f135f6b053883ULL, 0x492b6283880e1a8eULL, 0xfd7f938a4b6fecc4ULL,
+        0x055b13ffc5a5b8f5ULL, 0x7e297bbe5c679725ULL, 0xa030a0927fc54647ULL,
+        0xcf266e8dc0768543ULL, 0x2ccd7fa89c7fc980ULL, 0xbe75d3c280303417ULL,
+        0xff0931443779aadfULL, 0x61a26b973f2bee7aULL, 0xca3dc9b0f226d652ULL,
+        0xaad97a1fe3a78ae6ULL, 0x9b411568d9a48becULL, 0xc7d0cc7097d9eb5bULL,
+        0x4b368c7ea91a34baULL, 0x39304178dd02fb66ULL, 0x137a07210ddcd639ULL,
+        0x301e2c7d399445ebULL, 0xf5156a59c48be7a3ULL, 0xc66107635ffeadcdULL,
+        0x517b57ad9e5b8e85ULL, 0xf3fc5cd33409f587ULL, 0xb3ec6253eddee370ULL,
+        0xb36eb99d24679808ULL, 0xd899efe31138f5a8ULL, 0x211c1561ee74d53cULL,
+        0xc2153155efc1a071ULL, 0xe55ad43a80186e69ULL, 0xaf5a480c26fa368fULL,
+        0x047a23a9a0860135ULL, 0x2ae67c6e5df3352aULL, 0x1d9adc8c638d3357ULL,
+        0x9948241b768766edULL, 0x022ba9fc3bfb635fULL, 0x92ef01aa4caee65aULL,
+        0xe6ae9ed6aba61a34ULL, 0xe2cee88790b9892dULL, 0x896c1993fa04b4feULL,
+        0x253074afdce5a78dULL, 0x79d74dbca04459d6ULL, 0xeb593ba627be6854ULL,
+        0x8c4aeb0336c05e0bULL, 0xb2ff6d55a00fa4d6ULL, 0xf94c3732ed2f0cc9ULL,
+        0xcd84020109c078e8ULL, 0x246c9be47fb2578cULL, 0x79fb2b568bc7791cULL,
+        0xb6cacf6c2c21af8cULL, 0x1840afd7d2810f06ULL, 0xfa430978daf582daULL,
+        0x9d49eeb0fd11b95aULL, 0xf21220de5e06300aULL, 0x161041156a206b71ULL,
+        0x5f27d87f126c47a2ULL, 0xb50db575a3d97ea3ULL, 0x59a5b5a4128ab8d2ULL,
+        0xdc960028339f4707ULL, 0x6ead42c485c7f7afULL, 0xd1ef85d5d8e85930ULL,
+        0x81885f6a2b35086aULL, 0x299178ac9a56f8d9ULL, 0xe29c9aee05adcd06ULL,
+        0xc28221dafb6a20d7ULL, 0x339c484ea5bee056ULL, 0x67c8ed9c701a516cULL,
+        0xa912c1bc1ad7a931ULL, 0x9cf6d8c87c01bc3dULL, 0x0bf5e577e135a594ULL,
+        0xff5c3ea76795622fULL, 0xaa3b366d6a936ea9ULL, 0x41458c21dff5373aULL,
+        0x9928e7bd5525e943ULL, 0xc64bff4e2bfb9cc9ULL, 0x26d774306d12eed0ULL,
+        0x2ae2e531b4f9f482ULL, 0x69e84da356b884beULL, 0xd0f4515c6efc77ceULL,
+        0x0baaeb8bf9b0ff01ULL, 0x81a5ddbf94554392ULL, 0x07798d824b56446bULL,
+        0x7d241c9eda06ec3fULL, 0x7e629ca017d697faULL, 0x41af2c4562302673ULL,
+        0xc01876ecfb470c3bULL, 0xec0dbb5c0faf7108ULL, 0xbcd8b260f25a5413ULL,
+        0x707a7ddf454933a7ULL, 0x79ccd5155048cdbcULL, 0xc8a696567db38040ULL,
+        0x8970c88d28be4ac9ULL, 0xa38c80e4258b595cULL, 0x1858761948d94a88ULL,
+        0x4196ac9d69b2310eULL, 0x73c59b38c1113e8eULL, 0xe0a4d2526bbb1256ULL,
+        0x8b34f723862ed9a0ULL, 0x1ee3818b398082baULL, 0x29ef37f3990a3fe0ULL,
+        0x1d0f41f22968c5e3ULL, 0x15d18a3ddcbc8055ULL, 0x714138560ee9b54eULL,
+        0xf31c2cb74d66f026ULL, 0xd9147a678c556347ULL, 0x5c6a1bb6a59467a1ULL,
+        0x85e415ee2708da6cULL, 0x482fc53ace965b9dULL, 0x8a9c5d1b378c970eULL,
+        0xceb37d48a24aad40ULL, 0xe7efc48e5e59ab8aULL, 0xb6a77ffbd7441079ULL,
+        0x8246f5d05713a235ULL, 0xab3b2d8ea6657f83ULL, 0x7c49bac00748c10eULL,
+        0xa69a2f6f987773fcULL, 0x2e188e7f7ff578f6ULL, 0x1ef7ab52195f143bULL,
+        0xdc463f9dd819bff2ULL, 0x549f5f1228671291ULL, 0x43cbfc981ee54a13ULL,
+        0xea1ec379d4383730ULL, 0x1735a8addea4de8fULL, 0x2c09b349133a9fe6ULL,
+        0xf029ed88ae81261bULL,
+};
+
+/**
+ * Masks checked before and after the expected size of the chunk. The
+ * boundary is less likely before it and more likely after it, so the sizes
+ * of the chunks concentrate around @c HASH_CDC_AVG_SIZE.
+ */
+static const uint64_t CDC_MASK_SMALL = 0x9292524a49490000ULL; /* 18 bits */
+static const uint64_t CDC_MASK_LARGE = 0x8912224448910000ULL; /* 14 bits */
+
+size_t hash_cdc_chunk_size(size_t size, const unsigned char *buff)
+{
+        if (size <= HASH_CDC_MIN_SIZE)
+                return size;
+
+        const size_t end = size < HASH_CDC_MAX_SIZE ? size : HASH_CDC_MAX_SIZE;
+        const size_t normal = end < HASH_CDC_AVG_SIZE ? end : HASH_CDC_AVG_SIZE;
+        uint64_t h = 0;
+        size_t i = HASH_CDC_MIN_SIZE;
+        for (; i < normal; i++) {
+                h = (h << 1) + GEAR[buff[i]];
+                if (!(h & CDC_MASK_SMALL))
+                        return i + 1;
+        }
+        for (; i < end; i++) {
+                h = (h << 1) + GEAR[buff[i]];
+                if (!(h & CDC_MASK_LARGE))
+                        return i + 1;
+        }
+        return end;
+}
+
+/**
+ * Reads exactly @c size bytes of the file at @c offset.
+ */
+static bool read_segment(int fd, uint64_t offset, size_t size,
+                         unsigned char *buff)
+{
+        size_t done = 0;
+        while (done < size) {
+                const ssize_t n = pread(fd, &buff[done], size - done,
+                                        offset + done);
+                if (n == -1 && errno == EINTR)
+                        continue;
+                if (n == -1)
+                        return false;
+                if (n == 0) {
+                        errno = EIO;
+                        return false;
+                }
+                done += n;
+        }
+        return true;
+}
+
+bool hash_file_prefix(int fd, uint64_t offset, uint64_t end, uint64_t *hash)
+{
+        if (offset == end)
+                return true;
+
+        unsigned char *buff = malloc(HASH_PREFIX_SEGMENT_SIZE);
+        if (buff == NULL)
+                return false;
+
+        uint64_t h = *hash;
+        bool success = true;
+        while (success && offset < end) {
+                const size_t size = end - offset < HASH_PREFIX_SEGMENT_SIZE
+                                            ? end - offset
+                                            : HASH_PREFIX_SEGMENT_SIZE;
+                success = read_segment(fd, offset, size, buff);
+                h = hash_xxh64(size, buff, h);
+                offset += size;
+        }
+        free(buff);
+        if (success)
+                *hash = h;
+        return success;
+}
@@ -42,14 +42,15 @@ static inline void log_warning(const char *function_name)
         } while (0)
 
 /**
- * @brief Log version of the packet_read from packet.h module.
+ * @brief Log version of the packet_stream_read from packet.h module.
  *
- * @see packet_read()
+ * @see packet_stream_read()
  */
-static inline bool log_packet_read(int fd, struct packet **packet_buffptr,
+static inline bool log_packet_read(struct packet_stream *stream,
+                                   struct packet **packet_buffptr,
                                    size_t *nptr)
 {
-        bool success = packet_read(fd, packet_buffptr, nptr);
+        bool success = packet_stream_read(stream, packet_buffptr, nptr);
         if (success) {
                 syslog(LOG_DEBUG,
                        "received packet code: %d | payload_size: %zu",
@@ -62,19 +63,73 @@ static inline bool log_packet_read(int fd, struct packet **packet_buffptr,
 }
 
 /**
- * @brief Log version of the packet_send from packet.h module.
+ * @brief Log version of the packet_stream_read_header from packet.h module.
  *
- * @see packet_send()
+ * @see packet_stream_read_header()
  */
-static inline bool log_packet_send(int fd, enum packet_msg_code code,
+static inline bool log_packet_read_header(struct packet_stream *stream,
+                                          struct packet **packet_buffptr,
+                                          size_t *nptr)
+{
+        bool success = packet_stream_read_header(stream, packet_buffptr, nptr);
+        if (success) {
+                syslog(LOG_DEBUG,
+                       "received packet code: %d | payload_size: %zu",
+                       (*packet_buffptr)->code,
+                       (*packet_buffptr)->payload_size);
+        } else {
+                log_error("packet read header");
+        }
+        return success;
+}
+
+/**
+ * @brief Log version of the packet_stream_send from packet.h module.
+ *
+ * @see packet_stream_send()
+ */
+static inline bool log_packet_send(struct packet_stream *stream,
+                                   enum packet_msg_code code,
                                    size_t payload_size,
                                    const unsigned char payload[payload_size])
 {
         syslog(LOG_DEBUG, "sent packet code: %d | payload_size: %zu", code,
                payload_size);
-        bool success = packet_send(fd, code, payload_size, payload);
+        bool success = packet_stream_send(stream, code, payload_size, payload);
         if (!success)
                 log_error("packet send");
         return success;
 }
+
+/**
+ * @brief Log version of the packet_stream_send_file from packet.h module.
+ *
+ * @see packet_stream_send_file()
+ */
+static inline bool log_packet_send_file(struct packet_stream *stream,
+                                        enum packet_msg_code code,
+                                        size_t payload_size, int in_fd,
+                                        off_t offset)
+{
+        syslog(LOG_DEBUG, "sent packet code: %d | payload_size: %zu", code,
+               payload_size);
+        bool success = packet_stream_send_file(stream, code, payload_size,
+                                               in_fd, offset);
+        if (!success)
+                log_error("packet send file");
+        return success;
+}
+
+/**
+ * @brief Log version of the packet_stream_flush from packet.h module.
+ *
+ * @see packet_stream_flush()
+ */
+static inline bool log_packet_flush(struct packet_stream *stream)
+{
+        bool success = packet_stream_flush(stream);
+        if (!success)
+                log_error("packet flush");
+        return success;
+}
 #endif //LOG_H
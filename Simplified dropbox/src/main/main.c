@@ -22,6 +22,12 @@
 #include <sys/wait.h>
 
 const char *DEFAULT_PORT = "42069";
+const unsigned long DEFAULT_WINDOW_SIZE = 64;
+const unsigned long DEFAULT_CHUNK_SIZE = 1024 * 1024;
+const unsigned long DEFAULT_READ_AHEAD = 4;
+const unsigned long DEFAULT_SCANNERS = 4;
+const unsigned long DEFAULT_QUIET_PERIOD = 100;
+const unsigned long DEFAULT_SESSION_TIMEOUT = 30 * 1000;
 
 static bool daemonize(void)
 {
@@ -55,6 +61,12 @@ int main(int argc, char *argv[])
 {
         struct settings settings = {
                 .port = DEFAULT_PORT,
+                .window_size = DEFAULT_WINDOW_SIZE,
+                .chunk_size = DEFAULT_CHUNK_SIZE,
+                .read_ahead = DEFAULT_READ_AHEAD,
+                .scanners = DEFAULT_SCANNERS,
+                .quiet_period = DEFAULT_QUIET_PERIOD,
+                .session_timeout = DEFAULT_SESSION_TIMEOUT,
                 .read_fd = -1,
                 .write_fd = -1,
                 .lock_file_fd = -1,
@@ -1,7 +1,13 @@
 #include "options.h"
 
+#include "client.h"
+#include "packet.h"
+#include "server.h"
+
+#include <errno.h>
 #include <getopt.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 #define SIMPLE_OPTIONS                                                         \
@@ -11,11 +17,12 @@
         X(sparse, 's', "s")                                                    \
         X(foreground, 'n', "n")                                                \
         X(force, 'f', "f")                                                     \
+        X(delete, 'D', "D")                                                    \
         X(debug, 'd', "d")                                                     \
         X(quiet, 'q', "q")
 
 #define X(NAME, VAL, VAL_STR) VAL_STR
-static const char *OPTSTRING = SIMPLE_OPTIONS "pho";
+static const char *OPTSTRING = SIMPLE_OPTIONS "p:how:c:uW:r:j:Q:T:";
 #undef X
 
 #define X(NAME, VAL, VAL_STR) { .name = #NAME, .val = VAL },
@@ -26,6 +33,14 @@ static const struct option LONGOPTS[] = {
         // clang-format on
         { .name = "port", .val = 'p', .has_arg = required_argument },
         { .name = "one-shot", .val = 'o' },
+        { .name = "window", .val = 'w', .has_arg = required_argument },
+        { .name = "chunk-size", .val = 'c', .has_arg = required_argument },
+        { .name = "io-uring", .val = 'u' },
+        { .name = "writers", .val = 'W', .has_arg = required_argument },
+        { .name = "read-ahead", .val = 'r', .has_arg = required_argument },
+        { .name = "scanners", .val = 'j', .has_arg = required_argument },
+        { .name = "quiet-period", .val = 'Q', .has_arg = required_argument },
+        { .name = "session-timeout", .val = 'T', .has_arg = required_argument },
         { 0 },
 };
 
@@ -36,8 +51,13 @@ static void help(const char *program_name)
                "\n"
                "DESCRIPTION:\n"
                "If the program is run as client, then it will send files from\n"
-               "SOURCE to HOST. Additionally if -o isn't set, the client starts\n"
+               "SOURCE and its subfolders to HOST. Additionally if -o isn't set, the client starts\n"
                "watching changes in the SOURCE and synchronize them with the server.\n"
+               "The directories are watched through one fanotify(7) mark of the\n"
+               "filesystem if the client may set it, otherwise with inotify(7).\n"
+               "The files and folders moved within SOURCE are renamed on HOST.\n"
+               "When the connection is lost, the client keeps recording the changes\n"
+               "and sends them after it connects to the server again.\n"
                "If the program is run as server, then it will listen for the\n"
                "client requests.\n"
                "\n"
@@ -52,6 +72,8 @@ static void help(const char *program_name)
                "\n"
                "    -f,--force        Allows synchronization with non-empty TARGET folder.\n"
                "\n"
+               "    -D,--delete       Deletes the files of TARGET which are not in SOURCE.\n"
+               "\n"
                "\n"
                "    -h                Shows this message.\n"
                "\n"
@@ -63,10 +85,124 @@ static void help(const char *program_name)
                "\n"
                "    -q,--quiet        Sets WARNING log level.\n"
                "\n"
-               "    -s,--sparse       Saves files with holes effectively.\n",
+               "    -s,--sparse       Saves files with holes effectively.\n"
+               "\n"
+               "    -w,--window=N     Maximum number of data blocks sent without\n"
+               "                      waiting for the acknowledgement. 0 waits for\n"
+               "                      every block.\n"
+               "\n"
+               "    -c,--chunk-size=N Maximum size of the data chunks in KiB, from\n"
+               "                      256 to 4096. The peers use the smaller one.\n"
+               "\n"
+               "    -u,--io-uring     The server writes the blocks asynchronously\n"
+               "                      through io_uring while it receives the next\n"
+               "                      ones. Without io_uring it writes them directly.\n"
+               "\n"
+               "    -W,--writers=N    The server writes the blocks in N threads, from\n"
+               "                      1 to 64, while it receives the next ones. With\n"
+               "                      -u they are used if io_uring is unavailable.\n"
+               "\n"
+               "    -r,--read-ahead=N The client reads N data chunks ahead, up to\n"
+               "                      64, while it sends the current one. 0 reads\n"
+               "                      every chunk when it is sent. Defaults to 4.\n"
+               "\n"
+               "    -j,--scanners=N   The client scans SOURCE in N threads, from 1\n"
+               "                      to 64, while it sends the files found so far.\n"
+               "                      Defaults to 4.\n"
+               "\n"
+               "    -Q,--quiet-period=MS The client sends the changes of a file once\n"
+               "                      it has not changed for MS milliseconds, up to\n"
+               "                      60000, but at the latest after ten such periods.\n"
+               "                      0 sends them right away. Defaults to 100.\n"
+               "\n"
+               "    -T,--session-timeout=MS The server closes the session of a client\n"
+               "                      which does not take its replies for MS milliseconds,\n"
+               "                      or stalls in the middle of a file while the server\n"
+               "                      shuts down, up to 3600000. 0 waits forever.\n"
+               "                      Defaults to 30000.\n",
                program_name, program_name);
 }
 
+static bool parse_number(const char *str, unsigned long *number)
+{
+        char *end = NULL;
+        errno = 0;
+        *number = strtoul(str, &end, 10);
+        return errno == 0 && *str != '\0' && *end == '\0' && *str != '-';
+}
+
+static bool parse_window(const char *str, struct settings *settings)
+{
+        if (!parse_number(str, &settings->window_size)) {
+                fprintf(stderr, "invalid window size '%s'\n", str);
+                return false;
+        }
+        return true;
+}
+
+static bool parse_chunk_size(const char *str, struct settings *settings)
+{
+        unsigned long kibibytes;
+        if (!parse_number(str, &kibibytes)
+            || kibibytes < PACKET_MIN_CHUNK_SIZE / 1024
+            || kibibytes > PACKET_MAX_CHUNK_SIZE / 1024) {
+                fprintf(stderr, "invalid chunk size '%s'\n", str);
+                return false;
+        }
+        settings->chunk_size = kibibytes * 1024;
+        return true;
+}
+
+static bool parse_writers(const char *str, struct settings *settings)
+{
+        if (!parse_number(str, &settings->writers) || settings->writers == 0
+            || settings->writers > SERVER_MAX_WRITERS) {
+                fprintf(stderr, "invalid number of writers '%s'\n", str);
+                return false;
+        }
+        return true;
+}
+
+static bool parse_read_ahead(const char *str, struct settings *settings)
+{
+        if (!parse_number(str, &settings->read_ahead)
+            || settings->read_ahead > CLIENT_MAX_READ_AHEAD) {
+                fprintf(stderr, "invalid read-ahead '%s'\n", str);
+                return false;
+        }
+        return true;
+}
+
+static bool parse_scanners(const char *str, struct settings *settings)
+{
+        if (!parse_number(str, &settings->scanners) || settings->scanners == 0
+            || settings->scanners > CLIENT_MAX_SCANNERS) {
+                fprintf(stderr, "invalid number of scanners '%s'\n", str);
+                return false;
+        }
+        return true;
+}
+
+static bool parse_quiet_period(const char *str, struct settings *settings)
+{
+        if (!parse_number(str, &settings->quiet_period)
+            || settings->quiet_period > CLIENT_MAX_QUIET_PERIOD) {
+                fprintf(stderr, "invalid quiet period '%s'\n", str);
+                return false;
+        }
+        return true;
+}
+
+static bool parse_session_timeout(const char *str, struct settings *settings)
+{
+        if (!parse_number(str, &settings->session_timeout)
+            || settings->session_timeout > SERVER_MAX_SESSION_TIMEOUT) {
+                fprintf(stderr, "invalid session timeout '%s'\n", str);
+                return false;
+        }
+        return true;
+}
+
 static bool validate_options(int argc, struct settings *settings)
 {
         if (settings->server == settings->client) {
@@ -112,6 +248,37 @@ enum main_opt_code main_options_parse(int argc, char *const argv[],
                 case 'p':
                         settings->port = optarg;
                         break;
+                case 'w':
+                        if (!parse_window(optarg, settings))
+                                return OPT_ERROR;
+                        break;
+                case 'c':
+                        if (!parse_chunk_size(optarg, settings))
+                                return OPT_ERROR;
+                        break;
+                case 'u':
+                        settings->io_uring = true;
+                        break;
+                case 'W':
+                        if (!parse_writers(optarg, settings))
+                                return OPT_ERROR;
+                        break;
+                case 'r':
+                        if (!parse_read_ahead(optarg, settings))
+                                return OPT_ERROR;
+                        break;
+                case 'j':
+                        if (!parse_scanners(optarg, settings))
+                                return OPT_ERROR;
+                        break;
+                case 'Q':
+                        if (!parse_quiet_period(optarg, settings))
+                                return OPT_ERROR;
+                        break;
+                case 'T':
+                        if (!parse_session_timeout(optarg, settings))
+                                return OPT_ERROR;
+                        break;
                 default:
                         return OPT_ERROR;
                         break;
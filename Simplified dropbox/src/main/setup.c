@@ -5,14 +5,24 @@
 #include "log.h"
 
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
 static int open_socket(const struct addrinfo *info)
 {
         int fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
-        if (fd == -1)
+        if (fd == -1) {
                 log_warning("socket");
+                return fd;
+        }
+
+        // The packets are batched by the packet stream, Nagle's algorithm
+        // would only delay them. Accepted sockets inherit the option.
+        if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof(int))
+            == -1)
+                log_warning("setsockopt");
         return fd;
 }
 
@@ -78,18 +88,27 @@ static bool open_client_connection(const char *host, struct settings *settings)
         return settings->sock_fd != -1;
 }
 
+/**
+ * Closes the lost connection of the client and connects to the server again.
+ */
+static bool reopen_client_connection(struct settings *settings)
+{
+        if (settings->sock_fd != -1)
+                close_socket(settings->sock_fd);
+        return open_client_connection(settings->host, settings);
+}
+
 static bool setup_listening_socket(int sock_fd, const struct addrinfo *info)
 {
-#ifdef DROPBOX_TESTS
-        // Without this the tests fail because the source:port
-        // will be still used from the previous tests.
+        // Without this the restarted server cannot listen until the
+        // connections of the previous one leave TIME_WAIT, and the tests
+        // fail because the source:port is still used by the previous tests.
         if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 },
                        sizeof(int))
             == -1) {
                 log_warning("setsockopt");
                 return false;
         }
-#endif
         if (bind(sock_fd, info->ai_addr, info->ai_addrlen) == -1) {
                 log_warning("bind");
                 return false;
@@ -137,6 +156,8 @@ MAIN_SETUP(client)
 {
         if (!open_client_connection(args[0], settings))
                 return false;
+        settings->host = args[0];
+        settings->reconnect = reopen_client_connection;
         settings->cwd = args[1];
 
         return true;
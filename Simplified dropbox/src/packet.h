@@ -35,6 +35,24 @@ enum packet_msg_code {
         MSG_DELETE_FILE,    /**< delete a file                              */
         MSG_CHANGE_FILE,    /**< change a regular file                      */
         MSG_REJECTED,       /**< client rejected by server                  */
+        MSG_ACK,            /**< cumulative acknowledgement of data blocks  */
+        MSG_DELTA_FILE,     /**< change a regular file by a delta           */
+        MSG_SIGNATURES,     /**< signatures of the blocks of the old file   */
+        MSG_COPY_BLOCKS,    /**< copy blocks of the old file to the new one */
+        MSG_OFFER_CHUNKS,   /**< hashes of the next chunks of the open file */
+        MSG_MISSING_CHUNKS, /**< offered chunks the server does not have    */
+        MSG_GET_MANIFEST,   /**< ask for the files the server has           */
+        MSG_MANIFEST,       /**< metadata of some of the files of server    */
+        MSG_GET_RESUME,     /**< ask for the checkpoint of a partial file   */
+        MSG_RESUME_OFFSET,  /**< checkpoint of the partial file             */
+        MSG_RESUME_FILE,    /**< continue the partial file at checkpoint    */
+        MSG_CREATE_DIR,     /**< create a directory                         */
+        MSG_DELETE_DIR,     /**< delete a directory with all its content    */
+        MSG_FILE_BUNDLE,    /**< create several small files at once         */
+        MSG_BUNDLE_STATUS,  /**< files of the bundle the server created     */
+        MSG_WRITE_HOLE,     /**< leave a hole in the open file              */
+        MSG_FILE_SIZE,      /**< final size of the created file             */
+        MSG_RENAME,         /**< rename a file or a directory               */
         MSG_COUNT,          /**< count of MSG codes                         */
 };
 
@@ -55,8 +73,142 @@ struct packet_payload_abort {
         int32_t error_number; /**< errno coresponding to a failure */
 };
 
+/**
+ * Version of the protocol spoken by this program. Peers which don't send it
+ * are version 0 and transfer the files by blocks of the filesystem size.
+ */
+#define PACKET_PROTOCOL_VERSION 1
+
+/**
+ * Optional features of the protocol announced in the settings. Only the
+ * features announced by both peers are used.
+ */
+enum packet_feature {
+        PACKET_FEATURE_CHUNKS = 1 << 0, /**< data chunks larger than a block */
+        PACKET_FEATURE_DELTA = 1 << 1,  /**< changed files sent as deltas */
+        PACKET_FEATURE_DEDUP = 1 << 2,  /**< chunks the server has not sent */
+        PACKET_FEATURE_MANIFEST = 1 << 3, /**< files the server has listed */
+        PACKET_FEATURE_RESUME = 1 << 4, /**< partial files are continued */
+        PACKET_FEATURE_DIRS = 1 << 5,   /**< files in the subdirectories */
+        PACKET_FEATURE_BUNDLE = 1 << 6, /**< small files sent in bundles */
+        PACKET_FEATURE_HOLES = 1 << 7,  /**< holes sent as their size */
+        PACKET_FEATURE_PREALLOC = 1 << 8, /**< created files preallocated */
+        PACKET_FEATURE_REPLACE = 1 << 9, /**< changed files replaced at once */
+        PACKET_FEATURE_RENAME = 1 << 10, /**< moved files renamed in place */
+};
+
+/**
+ * Features supported by this program.
+ */
+#define PACKET_FEATURES                                                        \
+        ((uint64_t)(PACKET_FEATURE_CHUNKS | PACKET_FEATURE_DELTA               \
+                    | PACKET_FEATURE_DEDUP | PACKET_FEATURE_MANIFEST           \
+                    | PACKET_FEATURE_RESUME | PACKET_FEATURE_DIRS              \
+                    | PACKET_FEATURE_BUNDLE | PACKET_FEATURE_HOLES             \
+                    | PACKET_FEATURE_PREALLOC | PACKET_FEATURE_REPLACE         \
+                    | PACKET_FEATURE_RENAME))
+
+/**
+ * Bounds of the size of the data chunks if @c PACKET_FEATURE_CHUNKS is used.
+ */
+#define PACKET_MIN_CHUNK_SIZE (256 * 1024)
+#define PACKET_MAX_CHUNK_SIZE (4 * 1024 * 1024)
+
 struct packet_payload_settings {
-        uint64_t fs_block_size; /**< filesystem block size */
+        uint64_t fs_block_size;    /**< filesystem block size */
+        uint64_t window_size;      /**< max number of unacknowledged blocks,
+                                        0 if the sender cannot pipeline them */
+        uint64_t protocol_version; /**< @c PACKET_PROTOCOL_VERSION */
+        uint64_t features;         /**< mask of enum packet_feature */
+        uint64_t chunk_size;       /**< max size of a data chunk */
+};
+
+struct packet_payload_ack {
+        uint64_t block_count; /**< blocks of the open file written so far */
+};
+
+struct packet_payload_copy_blocks {
+        uint64_t index; /**< index of the first block of the old file */
+        uint64_t count; /**< number of the consecutive blocks */
+};
+
+/**
+ * Hole of the sparse file sent in MSG_WRITE_HOLE. The server replaces the
+ * bytes at the position of the open file with the hole and moves after it.
+ */
+struct packet_payload_hole {
+        uint64_t size; /**< size of the hole */
+};
+
+/**
+ * Final size of the created file sent in MSG_FILE_SIZE before its blocks,
+ * so the server allocates the file at once instead of block by block.
+ */
+struct packet_payload_file_size {
+        uint64_t size;   /**< size of the file */
+        uint64_t sparse; /**< 1 if the holes of the file are kept */
+};
+
+/**
+ * Checkpoint of the partial file sent in MSG_RESUME_OFFSET and confirmed by
+ * MSG_RESUME_FILE.
+ */
+struct packet_payload_resume {
+        uint64_t offset; /**< bytes of the file durably written, a multiple
+                              of HASH_PREFIX_SEGMENT_SIZE, 0 if none */
+        uint64_t hash;   /**< hash_file_prefix() of the written bytes */
+};
+
+/**
+ * Signature of a block of the old file in the payload of MSG_SIGNATURES.
+ */
+struct packet_block_signature {
+        uint64_t weak;   /**< rolling checksum of the block, see hash.h */
+        uint64_t strong; /**< XXH64 of the block with seed 0 */
+};
+
+/**
+ * Chunk of the file in the payload of MSG_OFFER_CHUNKS.
+ */
+struct packet_chunk_offer {
+        unsigned char hash[32]; /**< SHA-256 of the chunk */
+        uint64_t size;          /**< size of the chunk */
+};
+
+/**
+ * File of the server in the payload of MSG_MANIFEST, followed by its name.
+ * With @c PACKET_FEATURE_DIRS the directories are listed too, before the
+ * files in them, and the names are paths relative to the directory of the
+ * server.
+ */
+struct packet_manifest_entry {
+        uint64_t size;       /**< size of the file */
+        uint64_t mtime_sec;  /**< time of last modification, seconds */
+        uint64_t mtime_nsec; /**< time of last modification, nanoseconds */
+        uint64_t mode;       /**< type and permissions of the file */
+        uint64_t name_size;  /**< length of the name without '\0' */
+};
+
+/**
+ * Limits of MSG_FILE_BUNDLE if @c PACKET_FEATURE_BUNDLE is used.
+ */
+#define PACKET_BUNDLE_MAX_FILES 1024
+#define PACKET_BUNDLE_MAX_SIZE (1024 * 1024)
+
+/**
+ * File in the payload of MSG_FILE_BUNDLE, followed by its path and its
+ * content. The server replaces the file of the path with a new one.
+ */
+struct packet_bundle_record {
+        uint64_t size;       /**< size of the content */
+        uint64_t mode;       /**< permissions of the file */
+        uint64_t uid;        /**< uid of the owner of the file */
+        uint64_t gid;        /**< gid of the owner of the file */
+        uint64_t atime_sec;  /**< time of last access, seconds */
+        uint64_t atime_nsec; /**< time of last access, nanoseconds */
+        uint64_t mtime_sec;  /**< time of last modification, seconds */
+        uint64_t mtime_nsec; /**< time of last modification, nanoseconds */
+        uint64_t name_size;  /**< length of the path without '\0' */
 };
 
 struct packet_payload_set_perm_modes {
@@ -86,6 +238,39 @@ struct packet_payload_timestamps {
 // +-------------------+----------------------------+-----------------------------------------------+
 // | MSG_DELETE_FILE   | path length including '\0' | null-terminated byte string representing path |
 // +-------------------+----------------------------+-----------------------------------------------+
+// | MSG_DELTA_FILE    | path length including '\0' | null-terminated byte string representing path |
+// +-------------------+----------------------------+-----------------------------------------------+
+// | MSG_GET_RESUME    | path length including '\0' | null-terminated byte string representing path |
+// +-------------------+----------------------------+-----------------------------------------------+
+// | MSG_CREATE_DIR    | path length including '\0' | null-terminated byte string representing path |
+// +-------------------+----------------------------+-----------------------------------------------+
+// | MSG_DELETE_DIR    | path length including '\0' | null-terminated byte string representing path |
+// +-------------------+----------------------------+-----------------------------------------------+
+// | MSG_RENAME        | both path lengths          | null-terminated old path followed by the      |
+// |                   | including '\0'             | null-terminated new path                      |
+// +-------------------+----------------------------+-----------------------------------------------+
+// | MSG_SIGNATURES    | 16 + 16 * number of blocks | uint64_t block size and uint64_t file size    |
+// |                   |                            | followed by struct packet_block_signature of  |
+// |                   |                            | every block, all in network byte order        |
+// +-------------------+----------------------------+-----------------------------------------------+
+// | MSG_OFFER_CHUNKS  | 40 * number of chunks      | struct packet_chunk_offer of every chunk, the |
+// |                   |                            | size in network byte order                    |
+// +-------------------+----------------------------+-----------------------------------------------+
+// | MSG_MISSING_CHUNKS| 8 * number of chunks       | uint64_t indexes of the missing chunks within |
+// |                   |                            | the offer in network byte order, ascending    |
+// +-------------------+----------------------------+-----------------------------------------------+
+// | MSG_MANIFEST      | size of all entries        | struct packet_manifest_entry in network byte  |
+// |                   |                            | order followed by the name of the file for    |
+// |                   |                            | every file                                    |
+// +-------------------+----------------------------+-----------------------------------------------+
+// | MSG_FILE_BUNDLE   | size of all records and 8  | uint64_t number of the files followed by      |
+// |                   |                            | struct packet_bundle_record, the path and the |
+// |                   |                            | content of every file, the numbers in network |
+// |                   |                            | byte order                                    |
+// +-------------------+----------------------------+-----------------------------------------------+
+// | MSG_BUNDLE_STATUS | (number of the files + 7)  | bit i % 8 of byte i / 8 is set if the server  |
+// |                   | / 8                        | created the file i of the bundle              |
+// +-------------------+----------------------------+-----------------------------------------------+
 
 /***********************************************
  * Functions for sending and receiving packets *
@@ -109,6 +294,9 @@ struct packet_payload_timestamps {
  * In either case, on a successful call, @c *packet_buffptr and @c *n
  * will be updated to reflect the buffer address and allocated size respectively.
  *
+ * Fields of a fixed-size payload which were not sent by the peer, e.g. because
+ * it is an older version of the program, are set to 0.
+ *
  * Errors:
  *  	ENOMSG - packet contained unknown message code.
  *
@@ -122,6 +310,63 @@ struct packet_payload_timestamps {
  */
 bool packet_read(int fd, struct packet **packet_buffptr, size_t *n);
 
+/**
+ * Reads only the message code and the payload size of a packet from @c fd.
+ *
+ * The payload stays in @c fd and has to be read by packet_read_payload() or
+ * packet_read_payload_to_file() before the next packet is read. The buffer
+ * is handled the same way as in packet_read().
+ *
+ * @see packet_read()
+ *
+ * @param fd             a file descriptor open for reading
+ * @param packet_buffptr an address of the pointer of type struct packet *
+ * @param n              a pointer to a value representing size of @c packet_buffptr
+ * @return               true on success;
+ *                       false on failure and errno is set appropriately
+ */
+bool packet_read_header(int fd, struct packet **packet_buffptr, size_t *n);
+
+/**
+ * Reads the payload of a packet whose header was read by
+ * packet_read_header().
+ *
+ * @see packet_read()
+ *
+ * @param fd             a file descriptor open for reading
+ * @param packet_buffptr an address of the pointer holding the packet header
+ * @param n              a pointer to a value representing size of @c packet_buffptr
+ * @return               true on success;
+ *                       false on failure and errno is set appropriately
+ */
+bool packet_read_payload(int fd, struct packet **packet_buffptr, size_t *n);
+
+/**
+ * Writes the payload of a packet whose header was read by
+ * packet_read_header() straight into @c file_fd at its current offset.
+ *
+ * The payload is moved by splice(2) from @c fd through the pipe
+ * @c pipe_fds without being copied into the user space. If @c pipe_fds
+ * is NULL or the descriptors don't support splice(2), the payload is
+ * copied through a buffer instead.
+ *
+ * @note Only for packets with variable-sized payload (e.g. MSG_WRITE_BLOCK).
+ *
+ * Errors:
+ *  	EIO - @c fd ended before the whole payload was read.
+ *
+ * For other errors see splice(2), read(2) and write(2).
+ *
+ * @param fd        a file descriptor open for reading
+ * @param packet    a packet header read by packet_read_header()
+ * @param file_fd   a file descriptor open for writing
+ * @param pipe_fds  an empty pipe used for splicing or NULL
+ * @return          true on success;
+ *                  false on failure and errno is set appropriately
+ */
+bool packet_read_payload_to_file(int fd, const struct packet *packet,
+                                 int file_fd, const int pipe_fds[2]);
+
 /**
  * Sends a packet through @c fd.
  *
@@ -140,4 +385,212 @@ bool packet_read(int fd, struct packet **packet_buffptr, size_t *n);
 bool packet_send(int fd, enum packet_msg_code code, size_t payload_size,
                  const unsigned char payload[payload_size]);
 
+/**
+ * Sends a packet through @c fd with the payload taken directly from
+ * the file @c in_fd.
+ *
+ * The payload is moved by sendfile(2) without being copied into the user
+ * space. If @c fd doesn't support it, the payload is copied through
+ * a buffer instead. The packet on the wire is the same as the one sent by
+ * packet_send(), so the receiving side doesn't need to know about it.
+ *
+ * @note Only for packets with variable-sized payload (e.g. MSG_WRITE_BLOCK).
+ *
+ * Errors:
+ *  	EIO - @c in_fd ended before @c payload_size bytes were sent.
+ *
+ * For other errors see sendfile(2), pread(2) and write(2).
+ *
+ * @param fd            a file descriptor open for writing
+ * @param code          a message code of a packet
+ * @param payload_size  a size of the payload in bytes
+ * @param in_fd         a file descriptor of a regular file open for reading
+ * @param offset        an offset in @c in_fd where the payload starts
+ * @return              true on success;
+ *                      false on failure and errno is set appropriately
+ */
+bool packet_send_file(int fd, enum packet_msg_code code, size_t payload_size,
+                      int in_fd, off_t offset);
+
+/**********************************
+ * Buffered stream of the packets *
+ **********************************/
+
+/**
+ * Buffered connection for sending and receiving packets.
+ *
+ * The sent packets are queued in a buffer and written together by one
+ * writev(2) call when the buffer is full, when packet_stream_flush() is
+ * called, or before the stream blocks while reading. The read packets
+ * are read ahead into a buffer, so several small packets cost one read(2)
+ * call. The packets on the wire are the same as the ones sent by
+ * packet_send().
+ *
+ * @note Data read ahead are not visible to poll(2) on the read end, use
+ *       packet_stream_has_buffered() before waiting for the connection.
+ *
+ * Over non-blocking descriptors the packets are received piece by piece
+ * by packet_stream_receive() whenever the connection has some data, and
+ * read once packet_stream_has_packet() tells they are complete. The calls
+ * which still have to wait are limited by packet_stream_set_timeout().
+ */
+struct packet_stream;
+
+/**
+ * Creates a stream over the byte stream @c read_fd and @c write_fd.
+ *
+ * @param read_fd   a file descriptor open for reading
+ * @param write_fd  a file descriptor open for writing
+ * @return          a new stream on success;
+ *                  NULL on failure and errno is set appropriately
+ */
+struct packet_stream *packet_stream_create(int read_fd, int write_fd);
+
+/**
+ * Frees the stream. The pending writes are not flushed and the file
+ * descriptors are not closed.
+ *
+ * @param stream  a stream created by packet_stream_create() or NULL
+ */
+void packet_stream_destroy(struct packet_stream *stream);
+
+/**
+ * Limits how long one call may wait for the non-blocking descriptors of
+ * the stream, e.g. for a peer which does not read its replies. The call
+ * fails with ETIMEDOUT after @c timeout_ms milliseconds in total.
+ *
+ * @param stream      a packet stream
+ * @param timeout_ms  the limit in milliseconds; -1 waits forever
+ */
+void packet_stream_set_timeout(struct packet_stream *stream, int timeout_ms);
+
+/**
+ * Queues a packet for sending.
+ *
+ * @see packet_send()
+ *
+ * @param stream        a packet stream
+ * @param code          a message code of a packet
+ * @param payload_size  a size of the payload in bytes
+ * @param payload       a pointer to a payload buffer
+ * @return              true on success;
+ *                      false on failure and errno is set appropriately
+ */
+bool packet_stream_send(struct packet_stream *stream, enum packet_msg_code code,
+                        size_t payload_size,
+                        const unsigned char payload[payload_size]);
+
+/**
+ * Flushes the queued packets and sends a packet with the payload taken
+ * directly from the file @c in_fd.
+ *
+ * @see packet_send_file()
+ *
+ * @param stream        a packet stream
+ * @param code          a message code of a packet
+ * @param payload_size  a size of the payload in bytes
+ * @param in_fd         a file descriptor of a regular file open for reading
+ * @param offset        an offset in @c in_fd where the payload starts
+ * @return              true on success;
+ *                      false on failure and errno is set appropriately
+ */
+bool packet_stream_send_file(struct packet_stream *stream,
+                             enum packet_msg_code code, size_t payload_size,
+                             int in_fd, off_t offset);
+
+/**
+ * Writes all queued packets.
+ *
+ * @param stream  a packet stream
+ * @return        true on success;
+ *                false on failure and errno is set appropriately
+ */
+bool packet_stream_flush(struct packet_stream *stream);
+
+/**
+ * Reads a packet from the stream.
+ *
+ * @see packet_read()
+ *
+ * @param stream          a packet stream
+ * @param packet_buffptr  an address of the pointer of type struct packet *
+ * @param n               a pointer to a value representing size of @c packet_buffptr
+ * @return                true on success;
+ *                        false on failure and errno is set appropriately
+ */
+bool packet_stream_read(struct packet_stream *stream,
+                        struct packet **packet_buffptr, size_t *n);
+
+/**
+ * @see packet_read_header()
+ */
+bool packet_stream_read_header(struct packet_stream *stream,
+                               struct packet **packet_buffptr, size_t *n);
+
+/**
+ * @see packet_read_payload()
+ */
+bool packet_stream_read_payload(struct packet_stream *stream,
+                                struct packet **packet_buffptr, size_t *n);
+
+/**
+ * The part of the payload already read ahead is written from the buffer,
+ * the rest is spliced from the connection.
+ *
+ * @see packet_read_payload_to_file()
+ */
+bool packet_stream_read_payload_to_file(struct packet_stream *stream,
+                                        const struct packet *packet,
+                                        int file_fd, const int pipe_fds[2]);
+
+/**
+ * Reads the payload of the packet whose header was read by
+ * packet_stream_read_header() into @c buff without decoding it, e.g. into
+ * a buffer registered for asynchronous writes.
+ *
+ * @param stream  a packet stream
+ * @param packet  the header of the packet
+ * @param buff    a buffer of at least @c packet->payload_size bytes
+ * @return        true on success;
+ *                false on failure and errno is set appropriately
+ */
+bool packet_stream_read_payload_to_buffer(struct packet_stream *stream,
+                                          const struct packet *packet,
+                                          unsigned char *buff);
+
+/**
+ * Checks whether there are data read ahead, so the next packet may be read
+ * without waiting for the connection.
+ *
+ * @param stream  a packet stream
+ * @return        true if some data are buffered;
+ *                false otherwise
+ */
+bool packet_stream_has_buffered(const struct packet_stream *stream);
+
+/**
+ * Reads what the non-blocking read end has without waiting, until the
+ * next packet is buffered whole. The part of the packet received so far
+ * is kept in the stream, so the rest is received by the next call once
+ * the connection has more data.
+ *
+ * @param stream  a packet stream over a non-blocking read end
+ * @return        true if the next packet is complete or the connection has
+ *                no more data for now;
+ *                false on failure, ECONNRESET if the peer closed the
+ *                connection
+ */
+bool packet_stream_receive(struct packet_stream *stream);
+
+/**
+ * Checks whether the next packet is buffered whole, so it is read without
+ * waiting for the connection. A packet with an invalid header counts as
+ * complete, its reading fails.
+ *
+ * @param stream  a packet stream
+ * @return        true if the packet is complete;
+ *                false otherwise
+ */
+bool packet_stream_has_packet(const struct packet_stream *stream);
+
 #endif //PACKET_H
@@ -3,10 +3,13 @@
 #include "log.h"
 #include "utils.h"
 
-#include <alloca.h>
 #include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/sendfile.h>
 
 typedef uint8_t code_t;
 typedef uint64_t payload_size_t;
@@ -42,12 +45,99 @@ static arg_t *settings_ton(const unsigned char *payload, arg_t args[])
         struct packet_payload_settings *p
                 = (struct packet_payload_settings *)payload;
         args[0] = host_to_network(p->fs_block_size);
+        args[1] = host_to_network(p->window_size);
+        args[2] = host_to_network(p->protocol_version);
+        args[3] = host_to_network(p->features);
+        args[4] = host_to_network(p->chunk_size);
         return args;
 }
 static size_t settings_toh(const arg_t args[], unsigned char *payload)
 {
         struct packet_payload_settings p;
         p.fs_block_size = (uint64_t)network_to_host(args[0]);
+        p.window_size = (uint64_t)network_to_host(args[1]);
+        p.protocol_version = (uint64_t)network_to_host(args[2]);
+        p.features = (uint64_t)network_to_host(args[3]);
+        p.chunk_size = (uint64_t)network_to_host(args[4]);
+        memcpy(payload, &p, sizeof(p));
+        return sizeof(p);
+}
+
+static arg_t *ack_ton(const unsigned char *payload, arg_t args[])
+{
+        struct packet_payload_ack *p = (struct packet_payload_ack *)payload;
+        args[0] = host_to_network(p->block_count);
+        return args;
+}
+static size_t ack_toh(const arg_t args[], unsigned char *payload)
+{
+        struct packet_payload_ack p;
+        p.block_count = (uint64_t)network_to_host(args[0]);
+        memcpy(payload, &p, sizeof(p));
+        return sizeof(p);
+}
+
+static arg_t *copy_blocks_ton(const unsigned char *payload, arg_t args[])
+{
+        struct packet_payload_copy_blocks *p
+                = (struct packet_payload_copy_blocks *)payload;
+        args[0] = host_to_network(p->index);
+        args[1] = host_to_network(p->count);
+        return args;
+}
+static size_t copy_blocks_toh(const arg_t args[], unsigned char *payload)
+{
+        struct packet_payload_copy_blocks p;
+        p.index = (uint64_t)network_to_host(args[0]);
+        p.count = (uint64_t)network_to_host(args[1]);
+        memcpy(payload, &p, sizeof(p));
+        return sizeof(p);
+}
+
+static arg_t *hole_ton(const unsigned char *payload, arg_t args[])
+{
+        struct packet_payload_hole *p = (struct packet_payload_hole *)payload;
+        args[0] = host_to_network(p->size);
+        return args;
+}
+static size_t hole_toh(const arg_t args[], unsigned char *payload)
+{
+        struct packet_payload_hole p;
+        p.size = (uint64_t)network_to_host(args[0]);
+        memcpy(payload, &p, sizeof(p));
+        return sizeof(p);
+}
+
+static arg_t *file_size_ton(const unsigned char *payload, arg_t args[])
+{
+        struct packet_payload_file_size *p
+                = (struct packet_payload_file_size *)payload;
+        args[0] = host_to_network(p->size);
+        args[1] = host_to_network(p->sparse);
+        return args;
+}
+static size_t file_size_toh(const arg_t args[], unsigned char *payload)
+{
+        struct packet_payload_file_size p;
+        p.size = (uint64_t)network_to_host(args[0]);
+        p.sparse = (uint64_t)network_to_host(args[1]);
+        memcpy(payload, &p, sizeof(p));
+        return sizeof(p);
+}
+
+static arg_t *resume_ton(const unsigned char *payload, arg_t args[])
+{
+        struct packet_payload_resume *p
+                = (struct packet_payload_resume *)payload;
+        args[0] = host_to_network(p->offset);
+        args[1] = host_to_network(p->hash);
+        return args;
+}
+static size_t resume_toh(const arg_t args[], unsigned char *payload)
+{
+        struct packet_payload_resume p;
+        p.offset = (uint64_t)network_to_host(args[0]);
+        p.hash = (uint64_t)network_to_host(args[1]);
         memcpy(payload, &p, sizeof(p));
         return sizeof(p);
 }
@@ -119,7 +209,7 @@ static const struct conv_data {
         },
         {
                 .code = MSG_SETTINGS,
-                .arg_count = 1,
+                .arg_count = 5,
                 .to_network = settings_ton,
                 .to_host = settings_toh,
         },
@@ -141,9 +231,47 @@ static const struct conv_data {
                 .to_network = set_timestamps_ton,
                 .to_host = set_timestamps_toh,
         },
+        {
+                .code = MSG_ACK,
+                .arg_count = 1,
+                .to_network = ack_ton,
+                .to_host = ack_toh,
+        },
+        {
+                .code = MSG_COPY_BLOCKS,
+                .arg_count = 2,
+                .to_network = copy_blocks_ton,
+                .to_host = copy_blocks_toh,
+        },
+        {
+                .code = MSG_RESUME_OFFSET,
+                .arg_count = 2,
+                .to_network = resume_ton,
+                .to_host = resume_toh,
+        },
+        {
+                .code = MSG_RESUME_FILE,
+                .arg_count = 2,
+                .to_network = resume_ton,
+                .to_host = resume_toh,
+        },
+        {
+                .code = MSG_WRITE_HOLE,
+                .arg_count = 1,
+                .to_network = hole_ton,
+                .to_host = hole_toh,
+        },
+        {
+                .code = MSG_FILE_SIZE,
+                .arg_count = 2,
+                .to_network = file_size_ton,
+                .to_host = file_size_toh,
+        },
+        { .code = MSG_COUNT },
 };
 
-const struct conv_data *find_conversion_data(enum packet_msg_code code)
+static const struct conv_data *
+find_conversion_data(enum packet_msg_code code)
 {
         for (const struct conv_data *e = &PAYLOAD_CONV[0]; e->code < MSG_COUNT;
              ++e) {
@@ -173,6 +301,45 @@ bool packet_net_read_size(int fd, size_t *size_ptr)
         return true;
 }
 
+size_t packet_net_payload_capacity(enum packet_msg_code code,
+                                   size_t payload_size)
+{
+        const struct conv_data *conv = find_conversion_data(code);
+        if (conv == NULL)
+                return payload_size;
+
+        const size_t args_size = conv->arg_count * sizeof(arg_t);
+        return payload_size > args_size ? payload_size : args_size;
+}
+
+void packet_net_decode_header(const unsigned char header[PACKET_NET_HEADER_SIZE],
+                              enum packet_msg_code *code_ptr,
+                              size_t *size_ptr)
+{
+        code_t code;
+        payload_size_t size;
+        memcpy(&code, header, sizeof(code));
+        memcpy(&size, &header[sizeof(code)], sizeof(size));
+        *code_ptr = code;
+        *size_ptr = (size_t)be64toh(size);
+}
+
+void packet_net_decode_payload(struct packet *packet)
+{
+        const struct conv_data *conv = find_conversion_data(packet->code);
+        if (conv == NULL || packet->payload_size == 0)
+                return;
+
+        // Older peers send fewer arguments, the missing ones are zero.
+        const size_t args_size = conv->arg_count * sizeof(arg_t);
+        if (packet->payload_size < args_size)
+                memset(&packet->payload[packet->payload_size], 0,
+                       args_size - packet->payload_size);
+
+        packet->payload_size
+                = conv->to_host((const arg_t *)packet->payload, packet->payload);
+}
+
 bool packet_net_read_payload(int fd, struct packet *packet)
 {
         if (packet->payload_size == 0)
@@ -181,11 +348,98 @@ bool packet_net_read_payload(int fd, struct packet *packet)
             != (ssize_t)packet->payload_size)
                 return false;
 
-        const struct conv_data *conv = find_conversion_data(packet->code);
-        if (conv != NULL)
-                packet->payload_size = conv->to_host(
-                        (const arg_t *)packet->payload, packet->payload);
+        packet_net_decode_payload(packet);
+        return true;
+}
 
+/**
+ * Copies the payload through a buffer, for descriptors which splice(2)
+ * cannot be used with.
+ */
+static bool read_payload_copy(int fd, size_t size, int file_fd)
+{
+        unsigned char buff[BUFSIZ];
+        while (size > 0) {
+                const size_t chunk = size < sizeof(buff) ? size : sizeof(buff);
+                const ssize_t ret = utils_read(fd, chunk, buff);
+                if (ret == -1)
+                        return false;
+                if (ret == 0) {
+                        errno = EIO;
+                        return false;
+                }
+                if (utils_write(file_fd, ret, buff) != ret)
+                        return false;
+                size -= ret;
+        }
+        return true;
+}
+
+/**
+ * Empties the pipe after a failed write, so the data are not written with
+ * the next payload.
+ */
+static void discard_pipe(int pipe_fd, size_t size)
+{
+        const int saved_errno = errno;
+        unsigned char buff[BUFSIZ];
+        while (size > 0) {
+                const size_t chunk = size < sizeof(buff) ? size : sizeof(buff);
+                const ssize_t ret = utils_read(pipe_fd, chunk, buff);
+                if (ret <= 0)
+                        break;
+                size -= ret;
+        }
+        errno = saved_errno;
+}
+
+/**
+ * Moves @c size bytes from the pipe into @c file_fd.
+ */
+static bool splice_from_pipe(int pipe_fd, size_t size, int file_fd)
+{
+        while (size > 0) {
+                const ssize_t ret = splice(pipe_fd, NULL, file_fd, NULL, size,
+                                           SPLICE_F_MOVE);
+                if (ret == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EINVAL)
+                                return read_payload_copy(pipe_fd, size,
+                                                         file_fd);
+                        discard_pipe(pipe_fd, size);
+                        return false;
+                }
+                size -= ret;
+        }
+        return true;
+}
+
+bool packet_net_read_payload_to_file(int fd, size_t payload_size, int file_fd,
+                                     const int pipe_fds[2])
+{
+        if (pipe_fds == NULL)
+                return read_payload_copy(fd, payload_size, file_fd);
+
+        while (payload_size > 0) {
+                const ssize_t ret = splice(fd, NULL, pipe_fds[1], NULL,
+                                           payload_size, SPLICE_F_MOVE);
+                if (ret == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EINVAL)
+                                return read_payload_copy(fd, payload_size,
+                                                         file_fd);
+                        return false;
+                }
+                if (ret == 0) {
+                        errno = EIO;
+                        return false;
+                }
+                if (!splice_from_pipe(pipe_fds[0], ret, file_fd))
+                        return false;
+                payload_size -= ret;
+        }
         return true;
 }
 
@@ -202,6 +456,29 @@ static bool packet_net_send_size(int fd, size_t size)
         return utils_write(fd, sizeof(s), &s) == sizeof(s);
 }
 
+void packet_net_encode_header(enum packet_msg_code code, size_t payload_size,
+                              unsigned char header[PACKET_NET_HEADER_SIZE])
+{
+        const code_t c = (code_t)code;
+        const payload_size_t s = htobe64(payload_size);
+        memcpy(header, &c, sizeof(c));
+        memcpy(&header[sizeof(c)], &s, sizeof(s));
+}
+
+const unsigned char *
+packet_net_encode_payload(enum packet_msg_code code, size_t *payload_size_ptr,
+                          const unsigned char *payload,
+                          uint64_t args[PACKET_NET_MAX_ARGS])
+{
+        const struct conv_data *conv = find_conversion_data(code);
+        if (*payload_size_ptr == 0 || conv == NULL || conv->arg_count == 0)
+                return payload;
+
+        log_assert(conv->arg_count <= PACKET_NET_MAX_ARGS);
+        *payload_size_ptr = conv->arg_count * sizeof(arg_t);
+        return (const unsigned char *)conv->to_network(payload, args);
+}
+
 bool packet_net_send(int fd, enum packet_msg_code code, size_t payload_size,
                      const unsigned char payload[payload_size])
 {
@@ -210,15 +487,70 @@ bool packet_net_send(int fd, enum packet_msg_code code, size_t payload_size,
         if (payload_size == 0)
                 return packet_net_send_size(fd, payload_size);
 
-        const struct conv_data *conv = find_conversion_data(code);
-
-        if (conv != NULL && conv->arg_count > 0) {
-                payload_size = conv->arg_count * sizeof(uint64_t);
-                arg_t *args = alloca(payload_size);
-                payload = (unsigned char *)conv->to_network(payload, args);
-        }
+        arg_t args[PACKET_NET_MAX_ARGS];
+        payload = packet_net_encode_payload(code, &payload_size, payload, args);
 
         return packet_net_send_size(fd, payload_size)
                && utils_write(fd, payload_size, payload)
                           == (ssize_t)payload_size;
 }
+
+/**
+ * Copies the payload from @c in_fd through a buffer, for @c fd which
+ * sendfile(2) cannot write to.
+ */
+static bool send_file_copy(int fd, size_t size, int in_fd, off_t offset)
+{
+        unsigned char buff[BUFSIZ];
+        while (size > 0) {
+                const size_t chunk = size < sizeof(buff) ? size : sizeof(buff);
+                const ssize_t ret = pread(in_fd, buff, chunk, offset);
+                if (ret == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        return false;
+                }
+                if (ret == 0) {
+                        errno = EIO;
+                        return false;
+                }
+                if (utils_write(fd, ret, buff) != ret)
+                        return false;
+                offset += ret;
+                size -= ret;
+        }
+        return true;
+}
+
+bool packet_net_send_file_payload(int fd, size_t size, int in_fd, off_t offset)
+{
+        while (size > 0) {
+                const ssize_t ret = sendfile(fd, in_fd, &offset, size);
+                if (ret == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EINVAL || errno == ENOSYS)
+                                return send_file_copy(fd, size, in_fd, offset);
+                        return false;
+                }
+                // the file was truncated meanwhile
+                if (ret == 0) {
+                        errno = EIO;
+                        return false;
+                }
+                size -= ret;
+        }
+        return true;
+}
+
+bool packet_net_send_file(int fd, enum packet_msg_code code,
+                          size_t payload_size, int in_fd, off_t offset)
+{
+        const struct conv_data *conv = find_conversion_data(code);
+        log_assert(conv == NULL || conv->arg_count == 0);
+
+        return packet_net_send_code(fd, code)
+               && packet_net_send_size(fd, payload_size)
+               && packet_net_send_file_payload(fd, payload_size, in_fd,
+                                               offset);
+}
@@ -9,6 +9,18 @@
 
 #include "packet.h"
 
+#include <stdint.h>
+
+/**
+ * Size of the message code and the payload size on the wire.
+ */
+#define PACKET_NET_HEADER_SIZE (sizeof(uint8_t) + sizeof(uint64_t))
+
+/**
+ * Maximal number of arguments of a fixed-size payload.
+ */
+#define PACKET_NET_MAX_ARGS 5
+
 /**
  * @brief Reads message code from the @c fd
  *
@@ -31,6 +43,42 @@ bool packet_net_read_code(int fd, enum packet_msg_code *code_ptr);
  */
 bool packet_net_read_size(int fd, size_t *size_ptr);
 
+/**
+ * @brief Returns the number of bytes needed to hold the payload of
+ *        the given size after its conversion to the host representation.
+ *
+ * @param code          message code of the packet
+ * @param payload_size  size of the payload as received from the network
+ *
+ * @return   minimal size of the payload buffer
+ */
+size_t packet_net_payload_capacity(enum packet_msg_code code,
+                                   size_t payload_size);
+
+/**
+ * @brief Decodes the message code and the payload size received in
+ *        @c header.
+ *
+ * @param header         the header as received from the network
+ * @param[out] code_ptr  a pointer where to store the code
+ * @param[out] size_ptr  a pointer where to store the size
+ */
+void packet_net_decode_header(const unsigned char header[PACKET_NET_HEADER_SIZE],
+                              enum packet_msg_code *code_ptr,
+                              size_t *size_ptr);
+
+/**
+ * @brief Converts the received payload of @c packet to the host
+ *        representation.
+ *
+ * The buffer of the packet has to be at least
+ * packet_net_payload_capacity() bytes large. This operation can change
+ * the payload size stored in packet.
+ *
+ * @param packet  a pointer to packet structure
+ */
+void packet_net_decode_payload(struct packet *packet);
+
 /**
  * Reads payload into @c packet.payload.
  *
@@ -43,9 +91,59 @@ bool packet_net_read_size(int fd, size_t *size_ptr);
  */
 bool packet_net_read_payload(int fd, struct packet *packet);
 
+/**
+ * @see packet_read_payload_to_file()
+ */
+bool packet_net_read_payload_to_file(int fd, size_t payload_size, int file_fd,
+                                     const int pipe_fds[2]);
+
+/**
+ * @brief Encodes the message code and the payload size for sending.
+ *
+ * @param code          message code of the packet
+ * @param payload_size  size of the payload as returned by
+ *                      packet_net_encode_payload()
+ * @param[out] header   a buffer where to store the header
+ */
+void packet_net_encode_header(enum packet_msg_code code, size_t payload_size,
+                              unsigned char header[PACKET_NET_HEADER_SIZE]);
+
+/**
+ * @brief Converts the payload to the network representation.
+ *
+ * @param code                      message code of the packet
+ * @param[in,out] payload_size_ptr  size of the payload, updated to the
+ *                                  size of the converted payload
+ * @param payload                   the payload in the host representation
+ * @param args                      a buffer for the converted fixed-size
+ *                                  payload
+ *
+ * @return   pointer to the payload to be sent; either @c payload
+ *           or @c args
+ */
+const unsigned char *
+packet_net_encode_payload(enum packet_msg_code code, size_t *payload_size_ptr,
+                          const unsigned char *payload,
+                          uint64_t args[PACKET_NET_MAX_ARGS]);
+
 /**
  * @see packet_send()
  */
 bool packet_net_send(int fd, enum packet_msg_code code, size_t payload_size,
                      const unsigned char payload[payload_size]);
+
+/**
+ * @brief Sends @c size bytes of @c in_fd from @c offset as the payload
+ *        of a packet whose header was already sent.
+ *
+ * @see packet_send_file()
+ */
+bool packet_net_send_file_payload(int fd, size_t size, int in_fd,
+                                  off_t offset);
+
+/**
+ * @see packet_send_file()
+ */
+bool packet_net_send_file(int fd, enum packet_msg_code code,
+                          size_t payload_size, int in_fd, off_t offset);
 #endif /* NET_H */
@@ -33,8 +33,11 @@ static bool create_minimal_buffer(struct packet **packet_buffptr, size_t *n)
 
 static bool read_payload(int fd, struct packet **packet_buffptr, size_t *n)
 {
+        const struct packet *packet = *packet_buffptr;
         const size_t min_size
-                = sizeof(struct packet) + (*packet_buffptr)->payload_size;
+                = sizeof(struct packet)
+                  + packet_net_payload_capacity(packet->code,
+                                                packet->payload_size);
         if (*n < min_size && !expand_buffer(packet_buffptr, n, min_size))
                 return false;
 
@@ -77,10 +80,10 @@ static bool read_header(int fd, struct packet **packet_buffptr, size_t *n)
 #endif
 
         (*packet_buffptr)->payload_size = payload_size;
-
-        return read_payload(fd, packet_buffptr, n);
+        return true;
 }
-bool packet_read(int fd, struct packet **packet_buffptr, size_t *n)
+
+bool packet_read_header(int fd, struct packet **packet_buffptr, size_t *n)
 {
         log_assert(packet_buffptr != NULL);
         log_assert(n != NULL);
@@ -92,9 +95,38 @@ bool packet_read(int fd, struct packet **packet_buffptr, size_t *n)
         return read_header(fd, packet_buffptr, n);
 }
 
+bool packet_read_payload(int fd, struct packet **packet_buffptr, size_t *n)
+{
+        log_assert(packet_buffptr != NULL && *packet_buffptr != NULL);
+        log_assert(n != NULL);
+
+        return read_payload(fd, packet_buffptr, n);
+}
+
+bool packet_read_payload_to_file(int fd, const struct packet *packet,
+                                 int file_fd, const int pipe_fds[2])
+{
+        log_assert(packet != NULL);
+        return packet_net_read_payload_to_file(fd, packet->payload_size,
+                                               file_fd, pipe_fds);
+}
+
+bool packet_read(int fd, struct packet **packet_buffptr, size_t *n)
+{
+        return packet_read_header(fd, packet_buffptr, n)
+               && read_payload(fd, packet_buffptr, n);
+}
+
 bool packet_send(int fd, enum packet_msg_code code, size_t payload_size,
                  const unsigned char payload[payload_size])
 {
         log_assert(MSG_OK <= code && code < MSG_COUNT);
         return packet_net_send(fd, code, payload_size, payload);
 }
+
+bool packet_send_file(int fd, enum packet_msg_code code, size_t payload_size,
+                      int in_fd, off_t offset)
+{
+        log_assert(MSG_OK <= code && code < MSG_COUNT);
+        return packet_net_send_file(fd, code, payload_size, in_fd, offset);
+}
@@ -0,0 +1,498 @@
+/**
+ * @file stream.c
+ * @brief Definitions of the buffered packet stream
+ */
+
+#include "packet.h"
+#include "net.h"
+
+#include "log.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+
+/**
+ * Size of each of the read and write buffers of the stream.
+ */
+#define STREAM_BUFFER_SIZE (64 * 1024)
+
+struct packet_stream {
+        int read_fd;       /**< read end of the byte stream */
+        int write_fd;      /**< write end of the byte stream */
+        int timeout_ms;    /**< limit of a call waiting for a non-blocking
+                                descriptor, -1 if there is none */
+        size_t read_begin; /**< first byte in @c read_buff not yet consumed */
+        size_t read_end;   /**< end of the data in @c read_buff */
+        size_t read_size;  /**< size of @c read_buff, grows for a packet
+                                received by packet_stream_receive() */
+        size_t write_len;  /**< number of bytes waiting in @c write_buff */
+        unsigned char *read_buff;
+        unsigned char write_buff[STREAM_BUFFER_SIZE];
+};
+
+struct packet_stream *packet_stream_create(int read_fd, int write_fd)
+{
+        struct packet_stream *stream = malloc(sizeof(*stream));
+        if (stream == NULL)
+                return NULL;
+        stream->read_buff = malloc(STREAM_BUFFER_SIZE);
+        if (stream->read_buff == NULL) {
+                free(stream);
+                return NULL;
+        }
+
+        stream->read_fd = read_fd;
+        stream->write_fd = write_fd;
+        stream->timeout_ms = -1;
+        stream->read_begin = 0;
+        stream->read_end = 0;
+        stream->read_size = STREAM_BUFFER_SIZE;
+        stream->write_len = 0;
+        return stream;
+}
+
+void packet_stream_destroy(struct packet_stream *stream)
+{
+        if (stream == NULL)
+                return;
+        free(stream->read_buff);
+        free(stream);
+}
+
+void packet_stream_set_timeout(struct packet_stream *stream, int timeout_ms)
+{
+        stream->timeout_ms = timeout_ms;
+}
+
+static int64_t now_ms(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Waits until the non-blocking @c fd is ready for @c events. The first
+ * wait of a call sets its @c deadline, so the whole call is limited by
+ * @c timeout_ms however slowly the peer sends or receives the data.
+ *
+ * @return true if the descriptor is ready;
+ *         false on failure or after the deadline and errno is set
+ */
+static bool await(const struct packet_stream *stream, int fd, short events,
+                  int64_t *deadline)
+{
+        if (*deadline == -1 && stream->timeout_ms != -1)
+                *deadline = now_ms() + stream->timeout_ms;
+
+        struct pollfd pollfd = { .fd = fd, .events = events };
+        for (;;) {
+                int timeout = -1;
+                if (*deadline != -1) {
+                        const int64_t left = *deadline - now_ms();
+                        timeout = left > 0 ? (int)left : 0;
+                }
+                const int ret = poll(&pollfd, 1, timeout);
+                if (ret == -1 && errno == EINTR)
+                        continue;
+                if (ret == 0)
+                        errno = ETIMEDOUT;
+                return ret > 0;
+        }
+}
+
+static bool would_block(void)
+{
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+/* Writing */
+
+/**
+ * Writes all the @c iov_count buffers with as few writev(2) calls as
+ * possible.
+ */
+static bool write_all(const struct packet_stream *stream, struct iovec *iov,
+                      int iov_count)
+{
+        const int fd = stream->write_fd;
+        int64_t deadline = -1;
+        while (iov_count > 0) {
+                ssize_t ret = writev(fd, iov, iov_count);
+                if (ret == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        if (would_block() && await(stream, fd, POLLOUT,
+                                                   &deadline))
+                                continue;
+                        return false;
+                }
+
+                while (iov_count > 0 && (size_t)ret >= iov->iov_len) {
+                        ret -= iov->iov_len;
+                        iov++;
+                        iov_count--;
+                }
+                if (iov_count > 0) {
+                        iov->iov_base = (unsigned char *)iov->iov_base + ret;
+                        iov->iov_len -= ret;
+                }
+        }
+        return true;
+}
+
+bool packet_stream_flush(struct packet_stream *stream)
+{
+        if (stream->write_len == 0)
+                return true;
+
+        struct iovec iov = { stream->write_buff, stream->write_len };
+        stream->write_len = 0;
+        return write_all(stream, &iov, 1);
+}
+
+/**
+ * Appends @c size bytes to the write buffer.
+ *
+ * @return true if the bytes fit into the buffer;
+ *         false otherwise and nothing is appended
+ */
+static bool append(struct packet_stream *stream, size_t size,
+                   const unsigned char buff[size])
+{
+        if (STREAM_BUFFER_SIZE - stream->write_len < size)
+                return false;
+        if (size > 0)
+                memcpy(&stream->write_buff[stream->write_len], buff, size);
+        stream->write_len += size;
+        return true;
+}
+
+bool packet_stream_send(struct packet_stream *stream, enum packet_msg_code code,
+                        size_t payload_size,
+                        const unsigned char payload[payload_size])
+{
+        log_assert(MSG_OK <= code && code < MSG_COUNT);
+
+        uint64_t args[PACKET_NET_MAX_ARGS];
+        payload = packet_net_encode_payload(code, &payload_size, payload, args);
+
+        unsigned char header[PACKET_NET_HEADER_SIZE];
+        packet_net_encode_header(code, payload_size, header);
+
+        if (STREAM_BUFFER_SIZE - stream->write_len
+            >= sizeof(header) + payload_size) {
+                append(stream, sizeof(header), header);
+                append(stream, payload_size, payload);
+                return true;
+        }
+
+        // the queued packets, the header and the payload in one syscall
+        struct iovec iov[] = {
+                { stream->write_buff, stream->write_len },
+                { header, sizeof(header) },
+                { (void *)payload, payload_size },
+        };
+        stream->write_len = 0;
+        return write_all(stream, iov, sizeof(iov) / sizeof(*iov));
+}
+
+bool packet_stream_send_file(struct packet_stream *stream,
+                             enum packet_msg_code code, size_t payload_size,
+                             int in_fd, off_t offset)
+{
+        log_assert(MSG_OK <= code && code < MSG_COUNT);
+
+        unsigned char header[PACKET_NET_HEADER_SIZE];
+        packet_net_encode_header(code, payload_size, header);
+
+        if (!append(stream, sizeof(header), header)) {
+                if (!packet_stream_flush(stream))
+                        return false;
+                append(stream, sizeof(header), header);
+        }
+
+        return packet_stream_flush(stream)
+               && packet_net_send_file_payload(stream->write_fd, payload_size,
+                                               in_fd, offset);
+}
+
+/* Reading */
+
+bool packet_stream_has_buffered(const struct packet_stream *stream)
+{
+        return stream->read_begin < stream->read_end;
+}
+
+static size_t buffered(const struct packet_stream *stream)
+{
+        return stream->read_end - stream->read_begin;
+}
+
+/**
+ * Moves the buffered bytes to the beginning of the read buffer, if there
+ * is not room for @c size bytes after them.
+ */
+static void compact(struct packet_stream *stream, size_t size)
+{
+        if (stream->read_size - stream->read_begin >= size)
+                return;
+        memmove(stream->read_buff, &stream->read_buff[stream->read_begin],
+                buffered(stream));
+        stream->read_end -= stream->read_begin;
+        stream->read_begin = 0;
+}
+
+/**
+ * Reads from the connection until at least @c size bytes are buffered.
+ * The pending writes are flushed first, because the peer may wait for
+ * them before it sends anything.
+ */
+static bool fill(struct packet_stream *stream, size_t size)
+{
+        log_assert(size <= stream->read_size);
+        if (buffered(stream) >= size)
+                return true;
+
+        if (!packet_stream_flush(stream))
+                return false;
+
+        compact(stream, size);
+        int64_t deadline = -1;
+        while (buffered(stream) < size) {
+                const ssize_t ret
+                        = read(stream->read_fd,
+                               &stream->read_buff[stream->read_end],
+                               stream->read_size - stream->read_end);
+                if (ret == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        if (would_block() && await(stream, stream->read_fd,
+                                                   POLLIN, &deadline))
+                                continue;
+                        return false;
+                }
+                if (ret == 0)
+                        return false;
+                stream->read_end += ret;
+        }
+        return true;
+}
+
+/**
+ * Moves at most @c size buffered bytes into @c buff.
+ *
+ * @return number of bytes moved
+ */
+static size_t consume(struct packet_stream *stream, size_t size,
+                      unsigned char *buff)
+{
+        if (size > buffered(stream))
+                size = buffered(stream);
+        if (buff != NULL && size > 0)
+                memcpy(buff, &stream->read_buff[stream->read_begin], size);
+
+        stream->read_begin += size;
+        if (stream->read_begin == stream->read_end) {
+                stream->read_begin = 0;
+                stream->read_end = 0;
+        }
+        return size;
+}
+
+static bool reserve(struct packet **packet_buffptr, size_t *n, size_t size)
+{
+        if (*packet_buffptr != NULL && *n >= size)
+                return true;
+
+        struct packet *bigger_packet = realloc(*packet_buffptr, size);
+        if (bigger_packet == NULL)
+                return false;
+        *packet_buffptr = bigger_packet;
+        *n = size;
+        return true;
+}
+
+static bool validate_code(enum packet_msg_code code)
+{
+        if (code < MSG_OK || MSG_COUNT <= code) {
+                errno = ENOMSG;
+                return false;
+        }
+        return true;
+}
+
+bool packet_stream_read_header(struct packet_stream *stream,
+                               struct packet **packet_buffptr, size_t *n)
+{
+        log_assert(packet_buffptr != NULL);
+        log_assert(n != NULL);
+
+        if (!reserve(packet_buffptr, n, sizeof(struct packet))
+            || !fill(stream, PACKET_NET_HEADER_SIZE))
+                return false;
+
+        unsigned char header[PACKET_NET_HEADER_SIZE];
+        consume(stream, sizeof(header), header);
+
+        enum packet_msg_code code;
+        size_t payload_size;
+        packet_net_decode_header(header, &code, &payload_size);
+        if (!validate_code(code))
+                return false;
+
+        (*packet_buffptr)->code = code;
+        (*packet_buffptr)->payload_size = payload_size;
+        return true;
+}
+
+bool packet_stream_read_payload(struct packet_stream *stream,
+                                struct packet **packet_buffptr, size_t *n)
+{
+        log_assert(packet_buffptr != NULL && *packet_buffptr != NULL);
+        log_assert(n != NULL);
+
+        const struct packet *header = *packet_buffptr;
+        const size_t payload_size = header->payload_size;
+        if (!reserve(packet_buffptr, n,
+                     sizeof(struct packet)
+                             + packet_net_payload_capacity(header->code,
+                                                           payload_size)))
+                return false;
+
+        struct packet *packet = *packet_buffptr;
+        // small payloads are read ahead together with the next packets
+        if (payload_size <= STREAM_BUFFER_SIZE && !fill(stream, payload_size))
+                return false;
+
+        const size_t consumed = consume(stream, payload_size, packet->payload);
+        const size_t rest = payload_size - consumed;
+        if (rest > 0
+            && (!packet_stream_flush(stream)
+                || utils_read(stream->read_fd, rest,
+                              &packet->payload[consumed])
+                           != (ssize_t)rest))
+                return false;
+
+        packet_net_decode_payload(packet);
+        return true;
+}
+
+bool packet_stream_read_payload_to_buffer(struct packet_stream *stream,
+                                          const struct packet *packet,
+                                          unsigned char *buff)
+{
+        log_assert(packet != NULL);
+
+        const size_t size = packet->payload_size;
+        const size_t consumed = consume(stream, size, buff);
+        const size_t rest = size - consumed;
+        return rest == 0
+               || (packet_stream_flush(stream)
+                   && utils_read(stream->read_fd, rest, &buff[consumed])
+                              == (ssize_t)rest);
+}
+
+bool packet_stream_read_payload_to_file(struct packet_stream *stream,
+                                        const struct packet *packet,
+                                        int file_fd, const int pipe_fds[2])
+{
+        log_assert(packet != NULL);
+
+        size_t size = packet->payload_size;
+        if (packet_stream_has_buffered(stream)) {
+                const size_t chunk = size < buffered(stream) ? size
+                                                             : buffered(stream);
+                if (utils_write(file_fd, chunk,
+                                &stream->read_buff[stream->read_begin])
+                    != (ssize_t)chunk)
+                        return false;
+                consume(stream, chunk, NULL);
+                size -= chunk;
+        }
+
+        if (size > 0 && !packet_stream_flush(stream))
+                return false;
+
+        return packet_net_read_payload_to_file(stream->read_fd, size, file_fd,
+                                               pipe_fds);
+}
+
+/**
+ * Computes the size of the next packet, header included, from its buffered
+ * header.
+ *
+ * @return size of the packet;
+ *         size of the header if it is not buffered whole or it is invalid
+ */
+static size_t next_packet_size(const struct packet_stream *stream)
+{
+        if (buffered(stream) < PACKET_NET_HEADER_SIZE)
+                return PACKET_NET_HEADER_SIZE;
+
+        enum packet_msg_code code;
+        size_t payload_size;
+        packet_net_decode_header(&stream->read_buff[stream->read_begin], &code,
+                                 &payload_size);
+        if (code < MSG_OK || MSG_COUNT <= code
+            || payload_size > SIZE_MAX - PACKET_NET_HEADER_SIZE)
+                return PACKET_NET_HEADER_SIZE;
+        return PACKET_NET_HEADER_SIZE + payload_size;
+}
+
+bool packet_stream_has_packet(const struct packet_stream *stream)
+{
+        return buffered(stream) >= next_packet_size(stream);
+}
+
+/**
+ * Makes the read buffer large enough for @c size bytes.
+ */
+static bool grow(struct packet_stream *stream, size_t size)
+{
+        if (stream->read_size >= size)
+                return true;
+        unsigned char *bigger = realloc(stream->read_buff, size);
+        if (bigger == NULL)
+                return false;
+        stream->read_buff = bigger;
+        stream->read_size = size;
+        return true;
+}
+
+bool packet_stream_receive(struct packet_stream *stream)
+{
+        while (!packet_stream_has_packet(stream)) {
+                const size_t size = next_packet_size(stream);
+                if (!grow(stream, size))
+                        return false;
+                compact(stream, size);
+
+                const ssize_t ret
+                        = read(stream->read_fd,
+                               &stream->read_buff[stream->read_end],
+                               stream->read_size - stream->read_end);
+                if (ret == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        return would_block();
+                }
+                if (ret == 0) {
+                        errno = ECONNRESET;
+                        return false;
+                }
+                stream->read_end += ret;
+        }
+        return true;
+}
+
+bool packet_stream_read(struct packet_stream *stream,
+                        struct packet **packet_buffptr, size_t *n)
+{
+        return packet_stream_read_header(stream, packet_buffptr, n)
+               && packet_stream_read_payload(stream, packet_buffptr, n);
+}
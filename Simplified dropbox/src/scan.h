@@ -0,0 +1,66 @@
+/**
+ * @file scan.h
+ * @brief Scanning of the blocks of data: whether a block is all zeros and
+ *        where two blocks start to differ
+ *
+ * The kernels for SSE2, AVX2 and AVX-512 are chosen once, when the program
+ * is loaded, by the features of the CPU; the portable one compares words.
+ */
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Checks whether all the bytes are zeros.
+ *
+ * @param size  a number of bytes to check
+ * @param buff  a pointer to the bytes
+ * @return      true if all the bytes are zeros or @c size is 0;
+ *              false otherwise
+ */
+bool scan_zero(size_t size, const unsigned char *buff);
+
+/**
+ * Finds the first byte where the blocks differ.
+ *
+ * @param size  a number of bytes of each block
+ * @param a     a pointer to the first block
+ * @param b     a pointer to the second block
+ * @return      offset of the first different byte;
+ *              @c size if the blocks are the same
+ */
+size_t scan_mismatch(size_t size, const unsigned char *a,
+                     const unsigned char *b);
+
+/**
+ * @return true if the blocks of @c size bytes are the same
+ */
+static inline bool scan_equal(size_t size, const unsigned char *a,
+                              const unsigned char *b)
+{
+        return scan_mismatch(size, a, b) == size;
+}
+
+/**
+ * One implementation of the scans, for the tests and the benchmarks.
+ */
+struct scan_kernel {
+        const char *name;
+        bool (*supported)(void); /**< the CPU can run it */
+        bool (*zero)(size_t size, const unsigned char *buff);
+        size_t (*mismatch)(size_t size, const unsigned char *a,
+                           const unsigned char *b);
+};
+
+/**
+ * All the kernels from the portable one to the widest one, the last one
+ * supported is used by scan_zero() and scan_mismatch().
+ *
+ * @param[out] count  a number of the kernels
+ * @return            the array of the kernels
+ */
+const struct scan_kernel *scan_kernels(size_t *count);
+
+#endif //SCAN_H
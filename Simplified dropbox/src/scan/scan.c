@@ -0,0 +1,310 @@
+/**
+ * @file scan.c
+ * @brief Definitions of the scans of the blocks
+ */
+#include "scan.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+static bool portable_supported(void)
+{
+        return true;
+}
+
+static uint64_t load_word(const unsigned char *buff)
+{
+        uint64_t word;
+        memcpy(&word, buff, sizeof(word));
+        return word;
+}
+
+static bool portable_zero(size_t size, const unsigned char *buff)
+{
+        size_t i = 0;
+        for (; i + 4 * sizeof(uint64_t) <= size; i += 4 * sizeof(uint64_t)) {
+                if ((load_word(&buff[i]) | load_word(&buff[i + 8])
+                     | load_word(&buff[i + 16]) | load_word(&buff[i + 24]))
+                    != 0)
+                        return false;
+        }
+        for (; i < size; i++) {
+                if (buff[i] != 0)
+                        return false;
+        }
+        return true;
+}
+
+static size_t portable_mismatch(size_t size, const unsigned char *a,
+                                const unsigned char *b)
+{
+        size_t i = 0;
+        // the differing word is searched by bytes, whatever the endianness
+        while (i + sizeof(uint64_t) <= size
+               && load_word(&a[i]) == load_word(&b[i]))
+                i += sizeof(uint64_t);
+        while (i < size && a[i] == b[i])
+                i++;
+        return i;
+}
+
+#ifdef SCAN_X86
+
+static bool sse2_supported(void)
+{
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse2");
+}
+
+__attribute__((target("sse2"))) static bool
+sse2_zero(size_t size, const unsigned char *buff)
+{
+        const __m128i zero = _mm_setzero_si128();
+        size_t i = 0;
+        for (; i + 64 <= size; i += 64) {
+                const __m128i *p = (const __m128i *)&buff[i];
+                const __m128i v = _mm_or_si128(
+                        _mm_or_si128(_mm_loadu_si128(p),
+                                     _mm_loadu_si128(p + 1)),
+                        _mm_or_si128(_mm_loadu_si128(p + 2),
+                                     _mm_loadu_si128(p + 3)));
+                if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff)
+                        return false;
+        }
+        return portable_zero(size - i, &buff[i]);
+}
+
+__attribute__((target("sse2"))) static size_t
+sse2_mismatch(size_t size, const unsigned char *a, const unsigned char *b)
+{
+        size_t i = 0;
+        // the same 64 bytes are skipped at once
+        for (; i + 64 <= size; i += 64) {
+                const __m128i *pa = (const __m128i *)&a[i];
+                const __m128i *pb = (const __m128i *)&b[i];
+                const __m128i same = _mm_and_si128(
+                        _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(pa),
+                                                     _mm_loadu_si128(pb)),
+                                      _mm_cmpeq_epi8(_mm_loadu_si128(pa + 1),
+                                                     _mm_loadu_si128(pb + 1))),
+                        _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(pa + 2),
+                                                     _mm_loadu_si128(pb + 2)),
+                                      _mm_cmpeq_epi8(_mm_loadu_si128(pa + 3),
+                                                     _mm_loadu_si128(pb + 3))));
+                if (_mm_movemask_epi8(same) != 0xffff)
+                        break;
+        }
+        for (; i + 16 <= size; i += 16) {
+                const __m128i va = _mm_loadu_si128((const __m128i *)&a[i]);
+                const __m128i vb = _mm_loadu_si128((const __m128i *)&b[i]);
+                const unsigned same
+                        = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+                if (same != 0xffff)
+                        return i + __builtin_ctz(~same);
+        }
+        return i + portable_mismatch(size - i, &a[i], &b[i]);
+}
+
+static bool avx2_supported(void)
+{
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2"))) static bool
+avx2_zero(size_t size, const unsigned char *buff)
+{
+        size_t i = 0;
+        for (; i + 128 <= size; i += 128) {
+                const __m256i *p = (const __m256i *)&buff[i];
+                const __m256i v = _mm256_or_si256(
+                        _mm256_or_si256(_mm256_loadu_si256(p),
+                                        _mm256_loadu_si256(p + 1)),
+                        _mm256_or_si256(_mm256_loadu_si256(p + 2),
+                                        _mm256_loadu_si256(p + 3)));
+                if (!_mm256_testz_si256(v, v))
+                        return false;
+        }
+        return sse2_zero(size - i, &buff[i]);
+}
+
+__attribute__((target("avx2"))) static size_t
+avx2_mismatch(size_t size, const unsigned char *a, const unsigned char *b)
+{
+        size_t i = 0;
+        for (; i + 128 <= size; i += 128) {
+                const __m256i *pa = (const __m256i *)&a[i];
+                const __m256i *pb = (const __m256i *)&b[i];
+                const __m256i differ = _mm256_or_si256(
+                        _mm256_or_si256(
+                                _mm256_xor_si256(_mm256_loadu_si256(pa),
+                                                 _mm256_loadu_si256(pb)),
+                                _mm256_xor_si256(_mm256_loadu_si256(pa + 1),
+                                                 _mm256_loadu_si256(pb + 1))),
+                        _mm256_or_si256(
+                                _mm256_xor_si256(_mm256_loadu_si256(pa + 2),
+                                                 _mm256_loadu_si256(pb + 2)),
+                                _mm256_xor_si256(_mm256_loadu_si256(pa + 3),
+                                                 _mm256_loadu_si256(pb + 3))));
+                if (!_mm256_testz_si256(differ, differ))
+                        break;
+        }
+        for (; i + 32 <= size; i += 32) {
+                const __m256i va = _mm256_loadu_si256((const __m256i *)&a[i]);
+                const __m256i vb = _mm256_loadu_si256((const __m256i *)&b[i]);
+                const uint32_t same = (uint32_t)_mm256_movemask_epi8(
+                        _mm256_cmpeq_epi8(va, vb));
+                if (same != UINT32_MAX)
+                        return i + __builtin_ctz(~same);
+        }
+        return i + sse2_mismatch(size - i, &a[i], &b[i]);
+}
+
+static bool avx512_supported(void)
+{
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx512f")
+               && __builtin_cpu_supports("avx512bw");
+}
+
+/**
+ * Mask of the first @c size bytes of the vector, the bytes after them are
+ * neither loaded nor faulted on.
+ */
+__attribute__((target("avx512f,avx512bw"))) static __mmask64
+avx512_tail(size_t size)
+{
+        return size >= 64 ? ~(__mmask64)0 : ((__mmask64)1 << size) - 1;
+}
+
+__attribute__((target("avx512f,avx512bw"))) static bool
+avx512_zero(size_t size, const unsigned char *buff)
+{
+        size_t i = 0;
+        for (; i + 256 <= size; i += 256) {
+                const __m512i v = _mm512_or_si512(
+                        _mm512_or_si512(_mm512_loadu_si512(&buff[i]),
+                                        _mm512_loadu_si512(&buff[i + 64])),
+                        _mm512_or_si512(_mm512_loadu_si512(&buff[i + 128]),
+                                        _mm512_loadu_si512(&buff[i + 192])));
+                if (_mm512_test_epi64_mask(v, v) != 0)
+                        return false;
+        }
+        for (; i < size; i += 64) {
+                const __m512i v
+                        = _mm512_maskz_loadu_epi8(avx512_tail(size - i),
+                                                  &buff[i]);
+                if (_mm512_test_epi64_mask(v, v) != 0)
+                        return false;
+        }
+        return true;
+}
+
+__attribute__((target("avx512f,avx512bw"))) static size_t
+avx512_mismatch(size_t size, const unsigned char *a, const unsigned char *b)
+{
+        size_t i = 0;
+        for (; i + 256 <= size; i += 256) {
+                const __m512i differ = _mm512_or_si512(
+                        _mm512_or_si512(
+                                _mm512_xor_si512(_mm512_loadu_si512(&a[i]),
+                                                 _mm512_loadu_si512(&b[i])),
+                                _mm512_xor_si512(
+                                        _mm512_loadu_si512(&a[i + 64]),
+                                        _mm512_loadu_si512(&b[i + 64]))),
+                        _mm512_or_si512(
+                                _mm512_xor_si512(
+                                        _mm512_loadu_si512(&a[i + 128]),
+                                        _mm512_loadu_si512(&b[i + 128])),
+                                _mm512_xor_si512(
+                                        _mm512_loadu_si512(&a[i + 192]),
+                                        _mm512_loadu_si512(&b[i + 192]))));
+                if (_mm512_test_epi64_mask(differ, differ) != 0)
+                        break;
+        }
+        for (; i < size; i += 64) {
+                const __mmask64 tail = avx512_tail(size - i);
+                const __m512i va = _mm512_maskz_loadu_epi8(tail, &a[i]);
+                const __m512i vb = _mm512_maskz_loadu_epi8(tail, &b[i]);
+                const __mmask64 differ = _mm512_cmpneq_epi8_mask(va, vb);
+                if (differ != 0)
+                        return i + __builtin_ctzll(differ);
+        }
+        return size;
+}
+
+#endif //SCAN_X86
+
+static const struct scan_kernel KERNELS[] = {
+        { "portable", portable_supported, portable_zero, portable_mismatch },
+#ifdef SCAN_X86
+        { "sse2", sse2_supported, sse2_zero, sse2_mismatch },
+        { "avx2", avx2_supported, avx2_zero, avx2_mismatch },
+        { "avx512", avx512_supported, avx512_zero, avx512_mismatch },
+#endif
+};
+
+const struct scan_kernel *scan_kernels(size_t *count)
+{
+        *count = sizeof(KERNELS) / sizeof(KERNELS[0]);
+        return KERNELS;
+}
+
+#ifdef SCAN_X86
+
+/*
+ * The resolvers run while the program is relocated, before the
+ * constructors, so they do not read the table of the kernels.
+ */
+typedef bool (*zero_fn)(size_t, const unsigned char *);
+typedef size_t (*mismatch_fn)(size_t, const unsigned char *,
+                              const unsigned char *);
+
+static zero_fn resolve_zero(void)
+{
+        if (avx512_supported())
+                return avx512_zero;
+        if (avx2_supported())
+                return avx2_zero;
+        if (sse2_supported())
+                return sse2_zero;
+        return portable_zero;
+}
+
+static mismatch_fn resolve_mismatch(void)
+{
+        if (avx512_supported())
+                return avx512_mismatch;
+        if (avx2_supported())
+                return avx2_mismatch;
+        if (sse2_supported())
+                return sse2_mismatch;
+        return portable_mismatch;
+}
+
+bool scan_zero(size_t size, const unsigned char *buff)
+        __attribute__((ifunc("resolve_zero")));
+
+size_t scan_mismatch(size_t size, const unsigned char *a,
+                     const unsigned char *b)
+        __attribute__((ifunc("resolve_mismatch")));
+
+#else
+
+bool scan_zero(size_t size, const unsigned char *buff)
+{
+        return portable_zero(size, buff);
+}
+
+size_t scan_mismatch(size_t size, const unsigned char *a,
+                     const unsigned char *b)
+{
+        return portable_mismatch(size, a, b);
+}
+
+#endif //SCAN_X86
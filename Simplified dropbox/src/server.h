@@ -9,6 +9,16 @@
 
 #include "settings.h"
 
+/**
+ * Maximum number of the threads writing the received blocks.
+ */
+#define SERVER_MAX_WRITERS 64
+
+/**
+ * Maximum time in milliseconds the server waits for a stalled client.
+ */
+#define SERVER_MAX_SESSION_TIMEOUT (60 * 60 * 1000)
+
 /**
  * @brief Entry point of the server.
  *
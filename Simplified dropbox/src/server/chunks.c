@@ -0,0 +1,740 @@
+/**
+ * @file chunks.c
+ * @brief Content-addressed index of the chunks of the files.
+ *
+ * The index is an append-only log of the files written by the server,
+ * each with the hashes and the offsets of its chunks. A record without
+ * chunks marks the file deleted or renamed. The log is loaded into an open
+ * addressing hash table on start, where only the newest record of every
+ * file counts, and it is rewritten with only those records once most of
+ * it is superseded. The newest location of every chunk wins and the
+ * locations which no longer hold the chunk are found out when the chunk is
+ * read and dropped.
+ */
+#include "chunks.h"
+
+#include "log.h"
+#include "utils.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NO_NAME UINT32_MAX
+#define MIN_SLOT_COUNT 1024
+#define MIN_NAME_SLOT_COUNT 64
+
+/** the log is rewritten while loading when the live records take less */
+#define COMPACT_RATIO 2
+
+/**
+ * Location of a chunk. The slot is empty if @c size is 0 and the location
+ * is known to be invalid if @c name is @c NO_NAME or the file was written
+ * again since, i.e. its @c generation changed.
+ */
+struct chunk_entry {
+        unsigned char hash[HASH_SHA256_SIZE];
+        uint64_t offset;     /**< offset of the chunk in the file */
+        uint64_t size;       /**< size of the chunk */
+        uint32_t name;       /**< index of the name of the file */
+        uint32_t generation; /**< generation of the name it belongs to */
+};
+
+/**
+ * File of the index. Every file has one name, its newer records only bump
+ * the generation, which invalidates the chunks of the older ones.
+ */
+struct chunk_name {
+        char *name;
+        uint32_t generation;
+        bool indexed; /**< the newest record of the file has chunks */
+};
+
+struct server_chunks {
+        int dirfd;                 /**< directory of the files */
+        int log_fd;                /**< the index open for appending */
+        struct chunk_name *names;  /**< names of the indexed files */
+        size_t name_count;         /**< number of @c names */
+        size_t name_capacity;      /**< capacity of @c names */
+        uint32_t *name_slots;      /**< hash table of the indexes of the
+                                        names + 1, 0 if empty */
+        size_t name_slot_count;    /**< a power of 2 */
+        struct chunk_entry *slots; /**< hash table of the chunks */
+        size_t slot_count;         /**< number of the slots, a power of 2 */
+        size_t used;               /**< number of the slots not empty */
+        int source_fd;             /**< file the last chunk was read from */
+        uint32_t source_name;      /**< name of @c source_fd */
+        unsigned char *buff;       /**< buffer for a chunk */
+};
+
+/**
+ * Record of a chunk in the log, all numbers in network byte order.
+ */
+struct chunk_record {
+        unsigned char hash[HASH_SHA256_SIZE];
+        uint64_t offset;
+        uint64_t size;
+};
+
+static size_t slot_of(const struct server_chunks *index,
+                      const unsigned char hash[HASH_SHA256_SIZE])
+{
+        uint64_t prefix;
+        memcpy(&prefix, hash, sizeof(prefix));
+        return prefix & (index->slot_count - 1);
+}
+
+static size_t next_slot(const struct server_chunks *index, size_t slot)
+{
+        return (slot + 1) & (index->slot_count - 1);
+}
+
+/**
+ * Finds the slot of the chunk or the empty slot where it belongs.
+ */
+static struct chunk_entry *find_slot(const struct server_chunks *index,
+                                     const unsigned char *hash)
+{
+        size_t slot = slot_of(index, hash);
+        while (index->slots[slot].size != 0
+               && memcmp(index->slots[slot].hash, hash, HASH_SHA256_SIZE) != 0)
+                slot = next_slot(index, slot);
+        return &index->slots[slot];
+}
+
+/**
+ * Checks whether the location may still hold the chunk.
+ */
+static bool is_live(const struct server_chunks *index,
+                    const struct chunk_entry *entry)
+{
+        return entry->size != 0 && entry->name != NO_NAME
+               && entry->generation == index->names[entry->name].generation;
+}
+
+/**
+ * Moves the live locations to a new table, which is large enough for
+ * twice as many of them. The table shrinks if most of the locations were
+ * superseded.
+ */
+static bool rebuild_slots(struct server_chunks *index)
+{
+        const size_t old_count = index->slot_count;
+        struct chunk_entry *old_slots = index->slots;
+
+        size_t live = 0;
+        for (size_t i = 0; i < old_count; i++)
+                live += is_live(index, &old_slots[i]);
+        size_t slot_count = MIN_SLOT_COUNT;
+        while (4 * (live + 1) > slot_count)
+                slot_count *= 2;
+        struct chunk_entry *slots = calloc(slot_count, sizeof(*slots));
+        if (slots == NULL)
+                return false;
+
+        index->slots = slots;
+        index->slot_count = slot_count;
+        index->used = 0;
+        for (size_t i = 0; i < old_count; i++) {
+                const struct chunk_entry *entry = &old_slots[i];
+                // the invalid locations are left out
+                if (!is_live(index, entry))
+                        continue;
+                *find_slot(index, entry->hash) = *entry;
+                index->used++;
+        }
+        free(old_slots);
+        return true;
+}
+
+static bool insert(struct server_chunks *index, const struct chunk_entry *entry)
+{
+        if (2 * (index->used + 1) > index->slot_count && !rebuild_slots(index))
+                return false;
+
+        struct chunk_entry *slot = find_slot(index, entry->hash);
+        if (slot->size == 0)
+                index->used++;
+        *slot = *entry;
+        return true;
+}
+
+/**
+ * Finds the slot of the name or the empty slot where it belongs.
+ */
+static size_t find_name_slot(const struct server_chunks *index,
+                             const char *name, size_t size)
+{
+        const size_t mask = index->name_slot_count - 1;
+        size_t slot = hash_xxh64(size, name, 0) & mask;
+        while (index->name_slots[slot] != 0) {
+                const uint32_t found = index->name_slots[slot] - 1;
+                const char *other = index->names[found].name;
+                if (strncmp(other, name, size) == 0 && other[size] == '\0')
+                        break;
+                slot = (slot + 1) & mask;
+        }
+        return slot;
+}
+
+static bool grow_name_slots(struct server_chunks *index)
+{
+        const size_t slot_count = index->name_slot_count == 0
+                                          ? MIN_NAME_SLOT_COUNT
+                                          : 2 * index->name_slot_count;
+        uint32_t *slots = calloc(slot_count, sizeof(*slots));
+        if (slots == NULL)
+                return false;
+
+        free(index->name_slots);
+        index->name_slots = slots;
+        index->name_slot_count = slot_count;
+        for (size_t i = 0; i < index->name_count; i++) {
+                const char *name = index->names[i].name;
+                slots[find_name_slot(index, name, strlen(name))] = i + 1;
+        }
+        return true;
+}
+
+/**
+ * Finds the file of the index.
+ *
+ * @return index of the name;
+ *         @c NO_NAME if the file is not in the index
+ */
+static uint32_t find_name(const struct server_chunks *index, const char *name,
+                          size_t size)
+{
+        if (index->name_count == 0)
+                return NO_NAME;
+        const uint32_t found
+                = index->name_slots[find_name_slot(index, name, size)];
+        return found == 0 ? NO_NAME : found - 1;
+}
+
+/**
+ * Adds the file to the index, or starts the new generation of its chunks
+ * if it is there already.
+ */
+static bool push_name(struct server_chunks *index, const char *name,
+                      size_t size, uint32_t *name_index)
+{
+        *name_index = find_name(index, name, size);
+        if (*name_index != NO_NAME) {
+                index->names[*name_index].generation++;
+                return true;
+        }
+
+        if (index->name_count >= NO_NAME) {
+                errno = EOVERFLOW;
+                return false;
+        }
+        if (2 * (index->name_count + 1) > index->name_slot_count
+            && !grow_name_slots(index))
+                return false;
+        if (index->name_count == index->name_capacity) {
+                const size_t capacity = index->name_capacity == 0
+                                                ? 16
+                                                : 2 * index->name_capacity;
+                struct chunk_name *names
+                        = realloc(index->names, capacity * sizeof(*names));
+                if (names == NULL)
+                        return false;
+                index->names = names;
+                index->name_capacity = capacity;
+        }
+
+        char *copy = strndup(name, size);
+        if (copy == NULL)
+                return false;
+        *name_index = index->name_count;
+        index->names[index->name_count++] = (struct chunk_name){
+                .name = copy,
+        };
+        index->name_slots[find_name_slot(index, name, size)]
+                = index->name_count;
+        return true;
+}
+
+static bool read_u64(FILE *file, uint64_t *value)
+{
+        if (fread(value, sizeof(*value), 1, file) != 1)
+                return false;
+        *value = be64toh(*value);
+        return true;
+}
+
+/**
+ * Reads one file of the log into the index.
+ *
+ * @return true if the whole record was read;
+ *         false at the end of the log, on a torn record or on failure
+ */
+static bool load_record(struct server_chunks *index, FILE *file)
+{
+        char name[PATH_MAX];
+        uint64_t name_size;
+        uint64_t count;
+        if (!read_u64(file, &name_size) || name_size == 0
+            || name_size >= sizeof(name)
+            || fread(name, 1, name_size, file) != name_size
+            || !read_u64(file, &count))
+                return false;
+
+        uint32_t name_index;
+        if (!push_name(index, name, name_size, &name_index))
+                return false;
+        index->names[name_index].indexed = count > 0;
+
+        for (uint64_t i = 0; i < count; i++) {
+                struct chunk_record record;
+                if (fread(&record, sizeof(record), 1, file) != 1)
+                        return false;
+
+                struct chunk_entry entry = {
+                        .offset = be64toh(record.offset),
+                        .size = be64toh(record.size),
+                        .name = name_index,
+                        .generation = index->names[name_index].generation,
+                };
+                memcpy(entry.hash, record.hash, sizeof(entry.hash));
+                if (entry.size == 0 || entry.size > HASH_CDC_MAX_SIZE)
+                        return false;
+                if (!insert(index, &entry))
+                        return false;
+        }
+        return true;
+}
+
+/**
+ * Builds the record of the file with @c count chunks, each given by
+ * @c get_chunk.
+ *
+ * @return the record, which must be freed;
+ *         NULL on failure
+ */
+static unsigned char *
+build_record(const char *name, size_t count,
+             void (*get_chunk)(const void *chunks, size_t i,
+                               struct chunk_record *record),
+             const void *chunks, size_t *size)
+{
+        const size_t name_size = strlen(name);
+        *size = 2 * sizeof(uint64_t) + name_size
+                + count * sizeof(struct chunk_record);
+        unsigned char *record = malloc(*size);
+        if (record == NULL)
+                return NULL;
+
+        const uint64_t name_size_be = htobe64(name_size);
+        const uint64_t count_be = htobe64(count);
+        unsigned char *p = record;
+        memcpy(p, &name_size_be, sizeof(name_size_be));
+        p += sizeof(name_size_be);
+        memcpy(p, name, name_size);
+        p += name_size;
+        memcpy(p, &count_be, sizeof(count_be));
+        p += sizeof(count_be);
+        for (size_t i = 0; i < count; i++) {
+                struct chunk_record chunk;
+                get_chunk(chunks, i, &chunk);
+                memcpy(p, &chunk, sizeof(chunk));
+                p += sizeof(chunk);
+        }
+        return record;
+}
+
+static void get_offered_chunk(const void *chunks, size_t i,
+                              struct chunk_record *record)
+{
+        const struct server_chunk *chunk
+                = &((const struct server_chunk *)chunks)[i];
+        record->offset = htobe64(chunk->offset);
+        record->size = htobe64(chunk->size);
+        memcpy(record->hash, chunk->hash, sizeof(record->hash));
+}
+
+static void get_entry(const void *chunks, size_t i,
+                      struct chunk_record *record)
+{
+        const struct chunk_entry *entry
+                = ((const struct chunk_entry *const *)chunks)[i];
+        record->offset = htobe64(entry->offset);
+        record->size = htobe64(entry->size);
+        memcpy(record->hash, entry->hash, sizeof(record->hash));
+}
+
+/**
+ * Appends the record at once, so a crash tears at most the last record.
+ */
+static bool append_record(struct server_chunks *index, const char *name,
+                          size_t count,
+                          void (*get_chunk)(const void *chunks, size_t i,
+                                            struct chunk_record *record),
+                          const void *chunks)
+{
+        size_t size;
+        unsigned char *record
+                = build_record(name, count, get_chunk, chunks, &size);
+        if (record == NULL)
+                return false;
+
+        const bool written = utils_write(index->log_fd, size, record)
+                             == (ssize_t)size;
+        free(record);
+        return written;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+        const struct chunk_entry *x = *(const struct chunk_entry *const *)a;
+        const struct chunk_entry *y = *(const struct chunk_entry *const *)b;
+        if (x->name != y->name)
+                return x->name < y->name ? -1 : 1;
+        return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/**
+ * Writes the live locations grouped by the files to @c fd.
+ */
+static bool write_live(const struct server_chunks *index,
+                       const struct chunk_entry **live, size_t count, int fd)
+{
+        size_t start = 0;
+        while (start < count) {
+                const uint32_t name = live[start]->name;
+                size_t end = start;
+                while (end < count && live[end]->name == name)
+                        end++;
+
+                size_t size;
+                unsigned char *record
+                        = build_record(index->names[name].name, end - start,
+                                       get_entry, &live[start], &size);
+                if (record == NULL)
+                        return false;
+                const bool written
+                        = utils_write(fd, size, record) == (ssize_t)size;
+                free(record);
+                if (!written)
+                        return false;
+                start = end;
+        }
+        return true;
+}
+
+/**
+ * Replaces the log with the newest records of the files still indexed if
+ * they take less than the part @c COMPACT_RATIO of it, so the records
+ * superseded by the rewritten files and the deleted and renamed files do
+ * not pile up.
+ */
+static bool compact(struct server_chunks *index, off_t end)
+{
+        size_t count = 0;
+        for (size_t i = 0; i < index->slot_count; i++)
+                count += is_live(index, &index->slots[i]);
+        const struct chunk_entry **live = malloc((count + 1) * sizeof(*live));
+        if (live == NULL)
+                return false;
+        count = 0;
+        for (size_t i = 0; i < index->slot_count; i++)
+                if (is_live(index, &index->slots[i]))
+                        live[count++] = &index->slots[i];
+        qsort(live, count, sizeof(*live), compare_entries);
+
+        uint64_t live_size = count * sizeof(struct chunk_record);
+        for (size_t i = 0; i < count; i++)
+                if (i == 0 || live[i]->name != live[i - 1]->name)
+                        live_size += 2 * sizeof(uint64_t)
+                                     + strlen(index->names[live[i]->name].name);
+        for (size_t i = 0; i < index->name_count; i++)
+                index->names[i].indexed = false;
+        for (size_t i = 0; i < count; i++)
+                index->names[live[i]->name].indexed = true;
+
+        bool success = true;
+        if (COMPACT_RATIO * live_size >= (uint64_t)end)
+                goto clean;
+
+        const int fd = openat(index->dirfd, SERVER_CHUNKS_COMPACT_NAME,
+                              O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0600);
+        success = fd != -1 && write_live(index, live, count, fd)
+                  && fsync(fd) != -1;
+        if (fd != -1 && close(fd) == -1)
+                success = false;
+        if (success
+            && renameat(index->dirfd, SERVER_CHUNKS_COMPACT_NAME, index->dirfd,
+                        SERVER_CHUNKS_INDEX_NAME)
+                       == -1)
+                success = false;
+        if (!success) {
+                log_warning("compact chunks");
+                unlinkat(index->dirfd, SERVER_CHUNKS_COMPACT_NAME, 0);
+                // the old log is still whole
+                success = true;
+                goto clean;
+        }
+
+        // the old descriptor appends to the replaced log
+        const int log_fd = openat(index->dirfd, SERVER_CHUNKS_INDEX_NAME,
+                                  O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (log_fd == -1) {
+                success = false;
+                goto clean;
+        }
+        if (close(index->log_fd) == -1)
+                log_warning("close");
+        index->log_fd = log_fd;
+        syslog(LOG_DEBUG, "compacted chunk index from %lld to %llu bytes",
+               (long long)end, (unsigned long long)live_size);
+
+clean:
+        free(live);
+        return success;
+}
+
+/**
+ * Loads the log and cuts off the record torn by a crash, so the new
+ * records are appended right after the last complete one.
+ */
+static bool load(struct server_chunks *index)
+{
+        const int fd = openat(index->dirfd, SERVER_CHUNKS_INDEX_NAME,
+                              O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+                return errno == ENOENT;
+
+        FILE *file = fdopen(fd, "r");
+        if (file == NULL) {
+                close(fd);
+                return false;
+        }
+
+        off_t end = 0;
+        while (load_record(index, file))
+                end = ftello(file);
+
+        bool success = !ferror(file);
+        if (success && ftruncate(index->log_fd, end) == -1)
+                success = false;
+        fclose(file);
+        if (success)
+                success = rebuild_slots(index) && compact(index, end);
+
+        syslog(LOG_DEBUG, "loaded %zu chunks of %zu files", index->used,
+               index->name_count);
+        return success;
+}
+
+struct server_chunks *server_chunks_open(int dirfd)
+{
+        struct server_chunks *index = calloc(1, sizeof(*index));
+        if (index == NULL)
+                return NULL;
+        index->dirfd = dirfd;
+        index->source_fd = -1;
+        index->log_fd = openat(dirfd, SERVER_CHUNKS_INDEX_NAME,
+                               O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC,
+                               0600);
+
+        if (index->log_fd == -1 || !rebuild_slots(index)
+            || (index->buff = malloc(HASH_CDC_MAX_SIZE)) == NULL
+            || !load(index)) {
+                server_chunks_close(index);
+                return NULL;
+        }
+        return index;
+}
+
+void server_chunks_close(struct server_chunks *index)
+{
+        if (index == NULL)
+                return;
+
+        const int saved_errno = errno;
+        server_chunks_release(index);
+        if (index->log_fd != -1 && close(index->log_fd) == -1)
+                log_warning("close");
+        for (size_t i = 0; i < index->name_count; i++)
+                free(index->names[i].name);
+        free(index->names);
+        free(index->name_slots);
+        free(index->slots);
+        free(index->buff);
+        free(index);
+        errno = saved_errno;
+}
+
+void server_chunks_release(struct server_chunks *index)
+{
+        if (index->source_fd != -1 && close(index->source_fd) == -1)
+                log_warning("close");
+        index->source_fd = -1;
+}
+
+static bool open_source(struct server_chunks *index, uint32_t name)
+{
+        if (index->source_fd != -1 && index->source_name == name)
+                return true;
+
+        server_chunks_release(index);
+        index->source_fd = openat(index->dirfd, index->names[name].name,
+                                  O_RDONLY | O_CLOEXEC);
+        index->source_name = name;
+        return index->source_fd != -1;
+}
+
+/**
+ * Reads the chunk from its location and checks it is still there.
+ */
+static bool read_chunk(struct server_chunks *index,
+                       const struct chunk_entry *entry)
+{
+        size_t done = 0;
+        while (done < entry->size) {
+                const ssize_t ret = pread(index->source_fd, &index->buff[done],
+                                          entry->size - done,
+                                          entry->offset + done);
+                if (ret == -1 && errno == EINTR)
+                        continue;
+                if (ret <= 0)
+                        return false;
+                done += ret;
+        }
+
+        unsigned char hash[HASH_SHA256_SIZE];
+        hash_sha256(entry->size, index->buff, hash);
+        return memcmp(hash, entry->hash, sizeof(hash)) == 0;
+}
+
+static bool write_chunk(const unsigned char *buff, size_t size, off_t offset,
+                        int fd)
+{
+        size_t done = 0;
+        while (done < size) {
+                const ssize_t ret
+                        = pwrite(fd, &buff[done], size - done, offset + done);
+                if (ret == -1 && errno == EINTR)
+                        continue;
+                if (ret == -1)
+                        return false;
+                done += ret;
+        }
+        return true;
+}
+
+bool server_chunks_copy(struct server_chunks *index,
+                        const struct server_chunk *chunk, int fd)
+{
+        struct chunk_entry *entry = find_slot(index, chunk->hash);
+        if (!is_live(index, entry) || entry->size != chunk->size)
+                return false;
+
+        if (!open_source(index, entry->name) || !read_chunk(index, entry)) {
+                syslog(LOG_DEBUG, "chunk of %s at %lu is gone",
+                       index->names[entry->name].name,
+                       (unsigned long)entry->offset);
+                entry->name = NO_NAME;
+                return false;
+        }
+
+        if (!write_chunk(index->buff, chunk->size, chunk->offset, fd)) {
+                log_warning("pwrite");
+                return false;
+        }
+        return true;
+}
+
+bool server_chunks_add_file(struct server_chunks *index, const char *name,
+                            const struct server_dedup *dedup)
+{
+        uint32_t name_index;
+        if (!append_record(index, name, dedup->count, get_offered_chunk,
+                           dedup->chunks)
+            || !push_name(index, name, strlen(name), &name_index))
+                return false;
+        index->names[name_index].indexed = true;
+
+        for (size_t i = 0; i < dedup->count; i++) {
+                struct chunk_entry entry = {
+                        .offset = dedup->chunks[i].offset,
+                        .size = dedup->chunks[i].size,
+                        .name = name_index,
+                        .generation = index->names[name_index].generation,
+                };
+                memcpy(entry.hash, dedup->chunks[i].hash, sizeof(entry.hash));
+                if (!insert(index, &entry))
+                        return false;
+        }
+        return true;
+}
+
+/**
+ * Appends the record without chunks for the indexed file and drops its
+ * chunks.
+ */
+static bool forget_name(struct server_chunks *index, uint32_t name)
+{
+        if (!index->names[name].indexed)
+                return true;
+        if (!append_record(index, index->names[name].name, 0, get_entry,
+                           NULL))
+                return false;
+        index->names[name].generation++;
+        index->names[name].indexed = false;
+        return true;
+}
+
+bool server_chunks_forget(struct server_chunks *index, const char *name)
+{
+        const uint32_t found = find_name(index, name, strlen(name));
+        return found == NO_NAME || forget_name(index, found);
+}
+
+bool server_chunks_forget_dir(struct server_chunks *index, const char *dir)
+{
+        for (size_t i = 0; i < index->name_count; i++)
+                if (utils_path_is_within(index->names[i].name, dir)
+                    && !forget_name(index, i))
+                        return false;
+        return true;
+}
+
+bool server_dedup_push(struct server_dedup *dedup,
+                       const struct server_chunk *chunk)
+{
+        if (dedup->count == dedup->capacity) {
+                const size_t capacity
+                        = dedup->capacity == 0 ? 64 : 2 * dedup->capacity;
+                struct server_chunk *chunks
+                        = realloc(dedup->chunks, capacity * sizeof(*chunks));
+                if (chunks == NULL)
+                        return false;
+                dedup->chunks = chunks;
+                dedup->capacity = capacity;
+        }
+        dedup->chunks[dedup->count++] = *chunk;
+        return true;
+}
+
+void server_dedup_reset(struct server_dedup *dedup)
+{
+        dedup->count = 0;
+        dedup->next_missing = 0;
+        dedup->missing_count = 0;
+        dedup->end = 0;
+}
+
+void server_dedup_destroy(struct server_dedup *dedup)
+{
+        free(dedup->chunks);
+        dedup->chunks = NULL;
+        dedup->capacity = 0;
+        server_dedup_reset(dedup);
+}
@@ -0,0 +1,139 @@
+/**
+ * @file chunks.h
+ * @brief Content-addressed index of the chunks of the files written into
+ *        the directory, so the chunks the server already has are copied
+ *        locally instead of being sent by the client.
+ */
+#ifndef CHUNKS_H
+#define CHUNKS_H
+
+#include "hash.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Name of the file in the directory, where the index is kept between runs
+ * of the server.
+ */
+#define SERVER_CHUNKS_INDEX_NAME ".dropbox_chunks"
+
+/**
+ * Name of the file the index is rewritten into before it replaces the old
+ * one.
+ */
+#define SERVER_CHUNKS_COMPACT_NAME SERVER_CHUNKS_INDEX_NAME ".tmp"
+
+/**
+ * Chunk of the file being written.
+ */
+struct server_chunk {
+        unsigned char hash[HASH_SHA256_SIZE]; /**< SHA-256 of the chunk */
+        uint64_t offset;                      /**< offset in the file */
+        uint64_t size;                        /**< size of the chunk */
+        bool missing; /**< the client sends the chunk as MSG_WRITE_BLOCK */
+};
+
+/**
+ * Chunks of the file being written, which were offered by the client.
+ */
+struct server_dedup {
+        struct server_chunk *chunks; /**< chunks in the order of the file */
+        size_t count;                /**< number of the chunks */
+        size_t capacity;             /**< capacity of @c chunks */
+        size_t next_missing;   /**< first chunk which may still be missing */
+        size_t missing_count;  /**< number of the chunks not received yet */
+        uint64_t end;          /**< end of the last chunk in the file */
+};
+
+struct server_chunks;
+
+/**
+ * Loads the index kept in @c SERVER_CHUNKS_INDEX_NAME and opens it for
+ * appending the chunks of the new files.
+ *
+ * @param dirfd  file descriptor of the directory
+ * @return       the index, which must be freed by server_chunks_close();
+ *               NULL on failure and errno is set appropriately
+ */
+struct server_chunks *server_chunks_open(int dirfd);
+
+/**
+ * Frees the index.
+ */
+void server_chunks_close(struct server_chunks *index);
+
+/**
+ * Writes the chunk at its offset of @c fd if the index knows a file in the
+ * directory, which contains it. The data are read again and checked against
+ * the hash, so the entries of the files changed or removed since are never
+ * trusted.
+ *
+ * @param index  the index
+ * @param chunk  the chunk with its hash, size and offset
+ * @param fd     file descriptor of the file being written
+ * @return       true if the chunk was written;
+ *               false if the chunk is missing or it could not be copied
+ */
+bool server_chunks_copy(struct server_chunks *index,
+                        const struct server_chunk *chunk, int fd);
+
+/**
+ * Closes the file the last chunk was copied from.
+ */
+void server_chunks_release(struct server_chunks *index);
+
+/**
+ * Adds the chunks of the written file to the index.
+ *
+ * @param index  the index
+ * @param name   name of the file in the directory
+ * @param dedup  chunks of the file
+ * @return       true on success;
+ *               false on failure and errno is set appropriately
+ */
+bool server_chunks_add_file(struct server_chunks *index, const char *name,
+                            const struct server_dedup *dedup);
+
+/**
+ * Drops the chunks of the deleted or renamed file from the index.
+ *
+ * @param index  the index
+ * @param name   name of the file in the directory
+ * @return       true on success;
+ *               false on failure and errno is set appropriately
+ */
+bool server_chunks_forget(struct server_chunks *index, const char *name);
+
+/**
+ * Drops the chunks of all the files in the deleted or renamed directory,
+ * including the file of the same name, from the index.
+ *
+ * @param index  the index
+ * @param dir    name of the directory in the directory of the index
+ * @return       true on success;
+ *               false on failure and errno is set appropriately
+ */
+bool server_chunks_forget_dir(struct server_chunks *index, const char *dir);
+
+/**
+ * Appends the chunk offered by the client for the current file.
+ *
+ * @return true on success;
+ *         false if the memory could not be allocated
+ */
+bool server_dedup_push(struct server_dedup *dedup,
+                       const struct server_chunk *chunk);
+
+/**
+ * Forgets the chunks of the current file.
+ */
+void server_dedup_reset(struct server_dedup *dedup);
+
+/**
+ * Frees the chunks of the current file.
+ */
+void server_dedup_destroy(struct server_dedup *dedup);
+
+#endif /* CHUNKS_H */
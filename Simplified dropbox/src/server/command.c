@@ -1,12 +1,22 @@
 #include "command.h"
+#include "chunks.h"
+#include "delta.h"
 #include "extract.h"
+#include "manifest.h"
+#include "resume.h"
+#include "session.h"
 
 #include "set.h"
+#include "staging.h"
 
 #include "log.h"
 #include "utils.h"
 
+#include <dirent.h>
+#include <endian.h>
 #include <syslog.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -25,15 +35,62 @@ static bool are_modifying_flags_set(const struct server_file_info *file_info)
         return file_info->creating_file || file_info->changing_file;
 }
 
+/**
+ * Checks whether the path is within the directory of the server, i.e. it
+ * is relative and does not contain "..", and fits the names of the file
+ * info.
+ *
+ * @param path  the path
+ * @param size  size of the path including '\0'
+ * @return true if the path is valid;
+ * @return false otherwise and errno is set to EINVAL
+ */
+static bool is_valid_name(const char *path, size_t size)
+{
+        if (size < 2 || size > PATH_MAX || path[size - 1] != '\0'
+            || path[0] == '/')
+                goto invalid;
+
+        for (const char *name = path; *name != '\0';) {
+                const char *end = strchrnul(name, '/');
+                if (end - name == 2 && strncmp(name, "..", 2) == 0)
+                        goto invalid;
+                name = *end == '/' ? end + 1 : end;
+        }
+        return true;
+invalid:
+        syslog(LOG_ERR, "invalid path of %lu bytes", (unsigned long)size);
+        errno = EINVAL;
+        return false;
+}
+
+/**
+ * Checks whether the payload is a valid path, see is_valid_name().
+ *
+ * @param packet  packet with the path as its payload
+ * @return true if the path is valid;
+ * @return false otherwise and errno is set to EINVAL
+ */
+static bool is_valid_path(const struct packet *packet)
+{
+        return is_valid_name((const char *)packet->payload,
+                             packet->payload_size);
+}
+
 CMD(change_file)
 {
         if (are_modifying_flags_set(data->file_info)) {
                 syslog(LOG_ERR, "already modifying another file");
                 return MSG_ABORT;
         }
+        if (!is_valid_path(data->packet))
+                return MSG_ABORT;
+
+        const char *file_name = (char *)data->packet->payload;
+        if (server_sessions_is_busy(data->file_info, file_name))
+                return MSG_NOK;
 
-        strncpy(data->file_info->change_name, (char *)data->packet->payload,
-                NAME_MAX);
+        strcpy(data->file_info->change_name, file_name);
         if (faccessat(data->file_info->dirfd, data->file_info->change_name,
                       F_OK, 0)
             == -1) {
@@ -55,18 +112,54 @@ CMD(change_file)
         syslog(LOG_DEBUG, "%s found and ready to be changed by next command",
                data->file_info->change_name);
         data->file_info->changing_file = true;
+        data->file_info->blocks_written = 0;
+        data->file_info->blocks_acked = 0;
         return MSG_OK;
 }
 
+/**
+ * Checks whether the created file is a new version of an existing file,
+ * which the client did not delete before.
+ */
+static bool replaces_file(const struct server_file_info *file_info,
+                          const char *name)
+{
+        struct stat sb;
+        return (file_info->features & PACKET_FEATURE_REPLACE)
+               && fstatat(file_info->dirfd, name, &sb, AT_SYMLINK_NOFOLLOW)
+                          != -1
+               && S_ISREG(sb.st_mode);
+}
+
 CMD(create_file)
 {
         if (are_modifying_flags_set(data->file_info)) {
                 syslog(LOG_ERR, "already modifying another file");
                 return MSG_ABORT;
         }
+        if (!is_valid_path(data->packet))
+                return MSG_ABORT;
+        if (server_sessions_is_busy(data->file_info,
+                                    (char *)data->packet->payload))
+                return MSG_NOK;
+
         data->file_info->creating_file = true;
-        data->file_info->file_name = (char *)data->packet->payload;
-        const int flags = O_CREAT | O_WRONLY;
+        data->file_info->blocks_written = 0;
+        data->file_info->blocks_acked = 0;
+        data->file_info->preallocated = false;
+        strcpy(data->file_info->file_name, (char *)data->packet->payload);
+        server_dedup_reset(&data->file_info->dedup);
+        // the staged file cannot be continued, it is not in the directory
+        if (replaces_file(data->file_info, data->file_info->file_name)) {
+                if (!server_staging_open(data->file_info,
+                                         data->file_info->file_name)) {
+                        log_error("openat");
+                        return MSG_ABORT;
+                }
+                return MSG_OK;
+        }
+        // the written prefix is read again for the checkpoints
+        const int flags = O_CREAT | O_RDWR;
         if ((data->file_info->filefd
              = openat(data->file_info->dirfd, data->file_info->file_name, flags,
                       0666))
@@ -78,18 +171,47 @@ CMD(create_file)
                 log_error("openat");
                 return MSG_ABORT;
         }
+        server_resume_start(data->file_info->dirfd, data->file_info->resume,
+                            data->file_info->file_name);
         syslog(LOG_DEBUG, "file %s was created successfully",
                data->file_info->file_name);
         return MSG_OK;
 }
 
+/**
+ * Drops the chunks of the removed file or directory from the index, so the
+ * index does not grow with the files no longer there.
+ */
+static void forget_chunks(const struct server_file_info *file_info,
+                          const char *name, bool is_dir)
+{
+        if (file_info->chunks == NULL)
+                return;
+        const bool success
+                = is_dir ? server_chunks_forget_dir(file_info->chunks, name)
+                         : server_chunks_forget(file_info->chunks, name);
+        if (!success)
+                log_warning("forget chunks");
+}
+
 CMD(delete_file)
 {
+        if (!is_valid_path(data->packet))
+                return MSG_ABORT;
+
         const char *file_name = (char *)data->packet->payload;
+        if (server_sessions_is_busy(data->file_info, file_name))
+                return MSG_NOK;
+
         if (unlinkat(data->file_info->dirfd, file_name, 0) == -1) {
+                const int error = errno;
                 log_error("unlinkat");
-                return MSG_ABORT;
+                // e.g. the client never sent the file it deleted right away
+                return error == ENOENT ? MSG_NOK : MSG_ABORT;
         }
+        server_resume_forget(data->file_info->dirfd, data->file_info->resume,
+                             file_name);
+        forget_chunks(data->file_info, file_name, false);
         syslog(LOG_DEBUG, "file %s was deleted successfully", file_name);
         return MSG_OK;
 }
@@ -110,10 +232,14 @@ modify_metadata(struct server_command_data *data,
         if (ret_code == MSG_ABORT)
                 return MSG_ABORT;
 
-        if (data->file_info->changing_file
-            && ((ret_code = set(data->file_info)) == MSG_ABORT))
-                return MSG_ABORT;
+        if (!data->file_info->changing_file)
+                return ret_code;
 
+        // the attribute of the changed file is set right away
+        ret_code = set(data->file_info);
+        if (close(data->file_info->filefd) == -1)
+                log_warning("close");
+        data->file_info->filefd = -1;
         data->file_info->changing_file = false;
 
         return ret_code;
@@ -137,6 +263,115 @@ CMD(set_owner)
                                server_set_owner);
 }
 
+/**
+ * Returns the pipe the blocks are spliced through or NULL if the server
+ * couldn't create it.
+ */
+static const int *splice_pipe(const struct server_file_info *file_info)
+{
+        return file_info->pipe_fds[0] != -1 ? file_info->pipe_fds : NULL;
+}
+
+/**
+ * Returns the largest data block the client is allowed to send.
+ */
+static uint64_t max_block_size(const struct server_command_data *data)
+{
+        return data->file_info->chunk_size != 0 ? data->file_info->chunk_size
+                                                : data->settings->fs_block_size;
+}
+
+/**
+ * Moves to the offset of the next chunk the client sends, because the
+ * server did not have it.
+ */
+static bool seek_missing_chunk(const struct server_command_data *data)
+{
+        struct server_dedup *dedup = &data->file_info->dedup;
+        while (!dedup->chunks[dedup->next_missing].missing)
+                dedup->next_missing++;
+
+        const struct server_chunk *chunk = &dedup->chunks[dedup->next_missing];
+        if (data->packet->payload_size != chunk->size) {
+                syslog(LOG_ERR, "block of %lu bytes, missing chunk of %lu",
+                       (unsigned long)data->packet->payload_size,
+                       (unsigned long)chunk->size);
+                return false;
+        }
+        if (lseek(data->file_info->filefd, chunk->offset, SEEK_SET) == -1) {
+                log_error("lseek");
+                return false;
+        }
+        return true;
+}
+
+/**
+ * Marks the chunk as received. After the last missing chunk the file
+ * continues after the offered chunks.
+ */
+static bool finish_missing_chunk(const struct server_command_data *data)
+{
+        struct server_dedup *dedup = &data->file_info->dedup;
+        dedup->chunks[dedup->next_missing++].missing = false;
+        if (--dedup->missing_count > 0)
+                return true;
+
+        if (lseek(data->file_info->filefd, dedup->end, SEEK_SET) == -1) {
+                log_error("lseek");
+                return false;
+        }
+        return true;
+}
+
+/**
+ * Moves the checkpoint of the created file after the written block.
+ * The transfer goes on without the checkpoint if it fails.
+ *
+ * @return false if a write in flight failed
+ */
+static bool advance_checkpoint(const struct server_command_data *data)
+{
+        struct server_file_info *file_info = data->file_info;
+        const off_t position = lseek(file_info->filefd, 0, SEEK_CUR);
+        if (position == -1) {
+                log_warning("lseek");
+                server_resume_stop(file_info->resume, file_info->file_name);
+                return true;
+        }
+        // the checkpoint hashes the file, so it needs the blocks on disk
+        if (server_resume_is_due(file_info->resume, file_info->file_name,
+                                 position)
+            && !server_storage_drain(file_info->storage))
+                return false;
+        if (!server_resume_advance(file_info->dirfd, file_info->resume,
+                                   file_info->file_name, file_info->filefd,
+                                   position))
+                log_warning("checkpoint");
+        return true;
+}
+
+/**
+ * Reads the block into a buffer of the storage and submits its write at
+ * the position of the file. The position moves after the block at once.
+ */
+static bool write_block_async(const struct server_command_data *data)
+{
+        struct server_storage *storage = data->file_info->storage;
+        const int fd = data->file_info->filefd;
+        const size_t size = data->packet->payload_size;
+
+        unsigned char *buffer = server_storage_buffer(storage);
+        if (buffer == NULL
+            || !packet_stream_read_payload_to_buffer(data->settings->stream,
+                                                     data->packet, buffer))
+                return false;
+
+        const off_t end = lseek(fd, size, SEEK_CUR);
+        return end != -1
+               && server_storage_write(storage, fd, buffer, size,
+                                       end - (off_t)size);
+}
+
 CMD(write_block)
 {
         if (!are_modifying_flags_set(data->file_info)) {
@@ -144,6 +379,16 @@ CMD(write_block)
                 return MSG_ABORT;
         }
 
+        if (data->packet->payload_size > max_block_size(data)) {
+                syslog(LOG_ERR, "block of %lu bytes is too large",
+                       (unsigned long)data->packet->payload_size);
+                return MSG_ABORT;
+        }
+
+        struct server_dedup *dedup = &data->file_info->dedup;
+        if (dedup->missing_count > 0 && !seek_missing_chunk(data))
+                return MSG_ABORT;
+
         // Got empty block of sparse file
         if (data->packet->payload_size == 0) {
                 if (lseek(data->file_info->filefd,
@@ -152,13 +397,757 @@ CMD(write_block)
                         log_error("lseek");
                         return MSG_ABORT;
                 }
-        } else if (utils_write(data->file_info->filefd,
-                               data->packet->payload_size,
-                               &data->packet->payload)
-                   == -1) {
+        } else if (data->file_info->storage != NULL) {
+                if (!write_block_async(data)) {
+                        log_error("write");
+                        return MSG_ABORT;
+                }
+        } else if (!packet_stream_read_payload_to_file(
+                           data->settings->stream, data->packet,
+                           data->file_info->filefd,
+                           splice_pipe(data->file_info))) {
+                log_error("write");
+                return MSG_ABORT;
+        }
+        if (dedup->missing_count > 0 && !finish_missing_chunk(data))
+                return MSG_ABORT;
+        // the file is whole up to the position unless chunks are missing
+        if (dedup->missing_count == 0 && !advance_checkpoint(data)) {
                 log_error("write");
                 return MSG_ABORT;
         }
+        data->file_info->blocks_written++;
         syslog(LOG_DEBUG, "block written successfully");
         return MSG_OK;
 }
+
+/**
+ * Fills the part of the file with zeros, on the filesystems which cannot
+ * punch holes.
+ */
+static bool write_zeros(int fd, off_t offset, off_t size)
+{
+        static const unsigned char zeros[64 * 1024];
+        while (size > 0) {
+                const size_t len = size < (off_t)sizeof(zeros)
+                                           ? (size_t)size
+                                           : sizeof(zeros);
+                const ssize_t rc = pwrite(fd, zeros, len, offset);
+                if (rc == -1 && errno == EINTR)
+                        continue;
+                if (rc <= 0)
+                        return false;
+                offset += rc;
+                size -= rc;
+        }
+        return true;
+}
+
+/**
+ * Replaces the old bytes at the position of the file with the hole and
+ * moves after it. The file is extended if the hole ends after its end.
+ */
+static bool punch_hole(int fd, off_t size)
+{
+        struct stat sb;
+        const off_t offset = lseek(fd, 0, SEEK_CUR);
+        if (offset == -1 || fstat(fd, &sb) == -1)
+                return false;
+
+        const off_t end = offset + size;
+        if (offset < sb.st_size) {
+                const off_t len
+                        = (end < sb.st_size ? end : sb.st_size) - offset;
+                if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                              offset, len)
+                            == -1
+                    && (errno != EOPNOTSUPP || !write_zeros(fd, offset, len)))
+                        return false;
+        }
+        if (end > sb.st_size && ftruncate(fd, end) == -1)
+                return false;
+        return lseek(fd, end, SEEK_SET) != -1;
+}
+
+CMD(write_hole)
+{
+        struct server_file_info *file_info = data->file_info;
+        if (!are_modifying_flags_set(file_info)) {
+                syslog(LOG_ERR, "no file to modify");
+                return MSG_ABORT;
+        }
+        if (file_info->dedup.missing_count > 0) {
+                syslog(LOG_ERR, "hole instead of a missing chunk");
+                return MSG_ABORT;
+        }
+
+        const struct packet_payload_hole *payload
+                = (struct packet_payload_hole *)data->packet->payload;
+        const off_t position = lseek(file_info->filefd, 0, SEEK_CUR);
+        if (payload->size == 0 || position == -1
+            || payload->size > (uint64_t)(INT64_MAX - position)) {
+                syslog(LOG_ERR, "invalid hole of %lu bytes",
+                       (unsigned long)payload->size);
+                return MSG_ABORT;
+        }
+        if (!punch_hole(file_info->filefd, payload->size)
+            || !advance_checkpoint(data)) {
+                log_error("write hole");
+                return MSG_ABORT;
+        }
+        file_info->blocks_written++;
+        syslog(LOG_DEBUG, "hole of %lu bytes written",
+               (unsigned long)payload->size);
+        return MSG_OK;
+}
+
+CMD(file_size)
+{
+        struct server_file_info *file_info = data->file_info;
+        if (!file_info->creating_file || file_info->basis_fd != -1
+            || file_info->blocks_written > 0 || file_info->dedup.count > 0) {
+                syslog(LOG_ERR, "no created file to allocate");
+                return MSG_ABORT;
+        }
+
+        const struct packet_payload_file_size *payload
+                = (struct packet_payload_file_size *)data->packet->payload;
+        if (payload->size > INT64_MAX) {
+                syslog(LOG_ERR, "invalid file size %lu",
+                       (unsigned long)payload->size);
+                return MSG_ABORT;
+        }
+        // the file is written by the blocks without the preallocation too
+        if (!server_storage_preallocate(file_info->filefd, payload->size,
+                                        payload->sparse)) {
+                syslog(LOG_WARNING, "cannot allocate %s: %s",
+                       file_info->file_name, strerror(errno));
+                return MSG_OK;
+        }
+        file_info->preallocated = true;
+        syslog(LOG_DEBUG, "%s allocated to %lu bytes", file_info->file_name,
+               (unsigned long)payload->size);
+        return MSG_OK;
+}
+
+CMD(settings)
+{
+        if (are_modifying_flags_set(data->file_info)) {
+                syslog(LOG_ERR, "cannot change settings while modifying file");
+                return MSG_ABORT;
+        }
+
+        const struct packet_payload_settings *client_settings
+                = (struct packet_payload_settings *)data->packet->payload;
+
+        uint64_t window_size = client_settings->window_size;
+        if (window_size > data->settings->window_size)
+                window_size = data->settings->window_size;
+
+        uint64_t chunk_size = 0;
+        if (client_settings->protocol_version >= 1
+            && (client_settings->features & PACKET_FEATURE_CHUNKS)) {
+                chunk_size = client_settings->chunk_size;
+                if (chunk_size > data->settings->chunk_size
+                    || chunk_size % data->settings->fs_block_size != 0) {
+                        syslog(LOG_ERR, "invalid chunk size %lu",
+                               (unsigned long)chunk_size);
+                        return MSG_ABORT;
+                }
+        }
+
+        data->file_info->features = client_settings->protocol_version >= 1
+                                            ? client_settings->features
+                                                      & PACKET_FEATURES
+                                            : 0;
+        data->file_info->window_size = window_size;
+        data->file_info->chunk_size = chunk_size;
+        syslog(LOG_DEBUG, "window size set to %lu", (unsigned long)window_size);
+        syslog(LOG_DEBUG, "chunk size set to %lu", (unsigned long)chunk_size);
+        return MSG_OK;
+}
+
+/**
+ * Sends the signatures of the blocks of the old file to the client.
+ */
+static bool send_signatures(const struct server_command_data *data,
+                            int basis_fd, off_t file_size, uint64_t block_size)
+{
+        size_t payload_size;
+        unsigned char *payload = server_delta_signatures(basis_fd, file_size,
+                                                         block_size,
+                                                         &payload_size);
+        if (payload == NULL) {
+                log_error("signatures");
+                return false;
+        }
+
+        const bool success = log_packet_send(data->settings->stream,
+                                             MSG_SIGNATURES, payload_size,
+                                             payload);
+        free(payload);
+        return success;
+}
+
+CMD(delta_file)
+{
+        if (are_modifying_flags_set(data->file_info)) {
+                syslog(LOG_ERR, "already modifying another file");
+                return MSG_ABORT;
+        }
+        if (!is_valid_path(data->packet))
+                return MSG_ABORT;
+
+        const char *file_name = (char *)data->packet->payload;
+        if (server_sessions_is_busy(data->file_info, file_name))
+                return MSG_NOK;
+
+        const int basis_fd
+                = openat(data->file_info->dirfd, file_name, O_RDONLY);
+        if (basis_fd == -1) {
+                syslog(LOG_WARNING, "no old file %s for the delta: %s",
+                       file_name, strerror(errno));
+                return MSG_NOK;
+        }
+
+        enum packet_msg_code code = MSG_ABORT;
+        struct stat sb;
+        if (fstat(basis_fd, &sb) == -1) {
+                log_error("fstat");
+                goto error;
+        }
+        if (!S_ISREG(sb.st_mode)) {
+                syslog(LOG_WARNING, "%s is not a regular file", file_name);
+                code = MSG_NOK;
+                goto error;
+        }
+
+        // renamed over the old file in its directory once it is done
+        const int flags = O_CREAT | O_TRUNC | O_WRONLY;
+        if (server_staging_name(data->file_info, file_name))
+                data->file_info->filefd
+                        = openat(data->file_info->dirfd,
+                                 data->file_info->staged_name, flags, 0600);
+        if (data->file_info->filefd == -1) {
+                log_error("openat");
+                goto error;
+        }
+        data->file_info->staging = SERVER_STAGING_TEMP;
+
+        const uint64_t block_size = server_delta_block_size(sb.st_size);
+        if (!send_signatures(data, basis_fd, sb.st_size, block_size)) {
+                if (close(data->file_info->filefd) == -1)
+                        log_warning("close");
+                data->file_info->filefd = -1;
+                server_staging_discard(data->file_info);
+                goto error;
+        }
+
+        data->file_info->creating_file = true;
+        data->file_info->blocks_written = 0;
+        data->file_info->blocks_acked = 0;
+        data->file_info->basis_fd = basis_fd;
+        data->file_info->basis_block_size = block_size;
+        strcpy(data->file_info->file_name, file_name);
+        syslog(LOG_DEBUG, "applying delta to %s with blocks of %lu bytes",
+               file_name, (unsigned long)block_size);
+        return MSG_OK;
+error:
+        if (close(basis_fd) == -1)
+                log_warning("close");
+        return code;
+}
+
+CMD(copy_blocks)
+{
+        if (!are_modifying_flags_set(data->file_info)
+            || data->file_info->basis_fd == -1) {
+                syslog(LOG_ERR, "no delta to apply");
+                return MSG_ABORT;
+        }
+
+        const struct packet_payload_copy_blocks *payload
+                = (struct packet_payload_copy_blocks *)data->packet->payload;
+        if (!server_delta_copy_blocks(data->file_info->basis_fd,
+                                      data->file_info->basis_block_size,
+                                      payload->index, payload->count,
+                                      data->file_info->filefd)) {
+                log_error("copy blocks");
+                return MSG_ABORT;
+        }
+        data->file_info->blocks_written++;
+        syslog(LOG_DEBUG, "%lu blocks copied successfully",
+               (unsigned long)payload->count);
+        return MSG_OK;
+}
+
+/**
+ * Sends the indexes of the offered chunks starting with the chunk @c first
+ * of the current file, which the client has to send.
+ */
+static bool send_missing_chunks(const struct server_command_data *data,
+                                size_t first)
+{
+        const struct server_dedup *dedup = &data->file_info->dedup;
+        uint64_t *payload = malloc(dedup->missing_count * sizeof(*payload) + 1);
+        if (payload == NULL) {
+                log_error("malloc");
+                return false;
+        }
+
+        size_t count = 0;
+        for (size_t i = first; i < dedup->count; i++) {
+                if (dedup->chunks[i].missing)
+                        payload[count++] = htobe64(i - first);
+        }
+
+        const bool success = log_packet_send(data->settings->stream,
+                                             MSG_MISSING_CHUNKS,
+                                             count * sizeof(*payload),
+                                             (const unsigned char *)payload);
+        free(payload);
+        return success;
+}
+
+/**
+ * Decodes the offered chunk and copies it into the current file if the
+ * directory already contains it.
+ */
+static bool offer_chunk(struct server_command_data *data,
+                        const unsigned char *payload)
+{
+        struct server_file_info *file_info = data->file_info;
+        struct packet_chunk_offer offer;
+        memcpy(&offer, payload, sizeof(offer));
+
+        struct server_chunk chunk = {
+                .offset = file_info->dedup.end,
+                .size = be64toh(offer.size),
+        };
+        if (chunk.size == 0 || chunk.size > HASH_CDC_MAX_SIZE
+            || chunk.size > max_block_size(data)) {
+                syslog(LOG_ERR, "invalid chunk of %lu bytes",
+                       (unsigned long)chunk.size);
+                return false;
+        }
+        memcpy(chunk.hash, offer.hash, sizeof(chunk.hash));
+
+        chunk.missing = !server_chunks_copy(file_info->chunks, &chunk,
+                                            file_info->filefd);
+        if (!server_dedup_push(&file_info->dedup, &chunk)) {
+                log_error("malloc");
+                return false;
+        }
+        file_info->dedup.end += chunk.size;
+        if (chunk.missing)
+                file_info->dedup.missing_count++;
+        return true;
+}
+
+CMD(offer_chunks)
+{
+        struct server_file_info *file_info = data->file_info;
+        struct server_dedup *dedup = &file_info->dedup;
+        if (!file_info->creating_file || file_info->basis_fd != -1
+            || file_info->chunks == NULL || dedup->missing_count > 0) {
+                syslog(LOG_ERR, "no file to offer chunks for");
+                return MSG_ABORT;
+        }
+
+        const size_t offer_size = sizeof(struct packet_chunk_offer);
+        const size_t count = data->packet->payload_size / offer_size;
+        if (count == 0 || data->packet->payload_size % offer_size != 0) {
+                syslog(LOG_ERR, "invalid offer of chunks");
+                return MSG_ABORT;
+        }
+
+        // the chunks continue at the current position of the file
+        const off_t position = lseek(file_info->filefd, 0, SEEK_CUR);
+        if (position == -1) {
+                log_error("lseek");
+                return MSG_ABORT;
+        }
+        dedup->end = position;
+        dedup->next_missing = dedup->count;
+
+        const size_t first = dedup->count;
+        bool success = true;
+        for (size_t i = 0; success && i < count; i++)
+                success = offer_chunk(data, &data->packet->payload[i * offer_size]);
+        server_chunks_release(file_info->chunks);
+        if (!success || !send_missing_chunks(data, first))
+                return MSG_ABORT;
+
+        if (dedup->missing_count == 0
+            && lseek(file_info->filefd, dedup->end, SEEK_SET) == -1) {
+                log_error("lseek");
+                return MSG_ABORT;
+        }
+        if (dedup->missing_count == 0)
+                advance_checkpoint(data);
+        syslog(LOG_DEBUG, "%zu of %zu offered chunks missing",
+               dedup->missing_count, count);
+        return MSG_OK;
+}
+
+CMD(get_manifest)
+{
+        if (are_modifying_flags_set(data->file_info)) {
+                syslog(LOG_ERR, "cannot list files while modifying file");
+                return MSG_ABORT;
+        }
+
+        const bool recursive = data->file_info->features & PACKET_FEATURE_DIRS;
+        if (!server_manifest_send(data->settings->stream,
+                                  data->file_info->dirfd, recursive)) {
+                log_error("manifest");
+                return MSG_ABORT;
+        }
+        return MSG_OK;
+}
+
+CMD(get_resume)
+{
+        struct server_file_info *file_info = data->file_info;
+        if (are_modifying_flags_set(file_info)) {
+                syslog(LOG_ERR, "already modifying another file");
+                return MSG_ABORT;
+        }
+        if (!is_valid_path(data->packet))
+                return MSG_ABORT;
+
+        const char *file_name = (char *)data->packet->payload;
+        const struct server_checkpoint *checkpoint
+                = server_resume_find(file_info->resume, file_name);
+        struct packet_payload_resume payload = { 0 };
+        struct stat sb;
+        if (checkpoint != NULL && checkpoint->offset > 0
+            && fstatat(file_info->dirfd, file_name, &sb, AT_SYMLINK_NOFOLLOW)
+                       != -1
+            && S_ISREG(sb.st_mode)
+            && (uint64_t)sb.st_size >= checkpoint->offset) {
+                payload.offset = checkpoint->offset;
+                payload.hash = checkpoint->hash;
+        }
+        // MSG_RESUME_FILE continues the file asked for last
+        strcpy(file_info->file_name, file_name);
+
+        if (!log_packet_send(data->settings->stream, MSG_RESUME_OFFSET,
+                             sizeof(payload), (const unsigned char *)&payload))
+                return MSG_ABORT;
+        syslog(LOG_DEBUG, "%s can be resumed at %lu", file_name,
+               (unsigned long)payload.offset);
+        return MSG_OK;
+}
+
+CMD(resume_file)
+{
+        struct server_file_info *file_info = data->file_info;
+        if (are_modifying_flags_set(file_info)) {
+                syslog(LOG_ERR, "already modifying another file");
+                return MSG_ABORT;
+        }
+
+        const struct packet_payload_resume *payload
+                = (struct packet_payload_resume *)data->packet->payload;
+        struct server_checkpoint *checkpoint
+                = server_resume_find(file_info->resume, file_info->file_name);
+        if (checkpoint == NULL || checkpoint->offset == 0
+            || payload->offset != checkpoint->offset
+            || payload->hash != checkpoint->hash) {
+                syslog(LOG_WARNING, "no checkpoint to resume");
+                return MSG_NOK;
+        }
+        if (checkpoint->tracking
+            || server_sessions_is_busy(file_info, checkpoint->name))
+                return MSG_NOK;
+
+        file_info->filefd = openat(file_info->dirfd, checkpoint->name, O_RDWR);
+        if (file_info->filefd == -1) {
+                syslog(LOG_WARNING, "cannot resume %s: %s", checkpoint->name,
+                       strerror(errno));
+                return MSG_NOK;
+        }
+        // the bytes after the checkpoint may not have reached the disk
+        if (ftruncate(file_info->filefd, checkpoint->offset) == -1
+            || lseek(file_info->filefd, checkpoint->offset, SEEK_SET) == -1) {
+                log_error("resume");
+                if (close(file_info->filefd) == -1)
+                        log_warning("close");
+                file_info->filefd = -1;
+                return MSG_ABORT;
+        }
+
+        file_info->creating_file = true;
+        file_info->blocks_written = 0;
+        file_info->blocks_acked = 0;
+        file_info->preallocated = false;
+        server_dedup_reset(&file_info->dedup);
+        checkpoint->tracking = true;
+        syslog(LOG_DEBUG, "file %s resumed at %lu", checkpoint->name,
+               (unsigned long)checkpoint->offset);
+        return MSG_OK;
+}
+
+CMD(create_dir)
+{
+        if (are_modifying_flags_set(data->file_info)) {
+                syslog(LOG_ERR, "already modifying another file");
+                return MSG_ABORT;
+        }
+        if (!is_valid_path(data->packet))
+                return MSG_ABORT;
+
+        const int dirfd = data->file_info->dirfd;
+        const char *dir_name = (char *)data->packet->payload;
+        struct stat sb;
+        if (fstatat(dirfd, dir_name, &sb, AT_SYMLINK_NOFOLLOW) == 0) {
+                if (S_ISDIR(sb.st_mode))
+                        return MSG_OK;
+                // the file was replaced by the directory in the SOURCE
+                if (server_sessions_is_busy(data->file_info, dir_name))
+                        return MSG_NOK;
+                if (unlinkat(dirfd, dir_name, 0) == -1) {
+                        log_error("unlinkat");
+                        return MSG_ABORT;
+                }
+                server_resume_forget(dirfd, data->file_info->resume,
+                                     dir_name);
+        }
+
+        if (mkdirat(dirfd, dir_name, 0777) == -1) {
+                syslog(LOG_WARNING, "cannot create directory %s: %s",
+                       dir_name, strerror(errno));
+                return MSG_NOK;
+        }
+        syslog(LOG_DEBUG, "directory %s was created successfully", dir_name);
+        return MSG_OK;
+}
+
+/**
+ * Removes the directory @c name of @c dirfd with all its content.
+ *
+ * @return true on success;
+ *         false on failure and errno is set appropriately
+ */
+static bool remove_tree(int dirfd, const char *name)
+{
+        const int fd = openat(dirfd, name,
+                              O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd == -1)
+                return false;
+        DIR *dir = fdopendir(fd);
+        if (dir == NULL) {
+                close(fd);
+                return false;
+        }
+
+        bool success = true;
+        struct dirent *dirent;
+        while (success && (errno = 0, dirent = readdir(dir)) != NULL) {
+                const char *child = dirent->d_name;
+                if (strcmp(child, ".") == 0 || strcmp(child, "..") == 0)
+                        continue;
+                if (dirent->d_type != DT_DIR && unlinkat(fd, child, 0) == 0)
+                        continue;
+                success = (dirent->d_type == DT_DIR || errno == EISDIR)
+                          && remove_tree(fd, child);
+        }
+        if (success && errno != 0)
+                success = false;
+
+        const int saved_errno = errno;
+        closedir(dir);
+        errno = saved_errno;
+        return success && unlinkat(dirfd, name, AT_REMOVEDIR) == 0;
+}
+
+CMD(delete_dir)
+{
+        if (!is_valid_path(data->packet))
+                return MSG_ABORT;
+
+        struct server_file_info *file_info = data->file_info;
+        const char *dir_name = (char *)data->packet->payload;
+        if (server_sessions_is_busy(file_info, dir_name))
+                return MSG_NOK;
+
+        if (!remove_tree(file_info->dirfd, dir_name)) {
+                syslog(LOG_WARNING, "cannot delete directory %s: %s",
+                       dir_name, strerror(errno));
+                return errno == ENOENT || errno == ENOTDIR ? MSG_NOK
+                                                           : MSG_ABORT;
+        }
+        server_resume_forget_dir(file_info->dirfd, file_info->resume,
+                                 dir_name);
+        forget_chunks(file_info, dir_name, true);
+        syslog(LOG_DEBUG, "directory %s was deleted successfully", dir_name);
+        return MSG_OK;
+}
+
+CMD(rename)
+{
+        if (are_modifying_flags_set(data->file_info)) {
+                syslog(LOG_ERR, "already modifying another file");
+                return MSG_ABORT;
+        }
+
+        const char *old_name = (char *)data->packet->payload;
+        const size_t size = data->packet->payload_size;
+        const size_t old_size = strnlen(old_name, size) + 1;
+        if (old_size >= size || !is_valid_name(old_name, old_size)
+            || !is_valid_name(&old_name[old_size], size - old_size))
+                return MSG_ABORT;
+
+        struct server_file_info *file_info = data->file_info;
+        const char *new_name = &old_name[old_size];
+        if (server_sessions_is_busy(file_info, old_name)
+            || server_sessions_is_busy(file_info, new_name))
+                return MSG_NOK;
+
+        if (renameat(file_info->dirfd, old_name, file_info->dirfd, new_name)
+            == -1) {
+                const int error = errno;
+                syslog(LOG_WARNING, "cannot rename %s to %s: %s", old_name,
+                       new_name, strerror(error));
+                // e.g. the server does not have the file or the directory
+                // of the new name is not empty
+                const bool refused = error == ENOENT || error == ENOTDIR
+                                     || error == EISDIR || error == ENOTEMPTY
+                                     || error == EEXIST;
+                return refused ? MSG_NOK : MSG_ABORT;
+        }
+        server_resume_forget_dir(file_info->dirfd, file_info->resume,
+                                 old_name);
+        server_resume_forget_dir(file_info->dirfd, file_info->resume,
+                                 new_name);
+        // the index has no chunks under the new name, but the replaced file
+        forget_chunks(file_info, old_name, true);
+        forget_chunks(file_info, new_name, true);
+        syslog(LOG_DEBUG, "%s was renamed to %s", old_name, new_name);
+        return MSG_OK;
+}
+
+/**
+ * Replaces the file of the bundle with a new one and sets its metadata.
+ * The owner is set only if the server may change it. The new version of an
+ * existing file is written aside and replaces it in one step if the client
+ * asked for it.
+ *
+ * @return true if the file was created;
+ *         false otherwise
+ */
+static bool create_bundle_file(struct server_file_info *file_info,
+                               const struct packet_bundle_record *record,
+                               const char *name, const unsigned char *content)
+{
+        if (server_sessions_is_busy(file_info, name))
+                return false;
+
+        int fd;
+        if (replaces_file(file_info, name))
+                fd = server_staging_open(file_info, name) ? file_info->filefd
+                                                          : -1;
+        else
+                fd = openat(file_info->dirfd, name,
+                            O_CREAT | O_TRUNC | O_WRONLY | O_NOFOLLOW
+                                    | O_CLOEXEC,
+                            0600);
+        file_info->filefd = -1;
+        if (fd == -1) {
+                syslog(LOG_WARNING, "cannot create %s: %s", name,
+                       strerror(errno));
+                return false;
+        }
+        server_resume_forget(file_info->dirfd, file_info->resume, name);
+        forget_chunks(file_info, name, false);
+
+        const struct timespec times[2] = {
+                { .tv_sec = be64toh(record->atime_sec),
+                  .tv_nsec = be64toh(record->atime_nsec) },
+                { .tv_sec = be64toh(record->mtime_sec),
+                  .tv_nsec = be64toh(record->mtime_nsec) },
+        };
+        const size_t size = be64toh(record->size);
+        bool success = utils_write(fd, size, content) != -1
+                       && fchmod(fd, be64toh(record->mode) & 07777) != -1;
+        if (success && fchown(fd, be64toh(record->uid), be64toh(record->gid))
+                               == -1)
+                syslog(LOG_DEBUG, "cannot set owner of %s: %s", name,
+                       strerror(errno));
+        // the times are set last, the other changes would update them
+        success = success && futimens(fd, times) != -1;
+        if (success && file_info->staging != SERVER_STAGING_NONE) {
+                file_info->filefd = fd;
+                success = server_staging_commit(file_info, name);
+                file_info->filefd = -1;
+        }
+        if (!success)
+                syslog(LOG_WARNING, "cannot write %s: %s", name,
+                       strerror(errno));
+        server_staging_discard(file_info);
+        if (close(fd) == -1)
+                log_warning("close");
+        return success;
+}
+
+CMD(file_bundle)
+{
+        if (are_modifying_flags_set(data->file_info)) {
+                syslog(LOG_ERR, "already modifying another file");
+                return MSG_ABORT;
+        }
+
+        const unsigned char *payload = data->packet->payload;
+        const size_t payload_size = data->packet->payload_size;
+        uint64_t count;
+        if (payload_size < sizeof(count))
+                goto invalid;
+        memcpy(&count, payload, sizeof(count));
+        count = be64toh(count);
+        if (count == 0 || count > PACKET_BUNDLE_MAX_FILES)
+                goto invalid;
+
+        unsigned char status[(PACKET_BUNDLE_MAX_FILES + 7) / 8] = { 0 };
+        size_t offset = sizeof(count);
+        for (uint64_t i = 0; i < count; i++) {
+                struct packet_bundle_record record;
+                if (payload_size - offset < sizeof(record))
+                        goto invalid;
+                memcpy(&record, &payload[offset], sizeof(record));
+                offset += sizeof(record);
+
+                const uint64_t name_size = be64toh(record.name_size);
+                const uint64_t size = be64toh(record.size);
+                if (name_size >= PATH_MAX
+                    || payload_size - offset < name_size
+                    || payload_size - offset - name_size < size)
+                        goto invalid;
+                char name[PATH_MAX];
+                memcpy(name, &payload[offset], name_size);
+                name[name_size] = '\0';
+                if (strlen(name) != name_size
+                    || !is_valid_name(name, name_size + 1))
+                        return MSG_ABORT;
+                offset += name_size;
+
+                if (create_bundle_file(data->file_info, &record, name,
+                                       &payload[offset]))
+                        status[i / 8] |= 1u << (i % 8);
+                offset += size;
+        }
+        if (offset != payload_size)
+                goto invalid;
+
+        if (!log_packet_send(data->settings->stream, MSG_BUNDLE_STATUS,
+                             (count + 7) / 8, status))
+                return MSG_ABORT;
+        syslog(LOG_DEBUG, "bundle of %lu files was written",
+               (unsigned long)count);
+        return MSG_OK;
+invalid:
+        syslog(LOG_ERR, "invalid bundle of %lu bytes",
+               (unsigned long)payload_size);
+        errno = EINVAL;
+        return MSG_ABORT;
+}
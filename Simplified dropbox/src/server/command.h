@@ -34,5 +34,86 @@ CMD(set_timestamps);
 CMD(set_perm_modes);
 CMD(set_owner);
 
+/**
+ * @brief Writes the block into the current file. Only the header of
+ *        MSG_WRITE_BLOCK is read, the payload is read from the connection
+ *        straight into the file.
+ */
 CMD(write_block);
+
+/**
+ * @brief Leaves a hole in the current file, which also extends the file
+ *        if it ends with the hole.
+ */
+CMD(write_hole);
+
+/**
+ * @brief Allocates the created file to the size the client sends. The file
+ *        is cut at the end of the written data when it is done.
+ */
+CMD(file_size);
+
+CMD(settings);
+
+/**
+ * @brief Starts applying a delta to an existing file. The signatures of
+ *        the blocks of the file are sent to the client before the reply.
+ */
+CMD(delta_file);
+
+/**
+ * @brief Copies blocks of the old file into the file the delta is applied
+ *        to.
+ */
+CMD(copy_blocks);
+
+/**
+ * @brief Copies the offered chunks of the created file, which are found in
+ *        the directory, and sends MSG_MISSING_CHUNKS with the rest before
+ *        the reply. The missing chunks follow as MSG_WRITE_BLOCK.
+ */
+CMD(offer_chunks);
+
+/**
+ * @brief Lists the files of the directory in MSG_MANIFEST packets before
+ *        the reply.
+ */
+CMD(get_manifest);
+
+/**
+ * @brief Sends the checkpoint of the partial file in MSG_RESUME_OFFSET
+ *        before the reply, the offset is 0 if it cannot be resumed.
+ */
+CMD(get_resume);
+
+/**
+ * @brief Continues creating the partial file at the checkpoint the client
+ *        verified.
+ */
+CMD(resume_file);
+
+/**
+ * @brief Creates the directory, the file of the same name is replaced.
+ *        An existing directory is kept.
+ */
+CMD(create_dir);
+
+/**
+ * @brief Deletes the directory with all the files and directories in it.
+ */
+CMD(delete_dir);
+
+/**
+ * @brief Renames the file or the directory, the file or the empty
+ *        directory of the new name is replaced. The client sends the
+ *        content again on MSG_NOK.
+ */
+CMD(rename);
+
+/**
+ * @brief Replaces the small files of the bundle with their content and
+ *        metadata, and sends MSG_BUNDLE_STATUS with the files it created
+ *        before the reply. A file in use by another client is left out.
+ */
+CMD(file_bundle);
 #endif /* COMMAND_H */
@@ -0,0 +1,138 @@
+/**
+ * @file delta.c
+ * @brief Server side of the delta transfer.
+ */
+#include "delta.h"
+
+#include "hash.h"
+#include "packet.h"
+#include "utils.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DELTA_MIN_BLOCK_SIZE 2048
+#define DELTA_MAX_BLOCK_SIZE (128 * 1024)
+
+uint64_t server_delta_block_size(off_t file_size)
+{
+        uint64_t block_size = DELTA_MIN_BLOCK_SIZE;
+        while (block_size < DELTA_MAX_BLOCK_SIZE
+               && block_size * block_size < (uint64_t)file_size)
+                block_size *= 2;
+        return block_size;
+}
+
+unsigned char *server_delta_signatures(int fd, off_t file_size,
+                                       uint64_t block_size,
+                                       size_t *payload_size)
+{
+        const size_t block_count = (file_size + block_size - 1) / block_size;
+        const uint64_t header[] = { htobe64(block_size), htobe64(file_size) };
+        const size_t size = sizeof(header)
+                            + block_count * sizeof(struct packet_block_signature);
+
+        unsigned char *payload = malloc(size);
+        unsigned char *block = malloc(block_size);
+        if (payload == NULL || block == NULL)
+                goto error;
+
+        memcpy(payload, header, sizeof(header));
+        unsigned char *signatures = &payload[sizeof(header)];
+
+        for (size_t i = 0; i < block_count; i++) {
+                const ssize_t length = utils_read(fd, block_size, block);
+                if (length == -1)
+                        goto error;
+                // the file was truncated meanwhile
+                if (length == 0) {
+                        errno = EAGAIN;
+                        goto error;
+                }
+
+                struct hash_rolling rolling;
+                hash_rolling_init(&rolling, length, block);
+                const struct packet_block_signature signature = {
+                        .weak = htobe64(hash_rolling_digest(&rolling)),
+                        .strong = htobe64(hash_xxh64(length, block, 0)),
+                };
+                memcpy(&signatures[i * sizeof(signature)], &signature,
+                       sizeof(signature));
+        }
+
+        free(block);
+        *payload_size = size;
+        return payload;
+error:
+        free(block);
+        free(payload);
+        return NULL;
+}
+
+/**
+ * Copies the bytes through a buffer, when copy_file_range(2) cannot be used.
+ */
+static bool copy_range_by_buffer(int in_fd, off_t offset, size_t size,
+                                 int out_fd)
+{
+        unsigned char buff[BUFSIZ];
+        while (size > 0) {
+                const size_t chunk = size < sizeof(buff) ? size : sizeof(buff);
+                const ssize_t ret = pread(in_fd, buff, chunk, offset);
+                if (ret == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        return false;
+                }
+                if (ret == 0)
+                        break;
+                if (utils_write(out_fd, ret, buff) != ret)
+                        return false;
+                offset += ret;
+                size -= ret;
+        }
+        return true;
+}
+
+bool server_delta_copy_blocks(int basis_fd, uint64_t block_size,
+                              uint64_t index, uint64_t count, int fd)
+{
+        if (count == 0 || index > UINT64_MAX / block_size
+            || count > UINT64_MAX / block_size - index) {
+                errno = EINVAL;
+                return false;
+        }
+
+        loff_t offset = index * block_size;
+        size_t size = count * block_size;
+        bool copied = false;
+        while (size > 0) {
+                const ssize_t ret
+                        = copy_file_range(basis_fd, &offset, fd, NULL, size, 0);
+                if (ret == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EXDEV || errno == EINVAL
+                            || errno == ENOSYS || errno == EOPNOTSUPP)
+                                return copy_range_by_buffer(basis_fd, offset,
+                                                            size, fd);
+                        return false;
+                }
+                // the last block is shorter
+                if (ret == 0)
+                        break;
+                size -= ret;
+                copied = true;
+        }
+
+        // no such block
+        if (!copied) {
+                errno = EINVAL;
+                return false;
+        }
+        return true;
+}
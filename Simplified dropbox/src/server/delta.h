@@ -0,0 +1,60 @@
+/**
+ * @file delta.h
+ * @brief Signatures of the old files and their blocks copied into the new
+ *        files when a changed file is sent as a delta.
+ */
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Prefix of the name of the file the delta is applied into, before it
+ * replaces the old file. Every session appends its own suffix.
+ */
+#define SERVER_DELTA_TEMP_NAME ".dropbox_delta"
+
+/**
+ * Chooses the size of the blocks of the old file, so the number of the
+ * signatures grows only with the square root of the size of the file.
+ *
+ * @param file_size  size of the old file
+ * @return           size of the blocks
+ */
+uint64_t server_delta_block_size(off_t file_size);
+
+/**
+ * Computes the signatures of all blocks of the file and encodes them into
+ * the payload of MSG_SIGNATURES.
+ *
+ * @param fd                 file descriptor of the old file
+ * @param file_size          size of the old file
+ * @param block_size         size of the blocks
+ * @param[out] payload_size  size of the payload
+ * @return                   the payload allocated by malloc(3);
+ *                           NULL on failure and errno is set appropriately
+ */
+unsigned char *server_delta_signatures(int fd, off_t file_size,
+                                       uint64_t block_size,
+                                       size_t *payload_size);
+
+/**
+ * Copies @c count blocks starting with the block @c index of the old file
+ * to the current position of the new file. The last block of the old file
+ * may be shorter.
+ *
+ * @param basis_fd    file descriptor of the old file
+ * @param block_size  size of the blocks
+ * @param index       index of the first block
+ * @param count       number of the blocks
+ * @param fd          file descriptor of the new file
+ * @return            true on success;
+ *                    false on failure and errno is set appropriately
+ */
+bool server_delta_copy_blocks(int basis_fd, uint64_t block_size,
+                              uint64_t index, uint64_t count, int fd);
+
+#endif /* DELTA_H */
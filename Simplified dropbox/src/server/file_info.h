@@ -8,13 +8,32 @@
 #ifndef FILE_INFO_H
 #define FILE_INFO_H
 
+#include "chunks.h"
+#include "resume.h"
+#include "storage.h"
+
+struct server_sessions;
+
 #include <dirent.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+/**
+ * The new version of an existing file is written aside and replaces the
+ * file in one step once it is done, so the readers never see the file
+ * missing or half written.
+ */
+enum server_staging {
+        SERVER_STAGING_NONE,    /**< written under its name              */
+        SERVER_STAGING_TMPFILE, /**< written unnamed, by O_TMPFILE       */
+        SERVER_STAGING_TEMP,    /**< written under @c staged_name        */
+};
+
 struct server_file_info {
-        char *file_name;      /**< name of current file                     */
+        char file_name[PATH_MAX];     /**< path of current file             */
         int filefd;           /**< file descriptor of current file          */
         int dirfd;            /**< file descriptor of working directory     */
         struct timespec atim; /**< access time of current file              */
@@ -24,7 +43,40 @@ struct server_file_info {
         mode_t mode;          /**< permissions of current file              */
         bool creating_file;   /**< flag signaling file is being created     */
         bool changing_file;   /**< next command(s) modifies or rewrite file */
-        char change_name[NAME_MAX + 1]; /**< name of file to be changed     */
+        char change_name[PATH_MAX];     /**< path of file to be changed     */
+        uint64_t features;       /**< features announced by both peers  */
+        uint64_t window_size;    /**< negotiated window, 0 acks every block */
+        uint64_t chunk_size;     /**< negotiated max size of a data block,
+                                      0 for the filesystem block size       */
+        uint64_t blocks_written; /**< blocks written to the current file    */
+        uint64_t blocks_acked;   /**< blocks acknowledged to the client     */
+        bool preallocated; /**< created file has its final size until it
+                                is cut at the end of the written data     */
+        enum server_staging staging; /**< where the created file is written */
+        int pipe_fds[2]; /**< pipe for splicing blocks, -1 if unavailable */
+        int basis_fd;    /**< old file the delta is applied to, -1 if none  */
+        uint64_t basis_block_size;     /**< size of blocks of the old file  */
+        char temp_name[NAME_MAX + 1]; /**< hidden name of the session for
+                                           the files written aside         */
+        char staged_name[PATH_MAX];   /**< @c temp_name in the directory of
+                                           the current file, the file the
+                                           delta is applied into or the new
+                                           version is written into without
+                                           O_TMPFILE                       */
+        struct server_chunks *chunks;  /**< index of the chunks of the files
+                                            in the directory, NULL if
+                                            unavailable                     */
+        struct server_dedup dedup;     /**< chunks offered for current file */
+        struct server_resume *resume;  /**< checkpoints of the created files,
+                                            shared by the sessions          */
+        const struct server_sessions *sessions; /**< all the sessions, NULL
+                                                     if there is only one   */
+        struct server_storage *storage; /**< asynchronous writes of the
+                                             blocks, NULL if they are
+                                             written directly               */
+        struct server_writer *writer;   /**< threads writing the blocks,
+                                             shared by the sessions, NULL
+                                             if none                        */
 };
 
 #endif //FILE_INFO_H
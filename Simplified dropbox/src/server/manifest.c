@@ -0,0 +1,215 @@
+/**
+ * @file manifest.c
+ * @brief Manifest of the files of the directory.
+ */
+#include "manifest.h"
+
+#include "chunks.h"
+#include "delta.h"
+#include "resume.h"
+
+#include "log.h"
+
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Size of the payload of MSG_MANIFEST the entries are gathered into.
+ */
+#define MANIFEST_PACKET_SIZE (64 * 1024)
+
+/**
+ * Checks whether the file is written aside by a session, in any directory.
+ */
+static bool is_staged_file(const char *name)
+{
+        return strncmp(name, SERVER_DELTA_TEMP_NAME,
+                       strlen(SERVER_DELTA_TEMP_NAME))
+               == 0;
+}
+
+/**
+ * Checks whether the file belongs to the server and not to the client.
+ */
+static bool is_server_file(const char *name)
+{
+        return strcmp(name, ".") == 0 || strcmp(name, "..") == 0
+               || is_staged_file(name)
+               || strcmp(name, SERVER_CHUNKS_INDEX_NAME) == 0
+               || strcmp(name, SERVER_CHUNKS_COMPACT_NAME) == 0
+               || strcmp(name, SERVER_RESUME_NAME) == 0
+               || strcmp(name, SERVER_RESUME_TEMP_NAME) == 0;
+}
+
+/**
+ * Appends the entry of the file to the payload.
+ *
+ * @return size of the entry
+ */
+static size_t encode_entry(const char *name, const struct stat *sb,
+                           unsigned char *payload)
+{
+        const size_t name_size = strlen(name);
+        const struct packet_manifest_entry entry = {
+                .size = htobe64(sb->st_size),
+                .mtime_sec = htobe64(sb->st_mtim.tv_sec),
+                .mtime_nsec = htobe64(sb->st_mtim.tv_nsec),
+                .mode = htobe64(sb->st_mode),
+                .name_size = htobe64(name_size),
+        };
+        memcpy(payload, &entry, sizeof(entry));
+        memcpy(&payload[sizeof(entry)], name, name_size);
+        return sizeof(entry) + name_size;
+}
+
+/**
+ * State of the listing of the directory tree.
+ */
+struct manifest_walk {
+        struct packet_stream *stream;
+        unsigned char *payload; /**< entries not sent yet */
+        size_t len;             /**< size of the entries in the payload */
+        size_t count;           /**< entries listed so far */
+        bool recursive;
+        char path[PATH_MAX];    /**< path of the listed directory */
+};
+
+static bool append_entry(struct manifest_walk *walk, const struct stat *sb)
+{
+        if (walk->len + sizeof(struct packet_manifest_entry)
+                    + strlen(walk->path)
+            > MANIFEST_PACKET_SIZE) {
+                if (!log_packet_send(walk->stream, MSG_MANIFEST, walk->len,
+                                     walk->payload))
+                        return false;
+                walk->len = 0;
+        }
+        walk->len += encode_entry(walk->path, sb, &walk->payload[walk->len]);
+        walk->count++;
+        return true;
+}
+
+/**
+ * Checks whether the entry of the directory is listed.
+ */
+static bool is_listed(const struct manifest_walk *walk,
+                      const struct dirent *dirent, size_t path_len)
+{
+        const char *name = dirent->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0
+            || is_staged_file(name)
+            || (path_len == 0 && is_server_file(name)))
+                return false;
+        return dirent->d_type == DT_REG || dirent->d_type == DT_UNKNOWN
+               || (walk->recursive && dirent->d_type == DT_DIR);
+}
+
+static bool send_entries(struct manifest_walk *walk, DIR *dir,
+                         size_t path_len);
+
+/**
+ * Lists the subdirectory whose path is in @c walk->path.
+ */
+static bool send_subdir(struct manifest_walk *walk, int dirfd,
+                        const char *name)
+{
+        const int fd = openat(dirfd, name,
+                              O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        DIR *dir = fd != -1 ? fdopendir(fd) : NULL;
+        if (dir == NULL) {
+                // the client sends the files of the directory again
+                syslog(LOG_WARNING, "cannot list %s: %s", walk->path,
+                       strerror(errno));
+                if (fd != -1)
+                        close(fd);
+                return true;
+        }
+
+        const bool success = send_entries(walk, dir, strlen(walk->path));
+        const int saved_errno = errno;
+        closedir(dir);
+        errno = saved_errno;
+        return success;
+}
+
+static bool send_entries(struct manifest_walk *walk, DIR *dir,
+                         size_t path_len)
+{
+        const int fd = dirfd(dir);
+        struct dirent *dirent;
+        while ((errno = 0, dirent = readdir(dir)) != NULL) {
+                const char *name = dirent->d_name;
+                if (!is_listed(walk, dirent, path_len))
+                        continue;
+
+                struct stat sb;
+                // the file was removed meanwhile
+                if (fstatat(fd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1
+                    || !(S_ISREG(sb.st_mode)
+                         || (walk->recursive && S_ISDIR(sb.st_mode))))
+                        continue;
+
+                const int len = snprintf(&walk->path[path_len],
+                                         sizeof(walk->path) - path_len,
+                                         path_len == 0 ? "%s" : "/%s", name);
+                if ((size_t)len >= sizeof(walk->path) - path_len) {
+                        walk->path[path_len] = '\0';
+                        syslog(LOG_WARNING, "path in %s is too long",
+                               walk->path);
+                        continue;
+                }
+                if (!append_entry(walk, &sb)
+                    || (S_ISDIR(sb.st_mode)
+                        && !send_subdir(walk, fd, name)))
+                        return false;
+                walk->path[path_len] = '\0';
+        }
+        return errno == 0;
+}
+
+bool server_manifest_send(struct packet_stream *stream, int dirfd,
+                          bool recursive)
+{
+        const int fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1)
+                return false;
+
+        DIR *dir = fdopendir(fd);
+        if (dir == NULL) {
+                close(fd);
+                return false;
+        }
+
+        bool success = false;
+        struct manifest_walk *walk = calloc(1, sizeof(*walk));
+        unsigned char *payload = malloc(MANIFEST_PACKET_SIZE);
+        if (walk != NULL && payload != NULL) {
+                *walk = (struct manifest_walk){
+                        .stream = stream,
+                        .payload = payload,
+                        .recursive = recursive,
+                };
+                success = send_entries(walk, dir, 0);
+        }
+        if (success) {
+                syslog(LOG_DEBUG, "manifest of %zu files", walk->count);
+                success = walk->len == 0
+                          || log_packet_send(stream, MSG_MANIFEST, walk->len,
+                                             payload);
+        }
+
+        free(payload);
+        free(walk);
+        const int saved_errno = errno;
+        closedir(dir);
+        errno = saved_errno;
+        return success;
+}
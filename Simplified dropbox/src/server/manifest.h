@@ -0,0 +1,28 @@
+/**
+ * @file manifest.h
+ * @brief Listing of the files of the directory sent to the client, so it
+ *        sends only the files the server does not have.
+ */
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include "packet.h"
+
+#include <stdbool.h>
+
+/**
+ * Sends the size, modification time, mode and name of every regular file
+ * of the directory in MSG_MANIFEST packets. The files of the server itself
+ * are left out.
+ *
+ * @param stream     stream of the connection
+ * @param dirfd      file descriptor of the directory
+ * @param recursive  the subdirectories are listed too, each before its
+ *                   content, and the names are relative paths
+ * @return           true on success;
+ *                   false on failure and errno is set appropriately
+ */
+bool server_manifest_send(struct packet_stream *stream, int dirfd,
+                          bool recursive);
+
+#endif /* MANIFEST_H */
@@ -8,14 +8,19 @@
 #include "operation.h"
 
 #include "command.h"
+#include "delta.h"
 #include "log.h"
+#include "resume.h"
 #include "set.h"
+#include "staging.h"
 
 #include "utils.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <stdio.h>
 
 /**
  * Sends code to client about the result of operation.
@@ -41,10 +46,48 @@ static bool send_operation_result(const struct settings *settings,
 
         log_assert(code >= MSG_OK && code <= MSG_ABORT);
 
-        return log_packet_send(settings->write_fd, code, payload_size,
+        return log_packet_send(settings->stream, code, payload_size,
                                (unsigned char *)payload);
 }
 
+/**
+ * Counts the blocks of the current file which are on the disk. The blocks
+ * written asynchronously are acknowledged once their writes complete.
+ */
+static uint64_t blocks_completed(const struct server_file_info *file_info)
+{
+        return file_info->blocks_written
+               - server_storage_pending(file_info->storage);
+}
+
+/**
+ * Acknowledges all blocks written to the current file so far.
+ *
+ * @param settings Struct holding information about behaviour of the program
+ * @param file_info Struct containing all
+ *                  important information about current file
+ * @return true on success;
+ *         false if packet_send failed;
+ */
+static bool send_ack(const struct settings *settings,
+                     struct server_file_info *file_info)
+{
+        // without a window every block was answered by run_command()
+        const uint64_t completed = blocks_completed(file_info);
+        if (file_info->window_size == 0 || file_info->blocks_acked == completed)
+                return true;
+
+        const struct packet_payload_ack payload = {
+                .block_count = completed,
+        };
+        if (!log_packet_send(settings->stream, MSG_ACK, sizeof(payload),
+                             (const unsigned char *)&payload))
+                return false;
+
+        file_info->blocks_acked = completed;
+        return true;
+}
+
 static void close_file(struct server_file_info *file_info)
 {
         if (close(file_info->filefd) == -1) {
@@ -54,25 +97,120 @@ static void close_file(struct server_file_info *file_info)
         syslog(LOG_DEBUG, "File closed successfully.");
 }
 
+/**
+ * Closes the old file the delta was applied to. The new version is staged
+ * and replaces the old file like any other staged file.
+ *
+ * @param file_info Struct containing all
+ *                  important information about current file
+ */
+static void close_basis(struct server_file_info *file_info)
+{
+        if (file_info->basis_fd == -1)
+                return;
+        if (close(file_info->basis_fd) == -1)
+                log_warning("close");
+        file_info->basis_fd = -1;
+}
+
+/**
+ * Adds the chunks offered for the created file to the index, so the next
+ * files can be built from them. The chunks of the previous version of the
+ * file are dropped if none were offered.
+ *
+ * @param file_info Struct containing all
+ *                  important information about current file
+ * @return true on success;
+ *         false if some of the offered chunks never arrived;
+ */
+static bool index_chunks(struct server_file_info *file_info)
+{
+        struct server_dedup *dedup = &file_info->dedup;
+        if (dedup->count == 0) {
+                if (file_info->chunks != NULL
+                    && !server_chunks_forget(file_info->chunks,
+                                             file_info->file_name))
+                        log_warning("forget chunks");
+                return true;
+        }
+
+        const size_t missing_count = dedup->missing_count;
+        if (missing_count > 0)
+                syslog(LOG_ERR, "%zu chunks of %s never arrived", missing_count,
+                       file_info->file_name);
+        else if (!server_chunks_add_file(file_info->chunks,
+                                         file_info->file_name, dedup))
+                log_warning("index chunks");
+        server_dedup_reset(dedup);
+        return missing_count == 0;
+}
+
+/**
+ * Cuts the preallocated file at the end of the written data, in case the
+ * file on the client got shorter while it was sent.
+ *
+ * @param file_info Struct containing all
+ *                  important information about current file
+ * @return true on success;
+ *         false if the file couldn't be cut;
+ */
+static bool cut_preallocated(struct server_file_info *file_info)
+{
+        if (!file_info->preallocated)
+                return true;
+        file_info->preallocated = false;
+        const off_t end = lseek(file_info->filefd, 0, SEEK_CUR);
+        if (end == -1 || ftruncate(file_info->filefd, end) == -1) {
+                log_error("cut preallocated file");
+                return false;
+        }
+        return true;
+}
+
 static enum operation_status done(const struct settings *settings,
                                   struct server_file_info *file_info)
 {
+        if (!send_ack(settings, file_info))
+                return OPERATION_NOK;
+
         if (file_info->changing_file) {
                 file_info->changing_file = false;
                 goto end;
         }
 
         file_info->creating_file = false;
-        if (!send_operation_result(settings, server_set_timestamps(file_info))
-            || !send_operation_result(settings,
-                                      server_set_perm_modes(file_info))
-            || !send_operation_result(settings, server_set_owner(file_info)))
-                return OPERATION_NOK;
+        if (!index_chunks(file_info) || !cut_preallocated(file_info))
+                goto abort;
+        // the file replacing another one gets its name with the metadata
+        const enum packet_msg_code results[] = {
+                server_set_timestamps(file_info),
+                server_set_perm_modes(file_info),
+                server_set_owner(file_info),
+        };
+        close_basis(file_info);
+        if (!server_staging_commit(file_info, file_info->file_name)) {
+                log_error("replace");
+                goto abort;
+        }
+        server_resume_forget(file_info->dirfd, file_info->resume,
+                             file_info->file_name);
+
+        for (size_t i = 0; i < sizeof(results) / sizeof(results[0]); i++) {
+                if (!send_operation_result(settings, results[i]))
+                        return OPERATION_NOK;
+        }
 
 end:
         close_file(file_info);
         syslog(LOG_DEBUG, "Current file finished.");
         return OPERATION_OK;
+abort:
+        server_resume_stop(file_info->resume, file_info->file_name);
+        close_basis(file_info);
+        server_staging_discard(file_info);
+        send_operation_result(settings, MSG_ABORT);
+        close_file(file_info);
+        return OPERATION_NOK;
 }
 
 static enum operation_status run_command(server_command_t cmd,
@@ -90,6 +228,108 @@ static enum operation_status run_command(server_command_t cmd,
         return result;
 }
 
+/**
+ * Checks whether the packet carries data of the file which are
+ * acknowledged by the window.
+ */
+static bool is_data_block(enum packet_msg_code code)
+{
+        return code == MSG_WRITE_BLOCK || code == MSG_COPY_BLOCKS
+               || code == MSG_WRITE_HOLE;
+}
+
+/**
+ * Writes a block without replying to it immediately. The blocks are
+ * acknowledged cumulatively by MSG_ACK once half of the window is
+ * unacknowledged, or earlier by server_operation_flush_acks().
+ */
+static enum operation_status
+write_block_windowed(server_command_t cmd, struct server_command_data *data)
+{
+        const enum packet_msg_code code = cmd(data);
+        if (code != MSG_OK) {
+                send_operation_result(data->settings, code);
+                return OPERATION_NOK;
+        }
+
+        struct server_file_info *file_info = data->file_info;
+        const uint64_t ack_interval = (file_info->window_size + 1) / 2;
+        if (blocks_completed(file_info) - file_info->blocks_acked
+            < ack_interval)
+                return OPERATION_OK;
+
+        return send_ack(data->settings, file_info) ? OPERATION_OK
+                                                   : OPERATION_NOK;
+}
+
+/**
+ * Finds the end of the beginning of the file which is written whole. The
+ * offered chunks are written out of order, so the file is whole only up to
+ * the first chunk which is still missing.
+ *
+ * @param file_info Struct containing all
+ *                  important information about current file
+ * @return the end of the whole part of the file;
+ *         -1 on failure
+ */
+static off_t whole_prefix_end(const struct server_file_info *file_info)
+{
+        const struct server_dedup *dedup = &file_info->dedup;
+        if (dedup->missing_count == 0)
+                return lseek(file_info->filefd, 0, SEEK_CUR);
+
+        size_t i = dedup->next_missing;
+        while (!dedup->chunks[i].missing)
+                i++;
+        return dedup->chunks[i].offset;
+}
+
+void server_operation_abandon_file(struct server_file_info *file_info)
+{
+        if (file_info->filefd == -1)
+                return;
+
+        syslog(LOG_WARNING, "connection lost before the file was finished");
+        // the checkpoint must not cover a block which failed to be written
+        if (!server_storage_drain(file_info->storage)) {
+                log_warning("write");
+                server_resume_stop(file_info->resume, file_info->file_name);
+        }
+        if (server_resume_is_tracking(file_info->resume,
+                                      file_info->file_name)) {
+                const off_t end = whole_prefix_end(file_info);
+                if (end == -1
+                    || !server_resume_advance(file_info->dirfd,
+                                              file_info->resume,
+                                              file_info->file_name,
+                                              file_info->filefd, end))
+                        log_warning("checkpoint");
+                server_resume_stop(file_info->resume, file_info->file_name);
+        }
+        // the manifest shows the file shorter, so the client resumes it
+        if (file_info->preallocated) {
+                file_info->preallocated = false;
+                const off_t end = whole_prefix_end(file_info);
+                if (end == -1 || ftruncate(file_info->filefd, end) == -1)
+                        log_warning("cut preallocated file");
+        }
+        close_basis(file_info);
+        server_staging_discard(file_info);
+        server_dedup_reset(&file_info->dedup);
+        close_file(file_info);
+        file_info->creating_file = false;
+        file_info->changing_file = false;
+        // the blocks are never acknowledged to the next client
+        file_info->blocks_written = 0;
+        file_info->blocks_acked = 0;
+}
+
+bool server_operation_flush_acks(const struct settings *settings,
+                                 struct server_file_info *file_info)
+{
+        return send_ack(settings, file_info);
+}
+
 enum operation_status
 server_operation_process_operation(const struct settings *settings,
                                    struct server_file_info *file_info,
@@ -106,9 +346,31 @@ server_operation_process_operation(const struct settings *settings,
                 { MSG_SET_PERM_MODES, server_command_set_perm_modes },
                 { MSG_SET_OWNER, server_command_set_owner },
                 { MSG_WRITE_BLOCK, server_command_write_block },
+                { MSG_WRITE_HOLE, server_command_write_hole },
+                { MSG_FILE_SIZE, server_command_file_size },
+                { MSG_SETTINGS, server_command_settings },
+                { MSG_DELTA_FILE, server_command_delta_file },
+                { MSG_COPY_BLOCKS, server_command_copy_blocks },
+                { MSG_OFFER_CHUNKS, server_command_offer_chunks },
+                { MSG_GET_MANIFEST, server_command_get_manifest },
+                { MSG_GET_RESUME, server_command_get_resume },
+                { MSG_RESUME_FILE, server_command_resume_file },
+                { MSG_CREATE_DIR, server_command_create_dir },
+                { MSG_DELETE_DIR, server_command_delete_dir },
+                { MSG_RENAME, server_command_rename },
+                { MSG_FILE_BUNDLE, server_command_file_bundle },
                 { .cmd = NULL },
         };
 
+        // only the blocks are written asynchronously, the other commands
+        // need the file written so far; the hole is after the blocks
+        if (packet->code != MSG_WRITE_BLOCK && packet->code != MSG_WRITE_HOLE
+            && !server_storage_drain(file_info->storage)) {
+                log_error("write");
+                send_operation_result(settings, MSG_ABORT);
+                return OPERATION_NOK;
+        }
+
         if (packet->code == MSG_END_CONNECTION)
                 return OPERATION_END;
 
@@ -123,6 +385,10 @@ server_operation_process_operation(const struct settings *settings,
                                 .packet = packet,
                                 .settings = settings,
                         };
+                        if (is_data_block(packet->code)
+                            && file_info->window_size > 0)
+                                return write_block_windowed(
+                                        CODE_COMMAND_MAP[i].cmd, &data);
                         result = run_command(CODE_COMMAND_MAP[i].cmd, &data);
                 }
         }
@@ -34,4 +34,28 @@ server_operation_process_operation(const struct settings *settings,
                                    struct server_file_info *file_info,
                                    const struct packet *packet);
 
+/**
+ * Acknowledges the blocks of the current file which were written but not
+ * acknowledged yet. Does nothing if there are no such blocks.
+ *
+ * @param settings   Struct holding information about behaviour of the program
+ * @param file_info  Struct containing all
+ *                   important information about current file
+ *
+ * @return true on success;
+ *         false if sending of the acknowledgement failed;
+ */
+bool server_operation_flush_acks(const struct settings *settings,
+                                 struct server_file_info *file_info);
+
+/**
+ * Closes the current file after the connection was lost. The checkpoint of
+ * the created file is moved to the bytes written so far, so the client can
+ * continue the file after it connects again.
+ *
+ * @param file_info  Struct containing all
+ *                   important information about current file
+ */
+void server_operation_abandon_file(struct server_file_info *file_info);
+
 #endif //OPERATION_H
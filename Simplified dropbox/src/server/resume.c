@@ -0,0 +1,327 @@
+/**
+ * @file resume.c
+ * @brief Checkpoints of the files being created.
+ *
+ * Every checkpoint is a small record with the name of the file, the number
+ * of its bytes synced to the disk and the hash of them, followed by the
+ * hash of the record, so a record torn by a crash is ignored. The records
+ * of all the checkpoints with some bytes synced are written one after
+ * another to a new file, which replaces the old one after every segment of
+ * @c HASH_PREFIX_SEGMENT_SIZE bytes of any of the files.
+ */
+#include "resume.h"
+
+#include "hash.h"
+#include "log.h"
+#include "utils.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Header of the record, all numbers in network byte order.
+ */
+struct resume_record {
+        uint64_t offset;
+        uint64_t hash;
+        uint64_t name_size;
+};
+
+#define RECORD_MAX_SIZE                                                        \
+        (sizeof(struct resume_record) + PATH_MAX + sizeof(uint64_t))
+
+#define FILE_MAX_SIZE (SERVER_RESUME_MAX_COUNT * RECORD_MAX_SIZE)
+
+/**
+ * Decodes the record at the beginning of the @c size bytes, which is valid
+ * only if its hash matches.
+ *
+ * @return size of the record;
+ *         0 if the record is torn or damaged
+ */
+static size_t decode(const unsigned char *buff, size_t size,
+                     struct server_checkpoint *checkpoint)
+{
+        struct resume_record record;
+        if (size < sizeof(record) + sizeof(uint64_t))
+                return 0;
+        memcpy(&record, buff, sizeof(record));
+
+        const uint64_t name_size = be64toh(record.name_size);
+        if (name_size == 0 || name_size >= PATH_MAX
+            || size < sizeof(record) + name_size + sizeof(uint64_t))
+                return 0;
+        const size_t record_size = sizeof(record) + name_size;
+
+        uint64_t hash;
+        memcpy(&hash, &buff[record_size], sizeof(hash));
+        if (be64toh(hash) != hash_xxh64(record_size, buff, 0))
+                return 0;
+
+        checkpoint->name = strndup((char *)&buff[sizeof(record)], name_size);
+        if (checkpoint->name == NULL)
+                return 0;
+        checkpoint->offset = be64toh(record.offset);
+        checkpoint->hash = be64toh(record.hash);
+        checkpoint->tracking = false;
+        return record_size + sizeof(hash);
+}
+
+bool server_resume_load(int dirfd, struct server_resume *resume)
+{
+        resume->count = 0;
+        resume->saved = false;
+
+        const int fd = openat(dirfd, SERVER_RESUME_NAME, O_RDONLY);
+        if (fd == -1)
+                return errno == ENOENT;
+
+        unsigned char *buff = malloc(FILE_MAX_SIZE);
+        const ssize_t size
+                = buff == NULL ? -1 : utils_read(fd, FILE_MAX_SIZE, buff);
+        if (close(fd) == -1)
+                log_warning("close");
+        if (size == -1) {
+                free(buff);
+                return false;
+        }
+
+        resume->saved = true;
+        size_t done = 0;
+        while (done < (size_t)size && resume->count < SERVER_RESUME_MAX_COUNT) {
+                const size_t record_size
+                        = decode(&buff[done], size - done,
+                                 &resume->checkpoints[resume->count]);
+                if (record_size == 0) {
+                        syslog(LOG_WARNING, "damaged checkpoints ignored");
+                        break;
+                }
+                done += record_size;
+                resume->count++;
+        }
+        free(buff);
+        return true;
+}
+
+void server_resume_destroy(struct server_resume *resume)
+{
+        for (size_t i = 0; i < resume->count; i++)
+                free(resume->checkpoints[i].name);
+        resume->count = 0;
+}
+
+/**
+ * Appends the record of the checkpoint to the buffer.
+ *
+ * @return size of the record
+ */
+static size_t encode(const struct server_checkpoint *checkpoint,
+                     unsigned char *buff)
+{
+        const size_t name_size = strlen(checkpoint->name);
+        const struct resume_record record = {
+                .offset = htobe64(checkpoint->offset),
+                .hash = htobe64(checkpoint->hash),
+                .name_size = htobe64(name_size),
+        };
+        memcpy(buff, &record, sizeof(record));
+        memcpy(&buff[sizeof(record)], checkpoint->name, name_size);
+        const size_t size = sizeof(record) + name_size;
+        const uint64_t hash = htobe64(hash_xxh64(size, buff, 0));
+        memcpy(&buff[size], &hash, sizeof(hash));
+        return size + sizeof(hash);
+}
+
+/**
+ * Replaces the checkpoints in the directory with the ones which have some
+ * bytes synced. The file is removed if there are none.
+ */
+static bool save(int dirfd, struct server_resume *resume)
+{
+        unsigned char *buff = malloc(FILE_MAX_SIZE);
+        if (buff == NULL)
+                return false;
+        size_t size = 0;
+        for (size_t i = 0; i < resume->count; i++)
+                if (resume->checkpoints[i].offset > 0)
+                        size += encode(&resume->checkpoints[i], &buff[size]);
+
+        bool success = true;
+        if (size == 0) {
+                if (resume->saved
+                    && unlinkat(dirfd, SERVER_RESUME_NAME, 0) == -1
+                    && errno != ENOENT)
+                        success = false;
+                else
+                        resume->saved = false;
+                goto clean;
+        }
+
+        // written aside, so a crash leaves either the old or the new ones
+        const int fd = openat(dirfd, SERVER_RESUME_TEMP_NAME,
+                              O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd == -1) {
+                success = false;
+                goto clean;
+        }
+        success = utils_write(fd, size, buff) == (ssize_t)size
+                  && fdatasync(fd) != -1;
+        if (close(fd) == -1)
+                log_warning("close");
+        if (success
+            && renameat(dirfd, SERVER_RESUME_TEMP_NAME, dirfd,
+                        SERVER_RESUME_NAME)
+                       == -1)
+                success = false;
+        if (success)
+                resume->saved = true;
+        else if (unlinkat(dirfd, SERVER_RESUME_TEMP_NAME, 0) == -1)
+                log_warning("unlinkat");
+
+clean:
+        free(buff);
+        return success;
+}
+
+/**
+ * Removes the checkpoint from the table and from the directory if it was
+ * saved.
+ */
+static void drop(int dirfd, struct server_resume *resume,
+                 struct server_checkpoint *checkpoint)
+{
+        const bool saved = checkpoint->offset > 0;
+        free(checkpoint->name);
+        const size_t i = checkpoint - resume->checkpoints;
+        memmove(checkpoint, checkpoint + 1,
+                (resume->count - i - 1) * sizeof(*checkpoint));
+        resume->count--;
+        if (saved && !save(dirfd, resume))
+                log_warning("checkpoint");
+}
+
+struct server_checkpoint *server_resume_find(struct server_resume *resume,
+                                             const char *name)
+{
+        for (size_t i = 0; i < resume->count; i++)
+                if (strcmp(resume->checkpoints[i].name, name) == 0)
+                        return &resume->checkpoints[i];
+        return NULL;
+}
+
+void server_resume_start(int dirfd, struct server_resume *resume,
+                         const char *name)
+{
+        // the file is created again, so its old checkpoint is useless
+        struct server_checkpoint *checkpoint = server_resume_find(resume, name);
+        if (checkpoint != NULL)
+                drop(dirfd, resume, checkpoint);
+
+        if (resume->count == SERVER_RESUME_MAX_COUNT) {
+                size_t oldest = 0;
+                while (oldest < resume->count
+                       && resume->checkpoints[oldest].tracking)
+                        oldest++;
+                if (oldest == resume->count) {
+                        syslog(LOG_DEBUG, "no checkpoint for %s", name);
+                        return;
+                }
+                syslog(LOG_DEBUG, "checkpoint of %s dropped",
+                       resume->checkpoints[oldest].name);
+                drop(dirfd, resume, &resume->checkpoints[oldest]);
+        }
+
+        char *copy = strdup(name);
+        if (copy == NULL) {
+                log_warning("checkpoint");
+                return;
+        }
+        resume->checkpoints[resume->count++] = (struct server_checkpoint){
+                .name = copy,
+                .tracking = true,
+        };
+}
+
+bool server_resume_is_tracking(const struct server_resume *resume,
+                               const char *name)
+{
+        const struct server_checkpoint *checkpoint
+                = server_resume_find((struct server_resume *)resume, name);
+        return checkpoint != NULL && checkpoint->tracking;
+}
+
+static uint64_t segment_end(uint64_t position)
+{
+        return position - position % HASH_PREFIX_SEGMENT_SIZE;
+}
+
+bool server_resume_is_due(const struct server_resume *resume,
+                          const char *name, uint64_t position)
+{
+        const struct server_checkpoint *checkpoint
+                = server_resume_find((struct server_resume *)resume, name);
+        return checkpoint != NULL && checkpoint->tracking
+               && segment_end(position) > checkpoint->offset;
+}
+
+bool server_resume_advance(int dirfd, struct server_resume *resume,
+                           const char *name, int fd, uint64_t position)
+{
+        if (!server_resume_is_due(resume, name, position))
+                return true;
+
+        struct server_checkpoint *checkpoint = server_resume_find(resume, name);
+        const uint64_t end = segment_end(position);
+
+        uint64_t hash = checkpoint->hash;
+        if (fdatasync(fd) == -1
+            || !hash_file_prefix(fd, checkpoint->offset, end, &hash)) {
+                checkpoint->tracking = false;
+                return false;
+        }
+        checkpoint->offset = end;
+        checkpoint->hash = hash;
+        if (!save(dirfd, resume)) {
+                checkpoint->tracking = false;
+                return false;
+        }
+        syslog(LOG_DEBUG, "checkpoint of %s at %lu", checkpoint->name,
+               (unsigned long)end);
+        return true;
+}
+
+void server_resume_stop(struct server_resume *resume, const char *name)
+{
+        struct server_checkpoint *checkpoint = server_resume_find(resume, name);
+        if (checkpoint == NULL || !checkpoint->tracking)
+                return;
+        checkpoint->tracking = false;
+        // nothing to continue from, the checkpoint was never saved
+        if (checkpoint->offset == 0)
+                drop(-1, resume, checkpoint);
+}
+
+void server_resume_forget(int dirfd, struct server_resume *resume,
+                          const char *name)
+{
+        struct server_checkpoint *checkpoint = server_resume_find(resume, name);
+        if (checkpoint != NULL)
+                drop(dirfd, resume, checkpoint);
+}
+
+void server_resume_forget_dir(int dirfd, struct server_resume *resume,
+                              const char *dir)
+{
+        size_t i = 0;
+        while (i < resume->count) {
+                if (utils_path_is_within(resume->checkpoints[i].name, dir))
+                        drop(dirfd, resume, &resume->checkpoints[i]);
+                else
+                        i++;
+        }
+}
@@ -0,0 +1,149 @@
+/**
+ * @file resume.h
+ * @brief Checkpoints of the files being created, so the client continues a
+ *        file after the connection was lost instead of sending it again.
+ */
+#ifndef RESUME_H
+#define RESUME_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Name of the file in the directory, where the checkpoints are kept between
+ * runs of the server.
+ */
+#define SERVER_RESUME_NAME ".dropbox_resume"
+
+/**
+ * Name of the file the checkpoints are written into before they replace
+ * the old ones.
+ */
+#define SERVER_RESUME_TEMP_NAME SERVER_RESUME_NAME ".tmp"
+
+/**
+ * Maximum number of the checkpoints, the oldest checkpoint of a file not
+ * being written is dropped for a new one.
+ */
+#define SERVER_RESUME_MAX_COUNT 64
+
+/**
+ * Checkpoint of a file written sequentially from its beginning.
+ */
+struct server_checkpoint {
+        char *name;      /**< file of the checkpoint                   */
+        uint64_t offset; /**< bytes of the file durably written, 0 if
+                              none yet                                 */
+        uint64_t hash;   /**< hash_file_prefix() of the bytes          */
+        bool tracking;   /**< the file is being written in order       */
+};
+
+/**
+ * Checkpoints of the files, shared by all the sessions. Every file being
+ * written has its own one and the files left unfinished keep theirs until
+ * they are done, deleted, replaced or renamed.
+ */
+struct server_resume {
+        struct server_checkpoint checkpoints[SERVER_RESUME_MAX_COUNT];
+        size_t count; /**< number of the checkpoints, the oldest first */
+        bool saved;   /**< the checkpoints are in the directory        */
+};
+
+/**
+ * Loads the checkpoints kept in @c SERVER_RESUME_NAME. The damaged
+ * checkpoints are ignored.
+ *
+ * @param dirfd   file descriptor of the directory
+ * @param resume  the checkpoints to fill in
+ * @return        true on success;
+ *                false on failure and errno is set appropriately
+ */
+bool server_resume_load(int dirfd, struct server_resume *resume);
+
+/**
+ * Frees the checkpoints.
+ */
+void server_resume_destroy(struct server_resume *resume);
+
+/**
+ * Starts a new checkpoint of the file created from its beginning. The old
+ * checkpoint of the file is dropped, the checkpoints of the other files are
+ * kept.
+ *
+ * @param dirfd   file descriptor of the directory
+ * @param resume  the checkpoints
+ * @param name    name of the file in the directory
+ */
+void server_resume_start(int dirfd, struct server_resume *resume,
+                         const char *name);
+
+/**
+ * Finds the checkpoint of the file @c name.
+ *
+ * @return the checkpoint;
+ *         NULL if the file has none
+ */
+struct server_checkpoint *server_resume_find(struct server_resume *resume,
+                                             const char *name);
+
+/**
+ * Checks whether the checkpoint of the file @c name is tracking it.
+ */
+bool server_resume_is_tracking(const struct server_resume *resume,
+                               const char *name);
+
+/**
+ * Checks whether server_resume_advance() would move the checkpoint of the
+ * file @c name to @c position, so the file has to be written up to it.
+ */
+bool server_resume_is_due(const struct server_resume *resume,
+                          const char *name, uint64_t position);
+
+/**
+ * Moves the checkpoint to the last whole segment of the first @c position
+ * bytes of the file. The file is synced before, so the checkpoint never
+ * covers bytes which could be lost. On failure the file is no longer
+ * tracked. Nothing is done if the checkpoint does not track the file.
+ *
+ * @param dirfd     file descriptor of the directory
+ * @param resume    the checkpoints
+ * @param name      name of the file in the directory
+ * @param fd        file descriptor of the file open for reading and writing
+ * @param position  number of the bytes written to the file
+ * @return          true on success;
+ *                  false on failure and errno is set appropriately
+ */
+bool server_resume_advance(int dirfd, struct server_resume *resume,
+                           const char *name, int fd, uint64_t position);
+
+/**
+ * Stops tracking the file @c name. The checkpoint is kept, so the file can
+ * be continued later.
+ */
+void server_resume_stop(struct server_resume *resume, const char *name);
+
+/**
+ * Forgets the checkpoint of the file @c name, e.g. because the file was
+ * finished, replaced or deleted.
+ *
+ * @param dirfd   file descriptor of the directory
+ * @param resume  the checkpoints
+ * @param name    name of the file in the directory
+ */
+void server_resume_forget(int dirfd, struct server_resume *resume,
+                          const char *name);
+
+/**
+ * Forgets the checkpoints of the file @c dir or of the files in the
+ * directory @c dir, e.g. because it was deleted or renamed.
+ *
+ * @param dirfd   file descriptor of the directory
+ * @param resume  the checkpoints
+ * @param dir     name of the file or the directory in the directory
+ */
+void server_resume_forget_dir(int dirfd, struct server_resume *resume,
+                              const char *dir);
+
+#endif /* RESUME_H */
@@ -8,15 +8,26 @@
 
 #include "file_info.h"
 #include "operation.h"
+#include "session.h"
 
 #include "event_reader.h"
 #include "log.h"
 #include "utils.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
 #include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/statvfs.h>
 
+/**
+ * Milliseconds the server discards the data of the failed client before it
+ * closes the connection.
+ */
+#define DRAIN_TIMEOUT_MS 1000
+
 /**
  * Opens directory on which server performs requested commands.
  *
@@ -42,6 +53,51 @@ static bool get_filesystem_block_size(struct settings *settings,
         settings->fs_block_size = stats.f_bsize;
         return true;
 }
+/**
+ * Loads the index of the chunks of the files in the directory. Without it
+ * the client sends the whole files.
+ *
+ * @param file_info Struct containing all
+ *                  important information about current file
+ */
+static void open_chunks(struct server_file_info *file_info)
+{
+        file_info->chunks = server_chunks_open(file_info->dirfd);
+        if (file_info->chunks == NULL)
+                log_warning("chunk index");
+}
+
+/**
+ * Loads the checkpoints of the files left unfinished by the last
+ * connections. Without them the client sends the partial files again.
+ *
+ * @param file_info Struct containing all
+ *                  important information about current file
+ */
+static void open_resume(struct server_file_info *file_info)
+{
+        if (!server_resume_load(file_info->dirfd, file_info->resume))
+                log_warning("checkpoint");
+}
+
+/**
+ * Starts the threads writing the blocks of all the sessions. Without them
+ * the blocks are written directly.
+ *
+ * @param settings Struct holding information about behaviour of the program
+ * @param file_info Struct containing all
+ *                  important information about current file
+ */
+static void open_writer(const struct settings *settings,
+                        struct server_file_info *file_info)
+{
+        if (settings->writers == 0)
+                return;
+        file_info->writer = server_writer_start(settings->writers);
+        if (file_info->writer == NULL)
+                log_warning("writer threads");
+}
+
 /**
  * Sends information about filesystem to the client.
  *
@@ -51,13 +107,22 @@ static bool get_filesystem_block_size(struct settings *settings,
  * @return true on success;
            false if packet_send failed;
  */
-static bool send_settings(const struct settings *settings)
+static bool send_settings(const struct settings *settings,
+                          const struct server_file_info *file_info)
 {
+        uint64_t features = PACKET_FEATURES;
+        if (file_info->chunks == NULL)
+                features &= ~(uint64_t)PACKET_FEATURE_DEDUP;
+
         const struct packet_payload_settings payload = {
                 .fs_block_size = settings->fs_block_size,
+                .window_size = settings->window_size,
+                .protocol_version = PACKET_PROTOCOL_VERSION,
+                .features = features,
+                .chunk_size = settings->chunk_size,
         };
 
-        if (!log_packet_send(settings->write_fd, MSG_SETTINGS,
+        if (!log_packet_send(settings->stream, MSG_SETTINGS,
                              sizeof(struct packet_payload_settings),
                              (const unsigned char *)&payload))
                 return false;
@@ -83,36 +148,34 @@ static enum operation_status process_packet(const struct settings *settings,
         return operation_result;
 }
 
-static bool read_packets_until(int read_fd, struct settings *settings,
-                               struct server_file_info *file_info,
-                               struct packet **packet_ptr,
-                               size_t *packet_size_ptr,
-                               bool (*p)(struct server_file_info *))
+/**
+ * Reads a packet from the connection. The payload of MSG_WRITE_BLOCK is
+ * left in the stream to be written straight into the file.
+ *
+ * @param stream           stream of the connection
+ * @param packet_ptr       address of the packet buffer
+ * @param packet_size_ptr  pointer to the size of the packet buffer
+ * @return true on success;
+ *         false if packet read failed;
+ */
+static bool read_packet(struct packet_stream *stream,
+                        struct packet **packet_ptr, size_t *packet_size_ptr)
 {
-        if (p != NULL && p(file_info))
+        if (!log_packet_read_header(stream, packet_ptr, packet_size_ptr))
+                return false;
+        if ((*packet_ptr)->code == MSG_WRITE_BLOCK)
                 return true;
 
-        while (log_packet_read(read_fd, packet_ptr, packet_size_ptr)) {
-                enum operation_status operation_result
-                        = process_packet(settings, file_info, *packet_ptr);
-
-                if (operation_result == OPERATION_NOK)
-                        return false;
-                if (operation_result == OPERATION_END)
-                        return true;
-                if (p != NULL && p(file_info))
-                        return true;
+        if (!packet_stream_read_payload(stream, packet_ptr, packet_size_ptr)) {
+                log_error("packet read payload");
+                return false;
         }
-        return false;
+        return true;
 }
 
-static bool read_packets_loop(int read_fd, struct settings *settings,
-                              struct server_file_info *file_info,
-                              struct packet **packet_ptr,
-                              size_t *packet_size_ptr)
+static bool _not_in_process(struct server_file_info *file_info)
 {
-        return read_packets_until(read_fd, settings, file_info, packet_ptr,
-                                  packet_size_ptr, NULL);
+        return file_info->filefd < 0;
 }
 
 static void close_socket(int sock_fd)
@@ -122,179 +185,478 @@ static void close_socket(int sock_fd)
                 log_warning("connection socket");
 }
 
-static void close_connection(struct pollfd *pollfd)
+struct server_loop;
+
+/**
+ * Data of the callback monitoring the connection of one session.
+ */
+struct server_loop_slot {
+        struct server_loop *loop;
+        struct server_session *session;
+        int drain_timer; /**< timer closing the drained connection or -1 */
+        bool active;     /**< the client sent something since last check */
+};
+
+/**
+ * State of the event loop of the server.
+ */
+struct server_loop {
+        struct settings *settings;
+        const struct server_file_info *shared;
+        struct server_sessions *sessions;
+        struct event_reader *reader;
+        struct server_loop_slot slots[SERVER_MAX_SESSIONS];
+        bool ending; /**< shutting down once the last session is closed */
+        bool failed; /**< a session failed while shutting down */
+};
+
+/**
+ * Closes the session and the file the client left unfinished.
+ */
+static void close_connection(struct server_loop_slot *slot)
 {
-        close_socket(pollfd->fd);
-        pollfd->fd = -1;
+        struct server_loop *loop = slot->loop;
+        struct server_session *session = slot->session;
+        if (session->fd == -1)
+                return;
+        if (slot->drain_timer != -1) {
+                if (!event_reader_remove_timer(loop->reader, slot->drain_timer))
+                        log_warning("event_reader_remove_timer");
+                slot->drain_timer = -1;
+        }
+        if (!event_reader_remove(loop->reader, session->fd))
+                log_warning("event_reader_remove");
+        const struct server_storage *storage = session->file_info.storage;
+        if (storage != NULL)
+                event_reader_remove(loop->reader,
+                                    server_storage_event_fd(storage));
+        server_sessions_close(session);
 }
 
-static enum utils_loop_status
-_connection_callback(struct settings *settings,
-                     struct server_file_info *file_info,
-                     struct pollfd *connection_pollfd, size_t *packet_size_ptr,
-                     struct packet **packet_ptr)
+static bool has_sessions(const struct server_loop *loop)
 {
-        if (connection_pollfd->revents & POLLERR) {
-                syslog(LOG_ERR, "error occurred on the connection");
-                close_connection(connection_pollfd);
-                return UTILS_LOOP_ERROR;
+        for (size_t i = 0; i < SERVER_MAX_SESSIONS; i++)
+                if (loop->sessions->slots[i].fd != -1)
+                        return true;
+        return false;
+}
+
+/**
+ * Ends the event loop once the server is shutting down and the last
+ * session is closed.
+ */
+static enum utils_loop_status loop_status(const struct server_loop *loop)
+{
+        if (!loop->ending || has_sessions(loop))
+                return UTILS_LOOP_CONTINUE;
+        return loop->failed ? UTILS_LOOP_ERROR : UTILS_LOOP_BREAK;
+}
+
+static enum utils_loop_status _drain_callback(int fd, uint32_t events,
+                                              void *data)
+{
+        UNUSED(fd);
+        UNUSED(events);
+        struct server_loop_slot *slot = data;
+        syslog(LOG_DEBUG, "connection drained");
+        close_connection(slot);
+        return loop_status(slot->loop);
+}
+
+/**
+ * Stops replying to the failed client and discards the data it still sends,
+ * so the last reply (e.g. MSG_ABORT in the middle of a window of blocks) is
+ * not lost because of a connection reset. The connection is closed once
+ * the client closes it or after DRAIN_TIMEOUT_MS, the other sessions go on
+ * meanwhile.
+ */
+static bool start_drain(struct server_loop_slot *slot)
+{
+        struct server_session *session = slot->session;
+        if (!packet_stream_flush(session->settings.stream))
+                log_warning("packet flush");
+        if (shutdown(session->fd, SHUT_WR) == -1) {
+                log_warning("shutdown");
+                return false;
+        }
+        slot->drain_timer = event_reader_add_timer(
+                slot->loop->reader, DRAIN_TIMEOUT_MS, 0, _drain_callback, slot);
+        if (slot->drain_timer == -1) {
+                log_warning("event_reader_add_timer");
+                return false;
         }
+        // the other sessions may take over the file right away
+        server_operation_abandon_file(&session->file_info);
+        return true;
+}
 
-        if (connection_pollfd->revents & POLLRDHUP) {
-                syslog(LOG_DEBUG, "connection ended");
-                bool success = read_packets_loop(connection_pollfd->fd,
-                                                 settings, file_info,
-                                                 packet_ptr, packet_size_ptr);
-                close_connection(connection_pollfd);
-                return success ? UTILS_LOOP_BREAK : UTILS_LOOP_ERROR;
+/**
+ * Discards the data the drained client sent without blocking.
+ *
+ * @return true if the client may send more;
+ *         false if it closed the connection or the connection failed
+ */
+static bool discard_input(int sock_fd)
+{
+        unsigned char buff[BUFSIZ];
+        ssize_t size;
+        while ((size = recv(sock_fd, buff, sizeof(buff), MSG_DONTWAIT)) > 0) {
+                /* Nop */
         }
+        return size == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
 
-        if (connection_pollfd->revents & POLLIN) {
-                if (!log_packet_read(connection_pollfd->fd, packet_ptr,
-                                     packet_size_ptr))
+/**
+ * Checks whether next packet can be read without blocking.
+ */
+static bool has_pending_input(const struct settings *settings)
+{
+        if (packet_stream_has_buffered(settings->stream))
+                return true;
+
+        struct pollfd pollfd = { .fd = settings->read_fd, .events = POLLIN };
+        return poll(&pollfd, 1, 0) > 0;
+}
+
+/**
+ * Acknowledges written blocks and sends the queued replies once the client
+ * stopped sending, so the client never waits for a reply the server holds
+ * back.
+ */
+static bool flush_when_idle(const struct settings *settings,
+                            struct server_file_info *file_info)
+{
+        if (has_pending_input(settings))
+                return true;
+        return server_operation_flush_acks(settings, file_info)
+               && log_packet_flush(settings->stream);
+}
+
+/**
+ * Receives what the client sent without waiting and processes the packets
+ * received whole. The part of the next packet is kept in the stream of the
+ * session until the rest comes, so a slow client does not hold up the
+ * other sessions. While shutting down no file is started after the current
+ * one.
+ */
+static enum utils_loop_status
+process_incoming_packets(struct server_loop_slot *slot)
+{
+        struct server_session *session = slot->session;
+        struct settings *settings = &session->settings;
+        if (!packet_stream_receive(settings->stream)) {
+                if (errno == ECONNRESET)
+                        syslog(LOG_DEBUG, "connection ended");
+                else
+                        log_error("packet receive");
+                return UTILS_LOOP_ERROR;
+        }
+
+        while (packet_stream_has_packet(settings->stream)
+               && !(slot->loop->ending
+                    && _not_in_process(&session->file_info))) {
+                if (!read_packet(settings->stream, &session->packet,
+                                 &session->packet_size))
                         return UTILS_LOOP_ERROR;
 
-                enum operation_status status
-                        = process_packet(settings, file_info, *packet_ptr);
+                enum operation_status status = process_packet(
+                        settings, &session->file_info, session->packet);
 
                 if (status == OPERATION_NOK)
-                        return UTILS_LOOP_ERROR;
+                        return start_drain(slot) ? UTILS_LOOP_CONTINUE
+                                                 : UTILS_LOOP_ERROR;
 
                 if (status == OPERATION_END) {
                         return UTILS_LOOP_BREAK;
                 }
         }
 
+        return flush_when_idle(settings, &session->file_info)
+                       ? UTILS_LOOP_CONTINUE
+                       : UTILS_LOOP_ERROR;
+}
+
+static enum utils_loop_status
+_connection_events(struct server_loop_slot *slot, uint32_t events)
+{
+        if (events & EPOLLERR) {
+                syslog(LOG_ERR, "error occurred on the connection");
+                return UTILS_LOOP_ERROR;
+        }
+
+        // the packets sent before the client closed the connection first
+        if (events & (EPOLLIN | EPOLLRDHUP))
+                return process_incoming_packets(slot);
+
         return UTILS_LOOP_CONTINUE;
 }
 
+/**
+ * Serves the client of the session. The session is closed when the client
+ * disconnects or fails, but the other sessions go on. While shutting down
+ * it is closed once the client finished its file.
+ */
+static enum utils_loop_status _connection_callback(int fd, uint32_t events,
+                                                   void *data)
+{
+        struct server_loop_slot *slot = data;
+        struct server_loop *loop = slot->loop;
+        slot->active = true;
+        if (slot->drain_timer != -1) {
+                if ((events & EPOLLERR) || !discard_input(fd))
+                        close_connection(slot);
+                return loop_status(loop);
+        }
+
+        const enum utils_loop_status status = _connection_events(slot, events);
+        if (loop->ending
+            && (status == UTILS_LOOP_ERROR || slot->drain_timer != -1))
+                loop->failed = true;
+        if (status != UTILS_LOOP_CONTINUE
+            || (loop->ending && slot->drain_timer == -1
+                && _not_in_process(&slot->session->file_info)))
+                close_connection(slot);
+        return loop_status(loop);
+}
+
+/**
+ * Collects the writes of the session completed by the disk meanwhile, so
+ * their buffers are free for the next blocks, and acknowledges them if the
+ * client waits. A failed write aborts the next command of the session.
+ */
+static enum utils_loop_status _storage_callback(int fd, uint32_t events,
+                                                void *data)
+{
+        UNUSED(fd);
+        UNUSED(events);
+        struct server_loop_slot *slot = data;
+        struct server_session *session = slot->session;
+        if (!server_storage_reap(session->file_info.storage))
+                syslog(LOG_ERR, "a block of %s was not written",
+                       session->file_info.file_name);
+        else if (slot->drain_timer == -1
+                 && !flush_when_idle(&session->settings, &session->file_info))
+                close_connection(slot);
+        return loop_status(slot->loop);
+}
+
 static void reject_connection(int client_fd)
 {
-        if (!log_packet_send(client_fd, MSG_REJECTED, 0, NULL))
+        if (!packet_send(client_fd, MSG_REJECTED, 0, NULL))
                 log_warning("reject connection");
 
         close_socket(client_fd);
 }
 
-static void create_new_connection(struct settings *settings,
-                                  const struct pollfd *entry_pollfd,
-                                  struct pollfd *connection_pollfd)
+/**
+ * Switches the connection to non-blocking, so the packets are received as
+ * they come and the server waits for none of them.
+ */
+static bool set_nonblocking(int client_fd)
+{
+        const int flags = fcntl(client_fd, F_GETFL);
+        return flags != -1
+               && fcntl(client_fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+/**
+ * Opens the session of the client connected through @c client_fd in the
+ * @c slot and starts to monitor the connection. On failure @c client_fd is
+ * left open.
+ */
+static struct server_session *open_session(struct server_loop *loop,
+                                           size_t slot, int client_fd)
+{
+        struct server_loop_slot *loop_slot = &loop->slots[slot];
+        loop_slot->loop = loop;
+        loop_slot->session = &loop->sessions->slots[slot];
+        loop_slot->drain_timer = -1;
+        loop_slot->active = true;
+        if (!set_nonblocking(client_fd)
+            || !event_reader_add(loop->reader, client_fd, EPOLLIN | EPOLLRDHUP,
+                              _connection_callback, loop_slot))
+                return NULL;
+
+        struct server_session *session = server_sessions_open(
+                loop->sessions, slot, loop->settings, loop->shared, client_fd);
+        if (session == NULL) {
+                if (!event_reader_remove(loop->reader, client_fd))
+                        log_warning("event_reader_remove");
+                return NULL;
+        }
+        // a reply the client does not take in time closes the session
+        const unsigned long timeout = loop->settings->session_timeout;
+        packet_stream_set_timeout(session->settings.stream,
+                                  timeout == 0 ? -1 : (int)timeout);
+
+        struct server_storage *storage = session->file_info.storage;
+        if (storage != NULL
+            && !event_reader_add(loop->reader, server_storage_event_fd(storage),
+                                 EPOLLIN, _storage_callback, loop_slot)) {
+                // the completions are collected when the buffers run out
+                log_warning("event_reader_add");
+        }
+        return session;
+}
+
+static void create_new_connection(struct server_loop *loop, int entry_fd)
 {
         syslog(LOG_DEBUG, "establishing new connection");
-        int client_fd = accept(entry_pollfd->fd, NULL, NULL);
+        int client_fd = accept(entry_fd, NULL, NULL);
         if (client_fd == -1) {
                 log_warning("accept");
                 return;
         }
 
-        // max one active connection
-        if (connection_pollfd->fd != -1) {
+        const int slot = server_sessions_find_free(loop->sessions);
+        if (slot == -1) {
+                syslog(LOG_WARNING, "too many clients");
                 reject_connection(client_fd);
                 return;
         }
 
-        settings->read_fd = client_fd;
-        settings->write_fd = client_fd;
-        connection_pollfd->fd = client_fd;
-        send_settings(settings);
+        struct server_session *session = open_session(loop, slot, client_fd);
+        if (session == NULL) {
+                close_socket(client_fd);
+                return;
+        }
+        if (!send_settings(&session->settings, &session->file_info)
+            || !log_packet_flush(session->settings.stream))
+                log_warning("send settings");
 }
 
-static enum utils_loop_status _entry_callback(struct settings *settings,
-                                              const struct pollfd *entry_pollfd,
-                                              struct pollfd *connection_pollfd)
+static enum utils_loop_status _entry_callback(int fd, uint32_t events,
+                                              void *data)
 {
-        if (entry_pollfd->revents & POLLERR) {
+        struct server_loop *loop = data;
+        if (events & EPOLLERR) {
                 syslog(LOG_ERR, "error occurred on the entry socket");
                 return UTILS_LOOP_ERROR;
         }
 
-        if (entry_pollfd->revents & POLLIN) {
-                create_new_connection(settings, entry_pollfd,
-                                      connection_pollfd);
-        }
+        if (events & EPOLLIN)
+                create_new_connection(loop, fd);
         return UTILS_LOOP_CONTINUE;
 }
 
-static bool _not_in_process(struct server_file_info *file_info)
+/**
+ * Closes the sessions which sent nothing since the last expiration while
+ * the server is shutting down.
+ */
+static enum utils_loop_status _idle_callback(int fd, uint32_t events,
+                                             void *data)
 {
-        return file_info->filefd < 0;
+        UNUSED(fd);
+        UNUSED(events);
+        struct server_loop *loop = data;
+        for (size_t i = 0; i < SERVER_MAX_SESSIONS; i++) {
+                struct server_loop_slot *slot = &loop->slots[i];
+                if (loop->sessions->slots[i].fd == -1
+                    || slot->drain_timer != -1)
+                        continue;
+                if (slot->active) {
+                        slot->active = false;
+                        continue;
+                }
+                syslog(LOG_WARNING, "stalled connection closed");
+                loop->failed = true;
+                close_connection(slot);
+        }
+        return loop_status(loop);
 }
 
-static enum utils_loop_status
-_signal_callback(struct settings *settings, struct server_file_info *file_info,
-                 size_t *packet_size_ptr, struct packet **packet_ptr,
-                 const struct pollfd *signal_pollfd,
-                 struct pollfd *connection_pollfd)
+/**
+ * Closes the idle sessions and lets the other clients finish the files they
+ * are sending. The event loop goes on until the last session is closed, the
+ * ones stalled for @c session_timeout are closed meanwhile.
+ */
+static void end_sessions(struct server_loop *loop)
 {
-        if (!(signal_pollfd->revents & POLLIN))
-                return UTILS_LOOP_CONTINUE;
+        loop->ending = true;
+        for (size_t i = 0; i < SERVER_MAX_SESSIONS; i++) {
+                struct server_loop_slot *slot = &loop->slots[i];
+                struct server_session *session = &loop->sessions->slots[i];
+                if (session->fd == -1)
+                        continue;
 
-        struct signalfd_siginfo info;
-        if (utils_read(signal_pollfd->fd, sizeof(info), &info)
-            != sizeof(info)) {
-                log_error("read signal");
-                return UTILS_LOOP_ERROR;
+                syslog(LOG_DEBUG, "ending open connection");
+                slot->active = false;
+                if (slot->drain_timer == -1
+                    && _not_in_process(&session->file_info))
+                        close_connection(slot);
         }
-        syslog(LOG_DEBUG, "caught signal '%d'", info.ssi_signo);
 
-        if (info.ssi_signo == SIGPIPE) {
-                close_connection(connection_pollfd);
+        const unsigned long timeout = loop->settings->session_timeout;
+        if (timeout != 0 && has_sessions(loop)
+            && event_reader_add_timer(loop->reader, timeout, timeout,
+                                      _idle_callback, loop)
+                       == -1)
+                log_warning("event_reader_add_timer");
+}
+
+static enum utils_loop_status
+_signal_callback(const struct signalfd_siginfo *info, void *data)
+{
+        struct server_loop *loop = data;
+        syslog(LOG_DEBUG, "caught signal '%d'", info->ssi_signo);
+
+        // the write to the closed connection fails and closes the session
+        if (info->ssi_signo == SIGPIPE)
                 return UTILS_LOOP_CONTINUE;
-        }
 
-        syslog(LOG_DEBUG, "shutting down");
-        if (shutdown(settings->sock_fd, SHUT_RDWR) == -1)
-                log_warning("shutdown");
+        if (loop->ending)
+                return UTILS_LOOP_CONTINUE;
 
-        bool success = true;
-        if (connection_pollfd->fd != -1) {
-                syslog(LOG_DEBUG, "ending open connection");
-                success = read_packets_until(settings->read_fd, settings,
-                                             file_info, packet_ptr,
-                                             packet_size_ptr, _not_in_process);
-                close_connection(connection_pollfd);
+        syslog(LOG_DEBUG, "shutting down");
+        const int sock_fd = loop->settings->sock_fd;
+        if (sock_fd != -1) {
+                if (!event_reader_remove(loop->reader, sock_fd))
+                        log_warning("event_reader_remove");
+                if (shutdown(sock_fd, SHUT_RDWR) == -1)
+                        log_warning("shutdown");
         }
-        return success ? UTILS_LOOP_BREAK : UTILS_LOOP_ERROR;
+
+        end_sessions(loop);
+        return loop_status(loop);
 }
 
 static bool event_loop(struct settings *settings,
-                       struct server_file_info *file_info)
+                       const struct server_file_info *shared)
 {
-        size_t packet_size = 0;
-        struct packet *packet = NULL;
-
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wpedantic"
-        EVENT_READER_CALLBACK(callback)
-        {
-                log_assert(n == 2);
+        struct server_loop loop = {
+                .settings = settings,
+                .shared = shared,
+        };
+        bool success = false;
 
-                struct pollfd *entry_pollfd = &pollfds[0];
-                struct pollfd *connection_pollfd = &pollfds[1];
+        loop.sessions = server_sessions_create();
+        if (loop.sessions == NULL) {
+                log_error("server_sessions_create");
+                return false;
+        }
 
-                if (_entry_callback(settings, entry_pollfd, connection_pollfd)
-                    == UTILS_LOOP_ERROR)
-                        return UTILS_LOOP_ERROR;
+        loop.reader = event_reader_create(&settings->mask, _signal_callback,
+                                          &loop);
+        if (loop.reader == NULL)
+                goto clean_sessions;
 
-                if (_connection_callback(settings, file_info, connection_pollfd,
-                                         &packet_size, &packet)
-                    != UTILS_LOOP_CONTINUE)
-                        close_connection(connection_pollfd);
+        // -1 if the only client is already connected
+        if (settings->sock_fd != -1
+            && !event_reader_add(loop.reader, settings->sock_fd, EPOLLIN,
+                                 _entry_callback, &loop))
+                goto clean_reader;
 
-                return _signal_callback(settings, file_info, &packet_size,
-                                        &packet, signal_pollfd,
-                                        connection_pollfd);
-        }
-#pragma GCC diagnostic pop
+        // already connected, e.g. through a socketpair
+        if (settings->read_fd != -1
+            && open_session(&loop, 0, settings->read_fd) == NULL)
+                goto clean_reader;
 
-        const struct pollfd fds[] = {
-                { .fd = settings->sock_fd, .events = POLLIN },
-                { settings->read_fd, .events = POLLIN | POLLRDHUP },
-        };
-        bool success = event_reader(&settings->mask, sizeof(fds) / sizeof(*fds),
-                                    fds, callback);
-        free(packet);
+        success = event_reader_run(loop.reader);
 
+clean_reader:
+        event_reader_destroy(loop.reader);
+clean_sessions:
+        server_sessions_destroy(loop.sessions);
         return success;
 }
 
@@ -308,12 +670,27 @@ static bool event_loop(struct settings *settings,
 int server_main(struct settings *settings)
 {
         syslog(LOG_DEBUG, "Server call main");
+        // the state of the directory shared by the sessions
+        struct server_resume resume = { 0 };
         struct server_file_info file_info = { 0 };
         file_info.filefd = -1;
+        file_info.basis_fd = -1;
+        file_info.resume = &resume;
+
+        bool success = open_dir(settings, &file_info)
+                       && get_filesystem_block_size(settings, &file_info);
+        if (success) {
+                open_chunks(&file_info);
+                open_resume(&file_info);
+                open_writer(settings, &file_info);
+                success = event_loop(settings, &file_info);
+        }
+        // the sessions closed their queues with the event loop
+        server_writer_stop(file_info.writer);
+        server_chunks_close(file_info.chunks);
+        server_resume_destroy(&resume);
 
-        if (!open_dir(settings, &file_info)
-            || !get_filesystem_block_size(settings, &file_info)
-            || !event_loop(settings, &file_info)) {
+        if (!success) {
                 syslog(LOG_DEBUG, "Server main EXIT_FAILURE.");
                 return EXIT_FAILURE;
         }
@@ -0,0 +1,191 @@
+/**
+ * @file session.c
+ * @brief Sessions of the clients served by the server at the same time.
+ */
+#include "session.h"
+
+#include "delta.h"
+#include "operation.h"
+
+#include "log.h"
+#include "utils.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+struct server_sessions *server_sessions_create(void)
+{
+        struct server_sessions *sessions = malloc(sizeof(*sessions));
+        if (sessions == NULL)
+                return NULL;
+
+        for (size_t i = 0; i < SERVER_MAX_SESSIONS; i++)
+                sessions->slots[i].fd = -1;
+        return sessions;
+}
+
+int server_sessions_find_free(const struct server_sessions *sessions)
+{
+        for (size_t i = 0; i < SERVER_MAX_SESSIONS; i++) {
+                if (sessions->slots[i].fd == -1)
+                        return i;
+        }
+        return -1;
+}
+
+/**
+ * Creates the pipe through which the blocks are spliced into files.
+ * Without it the blocks are copied through a buffer.
+ */
+static void open_splice_pipe(struct server_file_info *file_info)
+{
+        if (pipe2(file_info->pipe_fds, O_CLOEXEC) == -1) {
+                log_warning("pipe2");
+                file_info->pipe_fds[0] = -1;
+                file_info->pipe_fds[1] = -1;
+        }
+}
+
+static void close_splice_pipe(struct server_file_info *file_info)
+{
+        for (size_t i = 0; i < 2; i++) {
+                if (file_info->pipe_fds[i] != -1
+                    && close(file_info->pipe_fds[i]) == -1)
+                        log_warning("close pipe");
+        }
+}
+
+/**
+ * Sets up the asynchronous writes of the blocks through io_uring, or the
+ * writer threads if io_uring is not available. Without them the blocks are
+ * written directly.
+ */
+static void open_storage(const struct settings *settings,
+                         struct server_file_info *file_info)
+{
+        size_t block_size = settings->chunk_size;
+        if (block_size < settings->fs_block_size)
+                block_size = settings->fs_block_size;
+
+        if (settings->io_uring) {
+                file_info->storage = server_storage_open(block_size);
+                if (file_info->storage != NULL)
+                        return;
+                syslog(LOG_WARNING, "io_uring unavailable");
+        }
+        if (file_info->writer != NULL)
+                file_info->storage
+                        = server_storage_open_writer(file_info->writer,
+                                                     block_size);
+        if (file_info->storage == NULL)
+                syslog(LOG_WARNING, "the blocks are written directly");
+}
+
+struct server_session *
+server_sessions_open(struct server_sessions *sessions, size_t slot,
+                     const struct settings *settings,
+                     const struct server_file_info *shared, int fd)
+{
+        struct server_session *session = &sessions->slots[slot];
+        log_assert(session->fd == -1);
+
+        struct packet_stream *stream = packet_stream_create(fd, fd);
+        if (stream == NULL) {
+                log_error("packet_stream_create");
+                return NULL;
+        }
+        session->settings = *settings;
+        session->settings.stream = stream;
+        session->settings.read_fd = fd;
+        session->settings.write_fd = fd;
+        session->packet = NULL;
+        session->packet_size = 0;
+
+        // the client has to ask for the window and the chunks
+        struct server_file_info *file_info = &session->file_info;
+        memset(file_info, 0, sizeof(*file_info));
+        file_info->filefd = -1;
+        file_info->basis_fd = -1;
+        file_info->dirfd = shared->dirfd;
+        file_info->chunks = shared->chunks;
+        file_info->resume = shared->resume;
+        file_info->writer = shared->writer;
+        file_info->sessions = sessions;
+        snprintf(file_info->temp_name, sizeof(file_info->temp_name),
+                 SERVER_DELTA_TEMP_NAME ".%zu", slot);
+        open_splice_pipe(file_info);
+        if (settings->io_uring || file_info->writer != NULL)
+                open_storage(settings, file_info);
+
+        session->fd = fd;
+        syslog(LOG_DEBUG, "session %zu opened", slot);
+        return session;
+}
+
+void server_sessions_close(struct server_session *session)
+{
+        if (session->fd == -1)
+                return;
+
+        server_operation_abandon_file(&session->file_info);
+        if (!packet_stream_flush(session->settings.stream))
+                log_warning("packet flush");
+        packet_stream_destroy(session->settings.stream);
+        session->settings.stream = NULL;
+
+        server_dedup_destroy(&session->file_info.dedup);
+        close_splice_pipe(&session->file_info);
+        server_storage_close(session->file_info.storage);
+        session->file_info.storage = NULL;
+        free(session->packet);
+        session->packet = NULL;
+        session->packet_size = 0;
+
+        if (close(session->fd) == -1)
+                log_warning("connection socket");
+        session->fd = -1;
+}
+
+void server_sessions_destroy(struct server_sessions *sessions)
+{
+        if (sessions == NULL)
+                return;
+        for (size_t i = 0; i < SERVER_MAX_SESSIONS; i++)
+                server_sessions_close(&sessions->slots[i]);
+        free(sessions);
+}
+
+/**
+ * Checks whether the session creates, changes or replaces the file or a
+ * file in the directory.
+ */
+static bool is_modifying(const struct server_file_info *file_info,
+                         const char *name)
+{
+        return (file_info->creating_file
+                && utils_path_is_within(file_info->file_name, name))
+               || (file_info->changing_file
+                   && utils_path_is_within(file_info->change_name, name));
+}
+
+bool server_sessions_is_busy(const struct server_file_info *file_info,
+                             const char *name)
+{
+        const struct server_sessions *sessions = file_info->sessions;
+        if (sessions == NULL)
+                return false;
+
+        for (size_t i = 0; i < SERVER_MAX_SESSIONS; i++) {
+                const struct server_session *session = &sessions->slots[i];
+                if (session->fd == -1 || &session->file_info == file_info)
+                        continue;
+                if (is_modifying(&session->file_info, name)) {
+                        syslog(LOG_WARNING, "%s is modified by another client",
+                               name);
+                        return true;
+                }
+        }
+        return false;
+}
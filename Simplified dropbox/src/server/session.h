@@ -0,0 +1,103 @@
+/**
+ * @file session.h
+ * @brief Sessions of the clients served by the server at the same time.
+ */
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "file_info.h"
+
+#include "packet.h"
+#include "settings.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Maximum number of the clients served at the same time. Other clients
+ * are rejected.
+ */
+#define SERVER_MAX_SESSIONS 16
+
+/**
+ * Connection of one client.
+ */
+struct server_session {
+        struct settings settings; /**< settings with the stream of the client */
+        struct server_file_info file_info; /**< file the client sends       */
+        struct packet *packet;             /**< buffer of received packets  */
+        size_t packet_size;                /**< size of the packet buffer   */
+        int fd;                            /**< connection, -1 if unused    */
+};
+
+/**
+ * Table of the sessions, indexed by the slot of the session.
+ */
+struct server_sessions {
+        struct server_session slots[SERVER_MAX_SESSIONS];
+};
+
+/**
+ * Creates the table without any session.
+ *
+ * @return  the table allocated by malloc(3);
+ *          NULL on failure
+ */
+struct server_sessions *server_sessions_create(void);
+
+/**
+ * Finds the slot of the table without any session.
+ *
+ * @param sessions  the table of the sessions
+ * @return          index of the slot;
+ *                  -1 if the table is full
+ */
+int server_sessions_find_free(const struct server_sessions *sessions);
+
+/**
+ * Opens the session of the client connected through @c fd in the @c slot.
+ * The session owns @c fd from now on.
+ *
+ * @param sessions  the table of the sessions
+ * @param slot      index of the free slot
+ * @param settings  settings of the server
+ * @param shared    state of the directory shared by all the sessions:
+ *                  dirfd, chunks, resume and writer
+ * @param fd        connection to the client
+ * @return          the session on success;
+ *                  NULL on failure and @c fd is left open
+ */
+struct server_session *
+server_sessions_open(struct server_sessions *sessions, size_t slot,
+                     const struct settings *settings,
+                     const struct server_file_info *shared, int fd);
+
+/**
+ * Closes the connection of the session and the file the client left
+ * unfinished. Pending replies are sent first.
+ *
+ * @param session  the session
+ */
+void server_sessions_close(struct server_session *session);
+
+/**
+ * Closes all the sessions and frees the table.
+ *
+ * @param sessions  the table of the sessions
+ */
+void server_sessions_destroy(struct server_sessions *sessions);
+
+/**
+ * Checks whether another session is creating, changing or replacing the
+ * file @c name or a file in the directory @c name, so the session of
+ * @c file_info must not touch it.
+ *
+ * @param file_info  state of the session asking
+ * @param name       path of the file or directory in the directory
+ * @return           true if the file is busy;
+ *                   false otherwise
+ */
+bool server_sessions_is_busy(const struct server_file_info *file_info,
+                             const char *name);
+
+#endif /* SESSION_H */
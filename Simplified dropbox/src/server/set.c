@@ -5,19 +5,14 @@
 #include "log.h"
 
 #include <sys/stat.h>
-#include <sys/time.h>
 
 enum packet_msg_code
 server_set_timestamps(const struct server_file_info *file_info)
 {
-        const struct timeval access_time
-                = { file_info->atim.tv_sec, file_info->atim.tv_nsec / 1000 };
-        const struct timeval modification_time
-                = { file_info->mtim.tv_sec, file_info->mtim.tv_nsec / 1000 };
-
-        const struct timeval times[2] = { access_time, modification_time };
-        if (futimes(file_info->filefd, times) == -1) {
-                log_warning("futimes");
+        // nanoseconds are kept, so the manifest compares equal times
+        const struct timespec times[2] = { file_info->atim, file_info->mtim };
+        if (futimens(file_info->filefd, times) == -1) {
+                log_warning("futimens");
                 return MSG_NOK;
         }
         syslog(LOG_DEBUG, "timestamps set successfully.");
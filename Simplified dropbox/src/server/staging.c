@@ -0,0 +1,95 @@
+/**
+ * @file staging.c
+ * @brief New versions of the existing files written aside and put in place
+ *        of the old versions in one step.
+ */
+#include "staging.h"
+
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+bool server_staging_name(struct server_file_info *file_info,
+                         const char *name)
+{
+        const char *slash = strrchr(name, '/');
+        const int dir_len = slash == NULL ? 0 : slash - name + 1;
+        const int len = snprintf(file_info->staged_name,
+                                 sizeof(file_info->staged_name), "%.*s%s",
+                                 dir_len, name, file_info->temp_name);
+        if (len < 0 || (size_t)len >= sizeof(file_info->staged_name)) {
+                errno = ENAMETOOLONG;
+                return false;
+        }
+        return true;
+}
+
+bool server_staging_open(struct server_file_info *file_info,
+                         const char *name)
+{
+        if (!server_staging_name(file_info, name))
+                return false;
+        char dir[PATH_MAX];
+        strcpy(dir, name);
+        char *slash = strrchr(dir, '/');
+        if (slash != NULL)
+                *slash = '\0';
+
+        file_info->staging = SERVER_STAGING_TMPFILE;
+        file_info->filefd = openat(file_info->dirfd, slash != NULL ? dir : ".",
+                                   O_TMPFILE | O_RDWR, 0666);
+        // EISDIR tells the kernel does not know O_TMPFILE
+        if (file_info->filefd == -1
+            && (errno == EOPNOTSUPP || errno == EISDIR)) {
+                file_info->staging = SERVER_STAGING_TEMP;
+                file_info->filefd = openat(file_info->dirfd,
+                                           file_info->staged_name,
+                                           O_CREAT | O_TRUNC | O_RDWR, 0666);
+        }
+        if (file_info->filefd == -1) {
+                file_info->staging = SERVER_STAGING_NONE;
+                return false;
+        }
+        syslog(LOG_DEBUG, "new version of %s is written aside", name);
+        return true;
+}
+
+bool server_staging_commit(struct server_file_info *file_info,
+                           const char *name)
+{
+        if (file_info->staging == SERVER_STAGING_NONE)
+                return true;
+        if (file_info->staging == SERVER_STAGING_TMPFILE) {
+                char path[sizeof("/proc/self/fd/") + 3 * sizeof(int)];
+                snprintf(path, sizeof(path), "/proc/self/fd/%d",
+                         file_info->filefd);
+                // the name may be left by a crashed server
+                if ((unlinkat(file_info->dirfd, file_info->staged_name, 0)
+                             == -1
+                     && errno != ENOENT)
+                    || linkat(AT_FDCWD, path, file_info->dirfd,
+                              file_info->staged_name, AT_SYMLINK_FOLLOW)
+                               == -1)
+                        return false;
+                file_info->staging = SERVER_STAGING_TEMP;
+        }
+        if (renameat(file_info->dirfd, file_info->staged_name,
+                     file_info->dirfd, name)
+            == -1)
+                return false;
+        file_info->staging = SERVER_STAGING_NONE;
+        syslog(LOG_DEBUG, "%s replaced by its new version", name);
+        return true;
+}
+
+void server_staging_discard(struct server_file_info *file_info)
+{
+        if (file_info->staging == SERVER_STAGING_TEMP
+            && unlinkat(file_info->dirfd, file_info->staged_name, 0) == -1)
+                log_warning("unlinkat");
+        file_info->staging = SERVER_STAGING_NONE;
+}
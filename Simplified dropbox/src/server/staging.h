@@ -0,0 +1,57 @@
+/**
+ * @file staging.h
+ * @brief New versions of the existing files written aside and put in place
+ *        of the old versions in one step, so the readers never see a file
+ *        missing or half written.
+ */
+#ifndef STAGING_H
+#define STAGING_H
+
+#include "file_info.h"
+
+#include <stdbool.h>
+
+/**
+ * Sets @c staged_name to @c temp_name in the directory of the file
+ * @c name, so the staged file is renamed within one directory.
+ *
+ * @param file_info  information about the current file
+ * @param name       name of the file in the directory
+ * @return           true on success;
+ *                   false if the name is too long and errno is set
+ */
+bool server_staging_name(struct server_file_info *file_info,
+                         const char *name);
+
+/**
+ * Opens @c filefd for the new version of the file @c name. It is an unnamed
+ * file in the directory of the old version, or @c staged_name if the
+ * filesystem does not support O_TMPFILE.
+ *
+ * @param file_info  information about the current file
+ * @param name       name of the file in the directory
+ * @return           true on success;
+ *                   false on failure and errno is set appropriately
+ */
+bool server_staging_open(struct server_file_info *file_info,
+                         const char *name);
+
+/**
+ * Puts the staged new version of the file @c name in place of the old
+ * version. The unnamed file is linked to @c staged_name first. Nothing is
+ * done if the file is not staged.
+ *
+ * @param file_info  information about the current file
+ * @param name       name of the file in the directory
+ * @return           true on success;
+ *                   false on failure and errno is set appropriately
+ */
+bool server_staging_commit(struct server_file_info *file_info,
+                           const char *name);
+
+/**
+ * Removes the staged file which never replaced the old version.
+ */
+void server_staging_discard(struct server_file_info *file_info);
+
+#endif /* STAGING_H */
@@ -0,0 +1,459 @@
+/**
+ * @file storage.c
+ * @brief Asynchronous writes of the received blocks through io_uring or
+ *        the writer threads, so the server goes on receiving while the
+ *        disk writes.
+ */
+#include "storage.h"
+
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/** maximum number of the writes in flight */
+#define STORAGE_QUEUE_DEPTH 16
+/** the buffers are locked in memory, RLIMIT_MEMLOCK is often 8 MiB */
+#define STORAGE_MAX_LOCKED (8 * 1024 * 1024)
+/** the next block is received while the previous one is written */
+#define STORAGE_MIN_BUFFERS 2
+
+struct server_storage {
+        struct server_writer_queue *queue; /**< NULL for io_uring         */
+
+        int ring_fd;
+        int event_fd;
+
+        void *sq_ring;
+        size_t sq_ring_size;
+        void *cq_ring;
+        size_t cq_ring_size;
+        struct io_uring_sqe *sqes;
+        size_t sqes_size;
+
+        unsigned *sq_tail;
+        unsigned *sq_mask;
+        unsigned *sq_array;
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned *cq_mask;
+        struct io_uring_cqe *cqes;
+
+        unsigned char *buffers;
+        size_t buffer_size;
+        unsigned buffer_count;
+        unsigned free[STORAGE_QUEUE_DEPTH]; /**< stack of free buffers     */
+        unsigned free_count;
+        int filling;  /**< buffer returned by server_storage_buffer(), -1 */
+        size_t sizes[STORAGE_QUEUE_DEPTH];  /**< sizes of the writes       */
+        unsigned in_flight;
+
+        int fixed_fd; /**< file in the fixed file slot, -1 if none         */
+        int error;    /**< errno of the first write failed since the drain */
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+        return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete,
+                       unsigned flags)
+{
+        int ret;
+        do {
+                ret = syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                              min_complete, flags, NULL, 0);
+        } while (ret == -1 && errno == EINTR);
+        return ret;
+}
+
+static int uring_register(int ring_fd, unsigned opcode, const void *arg,
+                          unsigned nr_args)
+{
+        return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+static bool map_rings(struct server_storage *storage,
+                      const struct io_uring_params *params)
+{
+        storage->sq_ring_size
+                = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+        storage->cq_ring_size = params->cq_off.cqes
+                                + params->cq_entries
+                                          * sizeof(struct io_uring_cqe);
+        const bool single_mmap = params->features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap && storage->cq_ring_size > storage->sq_ring_size)
+                storage->sq_ring_size = storage->cq_ring_size;
+
+        storage->sq_ring = mmap(NULL, storage->sq_ring_size,
+                                PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, storage->ring_fd,
+                                IORING_OFF_SQ_RING);
+        if (storage->sq_ring == MAP_FAILED)
+                return false;
+
+        storage->cq_ring = storage->sq_ring;
+        if (!single_mmap) {
+                storage->cq_ring = mmap(NULL, storage->cq_ring_size,
+                                        PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE,
+                                        storage->ring_fd, IORING_OFF_CQ_RING);
+                if (storage->cq_ring == MAP_FAILED)
+                        return false;
+        }
+
+        storage->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+        storage->sqes = mmap(NULL, storage->sqes_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, storage->ring_fd,
+                             IORING_OFF_SQES);
+        if (storage->sqes == MAP_FAILED)
+                return false;
+
+        unsigned char *sq = storage->sq_ring;
+        storage->sq_tail = (unsigned *)(sq + params->sq_off.tail);
+        storage->sq_mask = (unsigned *)(sq + params->sq_off.ring_mask);
+        storage->sq_array = (unsigned *)(sq + params->sq_off.array);
+
+        unsigned char *cq = storage->cq_ring;
+        storage->cq_head = (unsigned *)(cq + params->cq_off.head);
+        storage->cq_tail = (unsigned *)(cq + params->cq_off.tail);
+        storage->cq_mask = (unsigned *)(cq + params->cq_off.ring_mask);
+        storage->cqes = (struct io_uring_cqe *)(cq + params->cq_off.cqes);
+        return true;
+}
+
+static bool register_buffers(struct server_storage *storage)
+{
+        const size_t size = storage->buffer_count * storage->buffer_size;
+        storage->buffers = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (storage->buffers == MAP_FAILED) {
+                storage->buffers = NULL;
+                return false;
+        }
+
+        struct iovec iov[STORAGE_QUEUE_DEPTH];
+        for (unsigned i = 0; i < storage->buffer_count; i++) {
+                iov[i].iov_base = storage->buffers + i * storage->buffer_size;
+                iov[i].iov_len = storage->buffer_size;
+                storage->free[i] = storage->buffer_count - 1 - i;
+        }
+        storage->free_count = storage->buffer_count;
+        return uring_register(storage->ring_fd, IORING_REGISTER_BUFFERS, iov,
+                              storage->buffer_count)
+               == 0;
+}
+
+static bool register_files(struct server_storage *storage)
+{
+        // the slot is updated with the file being written
+        const int fds[1] = { -1 };
+        if (uring_register(storage->ring_fd, IORING_REGISTER_FILES, fds, 1)
+            == -1)
+                return false;
+
+        storage->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        return storage->event_fd != -1
+               && uring_register(storage->ring_fd, IORING_REGISTER_EVENTFD,
+                                 &storage->event_fd, 1)
+                          == 0;
+}
+
+static unsigned count_buffers(size_t block_size)
+{
+        size_t count = STORAGE_MAX_LOCKED / block_size;
+        if (count > STORAGE_QUEUE_DEPTH)
+                count = STORAGE_QUEUE_DEPTH;
+        if (count < STORAGE_MIN_BUFFERS)
+                count = STORAGE_MIN_BUFFERS;
+        return count;
+}
+
+struct server_storage *server_storage_open(size_t block_size)
+{
+        log_assert(block_size > 0);
+        struct server_storage *storage = calloc(1, sizeof(*storage));
+        if (storage == NULL) {
+                log_error("calloc");
+                return NULL;
+        }
+        storage->event_fd = -1;
+        storage->fixed_fd = -1;
+        storage->filling = -1;
+        storage->buffer_size = block_size;
+        storage->buffer_count = count_buffers(block_size);
+
+        struct io_uring_params params = { 0 };
+        storage->ring_fd = uring_setup(storage->buffer_count, &params);
+        if (storage->ring_fd == -1) {
+                log_warning("io_uring_setup");
+                free(storage);
+                return NULL;
+        }
+
+        if (!map_rings(storage, &params) || !register_buffers(storage)
+            || !register_files(storage)) {
+                log_warning("io_uring");
+                server_storage_close(storage);
+                return NULL;
+        }
+        syslog(LOG_DEBUG, "io_uring with %u buffers of %zu bytes",
+               storage->buffer_count, storage->buffer_size);
+        return storage;
+}
+
+struct server_storage *server_storage_open_writer(struct server_writer *writer,
+                                                  size_t block_size)
+{
+        struct server_storage *storage = calloc(1, sizeof(*storage));
+        if (storage == NULL) {
+                log_error("calloc");
+                return NULL;
+        }
+        storage->queue = server_writer_queue_open(writer, block_size);
+        if (storage->queue == NULL) {
+                free(storage);
+                return NULL;
+        }
+        return storage;
+}
+
+int server_storage_event_fd(const struct server_storage *storage)
+{
+        if (storage->queue != NULL)
+                return server_writer_queue_event_fd(storage->queue);
+        return storage->event_fd;
+}
+
+size_t server_storage_pending(const struct server_storage *storage)
+{
+        if (storage == NULL)
+                return 0;
+        if (storage->queue != NULL)
+                return server_writer_queue_pending(storage->queue);
+        return storage->in_flight;
+}
+
+static void complete(struct server_storage *storage,
+                     const struct io_uring_cqe *cqe)
+{
+        const unsigned index = cqe->user_data;
+        log_assert(index < storage->buffer_count);
+
+        int error = 0;
+        if (cqe->res < 0)
+                error = -cqe->res;
+        else if ((size_t)cqe->res != storage->sizes[index])
+                error = ENOSPC;
+        if (error != 0) {
+                syslog(LOG_ERR, "asynchronous write: %s.", strerror(error));
+                if (storage->error == 0)
+                        storage->error = error;
+        }
+
+        storage->free[storage->free_count++] = index;
+        storage->in_flight--;
+}
+
+static void reap(struct server_storage *storage)
+{
+        unsigned head = *storage->cq_head;
+        const unsigned tail = __atomic_load_n(storage->cq_tail,
+                                              __ATOMIC_ACQUIRE);
+        while (head != tail) {
+                complete(storage, &storage->cqes[head & *storage->cq_mask]);
+                head++;
+        }
+        __atomic_store_n(storage->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static bool wait_one(struct server_storage *storage)
+{
+        if (uring_enter(storage->ring_fd, 0, 1, IORING_ENTER_GETEVENTS)
+            == -1) {
+                log_error("io_uring_enter");
+                return false;
+        }
+        reap(storage);
+        return true;
+}
+
+static bool wait_all(struct server_storage *storage)
+{
+        reap(storage);
+        while (storage->in_flight > 0) {
+                if (!wait_one(storage))
+                        return false;
+        }
+        return true;
+}
+
+static bool set_fixed_file(struct server_storage *storage, int fd)
+{
+        struct io_uring_files_update update = {
+                .offset = 0,
+                .fds = (uintptr_t)&fd,
+        };
+        if (uring_register(storage->ring_fd, IORING_REGISTER_FILES_UPDATE,
+                           &update, 1)
+            == -1) {
+                log_error("io_uring_register files");
+                return false;
+        }
+        storage->fixed_fd = fd;
+        return true;
+}
+
+unsigned char *server_storage_buffer(struct server_storage *storage)
+{
+        if (storage->queue != NULL)
+                return server_writer_queue_buffer(storage->queue);
+        if (storage->filling == -1) {
+                while (storage->free_count == 0) {
+                        if (!wait_one(storage))
+                                return NULL;
+                }
+                storage->filling = storage->free[--storage->free_count];
+        }
+        return storage->buffers + storage->filling * storage->buffer_size;
+}
+
+static bool submit(struct server_storage *storage, unsigned index,
+                   size_t size, off_t offset)
+{
+        const unsigned tail = *storage->sq_tail;
+        const unsigned slot = tail & *storage->sq_mask;
+        struct io_uring_sqe *sqe = &storage->sqes[slot];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->fd = 0;
+        sqe->addr = (uintptr_t)(storage->buffers + index * storage->buffer_size);
+        sqe->len = size;
+        sqe->off = offset;
+        sqe->buf_index = index;
+        sqe->user_data = index;
+        storage->sq_array[slot] = slot;
+        __atomic_store_n(storage->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        if (uring_enter(storage->ring_fd, 1, 0, 0) != 1) {
+                log_error("io_uring_enter");
+                return false;
+        }
+        return true;
+}
+
+bool server_storage_write(struct server_storage *storage, int fd,
+                          unsigned char *buffer, size_t size, off_t offset)
+{
+        if (storage->queue != NULL)
+                return server_writer_queue_write(storage->queue, fd, buffer,
+                                                 size, offset);
+        log_assert(storage->filling != -1);
+        const unsigned index = storage->filling;
+        log_assert(buffer == storage->buffers + index * storage->buffer_size);
+        log_assert(size <= storage->buffer_size);
+
+        // a failed write aborts the transfer as soon as possible
+        reap(storage);
+        if (storage->error != 0) {
+                errno = storage->error;
+                return false;
+        }
+        if (fd != storage->fixed_fd
+            && (!wait_all(storage) || !set_fixed_file(storage, fd)))
+                return false;
+
+        storage->sizes[index] = size;
+        storage->in_flight++;
+        if (!submit(storage, index, size, offset)) {
+                storage->in_flight--;
+                return false;
+        }
+        storage->filling = -1;
+        return true;
+}
+
+bool server_storage_reap(struct server_storage *storage)
+{
+        if (storage->queue != NULL)
+                return server_writer_queue_reap(storage->queue);
+        uint64_t count;
+        if (read(storage->event_fd, &count, sizeof(count)) == -1
+            && errno != EAGAIN)
+                log_warning("read eventfd");
+        reap(storage);
+        return storage->error == 0;
+}
+
+bool server_storage_drain(struct server_storage *storage)
+{
+        if (storage == NULL)
+                return true;
+        if (storage->queue != NULL)
+                return server_writer_queue_drain(storage->queue);
+        if (!wait_all(storage))
+                return false;
+        // the fixed file would keep the closed file open
+        if (storage->fixed_fd != -1 && !set_fixed_file(storage, -1))
+                return false;
+
+        const int error = storage->error;
+        storage->error = 0;
+        if (error != 0) {
+                errno = error;
+                return false;
+        }
+        return true;
+}
+
+void server_storage_close(struct server_storage *storage)
+{
+        if (storage == NULL)
+                return;
+        if (storage->queue != NULL) {
+                server_writer_queue_close(storage->queue);
+                free(storage);
+                return;
+        }
+        if (storage->sqes != NULL && storage->sqes != MAP_FAILED
+            && !wait_all(storage))
+                log_warning("io_uring writes");
+
+        if (storage->buffers != NULL
+            && munmap(storage->buffers,
+                      storage->buffer_count * storage->buffer_size)
+                       == -1)
+                log_warning("munmap");
+        if (storage->sqes != NULL && storage->sqes != MAP_FAILED)
+                munmap(storage->sqes, storage->sqes_size);
+        if (storage->cq_ring != NULL && storage->cq_ring != MAP_FAILED
+            && storage->cq_ring != storage->sq_ring)
+                munmap(storage->cq_ring, storage->cq_ring_size);
+        if (storage->sq_ring != NULL && storage->sq_ring != MAP_FAILED)
+                munmap(storage->sq_ring, storage->sq_ring_size);
+        if (storage->event_fd != -1 && close(storage->event_fd) == -1)
+                log_warning("close eventfd");
+        if (close(storage->ring_fd) == -1)
+                log_warning("close io_uring");
+        free(storage);
+}
+
+bool server_storage_preallocate(int fd, off_t size, bool sparse)
+{
+        if (!sparse && fallocate(fd, 0, 0, size) == 0)
+                return true;
+        if (!sparse && errno != EOPNOTSUPP && errno != ENOSYS)
+                return false;
+        return ftruncate(fd, size) == 0;
+}
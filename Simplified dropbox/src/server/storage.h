@@ -0,0 +1,131 @@
+/**
+ * @file storage.h
+ * @brief Asynchronous writes of the received blocks through io_uring or
+ *        the writer threads, so the server goes on receiving while the
+ *        disk writes.
+ */
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "writer.h"
+
+/**
+ * Queue of the writes in flight. With io_uring the blocks are written from
+ * buffers registered with the kernel into the file registered as a fixed
+ * file, otherwise by the writer threads.
+ */
+struct server_storage;
+
+/**
+ * Sets up io_uring with the buffers for the blocks.
+ *
+ * @param block_size  size of the largest block
+ * @return            the storage on success;
+ *                    NULL if io_uring is not available, and the blocks
+ *                    have to be written synchronously
+ */
+struct server_storage *server_storage_open(size_t block_size);
+
+/**
+ * Queues the blocks for the writer threads.
+ *
+ * @param writer      the writer threads
+ * @param block_size  size of the largest block
+ * @return            the storage on success;
+ *                    NULL on failure
+ */
+struct server_storage *server_storage_open_writer(struct server_writer *writer,
+                                                  size_t block_size);
+
+/**
+ * Returns the eventfd signalled when a write completes, so the event loop
+ * can call server_storage_reap().
+ *
+ * @param storage  the storage
+ * @return         the eventfd;
+ *                 -1 if the completions are not signalled
+ */
+int server_storage_event_fd(const struct server_storage *storage);
+
+/**
+ * Returns the free buffer the block is read into before it is passed to
+ * server_storage_write(). Waits for a write to complete if all the
+ * buffers are in flight.
+ *
+ * @param storage  the storage
+ * @return         the buffer of the size given to server_storage_open(),
+ *                 the same one until it is passed to
+ *                 server_storage_write();
+ *                 NULL on failure
+ */
+unsigned char *server_storage_buffer(struct server_storage *storage);
+
+/**
+ * Submits the write of the block. The file has to stay open until
+ * the write completes.
+ *
+ * @param storage  the storage
+ * @param fd       the file
+ * @param buffer   the buffer returned by server_storage_buffer()
+ * @param size     size of the block
+ * @param offset   offset of the block in the file
+ * @return         true on success;
+ *                 false on failure and errno is set appropriately
+ */
+bool server_storage_write(struct server_storage *storage, int fd,
+                          unsigned char *buffer, size_t size, off_t offset);
+
+/**
+ * Returns the number of the blocks submitted and not known to be written
+ * yet, so they are not acknowledged to the client.
+ *
+ * @param storage  the storage; NULL if the writes are synchronous
+ * @return         number of the writes in flight
+ */
+size_t server_storage_pending(const struct server_storage *storage);
+
+/**
+ * Collects the completed writes without waiting.
+ *
+ * @param storage  the storage
+ * @return         true if all the completed writes succeeded;
+ *                 false otherwise
+ */
+bool server_storage_reap(struct server_storage *storage);
+
+/**
+ * Waits for all the writes in flight and releases the file. It has to be
+ * called before the file is read, changed otherwise or closed.
+ *
+ * @param storage  the storage; NULL if the writes are synchronous
+ * @return         true if all the writes since the last drain succeeded;
+ *                 false otherwise and errno is set appropriately
+ */
+bool server_storage_drain(struct server_storage *storage);
+
+/**
+ * Waits for all the writes in flight and releases the storage.
+ *
+ * @param storage  the storage; may be NULL
+ */
+void server_storage_close(struct server_storage *storage);
+
+/**
+ * Gives the file its final size before it is written. The blocks of the
+ * whole file are allocated at once by fallocate(2), so the concurrent
+ * writes do not fragment it. The sparse file or the file on a filesystem
+ * without fallocate(2) is only extended by ftruncate(2).
+ *
+ * @param fd      the file open for writing
+ * @param size    final size of the file
+ * @param sparse  true if the holes of the file are kept
+ * @return        true if the file has the size;
+ *                false otherwise and errno is set appropriately
+ */
+bool server_storage_preallocate(int fd, off_t size, bool sparse);
+
+#endif /* STORAGE_H */
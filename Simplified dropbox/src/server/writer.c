@@ -0,0 +1,380 @@
+/**
+ * @file writer.c
+ * @brief Pool of the threads writing the received blocks, so the event
+ *        loop only parses the packets of the clients.
+ *
+ * Every session has a single-producer single-consumer ring of the blocks:
+ * the event loop appends the blocks and the thread running the queue
+ * writes them, without any lock. A queue with blocks is scheduled on the
+ * list of the ready queues and run by one thread at a time, which keeps
+ * the blocks of the file in order. Only the list of the ready queues is
+ * locked, so the idle threads can sleep.
+ */
+#include "writer.h"
+
+#include "log.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/** maximum number of the blocks in the queue */
+#define WRITER_QUEUE_DEPTH 16
+/** memory for the buffers of one queue */
+#define WRITER_MAX_BUFFERED (8 * 1024 * 1024)
+/** the next block is received while the previous one is written */
+#define WRITER_MIN_BUFFERS 2
+
+struct writer_job {
+        int fd;
+        size_t size;
+        off_t offset;
+};
+
+struct server_writer_queue {
+        struct server_writer *writer;
+        struct server_writer_queue *next_ready; /**< guarded by the lock   */
+        int event_fd;
+
+        unsigned char *buffers;
+        size_t buffer_size;
+        unsigned depth;
+        struct writer_job jobs[WRITER_QUEUE_DEPTH];
+
+        unsigned tail;   /**< blocks appended, by the event loop          */
+        unsigned head;   /**< blocks written, by the thread               */
+        bool filling;    /**< buffer of the tail was returned             */
+        bool scheduled;  /**< on the ready list or run by a thread        */
+        bool running;    /**< a thread uses the queue, guarded by the lock */
+        int error;       /**< errno of the first write failed since drain */
+};
+
+struct server_writer {
+        pthread_mutex_t lock;
+        pthread_cond_t ready;       /**< a queue was scheduled or stopping */
+        pthread_cond_t idle;        /**< a thread left a queue             */
+        struct server_writer_queue *ready_head;
+        struct server_writer_queue *ready_tail;
+        bool stopping;
+        size_t thread_count;
+        pthread_t threads[SERVER_MAX_WRITERS];
+};
+
+/**
+ * Writes the whole block at its offset.
+ */
+static int write_job(const struct server_writer_queue *queue, unsigned index)
+{
+        const struct writer_job *job = &queue->jobs[index];
+        const unsigned char *buffer = queue->buffers
+                                      + index * queue->buffer_size;
+        size_t written = 0;
+        while (written < job->size) {
+                const ssize_t rc = pwrite(job->fd, buffer + written,
+                                          job->size - written,
+                                          job->offset + written);
+                if (rc == -1 && errno == EINTR)
+                        continue;
+                if (rc == -1)
+                        return errno;
+                if (rc == 0)
+                        return ENOSPC;
+                written += rc;
+        }
+        return 0;
+}
+
+static void signal_completion(const struct server_writer_queue *queue)
+{
+        const uint64_t one = 1;
+        if (write(queue->event_fd, &one, sizeof(one)) == -1
+            && errno != EAGAIN)
+                log_warning("write eventfd");
+}
+
+/**
+ * Writes the blocks of the queue until it is empty. The queue is left
+ * scheduled if the event loop appended a block meanwhile.
+ */
+static void run_queue(struct server_writer_queue *queue)
+{
+        unsigned head = queue->head;
+        do {
+                while (head
+                       != __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) {
+                        const int error = write_job(queue,
+                                                    head % queue->depth);
+                        int expected = 0;
+                        if (error != 0)
+                                __atomic_compare_exchange_n(
+                                        &queue->error, &expected, error, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+                        __atomic_store_n(&queue->head, ++head,
+                                         __ATOMIC_RELEASE);
+                        signal_completion(queue);
+                }
+                // pairs with the event loop appending and scheduling
+                __atomic_store_n(&queue->scheduled, false, __ATOMIC_SEQ_CST);
+        } while (head != __atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST)
+                 && !__atomic_exchange_n(&queue->scheduled, true,
+                                         __ATOMIC_SEQ_CST));
+}
+
+static struct server_writer_queue *next_ready(struct server_writer *writer)
+{
+        pthread_mutex_lock(&writer->lock);
+        while (writer->ready_head == NULL && !writer->stopping)
+                pthread_cond_wait(&writer->ready, &writer->lock);
+
+        struct server_writer_queue *queue = writer->ready_head;
+        if (queue != NULL) {
+                writer->ready_head = queue->next_ready;
+                if (writer->ready_head == NULL)
+                        writer->ready_tail = NULL;
+                queue->next_ready = NULL;
+                queue->running = true;
+        }
+        pthread_mutex_unlock(&writer->lock);
+        return queue;
+}
+
+static void *work(void *arg)
+{
+        struct server_writer *writer = arg;
+        struct server_writer_queue *queue;
+        while ((queue = next_ready(writer)) != NULL) {
+                run_queue(queue);
+
+                pthread_mutex_lock(&writer->lock);
+                queue->running = false;
+                pthread_cond_broadcast(&writer->idle);
+                pthread_mutex_unlock(&writer->lock);
+        }
+        return NULL;
+}
+
+struct server_writer *server_writer_start(size_t threads)
+{
+        log_assert(threads > 0 && threads <= SERVER_MAX_WRITERS);
+        struct server_writer *writer = calloc(1, sizeof(*writer));
+        if (writer == NULL) {
+                log_error("calloc");
+                return NULL;
+        }
+        pthread_mutex_init(&writer->lock, NULL);
+        pthread_cond_init(&writer->ready, NULL);
+        pthread_cond_init(&writer->idle, NULL);
+
+        for (; writer->thread_count < threads; writer->thread_count++) {
+                const int rc = pthread_create(
+                        &writer->threads[writer->thread_count], NULL, work,
+                        writer);
+                if (rc != 0) {
+                        errno = rc;
+                        log_error("pthread_create");
+                        server_writer_stop(writer);
+                        return NULL;
+                }
+        }
+        syslog(LOG_DEBUG, "%zu writer threads started", threads);
+        return writer;
+}
+
+void server_writer_stop(struct server_writer *writer)
+{
+        if (writer == NULL)
+                return;
+
+        pthread_mutex_lock(&writer->lock);
+        log_assert(writer->ready_head == NULL);
+        writer->stopping = true;
+        pthread_cond_broadcast(&writer->ready);
+        pthread_mutex_unlock(&writer->lock);
+
+        for (size_t i = 0; i < writer->thread_count; i++)
+                pthread_join(writer->threads[i], NULL);
+        pthread_cond_destroy(&writer->idle);
+        pthread_cond_destroy(&writer->ready);
+        pthread_mutex_destroy(&writer->lock);
+        free(writer);
+}
+
+static unsigned count_buffers(size_t block_size)
+{
+        size_t count = WRITER_MAX_BUFFERED / block_size;
+        if (count > WRITER_QUEUE_DEPTH)
+                count = WRITER_QUEUE_DEPTH;
+        if (count < WRITER_MIN_BUFFERS)
+                count = WRITER_MIN_BUFFERS;
+        return count;
+}
+
+struct server_writer_queue *server_writer_queue_open(
+        struct server_writer *writer, size_t block_size)
+{
+        log_assert(block_size > 0);
+        struct server_writer_queue *queue = calloc(1, sizeof(*queue));
+        if (queue == NULL) {
+                log_error("calloc");
+                return NULL;
+        }
+        queue->writer = writer;
+        queue->buffer_size = block_size;
+        queue->depth = count_buffers(block_size);
+
+        queue->buffers = malloc(queue->depth * block_size);
+        if (queue->buffers == NULL) {
+                log_error("malloc");
+                goto clean_queue;
+        }
+        queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (queue->event_fd == -1) {
+                log_error("eventfd");
+                goto clean_buffers;
+        }
+        syslog(LOG_DEBUG, "writer queue with %u buffers of %zu bytes",
+               queue->depth, queue->buffer_size);
+        return queue;
+
+clean_buffers:
+        free(queue->buffers);
+clean_queue:
+        free(queue);
+        return NULL;
+}
+
+int server_writer_queue_event_fd(const struct server_writer_queue *queue)
+{
+        return queue->event_fd;
+}
+
+size_t server_writer_queue_pending(const struct server_writer_queue *queue)
+{
+        return queue->tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+}
+
+static void consume_event(const struct server_writer_queue *queue)
+{
+        uint64_t count;
+        if (read(queue->event_fd, &count, sizeof(count)) == -1
+            && errno != EAGAIN)
+                log_warning("read eventfd");
+}
+
+/**
+ * Waits until at most @c pending blocks are not written.
+ */
+static bool wait_pending(struct server_writer_queue *queue, size_t pending)
+{
+        struct pollfd pollfd = { .fd = queue->event_fd, .events = POLLIN };
+        while (server_writer_queue_pending(queue) > pending) {
+                if (poll(&pollfd, 1, -1) == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        log_error("poll");
+                        return false;
+                }
+                consume_event(queue);
+        }
+        return true;
+}
+
+unsigned char *server_writer_queue_buffer(struct server_writer_queue *queue)
+{
+        if (!queue->filling) {
+                if (!wait_pending(queue, queue->depth - 1))
+                        return NULL;
+                queue->filling = true;
+        }
+        return queue->buffers + (queue->tail % queue->depth)
+                                        * queue->buffer_size;
+}
+
+static void schedule(struct server_writer_queue *queue)
+{
+        if (__atomic_exchange_n(&queue->scheduled, true, __ATOMIC_SEQ_CST))
+                return;
+
+        struct server_writer *writer = queue->writer;
+        pthread_mutex_lock(&writer->lock);
+        if (writer->ready_tail != NULL)
+                writer->ready_tail->next_ready = queue;
+        else
+                writer->ready_head = queue;
+        writer->ready_tail = queue;
+        pthread_cond_signal(&writer->ready);
+        pthread_mutex_unlock(&writer->lock);
+}
+
+bool server_writer_queue_write(struct server_writer_queue *queue, int fd,
+                               unsigned char *buffer, size_t size,
+                               off_t offset)
+{
+        log_assert(queue->filling);
+        const unsigned index = queue->tail % queue->depth;
+        log_assert(buffer == queue->buffers + index * queue->buffer_size);
+        log_assert(size <= queue->buffer_size);
+
+        // a failed write aborts the transfer as soon as possible
+        const int error = __atomic_load_n(&queue->error, __ATOMIC_RELAXED);
+        if (error != 0) {
+                errno = error;
+                return false;
+        }
+
+        queue->jobs[index] = (struct writer_job){
+                .fd = fd,
+                .size = size,
+                .offset = offset,
+        };
+        queue->filling = false;
+        __atomic_store_n(&queue->tail, queue->tail + 1, __ATOMIC_SEQ_CST);
+        schedule(queue);
+        return true;
+}
+
+bool server_writer_queue_reap(struct server_writer_queue *queue)
+{
+        consume_event(queue);
+        return __atomic_load_n(&queue->error, __ATOMIC_RELAXED) == 0;
+}
+
+bool server_writer_queue_drain(struct server_writer_queue *queue)
+{
+        if (!wait_pending(queue, 0))
+                return false;
+
+        const int error = __atomic_exchange_n(&queue->error, 0,
+                                              __ATOMIC_RELAXED);
+        if (error != 0) {
+                errno = error;
+                return false;
+        }
+        return true;
+}
+
+void server_writer_queue_close(struct server_writer_queue *queue)
+{
+        if (queue == NULL)
+                return;
+        if (!wait_pending(queue, 0))
+                log_warning("writer queue");
+
+        // the thread may still check the queue after the last block
+        struct server_writer *writer = queue->writer;
+        pthread_mutex_lock(&writer->lock);
+        while (queue->running
+               || __atomic_load_n(&queue->scheduled, __ATOMIC_SEQ_CST))
+                pthread_cond_wait(&writer->idle, &writer->lock);
+        pthread_mutex_unlock(&writer->lock);
+
+        if (close(queue->event_fd) == -1)
+                log_warning("close eventfd");
+        free(queue->buffers);
+        free(queue);
+}
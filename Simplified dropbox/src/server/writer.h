@@ -0,0 +1,92 @@
+/**
+ * @file writer.h
+ * @brief Pool of the threads writing the received blocks, so the event
+ *        loop only parses the packets of the clients.
+ */
+#ifndef WRITER_H
+#define WRITER_H
+
+#include "server.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Threads shared by all the sessions.
+ */
+struct server_writer;
+
+/**
+ * Blocks of one session. The blocks of a queue are written in order, one
+ * at a time, so the writes of one file never overtake each other.
+ */
+struct server_writer_queue;
+
+/**
+ * Starts the threads.
+ *
+ * @param threads  number of the threads, from 1 to SERVER_MAX_WRITERS
+ * @return         the pool on success;
+ *                 NULL on failure
+ */
+struct server_writer *server_writer_start(size_t threads);
+
+/**
+ * Stops the threads. All the queues have to be closed.
+ *
+ * @param writer  the pool; may be NULL
+ */
+void server_writer_stop(struct server_writer *writer);
+
+/**
+ * Creates the queue of a session with the buffers for the blocks.
+ *
+ * @param writer      the pool
+ * @param block_size  size of the largest block
+ * @return            the queue on success;
+ *                    NULL on failure
+ */
+struct server_writer_queue *server_writer_queue_open(
+        struct server_writer *writer, size_t block_size);
+
+/**
+ * Returns the eventfd signalled when a block is written.
+ */
+int server_writer_queue_event_fd(const struct server_writer_queue *queue);
+
+/**
+ * As server_storage_buffer().
+ */
+unsigned char *server_writer_queue_buffer(struct server_writer_queue *queue);
+
+/**
+ * As server_storage_write().
+ */
+bool server_writer_queue_write(struct server_writer_queue *queue, int fd,
+                               unsigned char *buffer, size_t size,
+                               off_t offset);
+
+/**
+ * As server_storage_reap().
+ */
+bool server_writer_queue_reap(struct server_writer_queue *queue);
+
+/**
+ * Returns the number of the blocks not written yet.
+ */
+size_t server_writer_queue_pending(const struct server_writer_queue *queue);
+
+/**
+ * As server_storage_drain().
+ */
+bool server_writer_queue_drain(struct server_writer_queue *queue);
+
+/**
+ * Waits for the blocks in the queue and frees it.
+ *
+ * @param queue  the queue; may be NULL
+ */
+void server_writer_queue_close(struct server_writer_queue *queue);
+
+#endif /* WRITER_H */
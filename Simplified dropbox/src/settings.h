@@ -10,29 +10,48 @@
 #include <signal.h>
 #include <stdbool.h>
 
+struct packet_stream;
+struct client_fanotify;
+
 /**
  * Struct holding information about behaviour of the program.
  */
 struct settings {
-        int lock_file_fd;            /**< file lock */
-        int read_fd;                 /**< read end of byte stream */
-        int write_fd;                /**< write end of byte stream */
-        const char *cwd;             /**< path to working directory */
-        int dirfd;                   /**< file descriptor of the cwd */
-        unsigned long fs_block_size; /**< size of a block on file system */
-        sigset_t mask;               /**< mask of blocked signals */
-        int sock_fd;                 /**< underlying socket for communication*/
+        int lock_file_fd;             /**< file lock */
+        int read_fd;                  /**< read end of byte stream */
+        int write_fd;                 /**< write end of byte stream */
+        struct packet_stream *stream; /**< packets over the byte stream */
+        const char *cwd;              /**< path to working directory */
+        int dirfd;                    /**< file descriptor of the cwd */
+        unsigned long fs_block_size;  /**< size of a block on file system */
+        unsigned long window_size;    /**< max number of blocks in flight */
+        unsigned long chunk_size;     /**< max size of a data chunk */
+        unsigned long writers;        /**< threads writing the blocks */
+        unsigned long read_ahead;     /**< blocks read ahead of the sent one */
+        unsigned long scanners;       /**< threads scanning the SOURCE */
+        unsigned long quiet_period;   /**< ms the changed file must rest */
+        unsigned long session_timeout; /**< ms a client may stall the server */
+        unsigned long features;       /**< protocol features of the peers */
+        sigset_t mask;                /**< mask of blocked signals */
+        int sock_fd;                  /**< underlying socket for communication*/
+        /** directories watched by fanotify(7), NULL if inotify(7) is used */
+        struct client_fanotify *fanotify;
+        /** connects the client to the server again, NULL if it cannot */
+        bool (*reconnect)(struct settings *settings);
         /* command line flags */
         bool verbose;
         bool sparse;
         bool foreground;
         bool one_shot;
         bool force;
+        bool delete;
         bool debug;
         bool quiet;
         bool client;
         bool server;
+        bool io_uring;
         const char *port;
+        const char *host;
 };
 
 #endif //SETTINGS_H
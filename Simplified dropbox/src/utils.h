@@ -7,6 +7,7 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stdbool.h>
 #include <unistd.h>
 
 #define UNUSED(VAR) ((void)(VAR))
@@ -59,4 +60,15 @@ ssize_t utils_read(int fd, size_t size, void *buff);
  */
 ssize_t utils_read_nonblocking(int fd, size_t size, void *buff);
 
+/**
+ * Checks whether the relative @c path is the directory @c dir or lies
+ * beneath it, e.g. "a/b/c" is within "a/b" but "a/bc" is not.
+ *
+ * @param path  path to check
+ * @param dir   path of the directory
+ * @return      true if @c path is @c dir or inside it;
+ *              false otherwise
+ */
+bool utils_path_is_within(const char *path, const char *dir);
+
 #endif //UTILS_H
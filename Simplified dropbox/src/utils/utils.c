@@ -4,6 +4,7 @@
 
 #include <errno.h>
 #include <stdbool.h>
+#include <string.h>
 #include <sys/types.h>
 
 #define BLOCK false
@@ -58,3 +59,10 @@ ssize_t utils_read_nonblocking(int fd, size_t size, void *buff)
 {
         return _utils_read(fd, size, buff, NOBLOCK);
 }
+
+bool utils_path_is_within(const char *path, const char *dir)
+{
+        const size_t len = strlen(dir);
+        return strncmp(path, dir, len) == 0
+               && (path[len] == '\0' || path[len] == '/');
+}
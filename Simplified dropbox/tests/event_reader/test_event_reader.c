@@ -0,0 +1,203 @@
+/**
+ * @file test_event_reader.c
+ * @brief Tests of the event reader.
+ */
+#define CUT_MAIN
+
+#include "cut.h"
+
+#include "event_reader.h"
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <unistd.h>
+
+struct test_data {
+        struct event_reader *reader;
+        int fds[2];      /**< pipe monitored by the reader */
+        int other_fd;    /**< read end of the other pipe   */
+        size_t calls;    /**< number of the callback calls */
+        size_t limit;    /**< calls until the loop ends    */
+        size_t signals;  /**< number of the caught signals */
+};
+
+static sigset_t block_signal(int signo)
+{
+        sigset_t mask;
+        ASSERT(sigemptyset(&mask) == 0);
+        ASSERT(sigaddset(&mask, signo) == 0);
+        ASSERT(sigprocmask(SIG_BLOCK, &mask, NULL) == 0);
+        return mask;
+}
+
+static enum utils_loop_status signal_break(const struct signalfd_siginfo *info,
+                                           void *data)
+{
+        struct test_data *test = data;
+        ASSERT(info->ssi_signo == SIGUSR1);
+        test->signals++;
+        return UTILS_LOOP_BREAK;
+}
+
+static struct event_reader *create_reader(struct test_data *test)
+{
+        const sigset_t mask = block_signal(SIGUSR1);
+        test->reader = event_reader_create(&mask, signal_break, test);
+        ASSERT(test->reader != NULL);
+        return test->reader;
+}
+
+static enum utils_loop_status read_byte(int fd, uint32_t events, void *data)
+{
+        struct test_data *test = data;
+        ASSERT(events & EPOLLIN);
+
+        char byte;
+        ASSERT(read(fd, &byte, 1) == 1);
+        test->calls++;
+        return test->calls == test->limit ? UTILS_LOOP_BREAK
+                                          : UTILS_LOOP_CONTINUE;
+}
+
+TEST(fd_callback)
+{
+        struct test_data test = { .limit = 3 };
+        struct event_reader *reader = create_reader(&test);
+        ASSERT(pipe(test.fds) == 0);
+
+        ASSERT(event_reader_add(reader, test.fds[0], EPOLLIN, read_byte,
+                                &test));
+        ASSERT(write(test.fds[1], "abc", 3) == 3);
+        // level-triggered, so the callback is called while data remain
+        ASSERT(event_reader_run(reader));
+        CHECK(test.calls == 3);
+
+        ASSERT(event_reader_remove(reader, test.fds[0]));
+        CHECK(!event_reader_remove(reader, test.fds[0]));
+
+        event_reader_destroy(reader);
+        ASSERT(close(test.fds[0]) == 0);
+        ASSERT(close(test.fds[1]) == 0);
+}
+
+static enum utils_loop_status remove_other(int fd, uint32_t events,
+                                           void *data)
+{
+        UNUSED(events);
+        struct test_data *test = data;
+        ASSERT(event_reader_remove(test->reader, test->other_fd));
+        ASSERT(event_reader_remove(test->reader, fd));
+        test->calls++;
+        return UTILS_LOOP_CONTINUE;
+}
+
+static enum utils_loop_status raise_signal(int timer, uint32_t events,
+                                           void *data)
+{
+        UNUSED(timer);
+        UNUSED(events);
+        UNUSED(data);
+        ASSERT(raise(SIGUSR1) == 0);
+        return UTILS_LOOP_CONTINUE;
+}
+
+TEST(remove_in_callback)
+{
+        struct test_data test = { 0 };
+        struct event_reader *reader = create_reader(&test);
+        int first[2];
+        int second[2];
+        ASSERT(pipe(first) == 0);
+        ASSERT(pipe(second) == 0);
+
+        // whichever is dispatched first removes both, so the pending event
+        // of the other one is dropped
+        test.other_fd = second[0];
+        ASSERT(event_reader_add(reader, first[0], EPOLLIN, remove_other,
+                                &test));
+        struct test_data other = { .reader = reader, .other_fd = first[0] };
+        ASSERT(event_reader_add(reader, second[0], EPOLLIN, remove_other,
+                                &other));
+        ASSERT(write(first[1], "a", 1) == 1);
+        ASSERT(write(second[1], "b", 1) == 1);
+
+        ASSERT(event_reader_add_timer(reader, 50, 0, raise_signal, NULL)
+               != -1);
+        ASSERT(event_reader_run(reader));
+        CHECK(test.calls + other.calls == 1);
+
+        event_reader_destroy(reader);
+        for (size_t i = 0; i < 2; i++) {
+                ASSERT(close(first[i]) == 0);
+                ASSERT(close(second[i]) == 0);
+        }
+}
+
+static enum utils_loop_status count_expiration(int timer, uint32_t events,
+                                               void *data)
+{
+        UNUSED(timer);
+        struct test_data *test = data;
+        ASSERT(events == EPOLLIN);
+        test->calls++;
+        return test->calls == test->limit ? UTILS_LOOP_BREAK
+                                          : UTILS_LOOP_CONTINUE;
+}
+
+TEST(periodic_timer)
+{
+        struct test_data test = { .limit = 3 };
+        struct event_reader *reader = create_reader(&test);
+
+        const int timer = event_reader_add_timer(reader, 10, 10,
+                                                 count_expiration, &test);
+        ASSERT(timer != -1);
+        ASSERT(event_reader_run(reader));
+        CHECK(test.calls == 3);
+
+        // disarmed, so only the signal ends the loop
+        ASSERT(event_reader_arm_timer(reader, timer, 0, 0));
+        ASSERT(event_reader_add_timer(reader, 50, 0, raise_signal, NULL)
+               != -1);
+        ASSERT(event_reader_run(reader));
+        CHECK(test.calls == 3);
+        CHECK(test.signals == 1);
+
+        ASSERT(event_reader_remove_timer(reader, timer));
+        CHECK(!event_reader_arm_timer(reader, timer, 10, 0));
+        event_reader_destroy(reader);
+}
+
+TEST(one_shot_timer)
+{
+        struct test_data test = { .limit = 0 };
+        struct event_reader *reader = create_reader(&test);
+
+        ASSERT(event_reader_add_timer(reader, 10, 0, count_expiration, &test)
+               != -1);
+        ASSERT(event_reader_add_timer(reader, 100, 0, raise_signal, NULL)
+               != -1);
+        ASSERT(event_reader_run(reader));
+        CHECK(test.calls == 1);
+        CHECK(test.signals == 1);
+        event_reader_destroy(reader);
+}
+
+static enum utils_loop_status fail(int fd, uint32_t events, void *data)
+{
+        UNUSED(fd);
+        UNUSED(events);
+        UNUSED(data);
+        return UTILS_LOOP_ERROR;
+}
+
+TEST(callback_error)
+{
+        struct test_data test = { 0 };
+        struct event_reader *reader = create_reader(&test);
+
+        ASSERT(event_reader_add_timer(reader, 10, 0, fail, NULL) != -1);
+        CHECK(!event_reader_run(reader));
+        event_reader_destroy(reader);
+}
@@ -50,6 +50,10 @@ static void test_push_back_int(generic_list *list, int count)
         generic_list_foreach(list, iter_equal, &ed);
         ASSERT(ed.curr == count);
 
+        for (int i = 0; i < count; i++)
+                ASSERT(*(int *)generic_list_at(list, i) == i);
+        ASSERT(generic_list_at(list, count) == NULL);
+
         ed.curr = count - 1;
         generic_list_foreach_reverse(list, iter_equal_reverse, &ed);
         ASSERT(ed.curr == -1);
@@ -0,0 +1,283 @@
+/**
+ * @file test_hash.c
+ * @brief Tests of the checksums.
+ */
+#define CUT_MAIN
+
+#include "cut.h"
+
+#include "hash.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+GLOBAL_TEAR_UP()
+{
+        srand(time(NULL));
+}
+
+static unsigned char *create_trashed_buffer(size_t size)
+{
+        unsigned char *buff = malloc(size);
+        ASSERT(buff != NULL);
+        for (size_t i = 0; i < size; i++)
+                buff[i] = rand();
+        return buff;
+}
+
+TEST(xxh64)
+{
+        SUBTEST(known_values)
+        {
+                const char *spam = "Nobody inspects the spammish repetition";
+                CHECK(hash_xxh64(0, "", 0) == 0xEF46DB3751D8E999ULL);
+                CHECK(hash_xxh64(1, "a", 0) == 0xD24EC4F1A98C6E5BULL);
+                CHECK(hash_xxh64(3, "abc", 0) == 0x44BC2CF5AD770999ULL);
+                CHECK(hash_xxh64(strlen(spam), spam, 0)
+                      == 0xFBCEA83C8A378BF1ULL);
+        }
+
+        SUBTEST(unaligned_input)
+        {
+                const size_t size = 1000;
+                unsigned char *buff = create_trashed_buffer(size + 1);
+                unsigned char *copy = malloc(size);
+                ASSERT(copy != NULL);
+                memcpy(copy, &buff[1], size);
+
+                CHECK(hash_xxh64(size, &buff[1], 42)
+                      == hash_xxh64(size, copy, 42));
+                CHECK(hash_xxh64(size, copy, 42) != hash_xxh64(size, copy, 0));
+                free(copy);
+                free(buff);
+        }
+}
+
+TEST(rolling)
+{
+        SUBTEST(roll_equals_init)
+        {
+                const size_t size = 10000;
+                const size_t window = 700;
+                unsigned char *buff = create_trashed_buffer(size);
+
+                struct hash_rolling rolling;
+                hash_rolling_init(&rolling, window, buff);
+                for (size_t i = 0; i + window < size; i++) {
+                        hash_rolling_roll(&rolling, buff[i], buff[i + window]);
+
+                        struct hash_rolling expected;
+                        hash_rolling_init(&expected, window, &buff[i + 1]);
+                        ASSERT(hash_rolling_digest(&rolling)
+                               == hash_rolling_digest(&expected));
+                }
+                free(buff);
+        }
+
+        SUBTEST(order_matters)
+        {
+                const unsigned char ab[] = { 1, 2 };
+                const unsigned char ba[] = { 2, 1 };
+                struct hash_rolling first;
+                struct hash_rolling second;
+                hash_rolling_init(&first, sizeof(ab), ab);
+                hash_rolling_init(&second, sizeof(ba), ba);
+                CHECK(hash_rolling_digest(&first)
+                      != hash_rolling_digest(&second));
+        }
+}
+
+/**
+ * Checks the digest of the @c size bytes against the hexadecimal string.
+ */
+static bool sha256_equals(size_t size, const void *buff, const char *hex)
+{
+        unsigned char digest[HASH_SHA256_SIZE];
+        hash_sha256(size, buff, digest);
+
+        char digest_hex[2 * HASH_SHA256_SIZE + 1];
+        for (size_t i = 0; i < HASH_SHA256_SIZE; i++)
+                sprintf(&digest_hex[2 * i], "%02x", digest[i]);
+        return strcmp(digest_hex, hex) == 0;
+}
+
+TEST(sha256)
+{
+        SUBTEST(known_values)
+        {
+                const char *abc = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmn"
+                                  "lmnomnopnopq";
+                CHECK(sha256_equals(0, "",
+                                    "e3b0c44298fc1c149afbf4c8996fb924"
+                                    "27ae41e4649b934ca495991b7852b855"));
+                CHECK(sha256_equals(3, "abc",
+                                    "ba7816bf8f01cfea414140de5dae2223"
+                                    "b00361a396177a9cb410ff61f20015ad"));
+                CHECK(sha256_equals(strlen(abc), abc,
+                                    "248d6a61d20638b8e5c026930c3e6039"
+                                    "a33ce45964ff2167f6ecedd419db06c1"));
+        }
+
+        SUBTEST(padding_boundaries)
+        {
+                unsigned char buff[64];
+                memset(buff, 'x', sizeof(buff));
+                CHECK(sha256_equals(55, buff,
+                                    "d5e285683cd4efc02d021a5c62014694"
+                                    "958901005d6f71e89e0989fac77e4072"));
+                CHECK(sha256_equals(56, buff,
+                                    "04c26261370ee7541549d16dee320c72"
+                                    "3e3fd14671e66a099afe0a377c16888e"));
+                CHECK(sha256_equals(64, buff,
+                                    "7ce100971f64e7001e8fe5a51973ecdf"
+                                    "e1ced42befe7ee8d5fd6219506b5393c"));
+        }
+
+        SUBTEST(million_bytes)
+        {
+                const size_t size = 1000000;
+                unsigned char *buff = malloc(size);
+                ASSERT(buff != NULL);
+                memset(buff, 'a', size);
+                CHECK(sha256_equals(size, buff,
+                                    "cdc76e5c9914fb9281a1c7e284d73e67"
+                                    "f1809a48a497200e046d39ccc7112cd0"));
+                free(buff);
+        }
+}
+
+/**
+ * Splits @c size bytes into chunks.
+ *
+ * @param[out] ends  the end offsets of the chunks
+ * @return           the number of the chunks
+ */
+static size_t cdc_split(size_t size, const unsigned char *buff, size_t *ends)
+{
+        size_t count = 0;
+        for (size_t offset = 0; offset < size; count++) {
+                offset += hash_cdc_chunk_size(size - offset, &buff[offset]);
+                ends[count] = offset;
+        }
+        return count;
+}
+
+TEST(cdc)
+{
+        const size_t size = 8 * 1024 * 1024;
+        const size_t max_chunks = size / HASH_CDC_MIN_SIZE + 1;
+
+        SUBTEST(chunk_bounds)
+        {
+                unsigned char *buff = create_trashed_buffer(size);
+                size_t *ends = malloc(max_chunks * sizeof(*ends));
+                ASSERT(ends != NULL);
+
+                const size_t count = cdc_split(size, buff, ends);
+                ASSERT(count > 1);
+                CHECK(ends[count - 1] == size);
+                for (size_t i = 0; i + 1 < count; i++) {
+                        const size_t chunk = ends[i] - (i > 0 ? ends[i - 1] : 0);
+                        CHECK(chunk >= HASH_CDC_MIN_SIZE);
+                        CHECK(chunk <= HASH_CDC_MAX_SIZE);
+                }
+                // the sizes concentrate around the expected size
+                CHECK(size / count > HASH_CDC_AVG_SIZE / 2);
+                CHECK(size / count < HASH_CDC_AVG_SIZE * 2);
+                free(ends);
+                free(buff);
+        }
+
+        SUBTEST(small_input)
+        {
+                unsigned char buff[100] = { 0 };
+                CHECK(hash_cdc_chunk_size(sizeof(buff), buff) == sizeof(buff));
+                CHECK(hash_cdc_chunk_size(0, buff) == 0);
+        }
+
+        SUBTEST(boundaries_follow_insertion)
+        {
+                const size_t inserted = 1000;
+                // how soon the boundaries synchronize depends on the data
+                srand(1);
+                unsigned char *buff = create_trashed_buffer(size + inserted);
+                size_t *ends = malloc(max_chunks * sizeof(*ends));
+                size_t *shifted_ends = malloc(max_chunks * sizeof(*ends));
+                ASSERT(ends != NULL && shifted_ends != NULL);
+
+                // the same data with new bytes at the beginning
+                const size_t count = cdc_split(size, &buff[inserted], ends);
+                const size_t shifted_count
+                        = cdc_split(size + inserted, buff, shifted_ends);
+
+                size_t same = 0;
+                for (size_t i = 0, j = 0; i < count && j < shifted_count;) {
+                        const size_t shifted = shifted_ends[j] - inserted;
+                        if (shifted_ends[j] < inserted || shifted < ends[i]) {
+                                j++;
+                        } else if (shifted > ends[i]) {
+                                i++;
+                        } else {
+                                same++;
+                                i++;
+                                j++;
+                        }
+                }
+                CHECK(same + 2 >= count);
+                free(shifted_ends);
+                free(ends);
+                free(buff);
+        }
+}
+
+TEST(file_prefix)
+{
+        const size_t segment = HASH_PREFIX_SEGMENT_SIZE;
+        const size_t size = 2 * segment + 1000;
+        unsigned char *buff = create_trashed_buffer(size);
+        FILE *file = tmpfile();
+        ASSERT(file != NULL);
+        ASSERT(fwrite(buff, 1, size, file) == size);
+        ASSERT(fflush(file) == 0);
+        const int fd = fileno(file);
+
+        SUBTEST(chained_segments)
+        {
+                uint64_t expected = hash_xxh64(segment, buff, 0);
+                expected = hash_xxh64(segment, &buff[segment], expected);
+                expected = hash_xxh64(size - 2 * segment, &buff[2 * segment],
+                                      expected);
+
+                uint64_t hash = 0;
+                ASSERT(hash_file_prefix(fd, 0, size, &hash));
+                CHECK(hash == expected);
+        }
+
+        SUBTEST(extended_prefix)
+        {
+                uint64_t whole = 0;
+                ASSERT(hash_file_prefix(fd, 0, size, &whole));
+
+                uint64_t hash = 0;
+                ASSERT(hash_file_prefix(fd, 0, segment, &hash));
+                CHECK(hash == hash_xxh64(segment, buff, 0));
+                ASSERT(hash_file_prefix(fd, segment, segment, &hash));
+                CHECK(hash == hash_xxh64(segment, buff, 0));
+                ASSERT(hash_file_prefix(fd, segment, size, &hash));
+                CHECK(hash == whole);
+        }
+
+        SUBTEST(short_file)
+        {
+                uint64_t hash = 42;
+                CHECK(!hash_file_prefix(fd, segment, size + 1, &hash));
+                CHECK(errno == EIO);
+                CHECK(hash == 42);
+        }
+
+        ASSERT(fclose(file) == 0);
+        free(buff);
+}
@@ -0,0 +1,238 @@
+/**
+ * @file test_journal.c
+ * @brief Tests of the journal of the changed files and of the delays
+ *        between the attempts to reconnect.
+ */
+#define CUT_MAIN
+
+#include "cut.h"
+
+#include "connection.h"
+#include "journal.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <sys/inotify.h>
+
+static void record_event(struct client_journal *journal, const char *name,
+                         uint32_t mask)
+{
+        const unsigned changes = client_journal_event_changes(mask);
+        ASSERT(changes != 0);
+        ASSERT(client_journal_record(journal, name, changes));
+}
+
+static enum client_journal_action
+find_action(struct client_journal *journal, const char *name, bool exists)
+{
+        const struct client_journal_entry *entry
+                = client_journal_find(journal, name);
+        ASSERT(entry != NULL);
+        return client_journal_action(entry, exists);
+}
+
+TEST(journal_merge)
+{
+        struct client_journal journal;
+        ASSERT(client_journal_create(&journal));
+
+        SUBTEST(empty)
+        {
+                CHECK(client_journal_find(&journal, "a") == NULL);
+                CHECK(client_journal_event_changes(IN_OPEN) == 0);
+        }
+
+        SUBTEST(create_then_modify)
+        {
+                record_event(&journal, "a", IN_CREATE);
+                record_event(&journal, "a", IN_CLOSE_WRITE);
+                record_event(&journal, "a", IN_ATTRIB);
+                CHECK(journal.count == 1);
+                CHECK(find_action(&journal, "a", true)
+                      == CLIENT_JOURNAL_CREATE);
+        }
+
+        SUBTEST(create_then_delete)
+        {
+                record_event(&journal, "a", IN_CREATE);
+                record_event(&journal, "a", IN_DELETE);
+                CHECK(find_action(&journal, "a", false)
+                      == CLIENT_JOURNAL_NONE);
+        }
+
+        SUBTEST(modify_then_delete)
+        {
+                record_event(&journal, "a", IN_CLOSE_WRITE);
+                record_event(&journal, "a", IN_DELETE);
+                CHECK(find_action(&journal, "a", false)
+                      == CLIENT_JOURNAL_DELETE);
+        }
+
+        SUBTEST(delete_then_create)
+        {
+                record_event(&journal, "a", IN_DELETE);
+                record_event(&journal, "a", IN_CREATE);
+                const struct client_journal_entry *entry
+                        = client_journal_find(&journal, "a");
+                ASSERT(entry != NULL);
+                CHECK(!(entry->changes & CLIENT_JOURNAL_CREATED));
+                CHECK(find_action(&journal, "a", true)
+                      == CLIENT_JOURNAL_UPDATE);
+        }
+
+        SUBTEST(attributes)
+        {
+                record_event(&journal, "a", IN_ATTRIB);
+                CHECK(find_action(&journal, "a", true)
+                      == CLIENT_JOURNAL_ATTRIBUTES);
+                record_event(&journal, "a", IN_CLOSE_WRITE);
+                CHECK(find_action(&journal, "a", true)
+                      == CLIENT_JOURNAL_UPDATE);
+        }
+
+        SUBTEST(many_files)
+        {
+                char name[32];
+                for (int i = 0; i < 1000; i++) {
+                        sprintf(name, "dir/%d", i);
+                        record_event(&journal, name, IN_CLOSE_WRITE);
+                }
+                CHECK(journal.count == 1000);
+                for (int i = 0; i < 1000; i++) {
+                        sprintf(name, "dir/%d", i);
+                        CHECK(client_journal_find(&journal, name) != NULL);
+                }
+                CHECK(!journal.overflowed);
+        }
+
+        SUBTEST(overflow)
+        {
+                char name[32];
+                for (int i = 0; i <= CLIENT_JOURNAL_MAX_ENTRIES; i++) {
+                        sprintf(name, "%d", i);
+                        record_event(&journal, name, IN_CLOSE_WRITE);
+                }
+                CHECK(journal.overflowed);
+                CHECK(journal.count == CLIENT_JOURNAL_MAX_ENTRIES);
+                ASSERT(client_journal_clear(&journal));
+                CHECK(!journal.overflowed);
+                CHECK(client_journal_find(&journal, "0") == NULL);
+        }
+
+        client_journal_destroy(&journal);
+}
+
+TEST(journal_rename)
+{
+        struct client_journal journal;
+        ASSERT(client_journal_create(&journal));
+
+        SUBTEST(file)
+        {
+                record_event(&journal, "a", IN_CREATE);
+                ASSERT(client_journal_rename(&journal, "a", "b"));
+                CHECK(client_journal_find(&journal, "a") == NULL);
+                CHECK(find_action(&journal, "b", true)
+                      == CLIENT_JOURNAL_CREATE);
+        }
+
+        SUBTEST(chain)
+        {
+                record_event(&journal, "a", IN_CLOSE_WRITE);
+                ASSERT(client_journal_rename(&journal, "a", "b"));
+                record_event(&journal, "b", IN_ATTRIB);
+                ASSERT(client_journal_rename(&journal, "b", "c"));
+                ASSERT(client_journal_rename(&journal, "c", "a"));
+                CHECK(journal.count == 1);
+                CHECK(client_journal_find(&journal, "b") == NULL);
+                CHECK(client_journal_find(&journal, "c") == NULL);
+                const struct client_journal_entry *entry
+                        = client_journal_find(&journal, "a");
+                ASSERT(entry != NULL);
+                CHECK(entry->changes
+                      == (CLIENT_JOURNAL_CONTENT | CLIENT_JOURNAL_METADATA));
+        }
+
+        SUBTEST(onto_changed_file)
+        {
+                record_event(&journal, "b", IN_ATTRIB);
+                record_event(&journal, "a", IN_CLOSE_WRITE);
+                ASSERT(client_journal_rename(&journal, "a", "b"));
+                CHECK(journal.count == 1);
+                CHECK(client_journal_find(&journal, "a") == NULL);
+                const struct client_journal_entry *entry
+                        = client_journal_find(&journal, "b");
+                ASSERT(entry != NULL);
+                CHECK(entry->changes
+                      == (CLIENT_JOURNAL_CONTENT | CLIENT_JOURNAL_METADATA));
+        }
+
+        SUBTEST(directory)
+        {
+                record_event(&journal, "d", IN_CREATE);
+                record_event(&journal, "d/x", IN_CLOSE_WRITE);
+                record_event(&journal, "d/e/y", IN_CREATE);
+                record_event(&journal, "dx", IN_CLOSE_WRITE);
+                ASSERT(client_journal_rename(&journal, "d", "n/d"));
+                CHECK(client_journal_find(&journal, "n/d") != NULL);
+                CHECK(client_journal_find(&journal, "n/d/x") != NULL);
+                CHECK(find_action(&journal, "n/d/e/y", true)
+                      == CLIENT_JOURNAL_CREATE);
+                CHECK(client_journal_find(&journal, "dx") != NULL);
+                CHECK(client_journal_find(&journal, "d/x") == NULL);
+                CHECK(journal.count == 4);
+        }
+
+        SUBTEST(missing)
+        {
+                record_event(&journal, "a", IN_CLOSE_WRITE);
+                ASSERT(client_journal_rename(&journal, "b", "c"));
+                CHECK(client_journal_find(&journal, "a") != NULL);
+                CHECK(client_journal_find(&journal, "c") == NULL);
+        }
+
+        SUBTEST(overflowed)
+        {
+                record_event(&journal, "a", IN_CLOSE_WRITE);
+                client_journal_overflow(&journal);
+                ASSERT(client_journal_rename(&journal, "a", "b"));
+                CHECK(journal.overflowed);
+        }
+
+        client_journal_destroy(&journal);
+}
+
+TEST(reconnect_delay)
+{
+        SUBTEST(doubled)
+        {
+                CHECK(client_connection_next_delay(CLIENT_RECONNECT_MIN_DELAY)
+                      == 2 * CLIENT_RECONNECT_MIN_DELAY);
+        }
+
+        SUBTEST(bounds)
+        {
+                CHECK(client_connection_next_delay(0)
+                      == CLIENT_RECONNECT_MIN_DELAY);
+                CHECK(client_connection_next_delay(CLIENT_RECONNECT_MAX_DELAY)
+                      == CLIENT_RECONNECT_MAX_DELAY);
+                CHECK(client_connection_next_delay(ULONG_MAX)
+                      == CLIENT_RECONNECT_MAX_DELAY);
+        }
+
+        SUBTEST(grows_to_maximum)
+        {
+                unsigned long delay = CLIENT_RECONNECT_MIN_DELAY;
+                int attempts = 0;
+                while (delay < CLIENT_RECONNECT_MAX_DELAY) {
+                        const unsigned long next
+                                = client_connection_next_delay(delay);
+                        CHECK(next > delay);
+                        CHECK(next <= CLIENT_RECONNECT_MAX_DELAY);
+                        delay = next;
+                        ASSERT(++attempts < 64);
+                }
+                CHECK(client_connection_next_delay(delay)
+                      == CLIENT_RECONNECT_MAX_DELAY);
+        }
+}
@@ -6,7 +6,11 @@
 #include "utils.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/socket.h>
 #include <time.h>
 
 GLOBAL_TEAR_UP()
@@ -23,6 +27,7 @@ static struct packet_map {
         { .code = MSG_DONE, .payload_size = 0 },
         { .code = MSG_END_CONNECTION, .payload_size = 0 },
         { .code = MSG_REJECTED, .payload_size = 0 },
+        { .code = MSG_GET_MANIFEST, .payload_size = 0 },
         { .code = MSG_ABORT,
           .payload_size = sizeof(struct packet_payload_abort) },
         { .code = MSG_SETTINGS,
@@ -31,6 +36,17 @@ static struct packet_map {
           .payload_size = sizeof(struct packet_payload_set_perm_modes) },
         { .code = MSG_SET_OWNER,
           .payload_size = sizeof(struct packet_payload_set_owner) },
+        { .code = MSG_ACK, .payload_size = sizeof(struct packet_payload_ack) },
+        { .code = MSG_COPY_BLOCKS,
+          .payload_size = sizeof(struct packet_payload_copy_blocks) },
+        { .code = MSG_RESUME_OFFSET,
+          .payload_size = sizeof(struct packet_payload_resume) },
+        { .code = MSG_RESUME_FILE,
+          .payload_size = sizeof(struct packet_payload_resume) },
+        { .code = MSG_WRITE_HOLE,
+          .payload_size = sizeof(struct packet_payload_hole) },
+        { .code = MSG_FILE_SIZE,
+          .payload_size = sizeof(struct packet_payload_file_size) },
         { .code = -1 },
 };
 
@@ -39,6 +55,17 @@ static struct packet_map FMA_PACKETS[] = {
         { .code = MSG_DELETE_FILE },
         { .code = MSG_CHANGE_FILE },
         { .code = MSG_WRITE_BLOCK },
+        { .code = MSG_DELTA_FILE },
+        { .code = MSG_SIGNATURES },
+        { .code = MSG_OFFER_CHUNKS },
+        { .code = MSG_MISSING_CHUNKS },
+        { .code = MSG_MANIFEST },
+        { .code = MSG_GET_RESUME },
+        { .code = MSG_CREATE_DIR },
+        { .code = MSG_DELETE_DIR },
+        { .code = MSG_FILE_BUNDLE },
+        { .code = MSG_BUNDLE_STATUS },
+        { .code = MSG_RENAME },
         { .code = -1 },
 };
 
@@ -121,6 +148,72 @@ TEST(packet_communication)
                 }
         }
 
+        SUBTEST(file_packets)
+        {
+                const size_t file_size = 3000;
+                const off_t offset = 1500;
+                const size_t payload_size = 1000;
+                unsigned char *buff = create_trashed_buffer(file_size);
+                FILE *file = tmpfile();
+                ASSERT(file != NULL);
+                ASSERT(utils_write(fileno(file), file_size, buff)
+                       == (ssize_t)file_size);
+
+                ASSERT(pipe(fds) == 0);
+                ASSERT(packet_send_file(fds[1], MSG_WRITE_BLOCK, payload_size,
+                                        fileno(file), offset));
+                ASSERT(packet_read(fds[0], &packet, &n));
+                ASSERT(packet->code == MSG_WRITE_BLOCK);
+                ASSERT(packet->payload_size == payload_size);
+                ASSERT(memcmp(packet->payload, &buff[offset], payload_size)
+                       == 0);
+
+                // the file is shorter than the payload
+                ASSERT(!packet_send_file(fds[1], MSG_WRITE_BLOCK, file_size,
+                                         fileno(file), offset));
+                CHECK(errno == EIO);
+
+                ASSERT(fclose(file) == 0);
+                free(buff);
+        }
+
+        SUBTEST(payload_to_file)
+        {
+                const size_t payload_size = 5000;
+                unsigned char *buff = create_trashed_buffer(payload_size);
+                unsigned char *file_buff = malloc(payload_size);
+                ASSERT(file_buff != NULL);
+                int pipe_fds[2];
+                ASSERT(pipe(pipe_fds) == 0);
+                ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+                // spliced through the pipe and copied without it
+                const int *pipes[] = { pipe_fds, NULL };
+                for (size_t i = 0; i < 2; i++) {
+                        FILE *file = tmpfile();
+                        ASSERT(file != NULL);
+                        ASSERT(packet_send(fds[1], MSG_WRITE_BLOCK,
+                                           payload_size, buff));
+                        ASSERT(packet_send(fds[1], MSG_DONE, 0, NULL));
+
+                        ASSERT(packet_read_header(fds[0], &packet, &n));
+                        ASSERT(packet->code == MSG_WRITE_BLOCK);
+                        ASSERT(packet->payload_size == payload_size);
+                        ASSERT(packet_read_payload_to_file(
+                                fds[0], packet, fileno(file), pipes[i]));
+                        ASSERT(pread(fileno(file), file_buff, payload_size, 0)
+                               == (ssize_t)payload_size);
+                        ASSERT(memcmp(buff, file_buff, payload_size) == 0);
+
+                        ASSERT(packet_read(fds[0], &packet, &n));
+                        ASSERT(packet->code == MSG_DONE);
+                        ASSERT(fclose(file) == 0);
+                }
+
+                free(file_buff);
+                free(buff);
+        }
+
         SUBTEST(bad_fd)
         {
                 ASSERT(!packet_send(-1, MSG_OK, 0, NULL));
@@ -131,3 +224,260 @@ TEST(packet_communication)
 
         free(packet);
 }
+
+static bool has_input(int fd)
+{
+        struct pollfd pollfd = { .fd = fd, .events = POLLIN };
+        return poll(&pollfd, 1, 0) > 0;
+}
+
+static void test_stream_packet(struct packet_stream *writer,
+                               struct packet_stream *reader,
+                               struct packet **packet_buff, size_t *n,
+                               struct packet_map test_packet)
+{
+        unsigned char *buff = NULL;
+        if (test_packet.payload_size != 0)
+                buff = create_trashed_buffer(test_packet.payload_size);
+        ASSERT(packet_stream_send(writer, test_packet.code,
+                                  test_packet.payload_size, buff));
+        ASSERT(packet_stream_flush(writer));
+        ASSERT(packet_stream_read(reader, packet_buff, n));
+        ASSERT((*packet_buff)->code == test_packet.code);
+        ASSERT((*packet_buff)->payload_size == test_packet.payload_size);
+        ASSERT(memcmp((*packet_buff)->payload, buff, test_packet.payload_size)
+               == 0);
+        free(buff);
+}
+
+/**
+ * Encodes the packet as packet_send() puts it on the wire.
+ *
+ * @return the bytes of the packet allocated by malloc(3)
+ */
+static unsigned char *encode_packet(enum packet_msg_code code,
+                                    size_t payload_size,
+                                    const unsigned char *payload,
+                                    size_t *size)
+{
+        FILE *file = tmpfile();
+        ASSERT(file != NULL);
+        ASSERT(packet_send(fileno(file), code, payload_size, payload));
+        const off_t end = lseek(fileno(file), 0, SEEK_END);
+        ASSERT(end > 0);
+        unsigned char *bytes = malloc(end);
+        ASSERT(bytes != NULL);
+        ASSERT(pread(fileno(file), bytes, end, 0) == end);
+        ASSERT(fclose(file) == 0);
+        *size = end;
+        return bytes;
+}
+
+static void set_nonblocking(int fd)
+{
+        const int flags = fcntl(fd, F_GETFL);
+        ASSERT(flags != -1);
+        ASSERT(fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0);
+}
+
+TEST(packet_stream)
+{
+        int fds[2];
+        struct packet *packet = NULL;
+        size_t n = 0;
+        struct packet_stream *writer = NULL;
+        struct packet_stream *reader = NULL;
+
+        SUBTEST(batched_packets)
+        {
+                const size_t count = 100;
+                ASSERT(pipe(fds) == 0);
+                ASSERT((writer = packet_stream_create(-1, fds[1])) != NULL);
+                ASSERT((reader = packet_stream_create(fds[0], -1)) != NULL);
+
+                for (size_t i = 0; i < count; i++) {
+                        const struct packet_payload_ack ack = { i };
+                        ASSERT(packet_stream_send(writer, MSG_ACK, sizeof(ack),
+                                                  (unsigned char *)&ack));
+                }
+                // nothing is written until the stream is flushed
+                CHECK(!has_input(fds[0]));
+                ASSERT(packet_stream_flush(writer));
+                ASSERT(has_input(fds[0]));
+
+                for (size_t i = 0; i < count; i++) {
+                        ASSERT(packet_stream_read(reader, &packet, &n));
+                        ASSERT(packet->code == MSG_ACK);
+                        const struct packet_payload_ack *ack
+                                = (struct packet_payload_ack *)packet->payload;
+                        ASSERT(ack->block_count == i);
+                }
+                // all the packets were read ahead by the first read
+                CHECK(!has_input(fds[0]));
+                CHECK(!packet_stream_has_buffered(reader));
+        }
+
+        SUBTEST(fixed_and_fma_packets)
+        {
+                ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+                ASSERT((writer = packet_stream_create(-1, fds[1])) != NULL);
+                ASSERT((reader = packet_stream_create(fds[0], -1)) != NULL);
+
+                for (size_t i = 0;
+                     FIXED_PACKETS[i].code != (enum packet_msg_code) - 1; i++) {
+                        test_stream_packet(writer, reader, &packet, &n,
+                                           FIXED_PACKETS[i]);
+                }
+                // larger than the buffers of the streams
+                for (size_t i = 0;
+                     FMA_PACKETS[i].code != (enum packet_msg_code) - 1; i++) {
+                        struct packet_map test_packet = FMA_PACKETS[i];
+                        test_packet.payload_size = 100 * 1024 + rand() % 4096;
+                        test_stream_packet(writer, reader, &packet, &n,
+                                           test_packet);
+                }
+        }
+
+        SUBTEST(compatible_with_packet_send)
+        {
+                ASSERT(pipe(fds) == 0);
+                ASSERT((writer = packet_stream_create(-1, fds[1])) != NULL);
+                ASSERT((reader = packet_stream_create(fds[0], -1)) != NULL);
+
+                const struct packet_payload_set_owner owner = { 1, 2 };
+                ASSERT(packet_send(fds[1], MSG_SET_OWNER, sizeof(owner),
+                                   (unsigned char *)&owner));
+                ASSERT(packet_stream_read(reader, &packet, &n));
+                ASSERT(packet->code == MSG_SET_OWNER);
+                ASSERT(memcmp(packet->payload, &owner, sizeof(owner)) == 0);
+
+                ASSERT(packet_stream_send(writer, MSG_SET_OWNER, sizeof(owner),
+                                          (unsigned char *)&owner));
+                ASSERT(packet_stream_flush(writer));
+                ASSERT(packet_read(fds[0], &packet, &n));
+                ASSERT(packet->code == MSG_SET_OWNER);
+                ASSERT(memcmp(packet->payload, &owner, sizeof(owner)) == 0);
+        }
+
+        SUBTEST(payload_to_file)
+        {
+                const size_t payload_size = 5000;
+                unsigned char *buff = create_trashed_buffer(payload_size);
+                unsigned char *file_buff = malloc(payload_size);
+                ASSERT(file_buff != NULL);
+                FILE *file = tmpfile();
+                ASSERT(file != NULL);
+                ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+                ASSERT((reader = packet_stream_create(fds[0], -1)) != NULL);
+
+                // the header and a part of the payload are read ahead
+                ASSERT(packet_send(fds[1], MSG_WRITE_BLOCK, payload_size,
+                                   buff));
+                ASSERT(packet_stream_read_header(reader, &packet, &n));
+                ASSERT(packet->payload_size == payload_size);
+                ASSERT(packet_stream_read_payload_to_file(reader, packet,
+                                                          fileno(file), NULL));
+                ASSERT(pread(fileno(file), file_buff, payload_size, 0)
+                       == (ssize_t)payload_size);
+                ASSERT(memcmp(buff, file_buff, payload_size) == 0);
+                CHECK(!packet_stream_has_buffered(reader));
+
+                ASSERT(fclose(file) == 0);
+                free(file_buff);
+                free(buff);
+        }
+
+        SUBTEST(payload_to_buffer)
+        {
+                const size_t payload_size = 100 * 1024;
+                unsigned char *buff = create_trashed_buffer(payload_size);
+                unsigned char *read_buff = malloc(payload_size);
+                ASSERT(read_buff != NULL);
+                ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+                ASSERT((writer = packet_stream_create(-1, fds[1])) != NULL);
+                ASSERT((reader = packet_stream_create(fds[0], -1)) != NULL);
+
+                // a part of the payload is read ahead with the header
+                ASSERT(packet_stream_send(writer, MSG_WRITE_BLOCK, payload_size,
+                                          buff));
+                ASSERT(packet_stream_send(writer, MSG_DONE, 0, NULL));
+                ASSERT(packet_stream_flush(writer));
+                ASSERT(packet_stream_read_header(reader, &packet, &n));
+                ASSERT(packet->payload_size == payload_size);
+                ASSERT(packet_stream_read_payload_to_buffer(reader, packet,
+                                                            read_buff));
+                ASSERT(memcmp(buff, read_buff, payload_size) == 0);
+                ASSERT(packet_stream_read(reader, &packet, &n));
+                CHECK(packet->code == MSG_DONE);
+
+                free(read_buff);
+                free(buff);
+        }
+
+        SUBTEST(received_in_pieces)
+        {
+                // larger than the buffer of the stream
+                const size_t payload_size = 100 * 1024;
+                unsigned char *buff = create_trashed_buffer(payload_size);
+                unsigned char *read_buff = malloc(payload_size);
+                ASSERT(read_buff != NULL);
+                size_t size;
+                unsigned char *bytes = encode_packet(
+                        MSG_WRITE_BLOCK, payload_size, buff, &size);
+                ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+                set_nonblocking(fds[0]);
+                ASSERT((reader = packet_stream_create(fds[0], -1)) != NULL);
+
+                // nothing to receive yet
+                ASSERT(packet_stream_receive(reader));
+                CHECK(!packet_stream_has_packet(reader));
+                const size_t split[] = { 0, 1, 9, 70000, size - 1, size };
+                for (size_t i = 0; i + 1 < sizeof(split) / sizeof(*split);
+                     i++) {
+                        CHECK(!packet_stream_has_packet(reader));
+                        const size_t len = split[i + 1] - split[i];
+                        ASSERT(utils_write(fds[1], len, &bytes[split[i]])
+                               == (ssize_t)len);
+                        ASSERT(packet_stream_receive(reader));
+                }
+                ASSERT(packet_stream_has_packet(reader));
+                ASSERT(packet_stream_read_header(reader, &packet, &n));
+                ASSERT(packet->payload_size == payload_size);
+                ASSERT(packet_stream_read_payload_to_buffer(reader, packet,
+                                                            read_buff));
+                ASSERT(memcmp(buff, read_buff, payload_size) == 0);
+                CHECK(!packet_stream_has_buffered(reader));
+
+                // the end of the connection is reported
+                ASSERT(close(fds[1]) == 0);
+                CHECK(!packet_stream_receive(reader));
+                CHECK(errno == ECONNRESET);
+
+                free(bytes);
+                free(read_buff);
+                free(buff);
+        }
+
+        SUBTEST(send_timeout)
+        {
+                const size_t payload_size = 100 * 1024;
+                unsigned char *buff = create_trashed_buffer(payload_size);
+                ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+                set_nonblocking(fds[1]);
+                ASSERT((writer = packet_stream_create(-1, fds[1])) != NULL);
+                packet_stream_set_timeout(writer, 100);
+
+                // the peer never reads, so the connection fills up
+                bool sent = true;
+                for (size_t i = 0; i < 1000 && sent; i++)
+                        sent = packet_stream_send(writer, MSG_WRITE_BLOCK,
+                                                  payload_size, buff);
+                CHECK(!sent);
+                CHECK(errno == ETIMEDOUT);
+                free(buff);
+        }
+
+        packet_stream_destroy(writer);
+        packet_stream_destroy(reader);
+        free(packet);
+}
@@ -0,0 +1,160 @@
+/**
+ * @file test_readahead.c
+ * @brief Tests of the ring of the blocks read ahead.
+ */
+#define CUT_MAIN
+
+#include "cut.h"
+
+#include "readahead.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOCK_SIZE 4096
+
+/**
+ * Creates the temporary file of @c size bytes, every byte is its offset
+ * modulo 251, so the blocks read from a wrong offset differ.
+ */
+static FILE *create_file(size_t size, unsigned char **content)
+{
+        FILE *file = tmpfile();
+        ASSERT(file != NULL);
+        *content = malloc(size + 1);
+        ASSERT(*content != NULL);
+        for (size_t i = 0; i < size; i++)
+                (*content)[i] = i % 251;
+        ASSERT(fwrite(*content, 1, size, file) == size);
+        ASSERT(fflush(file) == 0);
+        return file;
+}
+
+/**
+ * Reads the file from the @c offset through the ring and compares the
+ * blocks with the @c content.
+ */
+static void check_blocks(int fd, const unsigned char *content, size_t size,
+                         off_t offset, size_t depth)
+{
+        struct client_readahead *ra
+                = client_readahead_start(fd, offset, BLOCK_SIZE, depth);
+        ASSERT(ra != NULL);
+
+        size_t done = offset;
+        const unsigned char *block;
+        ssize_t rc;
+        while ((rc = client_readahead_next(ra, &block)) > 0) {
+                ASSERT(done + rc <= size);
+                CHECK(rc == BLOCK_SIZE || done + rc == size);
+                CHECK(memcmp(block, content + done, rc) == 0);
+                done += rc;
+        }
+        CHECK(rc == 0);
+        CHECK(done == size);
+        client_readahead_stop(ra);
+}
+
+TEST(readahead_blocks)
+{
+        const size_t size = 10 * BLOCK_SIZE + 100;
+        unsigned char *content;
+        FILE *file = create_file(size, &content);
+        const int fd = fileno(file);
+
+        SUBTEST(wraparound)
+        {
+                check_blocks(fd, content, size, 0, 3);
+        }
+
+        SUBTEST(single_slot)
+        {
+                check_blocks(fd, content, size, 0, 1);
+        }
+
+        SUBTEST(deeper_than_file)
+        {
+                check_blocks(fd, content, size, 0, CLIENT_MAX_READ_AHEAD);
+        }
+
+        SUBTEST(from_offset)
+        {
+                check_blocks(fd, content, size, BLOCK_SIZE + 7, 4);
+        }
+
+        SUBTEST(stop_early)
+        {
+                struct client_readahead *ra
+                        = client_readahead_start(fd, 0, BLOCK_SIZE, 2);
+                ASSERT(ra != NULL);
+                const unsigned char *block;
+                CHECK(client_readahead_next(ra, &block) == BLOCK_SIZE);
+                CHECK(memcmp(block, content, BLOCK_SIZE) == 0);
+                client_readahead_stop(ra);
+        }
+
+        ASSERT(fclose(file) == 0);
+        free(content);
+}
+
+TEST(readahead_end)
+{
+        SUBTEST(empty_file)
+        {
+                unsigned char *content;
+                FILE *file = create_file(0, &content);
+                check_blocks(fileno(file), content, 0, 0, 2);
+                ASSERT(fclose(file) == 0);
+                free(content);
+        }
+
+        SUBTEST(whole_blocks)
+        {
+                unsigned char *content;
+                FILE *file = create_file(4 * BLOCK_SIZE, &content);
+                check_blocks(fileno(file), content, 4 * BLOCK_SIZE, 0, 2);
+                ASSERT(fclose(file) == 0);
+                free(content);
+        }
+
+        SUBTEST(offset_at_end)
+        {
+                unsigned char *content;
+                FILE *file = create_file(BLOCK_SIZE + 1, &content);
+                check_blocks(fileno(file), content, BLOCK_SIZE + 1,
+                             BLOCK_SIZE + 1, 2);
+                ASSERT(fclose(file) == 0);
+                free(content);
+        }
+}
+
+TEST(readahead_error)
+{
+        char path[] = "/tmp/test_readahead_XXXXXX";
+        const int tmp_fd = mkstemp(path);
+        ASSERT(tmp_fd != -1);
+        ASSERT(write(tmp_fd, "data", 4) == 4);
+        ASSERT(close(tmp_fd) == 0);
+        // the reads of the write-only file fail
+        const int fd = open(path, O_WRONLY);
+        ASSERT(fd != -1);
+        ASSERT(unlink(path) == 0);
+
+        SUBTEST(reader_error)
+        {
+                struct client_readahead *ra
+                        = client_readahead_start(fd, 0, BLOCK_SIZE, 2);
+                ASSERT(ra != NULL);
+                const unsigned char *block;
+                errno = 0;
+                CHECK(client_readahead_next(ra, &block) == -1);
+                CHECK(errno == EBADF);
+                client_readahead_stop(ra);
+        }
+
+        ASSERT(close(fd) == 0);
+}
@@ -0,0 +1,231 @@
+/**
+ * @file test_scan.c
+ * @brief Tests of the scans of the blocks.
+ */
+#define CUT_MAIN
+
+#include "cut.h"
+
+#include "scan.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+/** the blocks start at every offset of the widest vector */
+#define MAX_OFFSET 64
+#define MAX_SIZE 600
+
+GLOBAL_TEAR_UP()
+{
+        srand(time(NULL));
+}
+
+static bool reference_zero(size_t size, const unsigned char *buff)
+{
+        for (size_t i = 0; i < size; i++) {
+                if (buff[i] != 0)
+                        return false;
+        }
+        return true;
+}
+
+static size_t reference_mismatch(size_t size, const unsigned char *a,
+                                 const unsigned char *b)
+{
+        size_t i = 0;
+        while (i < size && a[i] == b[i])
+                i++;
+        return i;
+}
+
+static unsigned char *create_trashed_buffer(size_t size)
+{
+        unsigned char *buff = malloc(size);
+        ASSERT(buff != NULL);
+        for (size_t i = 0; i < size; i++)
+                buff[i] = rand();
+        return buff;
+}
+
+/**
+ * Checks the block with the non-zero byte at @c position, if it is in the
+ * block, against the reference.
+ */
+static void check_zero(const struct scan_kernel *kernel, unsigned char *buff,
+                       size_t size, size_t position)
+{
+        if (position < size)
+                buff[position] = 1 + rand() % 255;
+        CHECK(kernel->zero(size, buff) == reference_zero(size, buff));
+        if (position < size)
+                buff[position] = 0;
+}
+
+/**
+ * Checks the blocks differing at @c position, if it is in the blocks,
+ * against the reference.
+ */
+static void check_mismatch(const struct scan_kernel *kernel,
+                           const unsigned char *a, unsigned char *b,
+                           size_t size, size_t position)
+{
+        if (position < size)
+                b[position] = ~a[position];
+        CHECK(kernel->mismatch(size, a, b) == reference_mismatch(size, a, b));
+        if (position < size)
+                b[position] = a[position];
+}
+
+/**
+ * Maps the block of @c size bytes right before an inaccessible page, so
+ * any read after the block crashes the test.
+ */
+static unsigned char *map_before_guard(size_t size, void **mapping,
+                                       size_t *mapping_size)
+{
+        const size_t page = sysconf(_SC_PAGESIZE);
+        *mapping_size = (size + page - 1) / page * page + page;
+        *mapping = mmap(NULL, *mapping_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        ASSERT(*mapping != MAP_FAILED);
+        unsigned char *guard = (unsigned char *)*mapping + *mapping_size - page;
+        ASSERT(mprotect(guard, page, PROT_NONE) == 0);
+        return guard - size;
+}
+
+TEST(zero)
+{
+        size_t count;
+        const struct scan_kernel *kernels = scan_kernels(&count);
+        ASSERT(count >= 1);
+        CHECK(strcmp(kernels[0].name, "portable") == 0);
+
+        SUBTEST(kernels_match_reference)
+        {
+                unsigned char *buff = calloc(1, MAX_OFFSET + MAX_SIZE);
+                ASSERT(buff != NULL);
+                for (size_t k = 0; k < count; k++) {
+                        if (!kernels[k].supported())
+                                continue;
+                        for (size_t offset = 0; offset < MAX_OFFSET; offset++)
+                                for (size_t size = 0; size < MAX_SIZE; size++) {
+                                        unsigned char *block = &buff[offset];
+                                        check_zero(&kernels[k], block, size,
+                                                   size);
+                                        check_zero(&kernels[k], block, size,
+                                                   0);
+                                        check_zero(&kernels[k], block, size,
+                                                   size / 2);
+                                        check_zero(&kernels[k], block, size,
+                                                   size - 1);
+                                }
+                }
+                free(buff);
+        }
+
+        SUBTEST(end_of_page)
+        {
+                void *mapping;
+                size_t mapping_size;
+                for (size_t k = 0; k < count; k++) {
+                        if (!kernels[k].supported())
+                                continue;
+                        for (size_t size = 0; size < MAX_SIZE; size++) {
+                                unsigned char *block = map_before_guard(
+                                        size, &mapping, &mapping_size);
+                                CHECK(kernels[k].zero(size, block));
+                                munmap(mapping, mapping_size);
+                        }
+                }
+        }
+
+        SUBTEST(dispatched)
+        {
+                const size_t size = 1024 * 1024;
+                unsigned char *buff = calloc(1, size);
+                ASSERT(buff != NULL);
+                CHECK(scan_zero(size, buff));
+                CHECK(scan_zero(0, buff));
+                buff[size - 1] = 1;
+                CHECK(!scan_zero(size, buff));
+                CHECK(scan_zero(size - 1, buff));
+                free(buff);
+        }
+}
+
+TEST(mismatch)
+{
+        size_t count;
+        const struct scan_kernel *kernels = scan_kernels(&count);
+
+        SUBTEST(kernels_match_reference)
+        {
+                unsigned char *a = create_trashed_buffer(MAX_OFFSET + MAX_SIZE);
+                unsigned char *b = malloc(MAX_OFFSET + MAX_SIZE);
+                ASSERT(b != NULL);
+                for (size_t k = 0; k < count; k++) {
+                        if (!kernels[k].supported())
+                                continue;
+                        for (size_t offset = 0; offset < MAX_OFFSET; offset++)
+                                for (size_t size = 0; size < MAX_SIZE; size++) {
+                                        // only the second block is shifted
+                                        unsigned char *block = &b[offset];
+                                        memcpy(block, a, size);
+                                        check_mismatch(&kernels[k], a, block,
+                                                       size, size);
+                                        check_mismatch(&kernels[k], a, block,
+                                                       size, 0);
+                                        check_mismatch(&kernels[k], a, block,
+                                                       size, size / 3);
+                                        check_mismatch(&kernels[k], a, block,
+                                                       size, size - 1);
+                                }
+                }
+                free(b);
+                free(a);
+        }
+
+        SUBTEST(first_difference_wins)
+        {
+                const size_t size = 4096;
+                unsigned char *a = create_trashed_buffer(size);
+                unsigned char *b = malloc(size);
+                ASSERT(b != NULL);
+                memcpy(b, a, size);
+                b[1000] ^= 0x80;
+                b[3000] ^= 0x01;
+                for (size_t k = 0; k < count; k++) {
+                        if (kernels[k].supported())
+                                CHECK(kernels[k].mismatch(size, a, b) == 1000);
+                }
+                CHECK(scan_mismatch(size, a, b) == 1000);
+                CHECK(!scan_equal(size, a, b));
+                CHECK(scan_equal(1000, a, b));
+                free(b);
+                free(a);
+        }
+
+        SUBTEST(end_of_page)
+        {
+                void *first;
+                void *second;
+                size_t first_size;
+                size_t second_size;
+                for (size_t k = 0; k < count; k++) {
+                        if (!kernels[k].supported())
+                                continue;
+                        for (size_t size = 0; size < MAX_SIZE; size++) {
+                                unsigned char *a = map_before_guard(
+                                        size, &first, &first_size);
+                                unsigned char *b = map_before_guard(
+                                        size, &second, &second_size);
+                                CHECK(kernels[k].mismatch(size, a, b) == size);
+                                munmap(first, first_size);
+                                munmap(second, second_size);
+                        }
+                }
+        }
+}
@@ -76,6 +76,8 @@ int prepare_test(const char *name, int *readfd, int *writefd,
                  struct settings *settings)
 {
         memset(settings, 0, sizeof(*settings));
+        // the client is connected already, no entry socket
+        settings->sock_fd = -1;
         char *dir_name = create_test_dir_name(name);
         settings->cwd = dir_name;
         int dirfd = make_test_dir(dir_name);
@@ -8,13 +8,22 @@
 
 #define CUT_MAIN
 
+#include "hash.h"
 #include "packet.h"
+#include "server/chunks.h"
+#include "server/delta.h"
+#include "server/session.h"
 #include "settings.h"
 #include "test_helper.h"
+#include <endian.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/time.h>
@@ -356,6 +365,152 @@ static void subtest_sparse_file(struct test_info *info)
         ASSERT(statbuf.st_blocks == 0);
 }
 
+/**
+ * Sends the hole of @c blocks filesystem blocks.
+ *
+ * @param info Struct holding information needed for testing
+ * @param blocks Size of the hole in blocks
+ * @param expected_msg Expected reply of the server
+ */
+static void hole_helper(struct test_info *info, uint64_t blocks,
+                        enum packet_msg_code expected_msg)
+{
+        const struct packet_payload_hole payload = {
+                .size = blocks * info->settings.fs_block_size,
+        };
+        ASSERT(packet_send(info->writefd, MSG_WRITE_HOLE, sizeof(payload),
+                           (const unsigned char *)&payload));
+        check_return_message(info, expected_msg);
+}
+
+/**
+ * Checks whether the holes between the blocks and at the end of the file
+ * are read as zeros and the trailing hole extends the file.
+ *
+ * @param info Struct holding information needed for testing
+ */
+static void subtest_write_holes(struct test_info *info)
+{
+        const size_t block_size = info->settings.fs_block_size;
+        unsigned char *buffer;
+        ASSERT((buffer = malloc(block_size)) != NULL);
+        memset(buffer, 42, block_size);
+
+        write_helper(info, buffer);
+        hole_helper(info, 4, MSG_OK);
+        write_helper(info, buffer);
+        hole_helper(info, 2, MSG_OK);
+
+        struct stat statbuf;
+        ASSERT(fstatat(info->dirfd, "test_file", &statbuf, 0) == 0);
+        ASSERT((size_t)statbuf.st_size == 8 * block_size);
+
+        int fd;
+        ASSERT((fd = openat(info->dirfd, "test_file", O_RDONLY)) != -1);
+        for (size_t i = 0; i < 8; i++) {
+                const unsigned char expected = i == 0 || i == 5 ? 42 : 0;
+                ASSERT(pread(fd, buffer, block_size, i * block_size)
+                       == (ssize_t)block_size);
+                for (size_t j = 0; j < block_size; j++)
+                        CHECK(buffer[j] == expected);
+        }
+        close(fd);
+        free(buffer);
+}
+
+/**
+ * Negotiates the window and checks whether blocks sent without waiting
+ * for the replies are written and acknowledged cumulatively.
+ *
+ * @param info Struct holding information needed for testing
+ */
+static void subtest_windowed_write(struct test_info *info)
+{
+        const uint64_t block_count = 10;
+        const struct packet_payload_settings client_settings = {
+                .fs_block_size = info->settings.fs_block_size,
+                .window_size = 8,
+        };
+        ASSERT(packet_send(info->writefd, MSG_SETTINGS,
+                           sizeof(client_settings),
+                           (const unsigned char *)&client_settings));
+        check_return_message(info, MSG_OK);
+        subtest_create_file(info);
+
+        void *buffer;
+        ASSERT((buffer = calloc(1, info->settings.fs_block_size)) != NULL);
+        for (uint64_t i = 0; i < block_count; i++) {
+                ASSERT(packet_send(info->writefd, MSG_WRITE_BLOCK,
+                                   info->settings.fs_block_size,
+                                   (unsigned char *)buffer));
+        }
+
+        uint64_t acked = 0;
+        while (acked < block_count) {
+                check_return_message(info, MSG_ACK);
+                const struct packet_payload_ack *ack
+                        = (struct packet_payload_ack *)info->pack->payload;
+                ASSERT(ack->block_count > acked);
+                ASSERT(ack->block_count <= block_count);
+                acked = ack->block_count;
+        }
+
+        struct stat statbuf;
+        ASSERT(fstatat(info->dirfd, "test_file", &statbuf, 0) == 0);
+        ASSERT((size_t)statbuf.st_size
+               == block_count * info->settings.fs_block_size);
+        free(buffer);
+}
+
+/**
+ * Sends the settings of a client which supports the data chunks.
+ *
+ * @param info Struct holding information needed for testing
+ * @param chunk_size Size of the chunks the client asks for
+ * @param expected_msg Expected reply of the server
+ */
+static void chunk_settings_helper(struct test_info *info, uint64_t chunk_size,
+                                  enum packet_msg_code expected_msg)
+{
+        const struct packet_payload_settings client_settings = {
+                .protocol_version = PACKET_PROTOCOL_VERSION,
+                .features = PACKET_FEATURE_CHUNKS,
+                .chunk_size = chunk_size,
+        };
+        ASSERT(packet_send(info->writefd, MSG_SETTINGS,
+                           sizeof(client_settings),
+                           (const unsigned char *)&client_settings));
+        check_return_message(info, expected_msg);
+}
+
+/**
+ * Negotiates the data chunks and checks whether blocks larger than
+ * the filesystem block are written.
+ *
+ * @param info Struct holding information needed for testing
+ */
+static void subtest_chunked_write(struct test_info *info)
+{
+        const size_t chunk_size = PACKET_MIN_CHUNK_SIZE;
+        chunk_settings_helper(info, chunk_size, MSG_OK);
+        subtest_create_file(info);
+
+        unsigned char *buffer;
+        ASSERT((buffer = malloc(chunk_size)) != NULL);
+        for (size_t i = 0; i < chunk_size; i++)
+                buffer[i] = (unsigned char)i;
+        for (int i = 0; i < 3; i++) {
+                ASSERT(packet_send(info->writefd, MSG_WRITE_BLOCK, chunk_size,
+                                   buffer));
+                check_return_message(info, MSG_OK);
+        }
+
+        struct stat statbuf;
+        ASSERT(fstatat(info->dirfd, "test_file", &statbuf, 0) == 0);
+        ASSERT((size_t)statbuf.st_size == 3 * chunk_size);
+        free(buffer);
+}
+
 /**
  * Creates a test_file and informs server about its incoming change.
  *
@@ -468,6 +623,15 @@ TEST(server_basic)
                 subtest_end_connection(&info);
         }
 
+        SUBTEST(delete_missing_file)
+        {
+                subtest_starter("delete_missing_file", &info);
+                ASSERT(packet_send(info.writefd, MSG_DELETE_FILE, 8,
+                                   (unsigned char *)"missing"));
+                check_return_message(&info, MSG_NOK);
+                subtest_end_connection(&info);
+        }
+
         SUBTEST(timestamps)
         {
                 subtest_starter("timestamps", &info);
@@ -531,6 +695,55 @@ TEST(server_opts)
                 subtest_sparse_file(&info);
                 subtest_end_connection(&info);
         }
+
+        SUBTEST(write_holes)
+        {
+                subtest_starter("write_holes", &info);
+                subtest_create_file(&info);
+                subtest_write_holes(&info);
+                send_msg_done(&info);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(empty_hole)
+        {
+                subtest_starter("empty_hole", &info);
+                subtest_create_file(&info);
+                hole_helper(&info, 0, MSG_ABORT);
+                subtest_waiter(&info);
+        }
+
+        SUBTEST(windowed_write)
+        {
+                info.dirfd = prepare_test("windowed_write", &info.readfd,
+                                          &info.writefd, &info.settings);
+                info.settings.window_size = 4;
+                start_server(&info.th, &info.settings);
+                subtest_windowed_write(&info);
+                send_msg_done(&info);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(chunked_write)
+        {
+                info.dirfd = prepare_test("chunked_write", &info.readfd,
+                                          &info.writefd, &info.settings);
+                info.settings.chunk_size = PACKET_MAX_CHUNK_SIZE;
+                start_server(&info.th, &info.settings);
+                subtest_chunked_write(&info);
+                send_msg_done(&info);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(chunk_too_large)
+        {
+                info.dirfd = prepare_test("chunk_too_large", &info.readfd,
+                                          &info.writefd, &info.settings);
+                info.settings.chunk_size = PACKET_MIN_CHUNK_SIZE;
+                start_server(&info.th, &info.settings);
+                chunk_settings_helper(&info, PACKET_MAX_CHUNK_SIZE, MSG_ABORT);
+                subtest_waiter(&info);
+        }
 }
 
 TEST(server_change)
@@ -581,6 +794,15 @@ TEST(server_change)
                 subtest_waiter(&info);
         }
 
+        // the file is closed after every changed attribute
+        SUBTEST(change_attributes)
+        {
+                subtest_starter("change_attributes", &info);
+                subtest_change_timestamps(&info);
+                subtest_change_perms(&info);
+                subtest_end_connection(&info);
+        }
+
         SUBTEST(change_write_blocks)
         {
                 subtest_starter("change_write_blocks", &info);
@@ -621,3 +843,1740 @@ TEST(server_change)
                 subtest_waiter(&info);
         }
 }
+
+/**
+ * Creates the old file of the delta with @c size bytes of data.
+ *
+ * @param info Struct holding information needed for testing
+ * @param size Size of the file
+ * @return The data of the file
+ */
+static unsigned char *old_file_helper(struct test_info *info, size_t size)
+{
+        unsigned char *buffer;
+        ASSERT((buffer = malloc(size)) != NULL);
+        for (size_t i = 0; i < size; i++)
+                buffer[i] = (unsigned char)(i * 7 + i / 256);
+
+        const int fd = openat(info->dirfd, "test_file", O_CREAT | O_WRONLY,
+                              0666);
+        ASSERT(fd != -1);
+        ASSERT(write(fd, buffer, size) == (ssize_t)size);
+        ASSERT(close(fd) == 0);
+        return buffer;
+}
+
+/**
+ * Requests the delta of test_file and checks the signatures of its blocks.
+ *
+ * @param info Struct holding information needed for testing
+ * @param old Data of the old file
+ * @param size Size of the old file
+ * @return Size of the blocks of the old file
+ */
+static uint64_t delta_file_helper(struct test_info *info,
+                                  const unsigned char *old, size_t size)
+{
+        const char *test_file = "test_file";
+        ASSERT(packet_send(info->writefd, MSG_DELTA_FILE, strlen(test_file) + 1,
+                           (const unsigned char *)test_file));
+        check_return_message(info, MSG_SIGNATURES);
+
+        uint64_t header[2];
+        ASSERT(info->pack->payload_size >= sizeof(header));
+        memcpy(header, info->pack->payload, sizeof(header));
+        const uint64_t block_size = be64toh(header[0]);
+        const size_t block_count = (size + block_size - 1) / block_size;
+        ASSERT(be64toh(header[1]) == size);
+        ASSERT(info->pack->payload_size
+               == sizeof(header)
+                          + block_count
+                                    * sizeof(struct packet_block_signature));
+
+        for (size_t i = 0; i < block_count; i++) {
+                const size_t offset = i * block_size;
+                const size_t length = size - offset < block_size
+                                              ? size - offset
+                                              : block_size;
+                struct hash_rolling rolling;
+                hash_rolling_init(&rolling, length, &old[offset]);
+
+                struct packet_block_signature signature;
+                memcpy(&signature,
+                       &info->pack->payload[sizeof(header)
+                                            + i * sizeof(signature)],
+                       sizeof(signature));
+                CHECK(be64toh(signature.weak) == hash_rolling_digest(&rolling));
+                CHECK(be64toh(signature.strong)
+                      == hash_xxh64(length, &old[offset], 0));
+        }
+
+        check_return_message(info, MSG_OK);
+        return block_size;
+}
+
+static void copy_blocks_helper(struct test_info *info, uint64_t index,
+                               uint64_t count,
+                               enum packet_msg_code expected_code)
+{
+        const struct packet_payload_copy_blocks payload = { index, count };
+        ASSERT(packet_send(info->writefd, MSG_COPY_BLOCKS, sizeof(payload),
+                           (const unsigned char *)&payload));
+        check_return_message(info, expected_code);
+}
+
+/**
+ * Rebuilds test_file from its blocks in a different order and new data.
+ *
+ * @param info Struct holding information needed for testing
+ */
+static void subtest_delta(struct test_info *info)
+{
+        const size_t size = 3 * 2048 + 100;
+        unsigned char *old = old_file_helper(info, size);
+        const uint64_t block_size = delta_file_helper(info, old, size);
+        ASSERT(block_size * 3 < size);
+
+        // the last two blocks, literal data and the first block
+        const char literal[] = "new data";
+        copy_blocks_helper(info, 2, 2, MSG_OK);
+        ASSERT(packet_send(info->writefd, MSG_WRITE_BLOCK, sizeof(literal),
+                           (const unsigned char *)literal));
+        check_return_message(info, MSG_OK);
+        copy_blocks_helper(info, 0, 1, MSG_OK);
+
+        send_msg_done(info);
+        for (int i = 0; i < 3; i++) {
+                ASSERT(packet_read(info->readfd, &info->pack,
+                                   &info->pack_len));
+                CHECK(info->pack->code != MSG_ABORT);
+        }
+
+        const size_t tail_size = size - 2 * block_size;
+        const size_t new_size = tail_size + sizeof(literal) + block_size;
+        unsigned char *new = malloc(new_size + 1);
+        ASSERT(new != NULL);
+        const int fd = openat(info->dirfd, "test_file", O_RDONLY);
+        ASSERT(fd != -1);
+        ASSERT(read(fd, new, new_size + 1) == (ssize_t)new_size);
+        ASSERT(close(fd) == 0);
+
+        CHECK(memcmp(new, &old[2 * block_size], tail_size) == 0);
+        CHECK(memcmp(&new[tail_size], literal, sizeof(literal)) == 0);
+        CHECK(memcmp(&new[tail_size + sizeof(literal)], old, block_size) == 0);
+        CHECK(faccessat(info->dirfd, ".dropbox_delta.0", F_OK, 0) != 0);
+        free(new);
+        free(old);
+}
+
+/**
+ * Checks the file the delta was applied to is removed when it cannot
+ * replace the old file.
+ *
+ * @param info Struct holding information needed for testing
+ */
+static void subtest_delta_not_replaced(struct test_info *info)
+{
+        const size_t size = 100;
+        unsigned char *old = old_file_helper(info, size);
+        delta_file_helper(info, old, size);
+        copy_blocks_helper(info, 0, 1, MSG_OK);
+
+        // a directory cannot be replaced by the file
+        ASSERT(unlinkat(info->dirfd, "test_file", 0) == 0);
+        ASSERT(mkdirat(info->dirfd, "test_file", 0777) == 0);
+        send_msg_done(info);
+        bool aborted = false;
+        for (int i = 0; i < 4 && !aborted; i++) {
+                ASSERT(packet_read(info->readfd, &info->pack,
+                                   &info->pack_len));
+                aborted = info->pack->code == MSG_ABORT;
+        }
+        CHECK(aborted);
+        CHECK(faccessat(info->dirfd, ".dropbox_delta.0", F_OK, 0) != 0);
+        free(old);
+}
+
+TEST(server_delta)
+{
+        struct test_info info = { 0 };
+
+        SUBTEST(delta)
+        {
+                subtest_starter("delta", &info);
+                subtest_delta(&info);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(delta_no_file)
+        {
+                subtest_starter("delta_no_file", &info);
+                const char *test_file = "test_file";
+                ASSERT(packet_send(info.writefd, MSG_DELTA_FILE,
+                                   strlen(test_file) + 1,
+                                   (const unsigned char *)test_file));
+                check_return_message(&info, MSG_NOK);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(delta_not_replaced)
+        {
+                subtest_starter("delta_not_replaced", &info);
+                subtest_delta_not_replaced(&info);
+                subtest_waiter(&info);
+        }
+
+        SUBTEST(copy_missing_block)
+        {
+                subtest_starter("copy_missing_block", &info);
+                unsigned char *old = old_file_helper(&info, 100);
+                delta_file_helper(&info, old, 100);
+                copy_blocks_helper(&info, 1, 1, MSG_ABORT);
+                subtest_waiter(&info);
+                free(old);
+        }
+
+        SUBTEST(copy_without_delta)
+        {
+                subtest_starter("copy_without_delta", &info);
+                subtest_create_file(&info);
+                copy_blocks_helper(&info, 0, 1, MSG_ABORT);
+                subtest_waiter(&info);
+        }
+}
+
+/**
+ * Data of the chunks used by the deduplication tests.
+ */
+struct test_chunk {
+        unsigned char data[3000];
+        size_t size;
+};
+
+static void chunks_helper(struct test_chunk chunks[3])
+{
+        const size_t sizes[] = { 1000, 3000, 500 };
+        for (size_t i = 0; i < 3; i++) {
+                chunks[i].size = sizes[i];
+                for (size_t j = 0; j < sizes[i]; j++)
+                        chunks[i].data[j] = (unsigned char)(j * (i + 3) + i);
+        }
+}
+
+static void create_helper(struct test_info *info, const char *name)
+{
+        ASSERT(packet_send(info->writefd, MSG_CREATE_FILE, strlen(name) + 1,
+                           (const unsigned char *)name));
+        check_return_message(info, MSG_OK);
+}
+
+/**
+ * Offers the chunks to the server and checks which of them it misses.
+ *
+ * @param info Struct holding information needed for testing
+ * @param chunks Chunks to offer
+ * @param count Number of the chunks
+ * @param missing Expected indexes of the missing chunks
+ * @param missing_count Number of the missing chunks
+ */
+static void offer_helper(struct test_info *info,
+                         const struct test_chunk *chunks[], size_t count,
+                         const uint64_t missing[], size_t missing_count)
+{
+        struct packet_chunk_offer offers[8];
+        ASSERT(count <= sizeof(offers) / sizeof(*offers));
+        for (size_t i = 0; i < count; i++) {
+                hash_sha256(chunks[i]->size, chunks[i]->data, offers[i].hash);
+                offers[i].size = htobe64(chunks[i]->size);
+        }
+        ASSERT(packet_send(info->writefd, MSG_OFFER_CHUNKS,
+                           count * sizeof(*offers),
+                           (const unsigned char *)offers));
+
+        check_return_message(info, MSG_MISSING_CHUNKS);
+        ASSERT(info->pack->payload_size == missing_count * sizeof(uint64_t));
+        for (size_t i = 0; i < missing_count; i++) {
+                uint64_t index;
+                memcpy(&index, &info->pack->payload[i * sizeof(index)],
+                       sizeof(index));
+                CHECK(be64toh(index) == missing[i]);
+        }
+        check_return_message(info, MSG_OK);
+}
+
+static void write_chunk_helper(struct test_info *info,
+                               const struct test_chunk *chunk)
+{
+        ASSERT(packet_send(info->writefd, MSG_WRITE_BLOCK, chunk->size,
+                           chunk->data));
+        check_return_message(info, MSG_OK);
+}
+
+static void done_helper(struct test_info *info)
+{
+        send_msg_done(info);
+        for (int i = 0; i < 3; i++) {
+                ASSERT(packet_read(info->readfd, &info->pack,
+                                   &info->pack_len));
+                CHECK(info->pack->code != MSG_ABORT);
+        }
+}
+
+/**
+ * Checks the file consists of the chunks.
+ */
+static void check_chunks(struct test_info *info, const char *name,
+                         const struct test_chunk *chunks[], size_t count)
+{
+        unsigned char data[4 * 3000 + 1];
+        const int fd = openat(info->dirfd, name, O_RDONLY);
+        ASSERT(fd != -1);
+        const ssize_t size = read(fd, data, sizeof(data));
+        ASSERT(close(fd) == 0);
+
+        size_t offset = 0;
+        for (size_t i = 0; i < count; i++) {
+                ASSERT(offset + chunks[i]->size <= (size_t)size);
+                CHECK(memcmp(&data[offset], chunks[i]->data, chunks[i]->size)
+                      == 0);
+                offset += chunks[i]->size;
+        }
+        CHECK(offset == (size_t)size);
+}
+
+/**
+ * Creates the file from the missing chunks sent by two offers.
+ */
+static void first_file_helper(struct test_info *info,
+                              const struct test_chunk chunks[3])
+{
+        const struct test_chunk *first[] = { &chunks[0], &chunks[1] };
+        const struct test_chunk *second[] = { &chunks[2] };
+        const uint64_t missing[] = { 0, 1 };
+
+        create_helper(info, "first");
+        offer_helper(info, first, 2, missing, 2);
+        write_chunk_helper(info, &chunks[0]);
+        write_chunk_helper(info, &chunks[1]);
+        offer_helper(info, second, 1, missing, 1);
+        write_chunk_helper(info, &chunks[2]);
+        done_helper(info);
+
+        const struct test_chunk *all[] = { &chunks[0], &chunks[1], &chunks[2] };
+        check_chunks(info, "first", all, 3);
+}
+
+/**
+ * Checks the second file is built only from the chunks of the first one.
+ */
+static void subtest_dedup(struct test_info *info)
+{
+        struct test_chunk chunks[3];
+        chunks_helper(chunks);
+        first_file_helper(info, chunks);
+
+        const struct test_chunk *reused[]
+                = { &chunks[2], &chunks[0], &chunks[1], &chunks[0] };
+        create_helper(info, "second");
+        offer_helper(info, reused, 4, NULL, 0);
+        done_helper(info);
+        check_chunks(info, "second", reused, 4);
+}
+
+/**
+ * Checks the chunks of a file changed behind the back of the server are
+ * sent again and placed at their offsets between the copied ones.
+ */
+static void subtest_dedup_changed_file(struct test_info *info)
+{
+        struct test_chunk chunks[3];
+        chunks_helper(chunks);
+        first_file_helper(info, chunks);
+
+        // the second chunk of the first file is overwritten
+        const int fd = openat(info->dirfd, "first", O_WRONLY);
+        ASSERT(fd != -1);
+        ASSERT(pwrite(fd, "changed", 7, chunks[0].size + 10) == 7);
+        ASSERT(close(fd) == 0);
+
+        const struct test_chunk *offered[]
+                = { &chunks[0], &chunks[1], &chunks[2] };
+        const uint64_t missing[] = { 1 };
+        create_helper(info, "second");
+        offer_helper(info, offered, 3, missing, 1);
+        write_chunk_helper(info, &chunks[1]);
+        done_helper(info);
+        check_chunks(info, "second", offered, 3);
+}
+
+/**
+ * Ends the server and starts it again in the same directory.
+ */
+static void restart_server(struct test_info *info)
+{
+        ASSERT(packet_send(info->writefd, MSG_END_CONNECTION, 0, NULL));
+        stop_server(info->th);
+        wait_server(info->th, SERVER_OK);
+        // the server closed its end of the connection
+        ASSERT(close(info->readfd) == 0);
+
+        int fds[2];
+        ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        info->readfd = fds[0];
+        info->writefd = fds[0];
+        info->settings.read_fd = fds[1];
+        info->settings.write_fd = fds[1];
+        start_server(&info->th, &info->settings);
+}
+
+static off_t index_size(struct test_info *info)
+{
+        struct stat statbuf;
+        ASSERT(fstatat(info->dirfd, SERVER_CHUNKS_INDEX_NAME, &statbuf, 0)
+               == 0);
+        return statbuf.st_size;
+}
+
+/**
+ * Checks the records of the deleted file are dropped from the index when
+ * it is loaded again and the chunks of the other files are kept.
+ */
+static void subtest_dedup_index_compacted(struct test_info *info)
+{
+        struct test_chunk chunks[3];
+        chunks_helper(chunks);
+        first_file_helper(info, chunks);
+
+        const struct test_chunk *reused[] = { &chunks[1] };
+        create_helper(info, "second");
+        offer_helper(info, reused, 1, NULL, 0);
+        done_helper(info);
+
+        char *name = "first";
+        ASSERT(packet_send(info->writefd, MSG_DELETE_FILE, strlen(name) + 1,
+                           (unsigned char *)name));
+        check_return_message(info, MSG_OK);
+        const off_t size = index_size(info);
+        restart_server(info);
+
+        // the server answers after it loaded the index, only the record of
+        // the second file is left
+        create_helper(info, "third");
+        const off_t live_size = 2 * sizeof(uint64_t) + strlen("second")
+                                + HASH_SHA256_SIZE + 2 * sizeof(uint64_t);
+        CHECK(index_size(info) == live_size);
+        CHECK(size > live_size);
+
+        const struct test_chunk *offered[] = { &chunks[0], &chunks[1] };
+        const uint64_t missing[] = { 0 };
+        offer_helper(info, offered, 2, missing, 1);
+        write_chunk_helper(info, &chunks[0]);
+        done_helper(info);
+        check_chunks(info, "third", offered, 2);
+}
+
+/**
+ * Checks the delta applied to another file keeps the chunks of the file
+ * created before it in the index.
+ */
+static void subtest_dedup_after_delta(struct test_info *info)
+{
+        struct test_chunk chunks[3];
+        chunks_helper(chunks);
+        first_file_helper(info, chunks);
+
+        const size_t size = 3 * 2048 + 100;
+        unsigned char *old = old_file_helper(info, size);
+        delta_file_helper(info, old, size);
+        copy_blocks_helper(info, 0, 1, MSG_OK);
+        done_helper(info);
+        free(old);
+
+        const struct test_chunk *reused[]
+                = { &chunks[0], &chunks[1], &chunks[2] };
+        create_helper(info, "second");
+        offer_helper(info, reused, 3, NULL, 0);
+        done_helper(info);
+        check_chunks(info, "second", reused, 3);
+}
+
+TEST(server_dedup)
+{
+        struct test_info info = { 0 };
+
+        SUBTEST(dedup)
+        {
+                subtest_starter("dedup", &info);
+                subtest_dedup(&info);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(dedup_changed_file)
+        {
+                subtest_starter("dedup_changed_file", &info);
+                subtest_dedup_changed_file(&info);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(dedup_index_reloaded)
+        {
+                subtest_starter("dedup_index_reloaded", &info);
+                struct test_chunk chunks[3];
+                chunks_helper(chunks);
+                first_file_helper(&info, chunks);
+                restart_server(&info);
+
+                const struct test_chunk *reused[] = { &chunks[1] };
+                create_helper(&info, "second");
+                offer_helper(&info, reused, 1, NULL, 0);
+                done_helper(&info);
+                check_chunks(&info, "second", reused, 1);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(dedup_index_compacted)
+        {
+                subtest_starter("dedup_index_compacted", &info);
+                subtest_dedup_index_compacted(&info);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(dedup_after_delta)
+        {
+                subtest_starter("dedup_after_delta", &info);
+                subtest_dedup_after_delta(&info);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(dedup_wrong_chunk_size)
+        {
+                subtest_starter("dedup_wrong_chunk_size", &info);
+                struct test_chunk chunks[3];
+                chunks_helper(chunks);
+                const struct test_chunk *offered[] = { &chunks[0] };
+                const uint64_t missing[] = { 0 };
+                create_helper(&info, "first");
+                offer_helper(&info, offered, 1, missing, 1);
+                ASSERT(packet_send(info.writefd, MSG_WRITE_BLOCK,
+                                   chunks[1].size, chunks[1].data));
+                check_return_message(&info, MSG_ABORT);
+                subtest_waiter(&info);
+        }
+
+        SUBTEST(offer_without_file)
+        {
+                subtest_starter("offer_without_file", &info);
+                const struct packet_chunk_offer offer = { .size = htobe64(1) };
+                ASSERT(packet_send(info.writefd, MSG_OFFER_CHUNKS,
+                                   sizeof(offer),
+                                   (const unsigned char *)&offer));
+                check_return_message(&info, MSG_ABORT);
+                subtest_waiter(&info);
+        }
+}
+
+/**
+ * Creates a file with @c size bytes and the modification time @c mtime.
+ */
+static void manifest_file_helper(struct test_info *info, const char *name,
+                                 size_t size, time_t mtime)
+{
+        const int fd = openat(info->dirfd, name, O_CREAT | O_WRONLY, 0640);
+        ASSERT(fd != -1);
+        ASSERT(ftruncate(fd, size) == 0);
+        const struct timespec times[] = { { mtime, 0 }, { mtime, 42 } };
+        ASSERT(futimens(fd, times) == 0);
+        ASSERT(close(fd) == 0);
+}
+
+/**
+ * Checks the manifest lists the files of the client and nothing else.
+ */
+static void subtest_manifest(struct test_info *info)
+{
+        manifest_file_helper(info, "first", 100, 1000);
+        manifest_file_helper(info, "second", 0, 2000);
+        ASSERT(mkdirat(info->dirfd, "folder", 0755) == 0);
+
+        ASSERT(packet_send(info->writefd, MSG_GET_MANIFEST, 0, NULL));
+        check_return_message(info, MSG_MANIFEST);
+
+        size_t count = 0;
+        size_t offset = 0;
+        while (offset < info->pack->payload_size) {
+                struct packet_manifest_entry entry;
+                ASSERT(info->pack->payload_size - offset >= sizeof(entry));
+                memcpy(&entry, &info->pack->payload[offset], sizeof(entry));
+                offset += sizeof(entry);
+
+                const size_t name_size = be64toh(entry.name_size);
+                ASSERT(info->pack->payload_size - offset >= name_size);
+                const char *name = (const char *)&info->pack->payload[offset];
+                offset += name_size;
+                count++;
+
+                CHECK(be64toh(entry.mode) == (S_IFREG | 0640));
+                CHECK(be64toh(entry.mtime_nsec) == 42);
+                if (name_size == 5 && memcmp(name, "first", 5) == 0) {
+                        CHECK(be64toh(entry.size) == 100);
+                        CHECK(be64toh(entry.mtime_sec) == 1000);
+                } else {
+                        ASSERT(name_size == 6 && memcmp(name, "second", 6) == 0);
+                        CHECK(be64toh(entry.size) == 0);
+                        CHECK(be64toh(entry.mtime_sec) == 2000);
+                }
+        }
+        CHECK(count == 2);
+        check_return_message(info, MSG_OK);
+}
+
+TEST(server_manifest)
+{
+        struct test_info info = { 0 };
+
+        SUBTEST(manifest)
+        {
+                subtest_starter("manifest", &info);
+                subtest_manifest(&info);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(manifest_empty)
+        {
+                subtest_starter("manifest_empty", &info);
+                ASSERT(packet_send(info.writefd, MSG_GET_MANIFEST, 0, NULL));
+                check_return_message(&info, MSG_OK);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(manifest_while_creating)
+        {
+                subtest_starter("manifest_while_creating", &info);
+                subtest_create_file(&info);
+                ASSERT(packet_send(info.writefd, MSG_GET_MANIFEST, 0, NULL));
+                check_return_message(&info, MSG_ABORT);
+                subtest_waiter(&info);
+        }
+}
+
+/**
+ * Sends the path of the directory and checks the reply.
+ */
+static void dir_helper(struct test_info *info, enum packet_msg_code code,
+                       const char *path, enum packet_msg_code expected_msg)
+{
+        ASSERT(packet_send(info->writefd, code, strlen(path) + 1,
+                           (const unsigned char *)path));
+        check_return_message(info, expected_msg);
+}
+
+/**
+ * Checks the directories are listed before their files with the paths
+ * relative to the directory of the server.
+ */
+static void subtest_manifest_dirs(struct test_info *info)
+{
+        const struct packet_payload_settings client_settings = {
+                .protocol_version = PACKET_PROTOCOL_VERSION,
+                .features = PACKET_FEATURE_DIRS,
+        };
+        ASSERT(packet_send(info->writefd, MSG_SETTINGS,
+                           sizeof(client_settings),
+                           (const unsigned char *)&client_settings));
+        check_return_message(info, MSG_OK);
+
+        ASSERT(mkdirat(info->dirfd, "folder", 0750) == 0);
+        manifest_file_helper(info, "folder/inner", 10, 3000);
+
+        ASSERT(packet_send(info->writefd, MSG_GET_MANIFEST, 0, NULL));
+        check_return_message(info, MSG_MANIFEST);
+
+        struct packet_manifest_entry entry;
+        ASSERT(info->pack->payload_size == 2 * sizeof(entry) + 6 + 12);
+        memcpy(&entry, info->pack->payload, sizeof(entry));
+        CHECK(be64toh(entry.mode) == (S_IFDIR | 0750));
+        CHECK(be64toh(entry.name_size) == 6);
+        CHECK(memcmp(&info->pack->payload[sizeof(entry)], "folder", 6) == 0);
+
+        const size_t offset = sizeof(entry) + 6;
+        memcpy(&entry, &info->pack->payload[offset], sizeof(entry));
+        CHECK(be64toh(entry.mode) == (S_IFREG | 0640));
+        CHECK(be64toh(entry.size) == 10);
+        CHECK(be64toh(entry.name_size) == 12);
+        CHECK(memcmp(&info->pack->payload[offset + sizeof(entry)],
+                     "folder/inner", 12)
+              == 0);
+        check_return_message(info, MSG_OK);
+}
+
+TEST(server_dirs)
+{
+        struct test_info info = { 0 };
+        struct stat sb;
+
+        SUBTEST(create_dir)
+        {
+                subtest_starter("create_dir", &info);
+                dir_helper(&info, MSG_CREATE_DIR, "dir", MSG_OK);
+                dir_helper(&info, MSG_CREATE_DIR, "dir/sub", MSG_OK);
+                dir_helper(&info, MSG_CREATE_DIR, "dir/sub", MSG_OK);
+                ASSERT(fstatat(info.dirfd, "dir/sub", &sb, 0) == 0);
+                CHECK(S_ISDIR(sb.st_mode));
+
+                const char *file = "dir/sub/file";
+                ASSERT(packet_send(info.writefd, MSG_CREATE_FILE,
+                                   strlen(file) + 1,
+                                   (const unsigned char *)file));
+                check_return_message(&info, MSG_OK);
+                CHECK(faccessat(info.dirfd, file, F_OK, 0) == 0);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(create_dir_over_file)
+        {
+                subtest_starter("create_dir_over_file", &info);
+                manifest_file_helper(&info, "name", 10, 1000);
+                dir_helper(&info, MSG_CREATE_DIR, "name", MSG_OK);
+                ASSERT(fstatat(info.dirfd, "name", &sb, 0) == 0);
+                CHECK(S_ISDIR(sb.st_mode));
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(create_dir_no_parent)
+        {
+                subtest_starter("create_dir_no_parent", &info);
+                dir_helper(&info, MSG_CREATE_DIR, "missing/dir", MSG_NOK);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(delete_dir)
+        {
+                subtest_starter("delete_dir", &info);
+                ASSERT(mkdirat(info.dirfd, "dir", 0755) == 0);
+                ASSERT(mkdirat(info.dirfd, "dir/sub", 0755) == 0);
+                ASSERT(mkdirat(info.dirfd, "dir/sub/empty", 0755) == 0);
+                manifest_file_helper(&info, "dir/file", 10, 1000);
+                manifest_file_helper(&info, "dir/sub/file", 10, 1000);
+                manifest_file_helper(&info, "dirfile", 10, 1000);
+
+                dir_helper(&info, MSG_DELETE_DIR, "dir", MSG_OK);
+                CHECK(faccessat(info.dirfd, "dir", F_OK, 0) != 0);
+                CHECK(faccessat(info.dirfd, "dirfile", F_OK, 0) == 0);
+                dir_helper(&info, MSG_DELETE_DIR, "dir", MSG_NOK);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(path_outside)
+        {
+                subtest_starter("path_outside", &info);
+                dir_helper(&info, MSG_CREATE_DIR, "dir/../../escape",
+                           MSG_ABORT);
+                subtest_waiter(&info);
+        }
+
+        SUBTEST(absolute_path)
+        {
+                subtest_starter("absolute_path", &info);
+                dir_helper(&info, MSG_DELETE_DIR, "/tmp", MSG_ABORT);
+                subtest_waiter(&info);
+        }
+
+        SUBTEST(manifest_dirs)
+        {
+                subtest_starter("manifest_dirs", &info);
+                subtest_manifest_dirs(&info);
+                subtest_end_connection(&info);
+        }
+}
+
+/**
+ * Number of the blocks of the file interrupted by the resume tests, one
+ * more than fits into the first segment of the checkpoints.
+ */
+#define RESUME_BLOCK_COUNT                                                     \
+        (HASH_PREFIX_SEGMENT_SIZE / PACKET_MIN_CHUNK_SIZE + 1)
+
+/**
+ * Prepares the subtest of a server accepting blocks of the chunk size.
+ */
+static void resume_starter(const char *test_name, struct test_info *info)
+{
+        info->dirfd = prepare_test(test_name, &info->readfd, &info->writefd,
+                                   &info->settings);
+        info->settings.chunk_size = PACKET_MIN_CHUNK_SIZE;
+        start_server(&info->th, &info->settings);
+}
+
+static unsigned char *resume_data_helper(void)
+{
+        const size_t size = RESUME_BLOCK_COUNT * PACKET_MIN_CHUNK_SIZE;
+        unsigned char *data = malloc(size);
+        ASSERT(data != NULL);
+        for (size_t i = 0; i < size; i++)
+                data[i] = (unsigned char)(i * 7 + i / 4096);
+        return data;
+}
+
+/**
+ * Writes all blocks of the file but the last one, then the connection is
+ * lost and the server is started again.
+ *
+ * @param info Struct holding information needed for testing
+ * @param data Content of the whole file
+ * @param preallocated The final size of the file is sent first
+ */
+static void interrupted_file_helper(struct test_info *info,
+                                    const unsigned char *data,
+                                    bool preallocated)
+{
+        chunk_settings_helper(info, PACKET_MIN_CHUNK_SIZE, MSG_OK);
+        create_helper(info, "big");
+        if (preallocated) {
+                const struct packet_payload_file_size payload = {
+                        .size = RESUME_BLOCK_COUNT * PACKET_MIN_CHUNK_SIZE,
+                };
+                ASSERT(packet_send(info->writefd, MSG_FILE_SIZE,
+                                   sizeof(payload),
+                                   (const unsigned char *)&payload));
+                check_return_message(info, MSG_OK);
+        }
+        for (size_t i = 0; i + 1 < RESUME_BLOCK_COUNT; i++) {
+                ASSERT(packet_send(info->writefd, MSG_WRITE_BLOCK,
+                                   PACKET_MIN_CHUNK_SIZE,
+                                   &data[i * PACKET_MIN_CHUNK_SIZE]));
+                check_return_message(info, MSG_OK);
+        }
+
+        // the server may notice the lost connection before the signal
+        ASSERT(close(info->readfd) == 0);
+        stop_server(info->th);
+        ASSERT(pthread_join(info->th, NULL) == 0);
+
+        int fds[2];
+        ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        info->readfd = fds[0];
+        info->writefd = fds[0];
+        info->settings.read_fd = fds[1];
+        info->settings.write_fd = fds[1];
+        start_server(&info->th, &info->settings);
+}
+
+/**
+ * Asks for the checkpoint of the file @c name.
+ */
+static struct packet_payload_resume get_resume_helper(struct test_info *info,
+                                                      const char *name)
+{
+        ASSERT(packet_send(info->writefd, MSG_GET_RESUME, strlen(name) + 1,
+                           (const unsigned char *)name));
+        check_return_message(info, MSG_RESUME_OFFSET);
+        struct packet_payload_resume checkpoint;
+        memcpy(&checkpoint, info->pack->payload, sizeof(checkpoint));
+        check_return_message(info, MSG_OK);
+        return checkpoint;
+}
+
+/**
+ * Checks the file @c name consists of the @c size bytes of the @c data.
+ */
+static void check_file_data(struct test_info *info, const char *name,
+                            const unsigned char *data, size_t size)
+{
+        unsigned char *written = malloc(size + 1);
+        ASSERT(written != NULL);
+        const int fd = openat(info->dirfd, name, O_RDONLY);
+        ASSERT(fd != -1);
+        size_t read_size = 0;
+        ssize_t ret;
+        while ((ret = read(fd, &written[read_size], size + 1 - read_size)) > 0)
+                read_size += ret;
+        ASSERT(close(fd) == 0);
+        CHECK(read_size == size);
+        CHECK(memcmp(written, data, size) == 0);
+        free(written);
+}
+
+/**
+ * Continues the interrupted file at the checkpoint and finishes it.
+ */
+static void resume_helper(struct test_info *info, const unsigned char *data)
+{
+        struct packet_payload_resume checkpoint
+                = get_resume_helper(info, "big");
+        CHECK(checkpoint.offset == HASH_PREFIX_SEGMENT_SIZE);
+        CHECK(checkpoint.hash
+              == hash_xxh64(HASH_PREFIX_SEGMENT_SIZE, data, 0));
+
+        chunk_settings_helper(info, PACKET_MIN_CHUNK_SIZE, MSG_OK);
+        ASSERT(packet_send(info->writefd, MSG_RESUME_FILE, sizeof(checkpoint),
+                           (const unsigned char *)&checkpoint));
+        check_return_message(info, MSG_OK);
+        const size_t rest = RESUME_BLOCK_COUNT * PACKET_MIN_CHUNK_SIZE
+                            - HASH_PREFIX_SEGMENT_SIZE;
+        ASSERT(packet_send(info->writefd, MSG_WRITE_BLOCK, rest,
+                           &data[HASH_PREFIX_SEGMENT_SIZE]));
+        check_return_message(info, MSG_OK);
+        done_helper(info);
+
+        check_file_data(info, "big", data,
+                        RESUME_BLOCK_COUNT * PACKET_MIN_CHUNK_SIZE);
+        CHECK(faccessat(info->dirfd, ".dropbox_resume", F_OK, 0) != 0);
+}
+
+/**
+ * Checks the interrupted file is continued at the checkpoint and finished.
+ */
+static void subtest_resume(struct test_info *info)
+{
+        unsigned char *data = resume_data_helper();
+        interrupted_file_helper(info, data, false);
+        resume_helper(info, data);
+        free(data);
+}
+
+/**
+ * Checks the checkpoint of the interrupted file is kept while another file
+ * is created with its own checkpoints and finished.
+ */
+static void subtest_resume_after_other_file(struct test_info *info)
+{
+        unsigned char *data = resume_data_helper();
+        interrupted_file_helper(info, data, false);
+
+        chunk_settings_helper(info, PACKET_MIN_CHUNK_SIZE, MSG_OK);
+        create_helper(info, "other");
+        for (size_t i = 0; i < RESUME_BLOCK_COUNT; i++) {
+                ASSERT(packet_send(info->writefd, MSG_WRITE_BLOCK,
+                                   PACKET_MIN_CHUNK_SIZE,
+                                   &data[i * PACKET_MIN_CHUNK_SIZE]));
+                check_return_message(info, MSG_OK);
+        }
+        done_helper(info);
+        CHECK(get_resume_helper(info, "other").offset == 0);
+
+        resume_helper(info, data);
+        free(data);
+}
+
+TEST(server_resume)
+{
+        struct test_info info = { 0 };
+
+        SUBTEST(resume)
+        {
+                resume_starter("resume", &info);
+                subtest_resume(&info);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(resume_after_other_file)
+        {
+                resume_starter("resume_after_other_file", &info);
+                subtest_resume_after_other_file(&info);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(resume_other_file)
+        {
+                resume_starter("resume_other_file", &info);
+                unsigned char *data = resume_data_helper();
+                interrupted_file_helper(&info, data, false);
+                const struct packet_payload_resume checkpoint
+                        = get_resume_helper(&info, "other");
+                CHECK(checkpoint.offset == 0);
+                free(data);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(resume_wrong_hash)
+        {
+                resume_starter("resume_wrong_hash", &info);
+                unsigned char *data = resume_data_helper();
+                interrupted_file_helper(&info, data, false);
+                struct packet_payload_resume checkpoint
+                        = get_resume_helper(&info, "big");
+                checkpoint.hash++;
+                ASSERT(packet_send(info.writefd, MSG_RESUME_FILE,
+                                   sizeof(checkpoint),
+                                   (const unsigned char *)&checkpoint));
+                check_return_message(&info, MSG_NOK);
+                free(data);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(resume_deleted_file)
+        {
+                resume_starter("resume_deleted_file", &info);
+                unsigned char *data = resume_data_helper();
+                interrupted_file_helper(&info, data, false);
+                ASSERT(packet_send(info.writefd, MSG_DELETE_FILE, 4,
+                                   (const unsigned char *)"big"));
+                check_return_message(&info, MSG_OK);
+                const struct packet_payload_resume checkpoint
+                        = get_resume_helper(&info, "big");
+                CHECK(checkpoint.offset == 0);
+                CHECK(faccessat(info.dirfd, ".dropbox_resume", F_OK, 0) != 0);
+                free(data);
+                subtest_end_connection(&info);
+        }
+}
+
+/**
+ * Fills in the abstract address the server of the subtest listens on.
+ */
+static socklen_t sessions_address(const char *test_name,
+                                  struct sockaddr_un *addr)
+{
+        memset(addr, 0, sizeof(*addr));
+        addr->sun_family = AF_UNIX;
+        const int len = snprintf(&addr->sun_path[1], sizeof(addr->sun_path) - 1,
+                                 "dropbox_%s_%d", test_name, (int)getpid());
+        ASSERT(len > 0);
+        return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+/**
+ * Milliseconds a stalled session may block the server in the tests.
+ */
+#define STALL_TIMEOUT_MS 300
+
+/**
+ * Prepares the subtest of a server which accepts other clients besides
+ * the one already connected.
+ */
+static void sessions_starter(const char *test_name, struct test_info *info,
+                             unsigned long session_timeout)
+{
+        info->dirfd = prepare_test(test_name, &info->readfd, &info->writefd,
+                                   &info->settings);
+        struct sockaddr_un addr;
+        const socklen_t addr_len = sessions_address(test_name, &addr);
+        const int sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        ASSERT(sock_fd != -1);
+        ASSERT(bind(sock_fd, (struct sockaddr *)&addr, addr_len) == 0);
+        ASSERT(listen(sock_fd, SERVER_MAX_SESSIONS + 1) == 0);
+        info->settings.sock_fd = sock_fd;
+        info->settings.session_timeout = session_timeout;
+        start_server(&info->th, &info->settings);
+}
+
+/**
+ * Connects another client to the server, which replies with @c code.
+ */
+static void connect_helper(const char *test_name, struct test_info *other,
+                           enum packet_msg_code code)
+{
+        struct sockaddr_un addr;
+        const socklen_t addr_len = sessions_address(test_name, &addr);
+        other->readfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        ASSERT(other->readfd != -1);
+        other->writefd = other->readfd;
+        ASSERT(connect(other->readfd, (struct sockaddr *)&addr, addr_len)
+               == 0);
+        check_return_message(other, code);
+}
+
+static void disconnect_helper(struct test_info *other)
+{
+        ASSERT(packet_send(other->writefd, MSG_END_CONNECTION, 0, NULL));
+        ASSERT(close(other->readfd) == 0);
+        free(other->pack);
+        other->pack = NULL;
+}
+
+static void sessions_end(struct test_info *info)
+{
+        const int sock_fd = info->settings.sock_fd;
+        subtest_end_connection(info);
+        ASSERT(close(sock_fd) == 0);
+}
+
+static void write_block_helper(struct test_info *info, const char *data)
+{
+        ASSERT(packet_send(info->writefd, MSG_WRITE_BLOCK, strlen(data),
+                           (const unsigned char *)data));
+        check_return_message(info, MSG_OK);
+}
+
+static void check_content(struct test_info *info, const char *name,
+                          const char *content)
+{
+        char buff[64] = { 0 };
+        const int fd = openat(info->dirfd, name, O_RDONLY);
+        ASSERT(fd != -1);
+        CHECK(read(fd, buff, sizeof(buff) - 1) == (ssize_t)strlen(content));
+        ASSERT(close(fd) == 0);
+        CHECK(strcmp(buff, content) == 0);
+}
+
+/**
+ * Checks the file another client is creating cannot be touched.
+ */
+static void subtest_conflicting_file(struct test_info *info,
+                                     struct test_info *other)
+{
+        create_helper(info, "a");
+        const enum packet_msg_code codes[]
+                = { MSG_CREATE_FILE, MSG_DELETE_FILE, MSG_DELTA_FILE };
+        for (size_t i = 0; i < sizeof(codes) / sizeof(*codes); i++) {
+                ASSERT(packet_send(other->writefd, codes[i], 2,
+                                   (const unsigned char *)"a"));
+                check_return_message(other, MSG_NOK);
+        }
+        write_block_helper(info, "first");
+        done_helper(info);
+
+        create_helper(other, "a");
+        write_block_helper(other, "second");
+        done_helper(other);
+        check_content(info, "a", "second");
+}
+
+/**
+ * Checks the server closes the connection of the other client.
+ */
+static void check_closed(struct test_info *other)
+{
+        char byte;
+        CHECK(read(other->readfd, &byte, 1) == 0);
+        ASSERT(close(other->readfd) == 0);
+        free(other->pack);
+        other->pack = NULL;
+}
+
+/**
+ * Checks a client stalled in the middle of a packet does not hold up the
+ * other client, and the packet is processed once its rest comes.
+ */
+static void subtest_stalled_session(struct test_info *info,
+                                    struct test_info *other)
+{
+        // MSG_CREATE_FILE "b" as packet_send() puts it on the wire
+        unsigned char packet[1 + sizeof(uint64_t) + 2] = { MSG_CREATE_FILE };
+        const uint64_t size = htobe64(2);
+        memcpy(&packet[1], &size, sizeof(size));
+        memcpy(&packet[1 + sizeof(size)], "b", 2);
+        const size_t split[] = { 0, 1, 5, sizeof(packet) - 1, sizeof(packet) };
+
+        for (size_t i = 0; i + 1 < sizeof(split) / sizeof(*split); i++) {
+                const size_t len = split[i + 1] - split[i];
+                ASSERT(write(other->writefd, &packet[split[i]], len)
+                       == (ssize_t)len);
+                const char name[] = { 'a', '0' + i, '\0' };
+                create_helper(info, name);
+                write_block_helper(info, "first");
+                done_helper(info);
+                check_content(info, name, "first");
+        }
+        check_return_message(other, MSG_OK);
+        write_block_helper(other, "second");
+        done_helper(other);
+        check_content(info, "b", "second");
+}
+
+/**
+ * Checks the server shutting down does not wait for a client which stalled
+ * in the middle of a file.
+ */
+static void subtest_stalled_file(struct test_info *info,
+                                 struct test_info *other)
+{
+        create_helper(other, "b");
+        ASSERT(packet_send(info->writefd, MSG_END_CONNECTION, 0, NULL));
+        stop_server(info->th);
+        check_closed(other);
+        wait_server(info->th, SERVER_ERROR);
+        clean_after_test(&info->settings, info->pack);
+        ASSERT(close(info->settings.sock_fd) == 0);
+}
+
+TEST(server_sessions)
+{
+        struct test_info info = { 0 };
+        struct test_info other = { 0 };
+
+        SUBTEST(two_sessions)
+        {
+                sessions_starter("two_sessions", &info, 0);
+                connect_helper("two_sessions", &other, MSG_SETTINGS);
+                create_helper(&info, "a");
+                create_helper(&other, "b");
+                write_block_helper(&other, "bbb");
+                write_block_helper(&info, "aaa");
+                done_helper(&other);
+                done_helper(&info);
+                check_content(&info, "a", "aaa");
+                check_content(&info, "b", "bbb");
+                disconnect_helper(&other);
+                sessions_end(&info);
+        }
+
+        SUBTEST(conflicting_file)
+        {
+                sessions_starter("conflicting_file", &info, 0);
+                connect_helper("conflicting_file", &other, MSG_SETTINGS);
+                subtest_conflicting_file(&info, &other);
+                disconnect_helper(&other);
+                sessions_end(&info);
+        }
+
+        SUBTEST(too_many_sessions)
+        {
+                sessions_starter("too_many_sessions", &info, 0);
+                struct test_info others[SERVER_MAX_SESSIONS] = { 0 };
+                // the first session is already connected
+                for (size_t i = 1; i < SERVER_MAX_SESSIONS; i++)
+                        connect_helper("too_many_sessions", &others[i],
+                                       MSG_SETTINGS);
+                connect_helper("too_many_sessions", &other, MSG_REJECTED);
+                ASSERT(close(other.readfd) == 0);
+                free(other.pack);
+                other.pack = NULL;
+                for (size_t i = 1; i < SERVER_MAX_SESSIONS; i++)
+                        disconnect_helper(&others[i]);
+                sessions_end(&info);
+        }
+
+        SUBTEST(stalled_session)
+        {
+                sessions_starter("stalled_session", &info, 0);
+                connect_helper("stalled_session", &other, MSG_SETTINGS);
+                subtest_stalled_session(&info, &other);
+                disconnect_helper(&other);
+                sessions_end(&info);
+        }
+
+        SUBTEST(stalled_file)
+        {
+                sessions_starter("stalled_file", &info, STALL_TIMEOUT_MS);
+                connect_helper("stalled_file", &other, MSG_SETTINGS);
+                subtest_stalled_file(&info, &other);
+        }
+}
+
+/**
+ * Prepares the subtest of a server writing the blocks through io_uring.
+ */
+static void io_uring_starter(const char *test_name, struct test_info *info)
+{
+        info->dirfd = prepare_test(test_name, &info->readfd, &info->writefd,
+                                   &info->settings);
+        info->settings.chunk_size = PACKET_MIN_CHUNK_SIZE;
+        info->settings.io_uring = true;
+        start_server(&info->th, &info->settings);
+}
+
+/**
+ * Checks the blocks written asynchronously are in the file once it is
+ * finished.
+ */
+static void subtest_async_write(struct test_info *info)
+{
+        unsigned char *data = resume_data_helper();
+        chunk_settings_helper(info, PACKET_MIN_CHUNK_SIZE, MSG_OK);
+        create_helper(info, "big");
+        for (size_t i = 0; i < RESUME_BLOCK_COUNT; i++) {
+                ASSERT(packet_send(info->writefd, MSG_WRITE_BLOCK,
+                                   PACKET_MIN_CHUNK_SIZE,
+                                   &data[i * PACKET_MIN_CHUNK_SIZE]));
+                check_return_message(info, MSG_OK);
+        }
+        done_helper(info);
+
+        check_file_data(info, "big", data,
+                        RESUME_BLOCK_COUNT * PACKET_MIN_CHUNK_SIZE);
+        free(data);
+}
+
+TEST(server_io_uring)
+{
+        struct test_info info = { 0 };
+
+        SUBTEST(async_write)
+        {
+                io_uring_starter("async_write", &info);
+                subtest_async_write(&info);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(async_resume)
+        {
+                io_uring_starter("async_resume", &info);
+                subtest_resume(&info);
+                subtest_end_connection(&info);
+        }
+}
+
+static void writer_starter(const char *test_name, struct test_info *info,
+                           unsigned long window_size)
+{
+        info->dirfd = prepare_test(test_name, &info->readfd, &info->writefd,
+                                   &info->settings);
+        info->settings.chunk_size = PACKET_MIN_CHUNK_SIZE;
+        info->settings.window_size = window_size;
+        info->settings.writers = 2;
+        start_server(&info->th, &info->settings);
+}
+
+TEST(server_writer)
+{
+        struct test_info info = { 0 };
+
+        SUBTEST(writer_write)
+        {
+                writer_starter("writer_write", &info, 0);
+                subtest_async_write(&info);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(writer_resume)
+        {
+                writer_starter("writer_resume", &info, 0);
+                subtest_resume(&info);
+                subtest_end_connection(&info);
+        }
+
+        // the blocks are acknowledged only once they are in the file
+        SUBTEST(writer_windowed_write)
+        {
+                writer_starter("writer_windowed_write", &info, 4);
+                subtest_windowed_write(&info);
+                send_msg_done(&info);
+                subtest_end_connection(&info);
+        }
+}
+
+/**
+ * Appends the record of the file to the payload of MSG_FILE_BUNDLE.
+ *
+ * @return offset of the next record
+ */
+static size_t bundle_record(unsigned char *payload, size_t offset,
+                            const char *name, const char *content,
+                            time_t mtime)
+{
+        const struct packet_bundle_record record = {
+                .size = htobe64(strlen(content)),
+                .mode = htobe64(S_IFREG | 0640),
+                .uid = htobe64(getuid()),
+                .gid = htobe64(getgid()),
+                .atime_sec = htobe64(mtime),
+                .mtime_sec = htobe64(mtime),
+                .mtime_nsec = htobe64(42),
+                .name_size = htobe64(strlen(name)),
+        };
+        memcpy(&payload[offset], &record, sizeof(record));
+        offset += sizeof(record);
+        memcpy(&payload[offset], name, strlen(name));
+        offset += strlen(name);
+        memcpy(&payload[offset], content, strlen(content));
+        return offset + strlen(content);
+}
+
+/**
+ * Sends the bundle of @c count records, which follow the count.
+ */
+static void bundle_helper(struct test_info *info, uint64_t count,
+                          unsigned char *payload, size_t size)
+{
+        count = htobe64(count);
+        memcpy(payload, &count, sizeof(count));
+        ASSERT(packet_send(info->writefd, MSG_FILE_BUNDLE, size, payload));
+}
+
+TEST(server_bundle)
+{
+        struct test_info info = { 0 };
+        unsigned char payload[1024];
+        struct stat sb;
+
+        SUBTEST(bundle_create)
+        {
+                subtest_starter("bundle_create", &info);
+                ASSERT(mkdirat(info.dirfd, "dir", 0755) == 0);
+                manifest_file_helper(&info, "old", 100, 1000);
+
+                size_t size = bundle_record(payload, 8, "dir/a", "alpha",
+                                            2000);
+                size = bundle_record(payload, size, "old", "beta", 3000);
+                bundle_helper(&info, 2, payload, size);
+                check_return_message(&info, MSG_BUNDLE_STATUS);
+                ASSERT(info.pack->payload_size == 1);
+                CHECK(info.pack->payload[0] == 0x3);
+                check_return_message(&info, MSG_OK);
+
+                ASSERT(fstatat(info.dirfd, "dir/a", &sb, 0) == 0);
+                CHECK(sb.st_size == 5);
+                CHECK((sb.st_mode & 07777) == 0640);
+                CHECK(sb.st_mtim.tv_sec == 2000);
+                CHECK(sb.st_mtim.tv_nsec == 42);
+                ASSERT(fstatat(info.dirfd, "old", &sb, 0) == 0);
+                CHECK(sb.st_size == 4);
+                CHECK(sb.st_mtim.tv_sec == 3000);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(bundle_missing_dir)
+        {
+                subtest_starter("bundle_missing_dir", &info);
+                size_t size = bundle_record(payload, 8, "missing/a", "alpha",
+                                            2000);
+                size = bundle_record(payload, size, "b", "", 3000);
+                bundle_helper(&info, 2, payload, size);
+                check_return_message(&info, MSG_BUNDLE_STATUS);
+                ASSERT(info.pack->payload_size == 1);
+                CHECK(info.pack->payload[0] == 0x2);
+                check_return_message(&info, MSG_OK);
+
+                ASSERT(fstatat(info.dirfd, "b", &sb, 0) == 0);
+                CHECK(sb.st_size == 0);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(bundle_path_outside)
+        {
+                subtest_starter("bundle_path_outside", &info);
+                const size_t size = bundle_record(payload, 8, "../escape",
+                                                  "alpha", 2000);
+                bundle_helper(&info, 1, payload, size);
+                check_return_message(&info, MSG_ABORT);
+                subtest_waiter(&info);
+        }
+
+        SUBTEST(bundle_truncated)
+        {
+                subtest_starter("bundle_truncated", &info);
+                const size_t size = bundle_record(payload, 8, "a", "alpha",
+                                                  2000);
+                bundle_helper(&info, 2, payload, size);
+                check_return_message(&info, MSG_ABORT);
+                subtest_waiter(&info);
+        }
+}
+
+/**
+ * Sends the final size of the created file.
+ *
+ * @param info Struct holding information needed for testing
+ * @param blocks Size of the file in blocks
+ * @param sparse The holes of the file are kept
+ * @param expected_msg Expected reply of the server
+ */
+static void file_size_helper(struct test_info *info, uint64_t blocks,
+                             bool sparse, enum packet_msg_code expected_msg)
+{
+        const struct packet_payload_file_size payload = {
+                .size = blocks * info->settings.fs_block_size,
+                .sparse = sparse,
+        };
+        ASSERT(packet_send(info->writefd, MSG_FILE_SIZE, sizeof(payload),
+                           (const unsigned char *)&payload));
+        check_return_message(info, expected_msg);
+}
+
+/**
+ * Writes the blocks of 42 into the preallocated file and checks it is cut
+ * after them once it is done.
+ *
+ * @param info Struct holding information needed for testing
+ * @param blocks Number of the written blocks
+ */
+static void preallocated_write_helper(struct test_info *info, size_t blocks)
+{
+        const size_t block_size = info->settings.fs_block_size;
+        unsigned char *buffer;
+        ASSERT((buffer = malloc(block_size)) != NULL);
+        memset(buffer, 42, block_size);
+        for (size_t i = 0; i < blocks; i++)
+                write_helper(info, buffer);
+        free(buffer);
+        done_helper(info);
+
+        struct stat sb;
+        ASSERT(fstatat(info->dirfd, "test_file", &sb, 0) == 0);
+        CHECK((size_t)sb.st_size == blocks * block_size);
+}
+
+TEST(server_prealloc)
+{
+        struct test_info info = { 0 };
+        struct stat sb;
+
+        SUBTEST(preallocated_file)
+        {
+                subtest_starter("preallocated_file", &info);
+                subtest_create_file(&info);
+                file_size_helper(&info, 16, false, MSG_OK);
+                ASSERT(fstatat(info.dirfd, "test_file", &sb, 0) == 0);
+                CHECK((size_t)sb.st_size == 16 * info.settings.fs_block_size);
+                preallocated_write_helper(&info, 16);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(preallocated_sparse_file)
+        {
+                subtest_starter("preallocated_sparse_file", &info);
+                subtest_create_file(&info);
+                file_size_helper(&info, 16, true, MSG_OK);
+                ASSERT(fstatat(info.dirfd, "test_file", &sb, 0) == 0);
+                CHECK((size_t)sb.st_size == 16 * info.settings.fs_block_size);
+                CHECK(sb.st_blocks == 0);
+                preallocated_write_helper(&info, 16);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(preallocated_file_shrunk)
+        {
+                subtest_starter("preallocated_file_shrunk", &info);
+                subtest_create_file(&info);
+                file_size_helper(&info, 16, false, MSG_OK);
+                preallocated_write_helper(&info, 3);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(preallocated_file_interrupted)
+        {
+                resume_starter("preallocated_file_interrupted", &info);
+                unsigned char *data = resume_data_helper();
+                interrupted_file_helper(&info, data, true);
+
+                // the file ends with the written blocks, so it is resumed
+                ASSERT(fstatat(info.dirfd, "big", &sb, 0) == 0);
+                CHECK((size_t)sb.st_size
+                      == (RESUME_BLOCK_COUNT - 1) * PACKET_MIN_CHUNK_SIZE);
+                resume_helper(&info, data);
+                free(data);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(file_size_without_file)
+        {
+                subtest_starter("file_size_without_file", &info);
+                file_size_helper(&info, 16, false, MSG_ABORT);
+                subtest_waiter(&info);
+        }
+}
+
+/**
+ * Negotiates the replacement of the changed files and writes the old
+ * version of the file @c name.
+ *
+ * @param info Struct holding information needed for testing
+ * @param name Name of the file
+ */
+static void replace_helper(struct test_info *info, const char *name)
+{
+        const struct packet_payload_settings client_settings = {
+                .protocol_version = PACKET_PROTOCOL_VERSION,
+                .features = PACKET_FEATURE_REPLACE,
+        };
+        ASSERT(packet_send(info->writefd, MSG_SETTINGS,
+                           sizeof(client_settings),
+                           (const unsigned char *)&client_settings));
+        check_return_message(info, MSG_OK);
+
+        const int fd = openat(info->dirfd, name, O_CREAT | O_WRONLY, 0600);
+        ASSERT(fd != -1);
+        ASSERT(write(fd, "old version", 11) == 11);
+        close(fd);
+}
+
+/**
+ * Checks "test_file" still holds the old version.
+ *
+ * @param info Struct holding information needed for testing
+ */
+static void check_old_version(struct test_info *info)
+{
+        char old[12] = { 0 };
+        const int fd = openat(info->dirfd, "test_file", O_RDONLY);
+        ASSERT(fd != -1);
+        CHECK(read(fd, old, sizeof(old)) == 11);
+        CHECK(strcmp(old, "old version") == 0);
+        close(fd);
+}
+
+/**
+ * Checks the content of the file @c name is @c size bytes of @c byte.
+ *
+ * @param info Struct holding information needed for testing
+ * @param name Name of the file
+ */
+static void check_replaced(struct test_info *info, const char *name,
+                           size_t size, unsigned char byte)
+{
+        unsigned char *buffer;
+        ASSERT((buffer = malloc(size + 1)) != NULL);
+        const int fd = openat(info->dirfd, name, O_RDONLY);
+        ASSERT(fd != -1);
+        ASSERT(read(fd, buffer, size + 1) == (ssize_t)size);
+        close(fd);
+        for (size_t i = 0; i < size; i++)
+                CHECK(buffer[i] == byte);
+        free(buffer);
+}
+
+TEST(server_replace)
+{
+        struct test_info info = { 0 };
+
+        SUBTEST(replace_file)
+        {
+                subtest_starter("replace_file", &info);
+                replace_helper(&info, "test_file");
+                subtest_create_file(&info);
+                const size_t block_size = info.settings.fs_block_size;
+                unsigned char *buffer;
+                ASSERT((buffer = malloc(block_size)) != NULL);
+                memset(buffer, 42, block_size);
+                for (int i = 0; i < 3; i++)
+                        write_helper(&info, buffer);
+                free(buffer);
+                // the old version is in place until the new one is done
+                check_old_version(&info);
+
+                done_helper(&info);
+                check_replaced(&info, "test_file", 3 * block_size, 42);
+                CHECK(faccessat(info.dirfd, SERVER_DELTA_TEMP_NAME ".0", F_OK,
+                                0)
+                      == -1);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(replace_file_in_dir)
+        {
+                subtest_starter("replace_file_in_dir", &info);
+                ASSERT(mkdirat(info.dirfd, "dir", 0755) == 0);
+                replace_helper(&info, "dir/test_file");
+                create_helper(&info, "dir/test_file");
+                const size_t block_size = info.settings.fs_block_size;
+                unsigned char *buffer;
+                ASSERT((buffer = malloc(block_size)) != NULL);
+                memset(buffer, 42, block_size);
+                write_helper(&info, buffer);
+                free(buffer);
+                done_helper(&info);
+
+                // nothing is left in the directory or in the root
+                check_replaced(&info, "dir/test_file", block_size, 42);
+                CHECK(faccessat(info.dirfd, SERVER_DELTA_TEMP_NAME ".0", F_OK,
+                                0)
+                      == -1);
+                CHECK(faccessat(info.dirfd, "dir/" SERVER_DELTA_TEMP_NAME ".0",
+                                F_OK, 0)
+                      == -1);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(replace_bundle_file)
+        {
+                subtest_starter("replace_bundle_file", &info);
+                ASSERT(mkdirat(info.dirfd, "dir", 0755) == 0);
+                replace_helper(&info, "dir/test_file");
+                struct stat old;
+                ASSERT(fstatat(info.dirfd, "dir/test_file", &old, 0) == 0);
+
+                unsigned char payload[256];
+                const size_t size = bundle_record(payload, 8, "dir/test_file",
+                                                  "**", 2000);
+                bundle_helper(&info, 1, payload, size);
+                check_return_message(&info, MSG_BUNDLE_STATUS);
+                CHECK(info.pack->payload[0] == 0x1);
+                check_return_message(&info, MSG_OK);
+
+                // the new version is a new file, never the truncated old one
+                struct stat sb;
+                ASSERT(fstatat(info.dirfd, "dir/test_file", &sb, 0) == 0);
+                CHECK(sb.st_ino != old.st_ino);
+                check_replaced(&info, "dir/test_file", 2, '*');
+                subtest_end_connection(&info);
+        }
+}
+
+/**
+ * Sends the old and the new path of the renamed file and checks the reply.
+ */
+static void rename_helper(struct test_info *info, const char *old_path,
+                          const char *new_path,
+                          enum packet_msg_code expected_msg)
+{
+        const size_t old_size = strlen(old_path) + 1;
+        const size_t new_size = strlen(new_path) + 1;
+        unsigned char *payload;
+        ASSERT((payload = malloc(old_size + new_size)) != NULL);
+        memcpy(payload, old_path, old_size);
+        memcpy(&payload[old_size], new_path, new_size);
+        ASSERT(packet_send(info->writefd, MSG_RENAME, old_size + new_size,
+                           payload));
+        free(payload);
+        check_return_message(info, expected_msg);
+}
+
+TEST(server_rename)
+{
+        struct test_info info = { 0 };
+        struct stat sb;
+
+        SUBTEST(rename_file)
+        {
+                subtest_starter("rename_file", &info);
+                manifest_file_helper(&info, "old", 10, 1000);
+                manifest_file_helper(&info, "new", 20, 2000);
+                rename_helper(&info, "old", "new", MSG_OK);
+                CHECK(faccessat(info.dirfd, "old", F_OK, 0) == -1);
+                ASSERT(fstatat(info.dirfd, "new", &sb, 0) == 0);
+                CHECK(sb.st_size == 10);
+                CHECK(sb.st_mtim.tv_sec == 1000);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(rename_dir)
+        {
+                subtest_starter("rename_dir", &info);
+                ASSERT(mkdirat(info.dirfd, "dir", 0755) == 0);
+                ASSERT(mkdirat(info.dirfd, "dir/sub", 0755) == 0);
+                ASSERT(mkdirat(info.dirfd, "other", 0755) == 0);
+                manifest_file_helper(&info, "dir/sub/file", 10, 1000);
+                rename_helper(&info, "dir", "other/moved", MSG_OK);
+                CHECK(faccessat(info.dirfd, "dir", F_OK, 0) == -1);
+                CHECK(faccessat(info.dirfd, "other/moved/sub/file", F_OK, 0)
+                      == 0);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(rename_missing_file)
+        {
+                subtest_starter("rename_missing_file", &info);
+                rename_helper(&info, "missing", "new", MSG_NOK);
+                CHECK(faccessat(info.dirfd, "new", F_OK, 0) == -1);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(rename_onto_full_dir)
+        {
+                subtest_starter("rename_onto_full_dir", &info);
+                ASSERT(mkdirat(info.dirfd, "dir", 0755) == 0);
+                ASSERT(mkdirat(info.dirfd, "full", 0755) == 0);
+                manifest_file_helper(&info, "full/file", 10, 1000);
+                rename_helper(&info, "dir", "full", MSG_NOK);
+                CHECK(faccessat(info.dirfd, "full/file", F_OK, 0) == 0);
+                subtest_end_connection(&info);
+        }
+
+        SUBTEST(rename_outside)
+        {
+                subtest_starter("rename_outside", &info);
+                manifest_file_helper(&info, "old", 10, 1000);
+                rename_helper(&info, "old", "../escape", MSG_ABORT);
+                subtest_waiter(&info);
+        }
+
+        SUBTEST(rename_one_path)
+        {
+                subtest_starter("rename_one_path", &info);
+                ASSERT(packet_send(info.writefd, MSG_RENAME, 4,
+                                   (const unsigned char *)"old"));
+                check_return_message(&info, MSG_ABORT);
+                subtest_waiter(&info);
+        }
+}
@@ -61,4 +61,24 @@ TEST(read_write)
                 free(buff);
                 free(buff_copy);
         }
-}
\ No newline at end of file
+}
+TEST(path_is_within)
+{
+        SUBTEST(same_path)
+        {
+                ASSERT(utils_path_is_within("a/b", "a/b"));
+        }
+
+        SUBTEST(nested_path)
+        {
+                ASSERT(utils_path_is_within("a/b/c", "a"));
+                ASSERT(utils_path_is_within("a/b/c", "a/b"));
+        }
+
+        SUBTEST(sibling_path)
+        {
+                ASSERT(!utils_path_is_within("a/bc", "a/b"));
+                ASSERT(!utils_path_is_within("a", "a/b"));
+                ASSERT(!utils_path_is_within("b/a", "a"));
+        }
+}
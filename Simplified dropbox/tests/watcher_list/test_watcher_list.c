@@ -0,0 +1,195 @@
+/**
+ * @file test_watcher_list.c
+ * @brief Tests of the registry of the watchers.
+ */
+#define CUT_MAIN
+
+#include "cut.h"
+
+#include "watcher_list.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static void add_watcher(client_watcher_list *list, int wd, const char *name)
+{
+        char *copy = strdup(name);
+        ASSERT(copy != NULL);
+        const struct client_watcher watcher = { .wd = wd, .name = copy };
+        ASSERT(client_watcher_list_add(list, &watcher));
+}
+
+static void check_watcher(const client_watcher_list *list, int wd,
+                          const char *name)
+{
+        const struct client_watcher *by_wd
+                = client_watcher_list_find_wd(list, wd);
+        ASSERT(by_wd != NULL);
+        CHECK(strcmp(by_wd->name, name) == 0);
+
+        const struct client_watcher *by_name
+                = client_watcher_list_find_name(list, name);
+        ASSERT(by_name != NULL);
+        CHECK(by_name->wd == wd);
+}
+
+TEST(watcher_list_find)
+{
+        client_watcher_list list;
+        ASSERT(client_watcher_list_create(&list));
+
+        SUBTEST(empty)
+        {
+                CHECK(client_watcher_list_find_wd(&list, 1) == NULL);
+                CHECK(client_watcher_list_find_wd(&list, -1) == NULL);
+                CHECK(client_watcher_list_find_name(&list, "a") == NULL);
+        }
+
+        SUBTEST(one_elem)
+        {
+                add_watcher(&list, 1, "a");
+                check_watcher(&list, 1, "a");
+                CHECK(client_watcher_list_find_wd(&list, 2) == NULL);
+                CHECK(client_watcher_list_find_name(&list, "b") == NULL);
+        }
+
+        SUBTEST(multiple_elems)
+        {
+                char name[32];
+                for (int wd = 1; wd <= 1000; wd++) {
+                        sprintf(name, "dir/%d", wd);
+                        add_watcher(&list, wd, name);
+                }
+                for (int wd = 1; wd <= 1000; wd++) {
+                        sprintf(name, "dir/%d", wd);
+                        check_watcher(&list, wd, name);
+                }
+                CHECK(client_watcher_list_find_wd(&list, 1001) == NULL);
+        }
+
+        SUBTEST(same_wd)
+        {
+                add_watcher(&list, 1, "a");
+                add_watcher(&list, 1, "b");
+                check_watcher(&list, 1, "b");
+                CHECK(client_watcher_list_find_name(&list, "a") == NULL);
+        }
+
+        SUBTEST(same_name)
+        {
+                add_watcher(&list, 1, "a");
+                add_watcher(&list, 2, "a");
+                check_watcher(&list, 2, "a");
+                CHECK(client_watcher_list_find_wd(&list, 1) != NULL);
+        }
+
+        client_watcher_list_destroy(&list);
+}
+
+TEST(watcher_list_remove)
+{
+        client_watcher_list list;
+        ASSERT(client_watcher_list_create(&list));
+        add_watcher(&list, 1, "a");
+        add_watcher(&list, 2, "a/b");
+
+        SUBTEST(by_wd)
+        {
+                CHECK(client_watcher_list_remove(&list, 1));
+                CHECK(client_watcher_list_find_wd(&list, 1) == NULL);
+                CHECK(client_watcher_list_find_name(&list, "a") == NULL);
+                check_watcher(&list, 2, "a/b");
+        }
+
+        SUBTEST(missing)
+        {
+                CHECK(!client_watcher_list_remove(&list, 3));
+                CHECK(!client_watcher_list_remove(&list, -1));
+                CHECK(client_watcher_list_remove(&list, 1));
+                CHECK(!client_watcher_list_remove(&list, 1));
+        }
+
+        SUBTEST(by_name)
+        {
+                const struct client_watcher *watcher
+                        = client_watcher_list_find_name(&list, "a/b");
+                ASSERT(watcher != NULL);
+                CHECK(client_watcher_list_remove(&list, watcher->wd));
+                CHECK(client_watcher_list_find_name(&list, "a/b") == NULL);
+                check_watcher(&list, 1, "a");
+        }
+
+        SUBTEST(older_of_same_name)
+        {
+                add_watcher(&list, 3, "a");
+                CHECK(client_watcher_list_remove(&list, 1));
+                check_watcher(&list, 3, "a");
+        }
+
+        SUBTEST(add_after_remove)
+        {
+                char name[32];
+                for (int round = 0; round < 100; round++) {
+                        sprintf(name, "c/%d", round);
+                        add_watcher(&list, 3 + round, name);
+                        CHECK(client_watcher_list_remove(&list, 3 + round));
+                }
+                add_watcher(&list, 1000, "c");
+                check_watcher(&list, 1, "a");
+                check_watcher(&list, 2, "a/b");
+                check_watcher(&list, 1000, "c");
+                CHECK(client_watcher_list_find_name(&list, "c/99") == NULL);
+        }
+
+        client_watcher_list_destroy(&list);
+}
+
+TEST(watcher_list_rename)
+{
+        client_watcher_list list;
+        ASSERT(client_watcher_list_create(&list));
+        add_watcher(&list, 1, "a");
+        add_watcher(&list, 2, "a/b");
+        add_watcher(&list, 3, "a/b/c");
+        add_watcher(&list, 4, "ab");
+
+        SUBTEST(subtree)
+        {
+                ASSERT(client_watcher_list_rename(&list, "a", "x"));
+                check_watcher(&list, 1, "x");
+                check_watcher(&list, 2, "x/b");
+                check_watcher(&list, 3, "x/b/c");
+                check_watcher(&list, 4, "ab");
+                CHECK(client_watcher_list_find_name(&list, "a") == NULL);
+                CHECK(client_watcher_list_find_name(&list, "a/b") == NULL);
+                CHECK(client_watcher_list_find_name(&list, "a/b/c") == NULL);
+        }
+
+        SUBTEST(nested_folder)
+        {
+                ASSERT(client_watcher_list_rename(&list, "a/b", "y/longer"));
+                check_watcher(&list, 1, "a");
+                check_watcher(&list, 2, "y/longer");
+                check_watcher(&list, 3, "y/longer/c");
+                check_watcher(&list, 4, "ab");
+        }
+
+        SUBTEST(missing)
+        {
+                ASSERT(client_watcher_list_rename(&list, "z", "x"));
+                check_watcher(&list, 1, "a");
+                check_watcher(&list, 2, "a/b");
+                check_watcher(&list, 3, "a/b/c");
+                check_watcher(&list, 4, "ab");
+        }
+
+        SUBTEST(remove_after_rename)
+        {
+                ASSERT(client_watcher_list_rename(&list, "a", "x"));
+                CHECK(client_watcher_list_remove(&list, 2));
+                CHECK(client_watcher_list_find_name(&list, "x/b") == NULL);
+                check_watcher(&list, 3, "x/b/c");
+        }
+
+        client_watcher_list_destroy(&list);
+}